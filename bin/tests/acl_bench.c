@@ -0,0 +1,117 @@
+/*
+ * Correctness and lookup cost of the source ACL, for acl_bench.py.
+ *
+ * Writes RULES random IPv4 prefixes (8 to 32 bits, allow or deny) and a few
+ * IPv6 rules to FILE and loads it. 200k addresses, half of them inside a
+ * rule, are then checked against a brute-force longest-prefix match. Prints
+ * the number of mismatches and the time per lookup of random IPv4 and IPv6
+ * addresses.
+ *
+ * Usage: acl_bench FILE RULES
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "libs/acl/acl.h"
+
+#define LOOKUPS 20000000
+
+static double elapsed_ns(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    struct timespec t0;
+    struct acl *acl;
+    uint32_t *prefix, x = 7;
+    int *bits, *allow, rules, i, j, mismatches = 0, sum = 0;
+    double v4, v6;
+    FILE *f;
+
+    if (argc != 3) {
+		fprintf(stderr, "usage: %s FILE RULES\n", argv[0]);
+		return 2;
+    }
+    rules = atoi(argv[2]);
+    prefix = calloc(rules, sizeof(*prefix));
+    bits = calloc(rules, sizeof(*bits));
+    allow = calloc(rules, sizeof(*allow));
+
+    srand(1);
+    if (!(f = fopen(argv[1], "w"))) {
+		perror(argv[1]);
+		return 1;
+    }
+    for (i = 0; i < rules; i++) {
+		struct in_addr addr;
+
+		bits[i] = 8 + rand() % 25;
+		prefix[i] = (uint32_t) rand() * 2654435761u;
+		if (bits[i] < 32)
+			prefix[i] &= ~((1u << (32 - bits[i])) - 1);
+		allow[i] = rand() & 1;
+		addr.s_addr = htonl(prefix[i]);
+		fprintf(f, "%s %s/%d\n", allow[i] ? "allow" : "deny", inet_ntoa(addr), bits[i]);
+    }
+    fprintf(f, "deny 2001:db8::/32\nallow 2001:db8:1::/48\ndefault deny\n");
+    fclose(f);
+    if (!(acl = acl_load(argv[1])))
+		return 1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    for (i = 0; i < 200000; i++) {
+		uint32_t addr;
+		int best = -1, expected;
+
+		if (i % 2) { // Inside a rule
+			j = rand() % rules;
+			addr = prefix[j] | (bits[j] < 32 ? rand() & ((1u << (32 - bits[j])) - 1) : 0);
+		} else {
+			addr = ((uint32_t) rand() * 2654435761u) ^ rand();
+		}
+		for (j = 0; j < rules; j++) {
+			uint32_t mask = ~0u << (32 - bits[j]);
+
+			if ((addr & mask) == prefix[j] && (best < 0 || bits[j] >= bits[best]))
+				best = j;
+		}
+		expected = best < 0 ? 0 : allow[best];
+		sin.sin_addr.s_addr = htonl(addr);
+		mismatches += acl_check(acl, (struct sockaddr *) &sin) != expected;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < LOOKUPS; i++) {
+		x = x * 1103515245 + 12345;
+		sin.sin_addr.s_addr = x;
+		sum += acl_check(acl, (struct sockaddr *) &sin);
+    }
+    v4 = elapsed_ns(&t0) / LOOKUPS;
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8:1::", &sin6.sin6_addr);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < LOOKUPS; i++) {
+		x = x * 1103515245 + 12345;
+		memcpy(&sin6.sin6_addr.s6_addr[4], &x, sizeof(x)); // Both 2001:db8:1::/48 and the deny
+		sum += acl_check(acl, (struct sockaddr *) &sin6);
+    }
+    v6 = elapsed_ns(&t0) / LOOKUPS;
+
+    printf("%d rules: %d mismatches in 200000 addresses, %.1f ns per IPv4 lookup, %.1f ns per IPv6 lookup (%d)\n",
+		rules, mismatches, v4, v6, sum);
+    return mismatches != 0;
+}
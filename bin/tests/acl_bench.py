@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""
+Source ACL test and benchmark (user-088).
+
+1. Builds acl_bench.c with the ACL and checks its longest-prefix matches
+   against a brute-force search, then reports the time per lookup, for 100
+   to 50,000 random IPv4 rules.
+2. Runs a client with --acl and --control: a denied source is dropped,
+   SIGHUP reloads the rules, and a file with an error keeps the old rules.
+
+Usage: acl_bench.py
+"""
+import os
+import signal
+import socket
+import subprocess
+import time
+
+from common import compile_c, path, start, stop, udp_app, control, check, finish
+
+SERVER, CLIENT = 24151, 24152
+
+
+def relayed(app, source):
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    c.bind((source, 0))
+    c.sendto(b'hi', ('127.0.0.1', CLIENT))
+    try:
+        app.recvfrom(100)
+        return True
+    except socket.timeout:
+        return False
+
+
+def write_rules(rules):
+    with open(path('test.acl'), 'w') as f:
+        f.write(rules)
+
+
+if __name__ == '__main__':
+    exe = compile_c('acl_bench.c', 'libs/acl/acl.c', 'libs/utils/utils.c', 'libs/log/log.c')
+    for rules in (100, 5000, 50000):
+        out = subprocess.run([exe, path('bench.acl'), str(rules)], capture_output=True, text=True)
+        print(out.stdout.strip().splitlines()[-1] if out.stdout.strip() else out.stderr.strip())
+        check('%d rules match a brute-force search' % rules, out.returncode == 0)
+
+    write_rules('# test\nallow 127.0.0.0/8\ndeny 127.0.0.2\n')
+    app = udp_app(timeout=1)
+    log = open(os.devnull, 'w')
+    ctl = path('acl.ctl')
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    cli = start('--acl', path('test.acl'), '--control', ctl, '0.0.0.0:%d' % CLIENT, '127.0.0.1:%d' % SERVER,
+                stdout=log, stderr=log)
+    try:
+        check('allowed source relayed, denied one dropped',
+              relayed(app, '127.0.0.1') and not relayed(app, '127.0.0.2'))
+        write_rules('deny 127.0.0.1/32\nallow 127.0.0.2\n')
+        cli.send_signal(signal.SIGHUP)
+        time.sleep(0.3)
+        check('SIGHUP reloads the rules', not relayed(app, '127.0.0.1') and relayed(app, '127.0.0.2'))
+        write_rules('bogus line\n')
+        check('acl reload of a bad file fails', control(ctl, 'acl reload').startswith('ERR'))
+        listing = control(ctl, 'acl')
+        check('the old rules and their hits are kept', 'deny 127.0.0.1/32' in listing and cli.poll() is None)
+    finally:
+        stop(cli, srv)
+    finish()
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""
+Admission test of the server (user-084).
+
+TCP connect probes, HTTP health checks, bad handshakes and a client that
+stalls in its handshake must not fork a tunnel. The stalled connection is
+closed after the handshake timeout, and a real client then gets exactly one
+tunnel. The status counters must account for every connection.
+
+Usage: admission_test.py
+"""
+import os
+import socket
+import time
+
+from common import path, start, stop, udp_app, control, status, check, finish
+
+SERVER, CLIENT = 24111, 24112
+
+
+def children(pid):
+    with open('/proc/%d/task/%d/children' % (pid, pid)) as f:
+        return f.read().split()
+
+
+if __name__ == '__main__':
+    ctl = path('admission.ctl')
+    app = udp_app()
+    log = open(os.devnull, 'w')
+    srv = start('-s', '--health-check', '--control', ctl, '127.0.0.1:%d' % SERVER,
+                '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    procs = [srv]
+    try:
+        for _ in range(20):
+            socket.create_connection(('127.0.0.1', SERVER)).close()
+
+        healthy = 0
+        for _ in range(20):
+            s = socket.create_connection(('127.0.0.1', SERVER))
+            s.sendall(b'GET /health HTTP/1.1\r\nHost: x\r\n\r\n')
+            reply = b''
+            while True:
+                data = s.recv(1000)
+                if not data:
+                    break
+                reply += data
+            healthy += reply.startswith(b'HTTP/1.0 200 OK')
+            s.close()
+        check('20 health checks answered 200 OK', healthy == 20)
+
+        for _ in range(5):
+            s = socket.create_connection(('127.0.0.1', SERVER))
+            s.sendall(b'x' * 32)
+            time.sleep(0.05)
+            s.close()
+
+        control(ctl, 'set handshake-timeout 500')
+        slow = socket.create_connection(('127.0.0.1', SERVER))
+        slow.sendall(b'\0')
+        slow.settimeout(2)
+        try:
+            closed = slow.recv(10) == b''
+        except (socket.timeout, ConnectionResetError):
+            closed = False
+        check('stalled handshake closed after handshake-timeout', closed)
+        check('no tunnel forked by probes and bad handshakes', children(srv.pid) == [])
+
+        cli = start('127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+        procs.append(cli)
+        c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        c.settimeout(3)
+        ok = 0
+        for i in range(50):
+            c.sendto(b'p%d' % i, ('127.0.0.1', CLIENT))
+            data, peer = app.recvfrom(9999)
+            app.sendto(b'R' + data, peer)
+            ok += c.recvfrom(9999)[0] == b'Rp%d' % i
+        check('real client relays 50 round trips', ok == 50)
+        check('real client has one tunnel', len(children(srv.pid)) == 1)
+
+        fields = status(ctl)
+        print(' '.join('%s=%s' % (k, fields.get(k)) for k in ('accepted', 'rejected', 'probes', 'tunnels')))
+        check('status counts the tunnel, the probes and the rejections',
+              fields.get('accepted') == '1' and fields.get('tunnels') == '1' and
+              int(fields.get('probes', 0)) + int(fields.get('rejected', 0)) == 46)
+    finally:
+        stop(*procs)
+    finish()
@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+"""
+Burst regression: 2000 datagrams of 6 to 305 bytes sent back to back, in
+groups of 100, must all reach the destination. This exercises the batched
+UDP egress of the server.
+
+Usage: burst.py [SERVER_OPTIONS] [CLIENT_OPTIONS]
+"""
+import socket
+import sys
+import time
+
+from common import start, stop, udp_app
+
+SERVER, CLIENT = 24011, 24012
+N = 2000
+
+if __name__ == '__main__':
+    args = sys.argv[1:] + [''] * 2
+    app = udp_app()
+    app.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+    srv = start('-s', *args[0].split(), '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1])
+    cli = start(*args[1].split(), '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER)
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    got = set()
+    try:
+        for i in range(N):
+            c.sendto(b'%06d' % i + b'x' * (i % 300), ('127.0.0.1', CLIENT))
+            if i % 100 == 0:
+                time.sleep(0.002)
+        while len(got) < N:
+            data, _ = app.recvfrom(70000)
+            got.add(int(data[:6]))
+    except socket.timeout:
+        pass
+    finally:
+        stop(cli, srv)
+    print('received', len(got), 'of', N)
+    sys.exit(0 if len(got) == N else 1)
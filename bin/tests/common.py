@@ -0,0 +1,130 @@
+"""
+Helpers shared by the test and benchmark scripts of bin/tests.
+
+The scripts run the binary built by bin/build.sh, or the one named by the
+UDPTUNNEL environment variable, on loopback ports, and print their results.
+Some of them need root: network namespaces, TPROXY, AF_XDP and eBPF.
+"""
+import atexit
+import os
+import platform
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), '..', '..'))
+ARCH = {'x86_64': 'amd64', 'aarch64': 'arm64', 'armv7l': 'armhf'}.get(platform.machine(), platform.machine())
+BIN = os.environ.get('UDPTUNNEL') or os.path.join(ROOT, 'build', 'output', 'dynamic', ARCH, 'udptunnel')
+
+# sockets, ACLs and session directories of the run, removed on exit
+TMP = tempfile.mkdtemp(prefix='udptunnel-tests-')
+atexit.register(shutil.rmtree, TMP, True)
+
+# checks that failed, see check()
+FAILURES = []
+
+
+def check(what, ok):
+    """Prints the outcome of a check and records its failure."""
+    print('%-68s %s' % (what, 'ok' if ok else 'FAILED'))
+    if not ok:
+        FAILURES.append(what)
+    return ok
+
+
+def finish():
+    """Exits with 1 if a check failed."""
+    print('%d checks failed' % len(FAILURES) if FAILURES else 'all checks passed')
+    sys.exit(1 if FAILURES else 0)
+
+
+def path(name):
+    """A file of the temporary directory."""
+    return os.path.join(TMP, name)
+
+
+def start(*args, delay=0.3, command=None, **kwargs):
+    """Starts udptunnel, or the command given, with args and gives it time to listen."""
+    proc = subprocess.Popen((command or [BIN]) + list(args), **kwargs)
+    time.sleep(delay)
+    return proc
+
+
+def stop(*procs):
+    """Terminates the processes and waits for them."""
+    for proc in procs:
+        if proc.poll() is None:
+            proc.terminate()
+    for proc in procs:
+        proc.wait()
+
+
+def udp_app(host='127.0.0.1', timeout=3):
+    """A bound UDP socket standing for the application behind the tunnel."""
+    app = socket.socket(socket.AF_INET6 if ':' in host else socket.AF_INET, socket.SOCK_DGRAM)
+    app.bind((host, 0))
+    app.settimeout(timeout)
+    return app
+
+
+def control(sock_path, command):
+    """Sends a command to the control socket and returns its reply."""
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(sock_path)
+    s.sendall((command + '\n').encode())
+    out = b''
+    while not (out.endswith(b'OK\n') or b'ERR' in out):
+        data = s.recv(65536)
+        if not data:
+            break
+        out += data
+    s.close()
+    return out.decode()
+
+
+def status(sock_path):
+    """The status of the control socket as a dictionary of strings."""
+    fields = {}
+    for line in control(sock_path, 'status').splitlines():
+        key, _, value = line.partition(' ')
+        fields[key] = value
+    return fields
+
+
+def cpu_time(pid):
+    """User and system CPU time of a process, in seconds."""
+    with open('/proc/%d/stat' % pid) as f:
+        stat = f.read().rsplit(')', 1)[1].split()
+    return (int(stat[11]) + int(stat[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def tree_cpu_time(pid):
+    """CPU time of a process and of its live descendants, such as the server tunnels."""
+    total = cpu_time(pid)
+    for task in os.listdir('/proc/%d/task' % pid):
+        try:
+            with open('/proc/%d/task/%s/children' % (pid, task)) as f:
+                children = [int(child) for child in f.read().split()]
+        except OSError:
+            continue
+        for child in children:
+            try:
+                total += tree_cpu_time(child)
+            except OSError:
+                pass
+    return total
+
+
+def compile_c(source, *inputs):
+    """Builds a C helper of bin/tests against the headers of the tree, with the
+    sources (.c, relative to src) and the libraries built next to the binary (.a)."""
+    exe = path(os.path.splitext(source)[0])
+    libdir = os.path.dirname(os.path.realpath(BIN))
+    subprocess.run(['cc', '-O2', '-I', os.path.join(ROOT, 'src'), '-o', exe,
+                    os.path.join(os.path.dirname(__file__), source)] +
+                   [os.path.join(ROOT, 'src', name) if name.endswith('.c') else os.path.join(libdir, name)
+                    for name in inputs], check=True)
+    return exe
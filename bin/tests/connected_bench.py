@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""
+Connected UDP socket and pinned reply source test and benchmark (user-093).
+
+1. Builds connected_bench.c and reports the cost per datagram of
+   sendmmsg() without a destination on a connected socket, against an
+   unconnected one with and without an IP_PKTINFO source.
+2. Runs a client bound to 0.0.0.0, then to [::]. Queries sent to
+   127.0.0.2 and 127.0.0.3 must get their replies from those addresses.
+3. Closes the destination of the server: the ICMP errors it gets on its
+   connected socket must not stop it.
+
+Usage: connected_bench.py [DATAGRAMS]
+"""
+import os
+import socket
+import subprocess
+import sys
+import time
+
+from common import compile_c, start, stop, udp_app, check, finish
+
+N = sys.argv[1] if len(sys.argv) > 1 else '2000000'
+SERVER, CLIENT = 24211, 24212
+
+
+def run(listen):
+    app = udp_app()
+    log = open(os.devnull, 'w')
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    cli = start('%s:%d' % (listen, CLIENT), '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+    c = udp_app()
+    try:
+        for dest in ('127.0.0.2', '127.0.0.3', '127.0.0.1'):
+            c.sendto(b'ping', (dest, CLIENT))
+            _, peer = app.recvfrom(100)
+            app.sendto(b'pong', peer)
+            try:
+                _, source = c.recvfrom(100)
+            except socket.timeout:
+                source = None
+            check('client on %s: a query to %s gets its reply from it' % (listen, dest),
+                  source == (dest, CLIENT))
+        app.close()
+        c.sendto(b'x', ('127.0.0.1', CLIENT))
+        time.sleep(0.3)
+        c.sendto(b'y', ('127.0.0.1', CLIENT))
+        time.sleep(0.3)
+        check('client on %s: the server survives its destination closing' % listen, srv.poll() is None)
+    finally:
+        stop(cli, srv)
+
+
+if __name__ == '__main__':
+    exe = compile_c('connected_bench.c')
+    print(subprocess.run([exe, N], capture_output=True, text=True).stdout.strip())
+    run('0.0.0.0')
+    run('[::]')
+    finish()
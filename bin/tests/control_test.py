@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""
+Runtime control socket test (user-083).
+
+Drives the control socket of a server and of a client: status, get and set
+with valid and invalid values, listeners added and removed while tunnels
+run, and settings that survive a SIGUSR2 upgrade.
+
+Usage: control_test.py
+"""
+import os
+import signal
+import socket
+import threading
+import time
+
+from common import path, start, stop, control, status, check, finish
+
+SERVER, SERVER2 = 24301, 24302
+CLIENT1, CLIENT2, CLIENT3 = 24311, 24312, 24313
+
+
+def echo_app(tag):
+    app = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    app.bind(('127.0.0.1', 0))
+
+    def run():
+        while True:
+            data, peer = app.recvfrom(70000)
+            app.sendto(tag + data, peer)
+    threading.Thread(target=run, daemon=True).start()
+    return '127.0.0.1:%d' % app.getsockname()[1]
+
+
+def ping(port):
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    c.settimeout(1)
+    c.sendto(b'hi', ('127.0.0.1', port))
+    try:
+        return c.recvfrom(100)[0]
+    except socket.timeout:
+        return None
+
+
+if __name__ == '__main__':
+    ctl, cctl = path('server.ctl'), path('client.ctl')
+    dest_a, dest_b = echo_app(b'A'), echo_app(b'B')
+    log = open(os.devnull, 'w')
+    srv = start('-s', '--control', ctl, '127.0.0.1:%d' % SERVER, dest_a, stdout=log, stderr=log)
+    procs = [srv]
+    try:
+        check('help lists the commands', 'set KEY VALUE' in control(ctl, 'help'))
+        fields = status(ctl)
+        check('server status', fields.get('mode') == 'server' and fields.get('destination') == dest_a)
+
+        c1 = start('--control', cctl, '127.0.0.1:%d' % CLIENT1, '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+        procs.append(c1)
+        check('first client relays to the destination', ping(CLIENT1) == b'Ahi')
+
+        check('set destination', control(ctl, 'set destination ' + dest_b).strip() == 'OK')
+        check('set batch 0 is rejected', control(ctl, 'set batch 0').startswith('ERR'))
+        check('set batch 8', control(ctl, 'set batch 8').strip() == 'OK')
+        check('set timeout x is rejected', control(ctl, 'set timeout x').startswith('ERR'))
+        control(ctl, 'set log-level debug')
+        check('get log-level', control(ctl, 'get log-level').startswith('log-level debug'))
+        check('get of an unknown setting', control(ctl, 'get nope').startswith('ERR'))
+        check('listen', control(ctl, 'listen 127.0.0.1:%d' % SERVER2).strip() == 'OK')
+        check('listen twice is rejected', control(ctl, 'listen 127.0.0.1:%d' % SERVER2).startswith('ERR'))
+        check('unlisten', control(ctl, 'unlisten 127.0.0.1:%d' % SERVER).strip() == 'OK')
+        fields = status(ctl)
+        check('status shows the new listener and settings',
+              fields.get('listen') == '127.0.0.1:%d' % SERVER2 and fields.get('batch') == '8')
+
+        c2 = start('127.0.0.1:%d' % CLIENT2, '127.0.0.1:%d' % SERVER2, stdout=log, stderr=log)
+        c3 = start('127.0.0.1:%d' % CLIENT3, '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+        procs += [c2, c3]
+        check('new listener, new destination', ping(CLIENT2) == b'Bhi')
+        check('running tunnel keeps its destination', ping(CLIENT1) == b'Ahi')
+        check('removed listener refuses clients', c3.poll() is not None)
+
+        check('client status', status(cctl).get('mode') == 'client')
+        check('client destination is read-only', control(cctl, 'set destination 1.2.3.4:5').startswith('ERR'))
+        check('set the client timeout', control(cctl, 'set timeout 2').strip() == 'OK')
+
+        os.kill(srv.pid, signal.SIGUSR2)
+        time.sleep(0.3)
+        fields = status(ctl)
+        check('server settings and listeners survive an upgrade',
+              fields.get('listen') == '127.0.0.1:%d' % SERVER2 and fields.get('batch') == '8' and
+              fields.get('destination') == dest_b)
+        os.kill(c1.pid, signal.SIGUSR2)
+        time.sleep(0.3)
+        check('client settings survive an upgrade', control(cctl, 'get timeout').startswith('timeout 2'))
+        check('client relays after its upgrade', ping(CLIENT1) == b'Ahi')
+        for _ in range(130): # The timeouts are checked every 10 seconds
+            if c1.poll() is not None:
+                break
+            time.sleep(0.1)
+        check('client exits after the new timeout', c1.poll() is not None)
+    finally:
+        stop(*procs)
+    finish()
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""
+DNS cache test of the client (user-091).
+
+A fake resolver behind the tunnel answers after 20 ms with a TTL of 5 s.
+1. The first query goes to the resolver; a repeat with another letter case
+   and ID is answered from the cache, with its own ID and case and an aged
+   TTL, and quickly.
+2. Once the TTL expired, the query goes to the resolver again.
+3. A response that no query asked for is not cached: the same query then
+   goes to the resolver and gets its answer, not the spoofed one.
+
+Usage: dns_test.py
+"""
+import os
+import socket
+import struct
+import threading
+import time
+
+from common import path, start, stop, status, check, finish
+
+SERVER, CLIENT = 24181, 24182
+NAME = b'\x07ExAmPlE\x03com\x00'
+
+
+def resolver(sock, state):
+    while True:
+        query, peer = sock.recvfrom(2000)
+        state['peer'] = peer
+        state['served'] += 1
+        time.sleep(0.02)
+        end = 12
+        while query[end]:
+            end += query[end] + 1
+        end += 5
+        header = query[:2] + b'\x81\x80' + struct.pack('>HHHH', 1, 1, 0, 0)
+        answer = b'\xc0\x0c' + struct.pack('>HHIH', 1, 1, 5, 4) + bytes([10, 0, 0, state['served']])
+        sock.sendto(header + query[12:end] + answer, peer)
+
+
+def query(c, qid, name=NAME):
+    """ID, name, TTL and last address byte of the answer, and the time it took in ms."""
+    c.sendto(struct.pack('>HHHHHH', qid, 0x0100, 1, 0, 0, 0) + name + b'\0\1\0\1', ('127.0.0.1', CLIENT))
+    t = time.time()
+    r = c.recv(2000)
+    return (struct.unpack('>H', r[:2])[0], r[12:12 + len(name)], struct.unpack('>I', r[-10:-6])[0], r[-1],
+            (time.time() - t) * 1000)
+
+
+if __name__ == '__main__':
+    dns = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    dns.bind(('127.0.0.1', 0))
+    state = {'served': 0, 'peer': None}
+    threading.Thread(target=resolver, args=(dns, state), daemon=True).start()
+    log = open(os.devnull, 'w')
+    ctl = path('dns.ctl')
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % dns.getsockname()[1], stdout=log, stderr=log)
+    cli = start('--set', 'dns-cache=64', '--control', ctl, '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER,
+                stdout=log, stderr=log)
+    try:
+        c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        c.settimeout(1)
+        first = query(c, 1)
+        print('miss: %.1f ms' % first[4])
+        check('the first query goes to the resolver', state['served'] == 1 and first[0] == 1)
+        lower = b'\x07example\x03COM\x00'
+        repeat = query(c, 2, lower)
+        print('hit: %.2f ms' % repeat[4])
+        check('a repeat is answered from the cache with its ID and case',
+              state['served'] == 1 and repeat[0] == 2 and repeat[1] == lower and repeat[3] == first[3])
+        time.sleep(1.2)
+        aged = query(c, 3)
+        check('the cached TTL ages (%d s)' % aged[2], state['served'] == 1 and aged[2] < 5)
+        time.sleep(4.2)
+        query(c, 4)
+        check('an expired answer goes to the resolver again', state['served'] == 2)
+
+        evil = b'\x04evil\x03com\x00'
+        c.settimeout(0.3)
+        dns.sendto(struct.pack('>HHHHHH', 7, 0x8180, 1, 1, 0, 0) + evil + b'\0\1\0\1' + b'\xc0\x0c' +
+                   struct.pack('>HHIH', 1, 1, 300, 4) + bytes([6, 6, 6, 6]), state['peer'])
+        try:
+            c.recv(2000) # Relayed to the last peer, as any datagram
+        except socket.timeout:
+            pass
+        c.settimeout(1)
+        answer = query(c, 8, evil)
+        check('an unsolicited response is not cached', state['served'] == 3 and answer[3] != 6)
+        fields = status(ctl)
+        print(' '.join('%s=%s' % item for item in fields.items() if item[0].startswith('dns-')))
+    finally:
+        stop(cli, srv)
+    finish()
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""
+End-to-end regression: round trips through a client and a server.
+
+Each datagram goes from a local sender to the client, through the tunnel to
+the destination, and its reply comes back the same way. The sizes vary
+from 4 to 200 bytes.
+
+Usage: e2e.py [udp|unixgram] [SERVER_OPTIONS] [CLIENT_OPTIONS] [COUNT]
+The options are passed as one string each, e.g.
+    e2e.py unixgram "" "--set bulk-threshold=0"
+"""
+import socket
+import sys
+
+from common import path, start, stop, udp_app
+
+SERVER, CLIENT = 24001, 24002
+
+
+def run(kind='udp', server_args=(), client_args=(), count=200):
+    if kind == 'unixgram':
+        app = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        app.bind(path('app.sock'))
+        app.settimeout(3)
+        dest = 'unixgram:' + path('app.sock')
+    else:
+        app = udp_app()
+        dest = '127.0.0.1:%d' % app.getsockname()[1]
+    srv = start('-s', *server_args, '127.0.0.1:%d' % SERVER, dest)
+    cli = start(*client_args, '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER)
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    c.settimeout(3)
+    ok = 0
+    try:
+        for i in range(count):
+            msg = ('pkt%d' % i).encode() * (1 + i % 50)
+            c.sendto(msg, ('127.0.0.1', CLIENT))
+            data, peer = app.recvfrom(70000)
+            if data != msg:
+                break
+            app.sendto(b'R' + data, peer)
+            reply, _ = c.recvfrom(70000)
+            if reply != b'R' + msg:
+                break
+            ok += 1
+    except socket.timeout:
+        pass
+    finally:
+        stop(cli, srv)
+    print('ok', ok, '/', count)
+    return ok == count
+
+
+if __name__ == '__main__':
+    args = sys.argv[1:] + [''] * 3
+    count = int(sys.argv[4]) if len(sys.argv) > 4 else 200
+    sys.exit(0 if run(args[0] or 'udp', args[1].split(), args[2].split(), count) else 1)
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Flood benchmark of --filter (user-099).
+
+1. CPU time of the client while a flood of unwanted datagrams hits its
+   listener: relayed without a filter, dropped by --acl after being read,
+   and dropped by --filter in the kernel.
+2. Accuracy of the filter-dropped counter: the client is stopped while the
+   flood arrives with wanted datagrams, so the receive buffer overflows. The
+   counter must be the number of unwanted datagrams, while the socket drops
+   also include the overflow. Without CAP_BPF, the status only shows
+   filter-socket-drops.
+
+Usage: filter_bench.py [DATAGRAMS]
+"""
+import os
+import signal
+import socket
+import sys
+import time
+
+from common import BIN, path, start, stop, udp_app, status, cpu_time
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 400000
+SERVER, CLIENT = 24201, 24202
+
+
+def socket_drops(port):
+    """Drops of the IPv4 UDP socket bound to port, from /proc/net/udp."""
+    with open('/proc/net/udp') as f:
+        for line in f.readlines()[1:]:
+            fields = line.split()
+            if int(fields[1].split(':')[1], 16) == port:
+                return int(fields[-1])
+    return 0
+
+
+def flood(count, source, payload=b'\0' * 64):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind((source, 0))
+    for _ in range(count):
+        s.sendto(payload, ('127.0.0.1', CLIENT))
+    s.close()
+
+
+def cpu(name, extra):
+    app = udp_app()
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1])
+    cli = start(*(extra + ['127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER]))
+    before = cpu_time(cli.pid)
+    flood(N, '127.0.0.2')
+    time.sleep(1)
+    used = cpu_time(cli.pid) - before
+    stop(cli, srv)
+    print('%-28s client CPU %.2fs for %d unwanted datagrams' % (name, used, N))
+
+
+def accuracy():
+    ctl = path('filter.ctl')
+    app = udp_app()
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1])
+    cli = start('--control', ctl, '--filter', '!src=127.0.0.2',
+                '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER)
+    unwanted = wanted = N // 4
+    os.kill(cli.pid, signal.SIGSTOP)
+    flood(unwanted, '127.0.0.2')
+    flood(wanted, '127.0.0.1')
+    os.kill(cli.pid, signal.SIGCONT)
+    time.sleep(1)
+    fields = status(ctl)
+    drops = socket_drops(CLIENT)
+    stop(cli, srv)
+    print('%d unwanted and %d wanted datagrams sent to the stopped client' % (unwanted, wanted))
+    print('socket drops %d: filtered, and dropped on a full buffer' % drops)
+    if 'filter-dropped' in fields:
+        dropped = int(fields['filter-dropped'])
+        print('filter-dropped %d: %s' % (dropped, 'exact' if dropped == unwanted else 'WRONG'))
+        return dropped == unwanted
+    print('filter-socket-drops %s: no eBPF counter without CAP_BPF' % fields.get('filter-socket-drops'))
+    return True
+
+
+if __name__ == '__main__':
+    print('binary', BIN)
+    acl = path('deny.acl')
+    with open(acl, 'w') as f:
+        f.write('deny 127.0.0.2/32\nallow 0.0.0.0/0\n')
+    cpu('no filter (relayed)', [])
+    cpu('--acl deny (userspace)', ['--acl', acl])
+    cpu('--filter (kernel)', ['--filter', '!src=127.0.0.2'])
+    sys.exit(0 if accuracy() else 1)
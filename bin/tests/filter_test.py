@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""
+--filter test (user-099).
+
+Runs a client with sets of --filter expressions and sends datagrams that
+each must pass or be dropped in the kernel: payload prefix and length,
+source and destination ports, negations, IPv4 and IPv6 sources on a
+dual-stack listener. The filter-dropped counter of the status must match
+the datagrams dropped; without CAP_BPF, where the status only has
+filter-socket-drops, the count is not checked. The fallback can be run by
+pointing UDPTUNNEL at a wrapper which drops the capabilities, e.g.
+capsh --drop=cap_bpf,cap_sys_admin,cap_perfmon.
+
+Usage: filter_test.py
+"""
+import socket
+
+from common import path, start, stop, udp_app, status, check, finish
+
+SERVER = 24231
+
+
+def run(listen, filters, sends):
+    ctl = path('filter-%d.ctl' % SERVER)
+    app = udp_app(timeout=0.3)
+    args = []
+    for expression in filters:
+        args += ['--filter', expression]
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1])
+    cli = start('--control', ctl, *args, listen, '127.0.0.1:%d' % SERVER)
+    port = int(listen.rsplit(':', 1)[1])
+    dropped = 0
+    try:
+        for source, sport, msg, passes in sends:
+            family = socket.AF_INET6 if ':' in source else socket.AF_INET
+            c = socket.socket(family, socket.SOCK_DGRAM)
+            c.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            c.bind((source, sport))
+            c.sendto(msg, ('::1' if ':' in source else '127.0.0.1', port))
+            try:
+                passed = app.recvfrom(70000)[0] == msg
+            except socket.timeout:
+                passed = False
+            c.close()
+            dropped += not passes
+            check('%s: %d bytes from %s port %d %s' % (' '.join(filters), len(msg), source, sport,
+                                                       'pass' if passes else 'dropped'), passed == passes)
+        fields = status(ctl)
+    finally:
+        stop(cli, srv)
+    if 'filter-dropped' in fields:
+        check('filter-dropped counts the %d dropped datagrams' % dropped, int(fields['filter-dropped']) == dropped)
+    else:
+        print('filter-socket-drops %s: no eBPF counter without CAP_BPF' % fields.get('filter-socket-drops'))
+
+
+if __name__ == '__main__':
+    run('127.0.0.1:24232', ['prefix=6162,len<=100', 'sport=40000-40010'], [
+        ('127.0.0.1', 40005, b'zzz', True),
+        ('127.0.0.1', 0, b'abXXX', True),
+        ('127.0.0.1', 0, b'ab' + b'x' * 200, False),
+        ('127.0.0.1', 0, b'zz', False),
+        ('127.0.0.1', 40011, b'zz', False),
+        ('127.0.0.1', 0, b'a', False),
+        ('127.0.0.1', 40010, b'a' * 1000, True),
+    ])
+    run('127.0.0.1:24233', ['!src=127.0.0.2,dport=24233', 'src=127.0.0.0/8,!prefix=00010203040506,len>=7'], [
+        ('127.0.0.1', 0, b'hello', True),
+        ('127.0.0.2', 0, b'hello', False),
+        ('127.0.0.2', 0, b'\x00\x01\x02\x03\x04\x05\x06', False),
+        ('127.0.0.2', 0, b'\x00\x01\x02\x03\x04\x05\x07', True),
+    ])
+    run('[::]:24234', ['src=::1/128,len>4', 'src=127.0.0.0/8'], [
+        ('::1', 0, b'hello', True),
+        ('::1', 0, b'hell', False),
+        ('127.0.0.1', 0, b'hi', True),
+    ])
+    finish()
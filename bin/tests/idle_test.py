@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""
+Lazy connect and idle disconnect test (user-086).
+
+A client with --idle-disconnect 2:
+1. has no TCP connection until the first datagram, which then goes through;
+2. keeps its connection while a datagram crosses it every half second;
+3. closes it 2 seconds after the last datagram, and reports connected 0;
+4. opens a new one on the next datagram, and also after the server closed
+   the connection.
+
+Usage: idle_test.py
+"""
+import os
+import signal
+import socket
+import subprocess
+import time
+
+from common import path, start, stop, udp_app, status, check, finish
+
+SERVER, CLIENT = 24261, 24262
+
+
+def connections():
+    """The local ports of the established connections to the server."""
+    out = subprocess.run(['ss', '-tnH', 'state', 'established', '( dport = :%d )' % SERVER],
+                         capture_output=True, text=True).stdout
+    return [line.split()[-2].rsplit(':', 1)[1] for line in out.splitlines()]
+
+
+if __name__ == '__main__':
+    app = udp_app()
+    ctl = path('idle.ctl')
+    log = open(os.devnull, 'w')
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    cli = start('--idle-disconnect', '2', '--control', ctl, '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER,
+                stdout=log, stderr=log)
+    c = udp_app()
+
+    def ping(msg):
+        c.sendto(msg, ('127.0.0.1', CLIENT))
+        data, source = app.recvfrom(100)
+        app.sendto(b'R' + data, source)
+        return data == msg and c.recvfrom(100)[0] == b'R' + msg
+
+    try:
+        check('no connection before the first datagram', connections() == [] and status(ctl).get('connected') == '0')
+        check('the first datagram opens the connection and goes through', ping(b'first'))
+        first = connections()
+        check('one connection is open', len(first) == 1)
+
+        ok = True
+        for i in range(6):
+            time.sleep(0.5)
+            ok &= ping(b'busy%d' % i)
+        check('3 s of traffic keep the same connection', ok and connections() == first)
+
+        t = time.time()
+        while connections() and time.time() - t < 5:
+            time.sleep(0.05)
+        idle = time.time() - t
+        check('the connection closes after 2 idle seconds (%.1f s)' % idle, 1.8 <= idle <= 2.8)
+        check('status shows connected 0', status(ctl).get('connected') == '0')
+
+        check('the next datagram reopens it', ping(b'again') and len(connections()) == 1)
+        second = connections()
+        check('with a new connection', second != first)
+
+        with open('/proc/%d/task/%d/children' % (srv.pid, srv.pid)) as f:
+            for pid in f.read().split():
+                os.kill(int(pid), signal.SIGTERM)
+        time.sleep(0.3)
+        try:
+            ok = ping(b'closed')
+        except socket.timeout: # Lost with the connection the server closed
+            ok = ping(b'closed2')
+        check('a connection closed by the server is reopened', ok and connections() not in ([], second))
+    finally:
+        stop(cli, srv)
+    finish()
@@ -0,0 +1,79 @@
+/*
+ * Cost of the user space frame parser, for kcm_bench.py.
+ *
+ * Builds a stream of length prefixed frames of SIZE bytes, copies it ROUNDS
+ * times into the receive buffer of a tunnel by chunks of 64 KB, as recv()
+ * would, and pulls the frames with udptunnel_udp_next(). Prints the time per
+ * frame. This is the work that --kcm moves to the kernel.
+ *
+ * Usage: kcm_bench SIZE ROUNDS
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "libs/relay/relay.h"
+
+#define STREAM_SIZE (4 << 20)
+#define CHUNK_SIZE  65536
+
+int main(int argc, char **argv)
+{
+    static char stream[STREAM_SIZE];
+    struct udptunnel_config config = { 0 };
+    struct udptunnel *tunnel;
+    struct timespec t0, t1;
+    size_t size = argc > 1 ? atol(argv[1]) : 100, off = 0;
+    int rounds = argc > 2 ? atoi(argv[2]) : 50, r;
+    long frames = 0, expected = 0;
+    double ns;
+
+    if (size < 1 || size > 65535) {
+		fprintf(stderr, "Invalid frame size %zu\n", size);
+		return 1;
+    }
+    while (off + size + 2 <= sizeof(stream)) {
+		uint16_t len = htons(size);
+
+		memcpy(stream + off, &len, 2);
+		memset(stream + off + 2, 'x', size);
+		off += size + 2;
+		expected++;
+    }
+    if (udptunnel_new(&tunnel, &config, NULL) < 0) {
+		fprintf(stderr, "udptunnel_new failed\n");
+		return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (r = 0; r < rounds; r++) {
+		size_t pos = 0;
+
+		while (pos < off) {
+			const char *packet;
+			size_t space, len;
+			void *buf;
+
+			if (udptunnel_tcp_buffer(tunnel, &buf, &space) < 0)
+				break;
+			len = off - pos < space ? off - pos : space;
+			if (len > CHUNK_SIZE)
+				len = CHUNK_SIZE;
+			memcpy(buf, stream + pos, len);
+			udptunnel_tcp_commit(tunnel, len);
+			pos += len;
+			while (udptunnel_udp_next(tunnel, &packet, &len) > 0)
+				frames++;
+		}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    udptunnel_free(tunnel);
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("user space parser: %ld frames of %zu bytes, %.1f ns per frame\n",
+		frames, size, frames ? ns / frames : 0);
+    return frames == expected * rounds ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""
+Benchmark of --kcm (user-092).
+
+1. Builds kcm_bench.c with libudptunnel and reports the cost per frame of
+   the user space parser, for 100-byte frames.
+2. Streams 100-byte datagrams from the client to the server, once without
+   and once with --kcm on the server, and reports the server CPU time per
+   frame, tunnel process included. Without AF_KCM (no kcm module), the
+   server logs that it falls back to the user space parser: both runs then
+   measure the same path, and the script says so.
+
+Usage: kcm_bench.py [DATAGRAMS]
+"""
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+from common import BIN, compile_c, start, stop, udp_app, tree_cpu_time
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+SERVER, CLIENT = 24191, 24192
+
+
+def run(extra):
+    app = udp_app()
+    app.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+    log = open(os.devnull, 'w')
+    srv = start('-v', '-s', *extra, '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1],
+                command=['stdbuf', '-oL', BIN], stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    cli = start('127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    c.connect(('127.0.0.1', CLIENT))
+    msg = b'x' * 100
+    got = [0]
+
+    def receive():
+        app.settimeout(1)
+        try:
+            while got[0] < N:
+                app.recvfrom(2048)
+                got[0] += 1
+        except socket.timeout:
+            pass
+
+    try:
+        c.send(msg) # Opens the tunnel before the clock starts
+        app.recvfrom(2048)
+        receiver = threading.Thread(target=receive)
+        receiver.start()
+        before = tree_cpu_time(srv.pid)
+        for i in range(N):
+            c.send(msg)
+            if i % 100 == 0:
+                time.sleep(0.001)
+        receiver.join()
+        cpu = tree_cpu_time(srv.pid) - before
+    finally:
+        stop(cli, srv)
+    got = got[0]
+    fallback = b'Cannot use AF_KCM' in srv.stdout.read()
+    name = '--kcm' if extra else 'user space'
+    print('%-10s %d of %d frames, server CPU %.2f us per frame%s' %
+          (name, got, N, cpu / max(got, 1) * 1e6, ' (fallback: no AF_KCM)' if fallback else ''))
+    return fallback
+
+
+if __name__ == '__main__':
+    exe = compile_c('kcm_bench.c', 'libudptunnel.a')
+    out = subprocess.run([exe, '100', '50'], capture_output=True, text=True)
+    print(out.stdout.strip() or out.stderr.strip())
+    run([])
+    if run(['--kcm']):
+        print('AF_KCM is not available: both runs parse the stream in user space')
+    sys.exit(out.returncode)
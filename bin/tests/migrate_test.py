@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""
+Tunnel migration test (user-095). Needs root and TCP_REPAIR.
+
+Builds three network namespaces on a bridge: the client host with the
+destination, host A and host B. The server address 10.99.0.100 starts on
+A, whose server has --migrate-to B. A client sends 4000 datagrams of 200
+bytes to an echo destination, one per millisecond. After 1500 of them:
+1. the tunnel is moved with the migrate control command of A, and the
+   address moves to B, as a floating IP would;
+2. the lingering tunnel on A gets SIGUSR1 and SIGUSR2, which must not end
+   the linger.
+Reports the migration time, the largest gap between replies and the
+datagrams lost, which must be none. The servers and the client share a
+--secret; a connection to the migration listener of B which sends nothing
+must not delay the migration, and --migrate-listen without --secret must
+be refused with exit status 2.
+
+Modes: ctl (default); burst, which adds 4000 datagrams of 1200 bytes around
+the migration; fail, where B is not running: the migration must fail and
+the tunnel must stay on A.
+
+Usage: migrate_test.py [ctl|burst|fail]
+"""
+import atexit
+import ctypes
+import os
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+from common import BIN, path, start, stop, control, check, finish
+
+MODE = sys.argv[1] if len(sys.argv) > 1 else 'ctl'
+NAMESPACES = {'udptunnel-mc': '10.99.0.1', 'udptunnel-ma': '10.99.0.2', 'udptunnel-mb': '10.99.0.3'}
+SWITCH, VIP = 'udptunnel-msw', '10.99.0.100'
+N, AT = 4000, 1500
+
+
+def sh(command):
+    subprocess.run(command, shell=True, check=True)
+
+
+def setup():
+    for ns in list(NAMESPACES) + [SWITCH]:
+        subprocess.run('ip netns del %s' % ns, shell=True, stderr=subprocess.DEVNULL)
+        sh('ip netns add %s' % ns)
+        atexit.register(subprocess.run, 'ip netns del %s' % ns, shell=True)
+    sh('ip -n %s link add br0 type bridge && ip -n %s link set br0 up' % (SWITCH, SWITCH))
+    for i, (ns, addr) in enumerate(NAMESPACES.items()):
+        sh('ip link add utm%d netns %s type veth peer name utp%d netns %s' % (i, ns, i, SWITCH))
+        sh('ip -n %s link set utp%d master br0 && ip -n %s link set utp%d up' % (SWITCH, i, SWITCH, i))
+        sh('ip -n %s addr add %s/24 dev utm%d && ip -n %s link set utm%d up && ip -n %s link set lo up' %
+           (ns, addr, i, ns, i, ns))
+    sh('ip -n udptunnel-ma addr add %s/32 dev lo' % VIP)
+    sh('ip -n udptunnel-mc route add %s/32 via 10.99.0.2' % VIP)
+
+
+def move_address():
+    sh('ip -n udptunnel-ma addr del %s/32 dev lo' % VIP)
+    sh('ip -n udptunnel-mb addr add %s/32 dev lo' % VIP)
+    sh('ip -n udptunnel-mc route replace %s/32 via 10.99.0.3' % VIP)
+
+
+def enter(ns):
+    """Moves this process, and the processes it starts, to the namespace."""
+    libc = ctypes.CDLL(None, use_errno=True)
+    fd = os.open('/run/netns/%s' % ns, os.O_RDONLY)
+    if libc.setns(fd, 0) != 0:
+        raise OSError(ctypes.get_errno(), 'setns')
+    os.close(fd)
+
+
+def lingering(pid):
+    with open('/proc/%d/task/%d/children' % (pid, pid)) as f:
+        return [int(child) for child in f.read().split()]
+
+
+def alive(pid):
+    try:
+        with open('/proc/%d/stat' % pid) as f:
+            return f.read().rsplit(')', 1)[1].split()[0] != 'Z'
+    except OSError:
+        return False
+
+
+if __name__ == '__main__':
+    refused = subprocess.run([BIN, '-s', '--migrate-listen', '127.0.0.1:24251', '127.0.0.1:24252', '127.0.0.1:9'],
+                             stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=5)
+    check('--migrate-listen without --secret is refused', refused.returncode == 2)
+    setup()
+    ctl, log_path, secret = path('migrate.ctl'), path('migrate.log'), path('secret')
+    with open(os.open(secret, os.O_WRONLY | os.O_CREAT, 0o600), 'wb') as f:
+        f.write(os.urandom(32))
+    log = open(log_path, 'w')
+    a = start('-s', '-v', '--secret', secret, '--migrate-to', '10.99.0.3:7000', '--control', ctl, '0.0.0.0:4000',
+              '10.99.0.1:9000', command=['ip', 'netns', 'exec', 'udptunnel-ma', BIN], stdout=log, stderr=log)
+    procs = [a]
+    if MODE != 'fail':
+        procs.append(start('-s', '-v', '--secret', secret, '--migrate-listen', '10.99.0.3:7000', '0.0.0.0:4000',
+                           '10.99.0.1:9000', command=['ip', 'netns', 'exec', 'udptunnel-mb', BIN],
+                           stdout=log, stderr=log))
+    enter('udptunnel-mc')
+    echo = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    echo.bind(('10.99.0.1', 9000))
+
+    def echo_loop():
+        while True:
+            data, peer = echo.recvfrom(65535)
+            echo.sendto(data, peer)
+
+    threading.Thread(target=echo_loop, daemon=True).start()
+    procs.append(start('-v', '--secret', secret, '127.0.0.1:5000', '%s:4000' % VIP, stdout=log, stderr=log))
+    app = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    app.connect(('127.0.0.1', 5000))
+    app.settimeout(0.001)
+    received, last, max_gap = set(), None, 0
+
+    def receive(until):
+        global last, max_gap
+        while True:
+            try:
+                data = app.recv(65535)
+                now = time.time()
+                received.add(struct.unpack('!I', data[:4])[0])
+                if last is not None and now - last > max_gap:
+                    max_gap = now - last
+                last = now
+            except socket.timeout:
+                pass
+            if time.time() >= until:
+                break
+
+    tunnels = []
+    try:
+        for i in range(N):
+            if i == AT:
+                if MODE != 'fail': # Stalls the migration listener for 5 s if the server waits for it
+                    stalled = socket.create_connection(('10.99.0.3', 7000))
+                print(control(ctl, 'migrate').strip())
+                t = time.time()
+                done = ('Cannot connect to', 'resuming the tunnel') if MODE == 'fail' else ('Migrated the tunnel',)
+                while not any(line in open(log_path).read() for line in done) and time.time() - t < 5:
+                    time.sleep(0.001)
+                print('%s after %.1f ms' % ('failed' if MODE == 'fail' else 'migrated', (time.time() - t) * 1000))
+                if MODE == 'fail':
+                    check('the migration fails and the tunnel stays on A',
+                          any(line in open(log_path).read() for line in done))
+                else:
+                    check('a stalled migration does not delay the next one', time.time() - t < 1)
+                    stalled.close()
+                    tunnels = lingering(a.pid)
+                    for pid in tunnels:
+                        os.kill(pid, 10) # SIGUSR1
+                        os.kill(pid, 12) # SIGUSR2
+                    move_address()
+            if i == AT + 200 and tunnels:
+                check('the lingering tunnel survives SIGUSR1 and SIGUSR2', all(alive(pid) for pid in tunnels))
+            app.send(struct.pack('!I', i) + os.urandom(200))
+            if MODE == 'burst' and AT - 100 <= i < AT + 100:
+                for j in range(20):
+                    app.send(struct.pack('!I', 100000 + i * 20 + j) + os.urandom(1200))
+            receive(time.time() + 0.001)
+        receive(time.time() + 3)
+    finally:
+        stop(*procs)
+        for pid in tunnels: # Still lingering
+            if alive(pid):
+                os.kill(pid, 15)
+    lost = [i for i in range(N) if i not in received]
+    print('received %d/%d, largest gap %.1f ms' % (N - len(lost), N, max_gap * 1000))
+    check('no datagram of the %d is lost (%d)' % (N, len(lost)), not lost)
+    finish()
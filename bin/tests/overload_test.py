@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""
+Overload protection test of the server (user-085).
+
+Covers the tunnel limit, the per-region limit, the tunnel table surviving
+a SIGUSR2 upgrade, a tunnel dropped after max-tunnels was lowered at
+runtime, and the memory threshold.
+
+With UDPTUNNEL_OLD set to a binary built before the tunnel table had a
+header, an upgrade from that binary must keep the server running and leave
+its tunnels untracked.
+
+Usage: overload_test.py
+"""
+import os
+import shutil
+import signal
+import time
+
+from common import BIN, path, start, stop, udp_app, control, status, check, finish
+
+SERVER, CLIENTS = 24121, 24130
+
+
+def children(pid):
+    with open('/proc/%d/task/%d/children' % (pid, pid)) as f:
+        return f.read().split()
+
+
+if __name__ == '__main__':
+    ctl = path('overload.ctl')
+    app = udp_app()
+    log = open(os.devnull, 'w')
+    srv = start('-s', '--set', 'max-tunnels=2', '--control', ctl, '127.0.0.1:%d' % SERVER,
+                '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    procs = [srv]
+
+    def client(i):
+        proc = start('127.0.0.1:%d' % (CLIENTS + i), '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+        procs.append(proc)
+        return proc
+
+    try:
+        for i in range(3):
+            client(i)
+        time.sleep(0.3)
+        fields = status(ctl)
+        check('max-tunnels=2 sheds the third client',
+              fields['tunnels'] == '2' and fields['shed-tunnels'] == '1' and len(children(srv.pid)) == 2)
+        check('the shed client exits', procs[3].poll() is not None)
+
+        control(ctl, 'set max-tunnels 0')
+        control(ctl, 'set max-region-tunnels 2')
+        client(3)
+        time.sleep(0.3)
+        fields = status(ctl)
+        check('max-region-tunnels=2 sheds a client of the same /24',
+              fields['tunnels'] == '2' and fields['shed-region'] == '1' and
+              fields['largest-region'] == '127.0.0.0/24 2')
+
+        os.kill(srv.pid, signal.SIGUSR2)
+        time.sleep(0.5)
+        check('the tunnel table survives an upgrade', status(ctl)['tunnels'] == '2')
+
+        control(ctl, 'set max-region-tunnels 0')
+        control(ctl, 'set max-tunnels 1')
+        for _ in range(50):
+            fields = status(ctl)
+            if fields['tunnels'] == '1':
+                break
+            time.sleep(0.1)
+        check('lowering max-tunnels drops a tunnel',
+              fields['tunnels'] == '1' and fields['dropped'] == '1' and len(children(srv.pid)) == 1)
+
+        control(ctl, 'set max-tunnels 0')
+        control(ctl, 'set min-memory 100000000')
+        time.sleep(1.3)
+        fields = status(ctl)
+        print('overloaded %s memory-available-mb %s lag-ms %s cpu-steal-pct %s' %
+              (fields['overloaded'], fields['memory-available-mb'], fields['lag-ms'], fields['cpu-steal-pct']))
+        check('min-memory above the available memory overloads the server', fields['overloaded'] != 'no')
+    finally:
+        stop(*procs)
+
+    if os.environ.get('UDPTUNNEL_OLD'):
+        exe = path('udptunnel-old')
+        shutil.copy(os.environ['UDPTUNNEL_OLD'], exe)
+        srv = start('-s', '--control', ctl, '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1],
+                    command=[exe], stdout=log, stderr=log)
+        procs = [srv]
+        try:
+            client(0)
+            client(1)
+            os.unlink(exe)
+            shutil.copy(BIN, exe)
+            os.kill(srv.pid, signal.SIGUSR2)
+            time.sleep(0.5)
+            check('an upgrade from the old table layout leaves its tunnels untracked',
+                  srv.poll() is None and status(ctl)['tunnels'] == '0')
+        finally:
+            stop(*procs)
+    finish()
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""
+Source pool test (user-097).
+
+A server with --source-pool 127.0.0.2,127.0.0.3 and --source-ports
+40000-40002 has 6 slots, one of them held by a socket of this script.
+1. Five clients fill the pool: the destination must see five different
+   sources of the pool, never the slot held by the other socket.
+2. A sixth connection must be shed with "source pool exhausted".
+3. Once a client has gone and its tunnel is reaped, the next client must
+   get the slot it freed.
+4. Once the other socket is closed and another client has gone, the next
+   two clients must get these two slots.
+
+Usage: pool_test.py
+"""
+import os
+import socket
+import time
+
+from common import path, start, stop, udp_app, status, check, finish
+
+SERVER, CLIENTS = 24251, 24252
+POOL = [(addr, port) for port in range(40000, 40003) for addr in ('127.0.0.2', '127.0.0.3')]
+FOREIGN = ('127.0.0.3', 40001)
+
+
+if __name__ == '__main__':
+    app = udp_app(timeout=1)
+    ctl = path('pool.ctl')
+    log = open(os.devnull, 'w')
+    foreign = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    foreign.bind(FOREIGN)
+    srv = start('-s', '--control', ctl, '--source-pool', '127.0.0.2,127.0.0.3', '--source-ports', '40000-40002',
+                '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    clients = []
+    c = udp_app()
+
+    def client():
+        """Starts a client and returns the source the destination sees for it, or None."""
+        port = CLIENTS + len(clients)
+        clients.append(start('127.0.0.1:%d' % port, '127.0.0.1:%d' % SERVER, stdout=log, stderr=log))
+        c.sendto(b'x', ('127.0.0.1', port))
+        try:
+            return app.recvfrom(100)[1]
+        except socket.timeout:
+            return None
+
+    try:
+        sources = [client() for _ in range(5)]
+        check('five tunnels get five slots of the pool', len(set(sources)) == 5 and set(sources) <= set(POOL))
+        check('the slot held by another socket is skipped', FOREIGN not in sources)
+        fields = status(ctl)
+        check('status counts 5 tunnels and 1 foreign slot',
+              fields.get('source-pool-tunnels') == '5' and fields.get('source-pool-foreign') == '1')
+
+        check('a sixth tunnel gets no slot', client() is None)
+        check('it is shed as the pool is exhausted', int(status(ctl).get('shed', 0)) >= 1)
+        stop(clients[5]) # Or it would take the next free slot
+
+        stop(clients[0])
+        time.sleep(0.5) # The tunnel sees the connection close and is reaped
+        check('the slot of a reaped tunnel is reused', client() == sources[0])
+
+        foreign.close()
+        stop(clients[1])
+        time.sleep(0.5)
+        check('the slots freed by the other socket and a tunnel are used again',
+              {client(), client()} == {FOREIGN, sources[1]})
+    finally:
+        stop(*clients, srv)
+    finish()
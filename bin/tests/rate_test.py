@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""
+Per-source rate limit test (user-089).
+
+1. A source floods the client for one second against source-rate=50 and
+   source-burst=10, while another source sends a few datagrams. About 50 of
+   the flood (a new source starts with one packet, then 50 per second) must
+   go through, and all the datagrams of the other source.
+2. 2000 new sources send 3 datagrams each, as a spoofed flood would: they
+   share one bucket, so about the burst and 50 per second go through.
+
+Usage: rate_test.py
+"""
+import os
+import socket
+import time
+
+from common import path, start, stop, udp_app, status, check, finish
+
+SERVER, CLIENT = 24161, 24162
+
+if __name__ == '__main__':
+    app = udp_app(timeout=0.5)
+    log = open(os.devnull, 'w')
+    ctl = path('rate.ctl')
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    cli = start('--set', 'source-rate=50', '--set', 'source-burst=10', '--control', ctl,
+                '0.0.0.0:%d' % CLIENT, '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+    try:
+        flood = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        flood.bind(('127.0.0.2', 0))
+        good = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        good.bind(('127.0.0.1', 0))
+        sent = good_sent = 0
+        t0 = time.time()
+        while time.time() - t0 < 1.0:
+            flood.sendto(b'F', ('127.0.0.1', CLIENT))
+            sent += 1
+            if sent % 1000 == 0: # Below the rate
+                good.sendto(b'G', ('127.0.0.1', CLIENT))
+                good_sent += 1
+            if sent % 50 == 0:
+                time.sleep(0.001)
+        got = {b'F': 0, b'G': 0}
+        try:
+            while True:
+                got[app.recvfrom(10)[0][:1]] += 1
+        except socket.timeout:
+            pass
+        print('flood of %d datagrams/s: %d relayed, other source %d of %d' % (sent, got[b'F'], got[b'G'], good_sent))
+        check('the flood is limited to the rate', 45 <= got[b'F'] <= 60)
+        check('the other source is not limited', got[b'G'] == good_sent)
+
+        t0 = time.time()
+        for i in range(2000):
+            s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            s.bind(('127.1.%d.%d' % (i // 250, i % 250 + 1), 0))
+            for _ in range(3):
+                s.sendto(b'S', ('127.0.0.1', CLIENT))
+            s.close()
+        elapsed = time.time() - t0
+        spoofed = 0
+        try:
+            while True:
+                spoofed += app.recvfrom(10)[0] == b'S'
+        except socket.timeout:
+            pass
+        print('6000 datagrams from 2000 sources in %.2f s: %d relayed' % (elapsed, spoofed))
+        check('new sources share one bucket', spoofed <= 10 + 50 * (elapsed + 0.1) + 5)
+        print(' '.join('%s=%s' % item for item in status(ctl).items() if item[0].startswith('rate-')))
+    finally:
+        stop(cli, srv)
+    finish()
@@ -0,0 +1,132 @@
+/*
+ * Test of the public API of libudptunnel, for relay_test.py.
+ *
+ * Drives two handles, a client and a server, through the handshake, frames
+ * split at every byte and across reads, the largest frame, oversized and
+ * truncated packets, a bad handshake and a state export in the middle of a
+ * frame. Prints one line per check and exits with 1 if one failed.
+ *
+ * Usage: relay_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libs/relay/relay.h"
+
+static int failures;
+
+static void check(const char *what, int ok)
+{
+    printf("%-68s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+		failures++;
+}
+
+/**
+ * Feeds len bytes of stream to the handle by chunks of step bytes and
+ * returns the number of packets decoded, checking each against expected.
+ */
+static int feed(struct udptunnel *tunnel, const char *stream, size_t len, size_t step,
+	const char *expected, size_t expected_len)
+{
+    size_t pos = 0;
+    int packets = 0;
+
+    while (pos < len) {
+		const char *packet;
+		size_t packet_len;
+		int n = udptunnel_tcp_in(tunnel, stream + pos, len - pos < step ? len - pos : step);
+
+		if (n < 0)
+			return n;
+		pos += n;
+		while ((n = udptunnel_udp_next(tunnel, &packet, &packet_len)) > 0) {
+			if (packet_len != expected_len || memcmp(packet, expected, expected_len) != 0)
+				return -100;
+			packets++;
+		}
+		if (n < 0)
+			return n;
+    }
+    return packets;
+}
+
+int main(void)
+{
+    static char stream[3 * (UDPTUNNEL_MAX_PAYLOAD + UDPTUNNEL_HEADER_SIZE)], big[UDPTUNNEL_MAX_PAYLOAD + 1];
+    static char state[UDPTUNNEL_EXPORT_SIZE];
+    struct udptunnel_config client_config = { 0 }, server_config = { 0 };
+    struct udptunnel *client, *server, *copy;
+    const char *packet;
+    char out[64];
+    size_t len, packet_len;
+    int n, i, ok;
+
+    server_config.expect_handshake = 1;
+    if (udptunnel_new(&client, &client_config, NULL) < 0 || udptunnel_new(&server, &server_config, NULL) < 0) {
+		fprintf(stderr, "udptunnel_new failed\n");
+		return 1;
+    }
+    memset(big, 'b', sizeof(big));
+
+    /* the client stream: handshake, then "hello" fed one byte at a time */
+    len = udptunnel_handshake(client, stream, sizeof(stream));
+    n = udptunnel_udp_in(client, "hello", 5, stream + len, sizeof(stream) - len);
+    check("udp_in encapsulates a packet behind a 2-byte prefix",
+		n == 7 && stream[len] == 0 && stream[len + 1] == 5 && memcmp(stream + len + 2, "hello", 5) == 0);
+    len += n;
+    check("the server is not established before the handshake", !udptunnel_established(server));
+    n = feed(server, stream, len, 1, "hello", 5);
+    check("a handshake and a frame split at every byte give one packet", n == 1);
+    check("the server is established after the handshake", udptunnel_established(server));
+    check("the stream is drained at a frame boundary", udptunnel_tcp_drained(server));
+
+    /* three frames of the largest size, cut across reads of 1000 bytes */
+    for (i = 0, len = 0; i < 3; i++)
+		len += udptunnel_udp_in(client, big, UDPTUNNEL_MAX_PAYLOAD, stream + len, sizeof(stream) - len);
+    check("udp_in accepts the largest payload", len == sizeof(stream));
+    check("three largest frames split across reads give three packets",
+		feed(server, stream, len, 1000, big, UDPTUNNEL_MAX_PAYLOAD) == 3);
+
+    /* oversized and truncated packets */
+    check("udp_in refuses a payload above the maximum",
+		udptunnel_udp_in(client, big, sizeof(big), stream, sizeof(stream)) == UDPTUNNEL_EMSGSIZE);
+    check("frame_header refuses a payload above the maximum",
+		udptunnel_frame_header(sizeof(big), out) == UDPTUNNEL_EMSGSIZE);
+    check("udp_in refuses an output buffer without room for the prefix",
+		udptunnel_udp_in(client, "hello", 5, out, 6) == UDPTUNNEL_ENOSPC);
+
+    /* udp_out keeps a packet which does not fit the caller buffer */
+    len = udptunnel_udp_in(client, big, 100, stream, sizeof(stream));
+    udptunnel_tcp_in(server, stream, len);
+    n = udptunnel_udp_out(server, out, sizeof(out), &packet_len);
+    ok = n == UDPTUNNEL_ENOSPC && udptunnel_udp_next(server, &packet, &packet_len) == 1 && packet_len == 100;
+    check("udp_out returns ENOSPC and keeps the packet for the next call", ok);
+
+    /* a state exported in the middle of a frame continues in another handle */
+    len = udptunnel_udp_in(client, "state", 5, stream, sizeof(stream));
+    udptunnel_tcp_in(server, stream, 4);
+    udptunnel_udp_next(server, &packet, &packet_len);
+    n = udptunnel_export(server, state, sizeof(state));
+    ok = n > 0 && udptunnel_new(&copy, &client_config, NULL) == 0 && udptunnel_import(copy, state, n) == 0;
+    check("an export in the middle of a frame is imported",
+		ok && feed(copy, stream + 4, len - 4, 1, "state", 5) == 1);
+    check("a corrupted export is refused", udptunnel_import(copy, "garbage", 7) == UDPTUNNEL_EINVAL);
+    udptunnel_free(copy);
+
+    /* a wrong handshake makes the handle unusable */
+    udptunnel_free(server);
+    udptunnel_new(&server, &server_config, NULL);
+    memset(stream, 'x', UDPTUNNEL_HANDSHAKE_SIZE);
+    check("a bad handshake is reported",
+		feed(server, stream, UDPTUNNEL_HANDSHAKE_SIZE, 7, NULL, 0) == UDPTUNNEL_EHANDSHAKE);
+    check("the handle refuses more data after a bad handshake",
+		udptunnel_tcp_in(server, stream, 1) == UDPTUNNEL_EHANDSHAKE);
+
+    udptunnel_free(server);
+    udptunnel_free(client);
+    printf(failures ? "%d checks failed\n" : "all checks passed\n", failures);
+    return failures != 0;
+}
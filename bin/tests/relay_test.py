@@ -0,0 +1,18 @@
+#!/usr/bin/env python3
+"""
+Test of the libudptunnel API (user-080).
+
+Builds relay_test.c against the libudptunnel.a built next to the binary and
+runs it: handshake, split frames, the largest and oversized frames, a bad
+handshake and a state export. See relay_test.c.
+
+Usage: relay_test.py
+"""
+import subprocess
+import sys
+
+from common import compile_c
+
+if __name__ == '__main__':
+    exe = compile_c('relay_test.c', 'libudptunnel.a')
+    sys.exit(subprocess.run([exe]).returncode)
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""
+Session resumption test (user-100).
+
+Runs three server nodes sharing a session directory behind a round-robin
+TCP balancer, and a client with --session and --idle-disconnect 1, so every
+idle second moves its connection to the next node.
+1. Four rounds of 10 round trips: the destination must see one source
+   throughout, whichever node the connection lands on.
+2. While the client is away, the destination sends 5 datagrams: they must
+   be replayed once the client reconnects.
+3. The tunnel process of the session is killed: the next node must adopt
+   the session with the same source port.
+4. A session record sent in a later segment than the handshake must be
+   taken as a record, and a client which sends nothing after its handshake
+   must get its tunnel after the handshake timeout.
+5. A session directory that other users can access must be refused with
+   exit status 2.
+
+Usage: session_test.py
+"""
+import os
+import signal
+import socket
+import threading
+import time
+
+from common import path, start, stop, udp_app, check, finish
+
+BALANCER, CLIENT = 24241, 24245
+NODES = [24242, 24243, 24244]
+HANDSHAKE = b'udptunnel by md.\0\0\0\x01\x03\x06\x10\x15\x21\x28\x36\x45\x55\x66\x78\x91'
+
+
+def pipe(a, b):
+    try:
+        while True:
+            data = a.recv(65536)
+            if not data:
+                break
+            b.sendall(data)
+    except OSError:
+        pass
+    for s in (a, b):
+        try:
+            s.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+
+def balancer():
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', BALANCER))
+    listener.listen(16)
+    n = 0
+    while True:
+        conn, _ = listener.accept()
+        node = socket.create_connection(('127.0.0.1', NODES[n % len(NODES)]))
+        n += 1
+        threading.Thread(target=pipe, args=(conn, node), daemon=True).start()
+        threading.Thread(target=pipe, args=(node, conn), daemon=True).start()
+
+
+def tunnel_pids(sessions):
+    """The tunnel processes named by the session records."""
+    pids = []
+    for name in os.listdir(sessions):
+        if not name.endswith('.sock'):
+            with open(os.path.join(sessions, name)) as f:
+                pids += [int(line[4:]) for line in f.read().splitlines() if line.startswith('pid ')]
+    return pids
+
+
+def kill_tunnels(sessions):
+    """Kills the tunnels lingering for session-linger seconds."""
+    for pid in tunnel_pids(sessions):
+        try:
+            os.kill(pid, signal.SIGTERM)
+        except OSError:
+            pass
+
+
+if __name__ == '__main__':
+    sessions = path('sessions')
+    app = udp_app()
+    dest = '127.0.0.1:%d' % app.getsockname()[1]
+    threading.Thread(target=balancer, daemon=True).start()
+    log = open(os.devnull, 'w')
+    servers = [start('-s', '--session-dir', sessions, '127.0.0.1:%d' % port, dest, stdout=log, stderr=log)
+               for port in NODES]
+    cli = start('--session', '--idle-disconnect', '1', '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % BALANCER,
+                delay=0.5, stdout=log, stderr=log)
+    c = udp_app()
+    sources = set()
+
+    def ping(i):
+        msg = b'x%d' % i
+        c.sendto(msg, ('127.0.0.1', CLIENT))
+        data, source = app.recvfrom(70000)
+        app.sendto(b'R' + data, source)
+        sources.add(source)
+        return data == msg and c.recvfrom(70000)[0] == b'R' + msg
+
+    try:
+        ok, replayed = True, []
+        for r in range(4):
+            ok &= all(ping(r * 100 + i) for i in range(10))
+            time.sleep(1.8) # Idle disconnect
+            if r == 3:
+                break
+            for k in range(5):
+                app.sendto(b'away%d-%d' % (r, k), next(iter(sources)))
+            time.sleep(0.2)
+            c.sendto(b'wake%d' % r, ('127.0.0.1', CLIENT))
+            sources.add(app.recvfrom(70000)[1])
+            try:
+                while len(replayed) < 5 * (r + 1):
+                    replayed.append(c.recvfrom(70000)[0])
+            except socket.timeout:
+                pass
+        check('40 round trips over 4 connections', ok)
+        check('the destination sees one source (%d)' % len(sources), len(sources) == 1)
+        check('the datagrams sent while the client is away are replayed (%d of 15)' % len(replayed),
+              replayed == [b'away%d-%d' % (r, k) for r in range(3) for k in range(5)])
+
+        pid = tunnel_pids(sessions)[0]
+        time.sleep(1.8)
+        os.kill(pid, signal.SIGTERM)
+        time.sleep(0.3)
+        ok = all(ping(900 + i) for i in range(10))
+        check('a killed tunnel is adopted with the same source port', ok and len(sources) == 1)
+    finally:
+        stop(cli, *servers)
+        kill_tunnels(sessions)
+
+    late_sessions = path('late-sessions')
+    srv = start('-s', '--session-dir', late_sessions, '--set', 'handshake-timeout=500',
+                '127.0.0.1:%d' % NODES[0], dest, stdout=log, stderr=log)
+    try:
+        late = socket.create_connection(('127.0.0.1', NODES[0]))
+        late.sendall(HANDSHAKE)
+        time.sleep(0.2)
+        late.sendall(b'\xff\xff' + os.urandom(16) + b'\0\x04late')
+        idle = socket.create_connection(('127.0.0.1', NODES[0]))
+        idle.sendall(HANDSHAKE)
+        time.sleep(1)
+        idle.sendall(b'\0\x04idle')
+        got = set()
+        try:
+            for _ in range(2):
+                got.add(app.recvfrom(70000)[0])
+        except socket.timeout:
+            pass
+        check('a session record after the handshake segment is not a frame', b'late' in got)
+        check('a client idle after its handshake gets its tunnel', b'idle' in got)
+        late.close()
+        idle.close()
+    finally:
+        stop(srv)
+        kill_tunnels(late_sessions)
+
+    shared = path('shared-sessions')
+    os.mkdir(shared, 0o755)
+    os.chmod(shared, 0o755)
+    srv = start('-s', '--session-dir', shared, '127.0.0.1:%d' % NODES[0], dest, stdout=log, stderr=log)
+    try:
+        srv.wait(3)
+    finally:
+        stop(srv)
+    check('a session directory open to other users is refused', srv.returncode == 2)
+    finish()
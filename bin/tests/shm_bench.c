@@ -0,0 +1,100 @@
+/*
+ * Round trips through the shared memory transport or a UDP socket, for
+ * shm_bench.py. Prints the p50 and the p99 of the round trip times in us.
+ *
+ * Usage: shm_bench shm PATH COUNT SIZE
+ *        shm_bench udp PORT COUNT SIZE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libs/shm/udptunnel_shm.h"
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    struct udptunnel_shm *shm = NULL;
+    char buf[65536], reply[65536];
+    double *rtts;
+    int fd = -1, count, size, i;
+
+    if (argc != 5) {
+		fprintf(stderr, "usage: %s shm PATH|udp PORT COUNT SIZE\n", argv[0]);
+		return 2;
+    }
+    count = atoi(argv[3]);
+    size = atoi(argv[4]);
+    rtts = calloc(count, sizeof(*rtts));
+    memset(buf, 'x', sizeof(buf));
+
+    if (strcmp(argv[1], "shm") == 0) {
+		if (!(shm = udptunnel_shm_attach(argv[2]))) {
+			perror("udptunnel_shm_attach");
+			return 1;
+		}
+    } else {
+		struct sockaddr_in sin;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(argv[2]));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+			perror("udp");
+			return 1;
+		}
+    }
+
+    for (i = -1; i < count; i++) { // The first round trip opens the tunnel
+		double start = now_us();
+		ssize_t len;
+
+		if (shm) {
+			if (udptunnel_shm_send(shm, buf, size) < 0) {
+				perror("udptunnel_shm_send");
+				return 1;
+			}
+			len = udptunnel_shm_recv(shm, reply, sizeof(reply), 1);
+		} else {
+			if (send(fd, buf, size, 0) < 0) {
+				perror("send");
+				return 1;
+			}
+			len = recv(fd, reply, sizeof(reply), 0);
+		}
+		if (len != size) {
+			fprintf(stderr, "round trip %d: got %zd bytes\n", i, len);
+			return 1;
+		}
+		if (i >= 0)
+			rtts[i] = now_us() - start;
+    }
+
+    qsort(rtts, count, sizeof(*rtts), compare);
+    printf("%.1f %.1f\n", rtts[count / 2], rtts[count * 99 / 100]);
+    if (shm)
+		udptunnel_shm_detach(shm);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""
+Shared-memory transport test and benchmark against loopback UDP (user-079).
+
+A C application (shm_bench.c, built against libudptunnel_shm.a) does
+closed-loop round trips with a local client, either through the shared
+memory rings of --shm or through the client's UDP socket. The destination
+behind the server echoes every datagram. The script reports the round trip
+percentiles and the CPU time of the client per round trip. The shared memory
+run wraps the rings several times, and a second application attaches after
+the first one detached.
+
+Usage: shm_bench.py [ROUND_TRIPS]
+"""
+import socket
+import subprocess
+import sys
+import threading
+
+from common import compile_c, path, start, stop, udp_app, cpu_time
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+SERVER, CLIENT = 24051, 24052
+
+
+def echo(app):
+    while True:
+        try:
+            data, peer = app.recvfrom(70000)
+        except OSError:
+            return
+        app.sendto(data, peer)
+
+
+def run(exe, kind, size):
+    app = udp_app(timeout=None)
+    threading.Thread(target=echo, args=(app,), daemon=True).start()
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1])
+    cli = start('--shm', path('bench.shm'), '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER)
+    target = path('bench.shm') if kind == 'shm' else str(CLIENT)
+    try:
+        before = cpu_time(cli.pid)
+        out = subprocess.run([exe, kind, target, str(N), str(size)], capture_output=True, text=True, timeout=120)
+        cpu = cpu_time(cli.pid) - before
+        again = kind != 'shm' or subprocess.run([exe, kind, target, '100', str(size)],
+                                                capture_output=True, timeout=10).returncode == 0
+    finally:
+        stop(cli, srv)
+        app.close()
+    if out.returncode or not again:
+        print('%-4s %5d bytes: FAILED %s' % (kind, size, out.stderr.strip()))
+        return False
+    p50, p99 = out.stdout.split()
+    print('%-4s %5d bytes: p50 %5s us  p99 %5s us  client CPU %.2f us per round trip' %
+          (kind, size, p50, p99, cpu * 1e6 / N))
+    return True
+
+
+if __name__ == '__main__':
+    exe = compile_c('shm_bench.c', 'libudptunnel_shm.a')
+    good = True
+    for size in (100, 1400):
+        for kind in ('udp', 'shm'):
+            good &= run(exe, kind, size)
+    sys.exit(0 if good else 1)
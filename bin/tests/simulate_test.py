@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+"""
+--simulate test (user-081).
+
+1. Without loss or bandwidth limit, every packet comes back after exactly
+   two link latencies.
+2. The same lossy specification run twice gives the same report, apart
+   from the relay processing time, with retransmissions and drops.
+3. A 60 s latency over 2000 packets reports an average between the minimum
+   and the maximum round trip times.
+4. Out of range values are refused with exit status 2.
+
+Usage: simulate_test.py
+"""
+import re
+import subprocess
+
+from common import BIN, check, finish
+
+
+def simulate(spec):
+    out = subprocess.run([BIN, '--simulate', spec], capture_output=True, text=True, timeout=120)
+    return out.returncode, out.stdout
+
+
+def rtt(report):
+    m = re.search(r'round trip time min ([\d.]+) avg ([\d.]+) p50 [\d.]+ p99 [\d.]+ max ([\d.]+) ms', report)
+    return tuple(float(x) for x in m.groups()) if m else None
+
+
+if __name__ == '__main__':
+    code, report = simulate('rate=10k,size=200,count=5000,latency=1ms')
+    check('an ideal link returns every packet', code == 0 and '5000 replies received, 0 dropped' in report)
+    check('an ideal link has a round trip of two latencies', rtt(report) == (2.0, 2.0, 2.0))
+
+    spec = 'rate=10k,size=1000,count=20k,bw=50M,latency=10ms,loss=0.01,seed=3'
+    reports = [simulate(spec)[1] for _ in range(2)]
+    same = [[line for line in r.splitlines() if 'processing time' not in line] for r in reports]
+    print('\n'.join(reports[0].splitlines()[1:4]))
+    check('a specification always gives the same results', same[0] == same[1] and len(same[0]) == 4)
+    check('loss causes retransmissions', re.search(r'[1-9]\d* retransmitted', reports[0]) is not None)
+
+    code, report = simulate('rate=100,count=2000,latency=60s')
+    low, avg, high = rtt(report) or (0, -1, 0)
+    check('a 60 s latency keeps the average within the range (%.0f ms)' % avg, code == 0 and low <= avg <= high)
+
+    for spec in ('latency=61s', 'latency=1e300', 'rto=1e30', 'rate=nan', 'count=1e13', 'size=70000',
+                 'loss=1', 'rcvbuf=1e12', 'seed=1e20', 'speed=1'):
+        check('%s is refused' % spec, simulate(spec)[0] == 2)
+    finish()
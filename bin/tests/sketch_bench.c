@@ -0,0 +1,61 @@
+/*
+ * Cost and accuracy of the top talkers sketch, for sketch_bench.py.
+ *
+ * Feeds COUNT updates: one in ten comes from a heavy hitter with 1000 bytes,
+ * the others from PEERS random IPv4 peers with 100 bytes. Prints the time per
+ * update, the error of the heavy hitter's byte estimate and the estimated
+ * number of distinct peers.
+ *
+ * Usage: sketch_bench COUNT PEERS
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "libs/sketch/sketch.h"
+
+int main(int argc, char **argv)
+{
+    struct sketch_entry top[SKETCH_TOP_SIZE];
+    struct sockaddr_in peer, heavy;
+    struct timespec t0, t1;
+    struct sketch *sketch = sketch_new();
+    long count = argc > 1 ? atol(argv[1]) : 10000000, i;
+    uint32_t peers = argc > 2 ? atol(argv[2]) : 1000000, x = 1;
+    uint64_t heavy_bytes = 0;
+    double ns;
+    int n;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    heavy = peer;
+    heavy.sin_addr.s_addr = htonl(0xc0000201); // 192.0.2.1
+    heavy.sin_port = htons(53);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < count; i++) {
+		if (i % 10 == 0) {
+			sketch_update(sketch, (struct sockaddr *) &heavy, sizeof(heavy), 1000);
+			heavy_bytes += 1000;
+			continue;
+		}
+		x = x * 1103515245 + 12345;
+		peer.sin_addr.s_addr = htonl(0x0a000000 + (x >> 8) % peers); // 10.0.0.0/8
+		sketch_update(sketch, (struct sockaddr *) &peer, sizeof(peer), 100);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / count;
+
+    n = sketch_top(sketch, 0, top, SKETCH_TOP_SIZE);
+    if (n < 1 || memcmp(&((struct sockaddr_in *) &top[0].addr)->sin_addr, &heavy.sin_addr, 4)) {
+		fprintf(stderr, "the heavy hitter is not the top talker\n");
+		return 1;
+    }
+    printf("%.1f ns per update, heavy hitter bytes %+.4f%%, distinct peers %llu for %u\n", ns,
+		((double) top[0].bytes - heavy_bytes) * 100 / heavy_bytes,
+		(unsigned long long) sketch_distinct(sketch), peers + 1);
+    return 0;
+}
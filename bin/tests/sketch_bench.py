@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""
+Top talkers sketch test and benchmark (user-087).
+
+1. Builds sketch_bench.c with the sketch and reports the cost of an update
+   and the accuracy of the estimates, for 10M updates over 1M peers and one
+   heavy hitter.
+2. Runs a client with --control: 300 peers send one datagram each, and one
+   of them sends 200 of 1000 bytes. The top command must list it first,
+   and status must count about 300 peers.
+3. Runs a client with the top-talkers setting and no control socket: it
+   must log its top talkers.
+
+Usage: sketch_bench.py
+"""
+import os
+import socket
+import subprocess
+import time
+
+from common import BIN, compile_c, path, start, stop, udp_app, control, status, check, finish
+
+SERVER, CLIENT = 24141, 24142
+
+if __name__ == '__main__':
+    exe = compile_c('sketch_bench.c', 'libs/sketch/sketch.c', 'libs/utils/utils.c', 'libs/log/log.c')
+    out = subprocess.run([exe, '10000000', '1000000'], capture_output=True, text=True)
+    print(out.stdout.strip() or out.stderr.strip())
+    check('the heavy hitter is the top talker of the standalone run', out.returncode == 0)
+
+    ctl = path('sketch.ctl')
+    app = udp_app()
+    log = open(os.devnull, 'w')
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    cli = start('--control', ctl, '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+    try:
+        socks = [socket.socket(socket.AF_INET, socket.SOCK_DGRAM) for _ in range(300)]
+        for i, s in enumerate(socks):
+            for _ in range(200 if i == 5 else 1):
+                s.sendto(b'x' * (1000 if i == 5 else 10), ('127.0.0.1', CLIENT))
+        time.sleep(0.5)
+        top = control(ctl, 'top').splitlines()
+        print(top[0] if top else '')
+        check('top lists the heavy sender first', bool(top) and ':%d ' % socks[5].getsockname()[1] in top[0])
+        peers = int(status(ctl).get('udp-peers', 0))
+        check('status counts about 300 peers (%d)' % peers, 270 <= peers <= 330)
+    finally:
+        stop(cli)
+
+    cli = start('-v', '--set', 'top-talkers=1', '127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER,
+                command=['stdbuf', '-oL', BIN], stdout=subprocess.PIPE, stderr=log)
+    try:
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        for _ in range(100):
+            s.sendto(b'x' * 100, ('127.0.0.1', CLIENT))
+        time.sleep(2.5)
+    finally:
+        stop(cli, srv)
+    logged = cli.stdout.read().decode()
+    check('top-talkers logs without a control socket', 'Top talkers of' in logged)
+    finish()
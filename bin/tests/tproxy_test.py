@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""
+--tproxy test (user-098). Needs root.
+
+Builds three network namespaces: an application, the client host which
+routes 10.99.1.0/24 to itself with an AnyIP local route (standing for the
+TPROXY rule, without iptables or nft), and the server host, where two echo
+destinations listen on 10.99.1.5 and 10.99.1.6. Three flows, two of them
+to the same destination, do 50 round trips each through one tunnel: the
+replies must come from the original destination and carry its echo. With
+tproxy-timeout=2, a datagram sent once the flows expired must still be
+relayed. Runs with a client listening on 0.0.0.0, then on [::].
+
+The server has a --secret and an --acl which denies 10.99.2.0/24: a flow
+to 10.99.2.7 must get no reply, nor the frames of a raw client naming
+the loopback and link-local addresses of the server host, while its frame
+to 10.99.1.5 is answered. A server --tproxy
+without --secret must be refused with exit status 2.
+
+Usage: tproxy_test.py
+"""
+import atexit
+import os
+import subprocess
+
+from common import BIN, path, start, stop, status, check, finish
+
+APP, CLI, SRV = 'udptunnel-tapp', 'udptunnel-tcli', 'udptunnel-tsrv'
+
+ECHO = '''
+import socket, threading
+def run(ip):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind((ip, 7000))
+    while True:
+        d, a = s.recvfrom(65535)
+        s.sendto(b"echo " + ip.encode() + b" " + d, a)
+for ip in ("10.99.1.5", "10.99.1.6", "10.99.2.7", "127.0.0.1"):
+    threading.Thread(target=run, args=(ip,), daemon=True).start()
+threading.Event().wait()
+'''
+
+FLOWS = '''
+import socket, time
+socks = []
+for dst in (("10.99.1.5", 7000), ("10.99.1.5", 7000), ("10.99.1.6", 7000)):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(("10.50.1.2", 0))
+    s.settimeout(2)
+    socks.append((s, dst))
+ok = 0
+for r in range(50):
+    for i, (s, dst) in enumerate(socks):
+        msg = b"r%d-s%d" % (r, i)
+        s.sendto(msg, dst)
+        try:
+            d, a = s.recvfrom(1000)
+            ok += a == dst and d == b"echo " + dst[0].encode() + b" " + msg
+        except socket.timeout:
+            pass
+print(ok)
+time.sleep(4)
+s, dst = socks[0]
+s.sendto(b"again", dst)
+try:
+    print(s.recvfrom(1000)[0].decode())
+except socket.timeout:
+    print("timeout")
+s.sendto(b"denied", ("10.99.2.7", 7000))
+try:
+    print(s.recvfrom(1000)[0].decode())
+except socket.timeout:
+    print("timeout")
+'''
+
+# frames of a client which names the destinations itself
+FORGED = '''
+import re, socket, struct, sys
+c = socket.create_connection(("10.60.1.2", 4000))
+c.sendall(open(sys.argv[1], "rb").read(32))
+src = socket.inet_aton("10.50.1.2") + struct.pack("!H", 4321)
+for dst in ("127.0.0.1", "169.254.1.1", "0.0.0.0", "10.99.1.5"):
+    frame = b"\\x04" + socket.inet_aton(dst) + struct.pack("!H", 7000) + src + b"forged"
+    c.sendall(struct.pack("!H", len(frame)) + frame)
+mapped = socket.inet_pton(socket.AF_INET6, "::ffff:127.0.0.1") + struct.pack("!H", 7000)
+frame = b"\\x06" + mapped + socket.inet_pton(socket.AF_INET6, "::ffff:10.50.1.2") + struct.pack("!H", 4321) + b"forged"
+c.sendall(struct.pack("!H", len(frame)) + frame)
+c.settimeout(2)
+data = b""
+try:
+    while True:
+        data += c.recv(1000)
+except socket.timeout:
+    pass
+print(" ".join(sorted(set(re.findall(r"echo ([0-9.]+) forged", data.decode("latin-1"))))))
+'''
+
+
+def sh(command):
+    subprocess.run(command, shell=True, check=True)
+
+
+def setup():
+    for ns in (APP, CLI, SRV):
+        subprocess.run('ip netns del %s' % ns, shell=True, stderr=subprocess.DEVNULL)
+        sh('ip netns add %s && ip -n %s link set lo up' % (ns, ns))
+        atexit.register(subprocess.run, 'ip netns del %s' % ns, shell=True)
+    sh('ip link add uta0 netns %s type veth peer name uta1 netns %s' % (APP, CLI))
+    sh('ip link add utb0 netns %s type veth peer name utb1 netns %s' % (CLI, SRV))
+    sh('ip -n %s addr add 10.50.1.2/24 dev uta0 && ip -n %s link set uta0 up' % (APP, APP))
+    sh('ip -n %s route add default via 10.50.1.1' % APP)
+    sh('ip -n %s addr add 10.50.1.1/24 dev uta1 && ip -n %s link set uta1 up' % (CLI, CLI))
+    sh('ip -n %s addr add 10.60.1.1/24 dev utb0 && ip -n %s link set utb0 up' % (CLI, CLI))
+    sh('ip -n %s route add local 10.99.0.0/16 dev lo' % CLI)
+    sh('ip -n %s addr add 10.60.1.2/24 dev utb1 && ip -n %s link set utb1 up' % (SRV, SRV))
+    sh('ip -n %s addr add 10.99.1.5/32 dev lo && ip -n %s addr add 10.99.1.6/32 dev lo' % (SRV, SRV))
+    sh('ip -n %s addr add 10.99.2.7/32 dev lo' % SRV)
+
+
+def run(listen, secret, acl):
+    ctl = path('tproxy.ctl')
+    log = open(os.devnull, 'w')
+    echo = start('-c', ECHO, command=['ip', 'netns', 'exec', SRV, 'python3'])
+    srv = start('-s', '--tproxy', '--secret', secret, '--acl', acl, '10.60.1.2:4000',
+                command=['ip', 'netns', 'exec', SRV, BIN], stdout=log, stderr=log)
+    cli = start('--tproxy', '--secret', secret, '--control', ctl, '--set', 'tproxy-timeout=2', '%s:7000' % listen,
+                '10.60.1.2:4000', command=['ip', 'netns', 'exec', CLI, BIN], stdout=log, stderr=log)
+    try:
+        out = subprocess.run(['ip', 'netns', 'exec', APP, 'python3', '-c', FLOWS],
+                             capture_output=True, text=True, timeout=60).stdout.split('\n')
+        fields = status(ctl)
+        forged = subprocess.run(['ip', 'netns', 'exec', CLI, 'python3', '-c', FORGED, secret],
+                                capture_output=True, text=True, timeout=10).stdout.strip()
+    finally:
+        stop(cli, srv, echo)
+    print(' '.join('%s=%s' % (k, v) for k, v in fields.items() if k.startswith('tproxy')))
+    check('client on %s: 150 round trips answered by their destination (%s)' % (listen, out[0]), out[0] == '150')
+    check('client on %s: a flow is relayed again after it expired' % listen,
+          len(out) > 1 and out[1] == 'echo 10.99.1.5 again')
+    check('client on %s: no flow to a destination denied by the ACL' % listen, len(out) > 2 and out[2] == 'timeout')
+    check('client on %s: no flow to the loopback or link-local addresses (%s)' % (listen, forged),
+          forged == '10.99.1.5')
+
+
+if __name__ == '__main__':
+    refused = subprocess.run([BIN, '-s', '--tproxy', '127.0.0.1:24251'], stdout=subprocess.DEVNULL,
+                             stderr=subprocess.DEVNULL, timeout=5)
+    check('a server --tproxy without --secret is refused', refused.returncode == 2)
+    secret, acl = path('secret'), path('destinations.acl')
+    with open(os.open(secret, os.O_WRONLY | os.O_CREAT, 0o600), 'wb') as f:
+        f.write(os.urandom(32))
+    with open(acl, 'w') as f:
+        f.write('deny 10.99.2.0/24\n') # The loopback and link-local addresses are refused anyway
+    setup()
+    run('0.0.0.0', secret, acl)
+    run('[::]', secret, acl)
+    finish()
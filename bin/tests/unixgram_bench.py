@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""
+Benchmark of unixgram: destinations against loopback UDP (user-076).
+
+Sends closed-loop round trips of 100-byte datagrams through the tunnel to a
+local echo destination, once over UDP and once over a unix datagram socket.
+Reports the round trip percentiles and the server CPU time per round trip,
+tunnel process included.
+
+Usage: unixgram_bench.py [ROUND_TRIPS]
+"""
+import os
+import socket
+import sys
+import time
+
+from common import path, start, stop, udp_app, tree_cpu_time
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+SERVER, CLIENT = 24021, 24022
+
+
+def run(kind):
+    if kind == 'unixgram':
+        if os.path.exists(path('bench.sock')):
+            os.unlink(path('bench.sock'))
+        app = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        app.bind(path('bench.sock'))
+        app.settimeout(3)
+        dest = 'unixgram:' + path('bench.sock')
+    else:
+        app = udp_app()
+        dest = '127.0.0.1:%d' % app.getsockname()[1]
+    srv = start('-s', '127.0.0.1:%d' % SERVER, dest)
+    cli = start('127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER)
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    c.settimeout(3)
+    c.connect(('127.0.0.1', CLIENT))
+    msg = b'x' * 100
+    rtts = []
+    try:
+        c.send(msg) # Opens the tunnel before the clock starts
+        data, peer = app.recvfrom(2048)
+        app.sendto(data, peer)
+        c.recv(2048)
+        before = tree_cpu_time(srv.pid)
+        for _ in range(N):
+            t = time.perf_counter()
+            c.send(msg)
+            data, peer = app.recvfrom(2048)
+            app.sendto(data, peer)
+            c.recv(2048)
+            rtts.append(time.perf_counter() - t)
+        cpu = tree_cpu_time(srv.pid) - before
+    finally:
+        stop(cli, srv)
+    rtts.sort()
+    print('%-9s p50 %5.1f us  p99 %5.1f us  server CPU %.2f us per round trip' %
+          (kind, rtts[len(rtts) // 2] * 1e6, rtts[len(rtts) * 99 // 100] * 1e6, cpu / N * 1e6))
+
+
+if __name__ == '__main__':
+    for kind in ('udp', 'unixgram', 'udp', 'unixgram'):
+        run(kind)
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Binary upgrade test and blackout measurement (user-082).
+
+Streams paced datagrams through a client and a server to an echo
+destination, and upgrades with SIGUSR2, in turn, the server parent (after
+replacing its binary), the client and the server tunnels. Every reply
+must come back, and a second client must then reach the upgraded server.
+Prints the blackout of each upgrade, as logged by the new binary.
+
+The binary is copied to a temporary directory, so that it can be replaced.
+
+Usage: upgrade_test.py [DATAGRAMS]
+"""
+import os
+import re
+import shutil
+import signal
+import socket
+import sys
+import threading
+import time
+
+from common import BIN, path, start, stop, udp_app
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 6000
+SERVER, CLIENT, CLIENT2 = 24101, 24102, 24103
+
+
+def children(pid):
+    try:
+        with open('/proc/%d/task/%d/children' % (pid, pid)) as f:
+            return [int(child) for child in f.read().split()]
+    except OSError:
+        return []
+
+
+def echo(app):
+    while True:
+        try:
+            data, peer = app.recvfrom(70000)
+        except OSError:
+            return
+        app.sendto(b'R' + data, peer)
+
+
+if __name__ == '__main__':
+    exe = path('udptunnel')
+    shutil.copy(BIN, exe)
+    app = udp_app(timeout=None)
+    threading.Thread(target=echo, args=(app,), daemon=True).start()
+    log = open(path('upgrade.log'), 'w')
+    command = ['stdbuf', '-oL', exe, '-v'] # The blackouts are notices
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1],
+                command=command, stdout=log, stderr=log)
+    cli = start('127.0.0.1:%d' % CLIENT, '127.0.0.1:%d' % SERVER, command=command, stdout=log, stderr=log)
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    c.bind(('127.0.0.1', 0))
+    c.settimeout(3)
+    got = set()
+
+    def receive():
+        try:
+            while len(got) < N:
+                got.add(int(c.recvfrom(70000)[0][1:].split(b':')[0]))
+        except socket.timeout:
+            pass
+
+    receiver = threading.Thread(target=receive)
+    receiver.start()
+    for i in range(N):
+        c.sendto(b'%d:' % i + b'x' * (i % 200), ('127.0.0.1', CLIENT))
+        if i == N // 4:
+            shutil.copy(BIN, exe + '.new')
+            os.rename(exe + '.new', exe)
+            os.kill(srv.pid, signal.SIGUSR2)
+        elif i == N // 2:
+            os.kill(cli.pid, signal.SIGUSR2)
+        elif i == 3 * N // 4:
+            for tunnel in children(srv.pid):
+                os.kill(tunnel, signal.SIGUSR2)
+        time.sleep(0.0002)
+    receiver.join()
+
+    cli2 = start('127.0.0.1:%d' % CLIENT2, '127.0.0.1:%d' % SERVER, command=command, stdout=log, stderr=log)
+    c.sendto(b'0:hello', ('127.0.0.1', CLIENT2))
+    try:
+        second = c.recvfrom(100)[0] == b'R0:hello'
+    except socket.timeout:
+        second = False
+    alive = srv.poll() is None and cli.poll() is None
+    stop(cli2, cli, srv)
+    log.close()
+
+    with open(path('upgrade.log')) as f:
+        blackouts = re.findall(r'not served for ([0-9.]+) ms', f.read())
+    print('received %d / %d' % (len(got), N))
+    print('blackouts (ms):', ' '.join(blackouts))
+    print('second client', 'ok' if second else 'FAILED', '- upgraded processes', 'alive' if alive else 'DEAD')
+    sys.exit(0 if len(got) == N and second and alive and len(blackouts) >= 3 else 1)
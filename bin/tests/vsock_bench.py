@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""
+Benchmark of the vsock: stream side against loopback TCP (user-077).
+
+Runs the client and the server on this machine, once over loopback TCP and
+once over vsock:local, which needs the vsock_loopback module. Reports the
+p50 and p99 of closed-loop 100-byte round trips. Then it sends a one-way
+stream of 1400-byte datagrams, paced at about 45 MB/s, and reports the
+datagrams delivered and the CPU time of both ends per MB.
+
+Exits with 77 (skipped) after the TCP run if vsock is not available.
+
+Usage: vsock_bench.py [ROUND_TRIPS]
+"""
+import socket
+import sys
+import threading
+import time
+
+from common import start, stop, udp_app, tree_cpu_time
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+PORT, CLIENT = 24031, 24032
+STREAM = 20000
+
+
+def vsock_available():
+    try:
+        s = socket.socket(socket.AF_VSOCK, socket.SOCK_STREAM)
+        s.bind((1, socket.VMADDR_PORT_ANY)) # VMADDR_CID_LOCAL
+        s.close()
+        return True
+    except (AttributeError, OSError):
+        return False
+
+
+def run(kind):
+    listen, connect = ('127.0.0.1:%d' % PORT,) * 2
+    if kind == 'vsock':
+        listen, connect = 'vsock:%d' % PORT, 'vsock:local:%d' % PORT
+    app = udp_app()
+    app.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+    srv = start('-s', listen, '127.0.0.1:%d' % app.getsockname()[1])
+    cli = start('127.0.0.1:%d' % CLIENT, connect)
+    c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    c.settimeout(3)
+    c.connect(('127.0.0.1', CLIENT))
+    msg = b'x' * 100
+    rtts = []
+    try:
+        for i in range(N + 1):
+            t = time.perf_counter()
+            c.send(msg)
+            data, peer = app.recvfrom(2048)
+            app.sendto(data, peer)
+            c.recv(2048)
+            if i: # The first one opens the tunnel
+                rtts.append(time.perf_counter() - t)
+
+        big = b'y' * 1400
+        got, last = 0, 0
+        def receive():
+            nonlocal got, last
+            app.settimeout(0.5)
+            try:
+                while got < STREAM:
+                    app.recvfrom(2048)
+                    got += 1
+                    last = time.perf_counter()
+            except socket.timeout:
+                pass
+        receiver = threading.Thread(target=receive)
+        receiver.start()
+        before = tree_cpu_time(srv.pid) + tree_cpu_time(cli.pid)
+        t = time.perf_counter()
+        for i in range(STREAM):
+            c.send(big)
+            if i % 16 == 15:
+                time.sleep(0.0005) # Stays within the receive buffers
+        receiver.join()
+        cpu = tree_cpu_time(srv.pid) + tree_cpu_time(cli.pid) - before
+    finally:
+        stop(cli, srv)
+    rtts.sort()
+    mb = got * len(big) / 1e6
+    print('%-5s p50 %5.1f us  p99 %5.1f us  stream %d/%d delivered, %.0f MB/s, %.2f ms CPU per MB' %
+          (kind, rtts[len(rtts) // 2] * 1e6, rtts[len(rtts) * 99 // 100] * 1e6,
+           got, STREAM, mb / (last - t), cpu * 1e3 / mb))
+
+
+if __name__ == '__main__':
+    run('tcp')
+    if not vsock_available():
+        print('vsock: not available, load the vsock_loopback module')
+        sys.exit(77)
+    run('vsock')
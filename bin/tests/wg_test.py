@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+"""
+WireGuard keepalive suppression test (user-090).
+
+Ten WireGuard keepalives (32-byte transport messages) and ten data messages
+go through a client with wireguard-keepalive=2, 0.5 s apart. Only the
+keepalives sent after 2 s without any other one relayed may go through,
+all the data must, and the TCP connection must have a keepalive timer.
+
+Usage: wg_test.py
+"""
+import os
+import socket
+import struct
+import subprocess
+import time
+
+from common import path, start, stop, udp_app, status, check, finish
+
+SERVER, CLIENT = 24171, 24172
+
+if __name__ == '__main__':
+    app = udp_app(timeout=0.3)
+    log = open(os.devnull, 'w')
+    ctl = path('wg.ctl')
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1], stdout=log, stderr=log)
+    cli = start('--set', 'wireguard-keepalive=2', '--control', ctl, '127.0.0.1:%d' % CLIENT,
+                '127.0.0.1:%d' % SERVER, stdout=log, stderr=log)
+    try:
+        c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        keepalive = struct.pack('<I', 4) + b'\1' * 12 + b'\2' * 16
+        data = struct.pack('<I', 4) + b'\1' * 12 + b'\2' * 48
+        for _ in range(10):
+            c.sendto(keepalive, ('127.0.0.1', CLIENT))
+            c.sendto(data, ('127.0.0.1', CLIENT))
+            time.sleep(0.5)
+        sizes = []
+        try:
+            while True:
+                sizes.append(len(app.recvfrom(100)[0]))
+        except socket.timeout:
+            pass
+        print('keepalives relayed %d, data relayed %d, %s' %
+              (sizes.count(32), sizes.count(64), status(ctl).get('wg-keepalives-dropped')))
+        check('most keepalives are suppressed', 1 <= sizes.count(32) <= 4)
+        check('all the data is relayed', sizes.count(64) == 10)
+        ss = subprocess.run(['ss', '-tno', 'state', 'established', '( dport = :%d )' % SERVER],
+                            capture_output=True, text=True).stdout
+        check('the TCP connection has a keepalive timer', 'timer:(keepalive' in ss)
+    finally:
+        stop(cli, srv)
+    finish()
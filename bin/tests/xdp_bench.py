@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+AF_XDP ingest test and benchmark (user-078). Needs root.
+
+Creates a network namespace whose veth peer sends to a client listening on
+the host side of the pair, with and without --xdp (generic mode on veth).
+1. 300 round trips of up to 900 bytes must all come back.
+2. A flood of 64-byte datagrams from the namespace: reports the datagrams
+   relayed, the client CPU time per datagram, and how many of them went
+   through the kernel UDP stack (Udp InDatagrams of /proc/net/snmp, less
+   those the destination received).
+
+Usage: xdp_bench.py [DATAGRAMS]
+"""
+import atexit
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+from common import start, stop, udp_app, cpu_time
+
+N = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+NS, HOST, PEER = 'udptunnel-xdp', '10.98.0.1', '10.98.0.2'
+SERVER, CLIENT = 24041, 24042
+
+SENDER = '''
+import socket, sys, time
+c = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+c.settimeout(2)
+if sys.argv[1] == 'roundtrips':
+    ok = 0
+    for i in range(300):
+        m = b"%05d" % i + b"z" * (i % 900)
+        c.sendto(m, ("{host}", {port}))
+        try:
+            ok += c.recvfrom(5000)[0] == b"R" + m
+        except socket.timeout:
+            pass
+    print(ok)
+else:
+    m = b"x" * 64
+    for i in range(int(sys.argv[1])):
+        c.sendto(m, ("{host}", {port}))
+        if i % 32 == 31:
+            time.sleep(0.0002)
+'''.format(host=HOST, port=CLIENT)
+
+
+def sh(command):
+    subprocess.run(command, shell=True, check=True)
+
+
+def setup():
+    subprocess.run('ip netns del %s' % NS, shell=True, stderr=subprocess.DEVNULL)
+    sh('ip netns add %s' % NS)
+    atexit.register(subprocess.run, 'ip netns del %s' % NS, shell=True)
+    sh('ip link add utx0 type veth peer name utx1 netns %s' % NS)
+    sh('ip addr add %s/24 dev utx0 && ip link set utx0 up' % HOST)
+    sh('ip -n %s addr add %s/24 dev utx1 && ip -n %s link set utx1 up' % (NS, PEER, NS))
+
+
+def udp_in_datagrams():
+    with open('/proc/net/snmp') as f:
+        lines = [line.split() for line in f if line.startswith('Udp:')]
+    return int(lines[1][lines[0].index('InDatagrams')])
+
+
+def run(name, extra):
+    app = udp_app(timeout=1)
+    app.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+    srv = start('-s', '127.0.0.1:%d' % SERVER, '127.0.0.1:%d' % app.getsockname()[1])
+    cli = start(*extra, '%s:%d' % (HOST, CLIENT), '127.0.0.1:%d' % SERVER, delay=0.5)
+    sender = ['ip', 'netns', 'exec', NS, 'python3', '-c', SENDER]
+    got = 0
+
+    def echo(reply):
+        nonlocal got
+        try:
+            while True:
+                data, peer = app.recvfrom(5000)
+                got += 1
+                if reply:
+                    app.sendto(b'R' + data, peer)
+        except socket.timeout:
+            pass
+
+    try:
+        receiver = threading.Thread(target=echo, args=(True,))
+        receiver.start()
+        ok = int(subprocess.run(sender + ['roundtrips'], capture_output=True, text=True).stdout or 0)
+        receiver.join()
+
+        got = 0
+        snmp = udp_in_datagrams()
+        before = cpu_time(cli.pid)
+        receiver = threading.Thread(target=echo, args=(False,))
+        receiver.start()
+        subprocess.run(sender + [str(N)], check=True)
+        receiver.join()
+        cpu = cpu_time(cli.pid) - before
+        stack = udp_in_datagrams() - snmp - got
+    finally:
+        stop(cli, srv)
+    print('%-8s round trips %d/300  flood %d/%d relayed, %.2f us client CPU each, %d through the UDP stack' %
+          (name, ok, got, N, cpu * 1e6 / max(got, 1), stack))
+    return ok == 300
+
+
+if __name__ == '__main__':
+    setup()
+    good = run('socket', [])
+    good &= run('--xdp', ['--xdp', 'utx0:0'])
+    sys.exit(0 if good else 1)
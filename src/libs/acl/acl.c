@@ -0,0 +1,369 @@
+/*
+ * ACL Library - Source address filter with longest prefix match
+ *
+ * Loads allow and deny rules for IPv4 and IPv6 prefixes from a file and
+ * decides for each packet whether its source is accepted, using the most
+ * specific rule which matches, and counts the hits of every rule.
+ *
+ * The prefixes are expanded in a multibit trie: a direct table indexed by the
+ * first 16 bits of the address, then nodes of 256 entries for each following
+ * byte. An IPv4 lookup reads at most 3 entries and an IPv6 one at most 15,
+ * whatever the number of rules, and only the nodes needed by the prefixes
+ * longer than /16 are allocated.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "acl.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#define ROOT_BITS 16               // Bits of the address indexing the direct table
+#define ROOT_SIZE (1 << ROOT_BITS)
+#define NODE_SIZE 256              // Entries of a node, one per value of the next byte
+
+/* a line of the file */
+struct acl_rule {
+    int family;
+    unsigned char prefix[16];      // Network byte order, host bits cleared
+    int len;                       // Prefix length in bits
+    int allow;                     // 1 = allow, 0 = deny
+    uint64_t hits;
+};
+
+/* a slot of the trie: the most specific rule ending here, and the longer ones below */
+struct acl_entry {
+    uint32_t rule;                 // Index + 1 in the rules, 0 if none
+    uint32_t child;                // Index of the node for the next byte, 0 if none
+};
+
+struct acl_node {
+    struct acl_entry e[NODE_SIZE];
+};
+
+struct acl_trie {
+    struct acl_entry *root;        // ROOT_SIZE entries, NULL if the family has no rules
+    struct acl_node *nodes;        // Node 0 is not used, so that 0 means no child
+    uint32_t count, allocated;
+};
+
+struct acl {
+    struct acl_rule *rules;
+    int nrules;
+    struct acl_trie v4, v6;
+    int default_allow;             // Action for the sources matching no rule
+    uint64_t default_hits;
+};
+
+/**
+ * Stores a rule in an entry, unless the entry has a more specific rule.
+ * Rules of the same length replace each other, so the last line wins.
+ *
+ * @param acl (const struct acl*) - ACL being built
+ * @param entry (struct acl_entry*) - Entry covered by the prefix
+ * @param rule (uint32_t) - Index + 1 of the rule
+ *
+ * @return void
+ */
+static void set_rule(const struct acl *acl, struct acl_entry *entry, uint32_t rule)
+{
+    if (!entry->rule || acl->rules[entry->rule - 1].len <= acl->rules[rule - 1].len)
+		entry->rule = rule;
+}
+
+/* entry of a node, or of the direct table for node 0 */
+static struct acl_entry *trie_entry(struct acl_trie *trie, uint32_t node, uint32_t index)
+{
+    return node ? &trie->nodes[node].e[index] : &trie->root[index];
+}
+
+/* returns the node below an entry, creating it if needed; the nodes may move */
+static uint32_t child_node(struct acl_trie *trie, uint32_t node, uint32_t index)
+{
+    if (!trie_entry(trie, node, index)->child) {
+		if (trie->count >= trie->allocated) { // Also the first node, count starts at 1
+			trie->allocated = trie->allocated ? trie->allocated * 2 : 16;
+			trie->nodes = NOFAIL(realloc(trie->nodes, trie->allocated * sizeof(*trie->nodes)));
+		}
+		memset(&trie->nodes[trie->count], 0, sizeof(trie->nodes[0]));
+		trie_entry(trie, node, index)->child = trie->count++;
+    }
+    return trie_entry(trie, node, index)->child;
+}
+
+/**
+ * Expands a rule in the trie of its family: a prefix ending inside a stride
+ * covers all the entries which share its first bits at that level.
+ *
+ * @param acl (struct acl*) - ACL being built
+ * @param rule (uint32_t) - Index + 1 of the rule
+ *
+ * @return void
+ */
+static void insert_rule(struct acl *acl, uint32_t rule)
+{
+    const struct acl_rule *r = &acl->rules[rule - 1];
+    struct acl_trie *trie = r->family == AF_INET ? &acl->v4 : &acl->v6;
+    uint32_t first, count, i, node;
+    int depth;
+
+    if (!trie->root) {
+		trie->root = NOFAIL(calloc(ROOT_SIZE, sizeof(*trie->root)));
+		trie->count = 1; // Node 0 means no child
+    }
+
+    first = (r->prefix[0] << 8) | r->prefix[1];
+    if (r->len <= ROOT_BITS) {
+		count = 1U << (ROOT_BITS - r->len);
+		for (i = first; i < first + count; i++)
+			set_rule(acl, &trie->root[i], rule);
+		return;
+    }
+
+    /* one node per byte until the last, partial or full, one */
+    node = child_node(trie, 0, first);
+    for (depth = ROOT_BITS; r->len - depth > 8; depth += 8)
+		node = child_node(trie, node, r->prefix[depth / 8]);
+
+    count = 1U << (8 - (r->len - depth));
+    first = r->prefix[depth / 8];
+    for (i = first; i < first + count; i++)
+		set_rule(acl, &trie->nodes[node].e[i], rule);
+}
+
+/**
+ * Parses a rule: "allow PREFIX" or "deny PREFIX", where PREFIX is an IPv4 or
+ * IPv6 address with an optional /LENGTH.
+ *
+ * @param action (const char*) - First word of the line
+ * @param prefix (char*) - Second word of the line, modified
+ * @param rule (struct acl_rule*) - Output rule
+ *
+ * @return int - 0 on success, -1 if the rule is not valid
+ */
+static int parse_rule(const char *action, char *prefix, struct acl_rule *rule)
+{
+    char *slash = strchr(prefix, '/');
+    char *end;
+    int bits, i;
+
+    memset(rule, 0, sizeof(*rule));
+    if (strcmp(action, "allow") == 0)
+		rule->allow = 1;
+    else if (strcmp(action, "deny") != 0)
+		return -1;
+
+    if (slash)
+		*slash++ = '\0';
+    if (inet_pton(AF_INET, prefix, rule->prefix) == 1)
+		rule->family = AF_INET;
+    else if (inet_pton(AF_INET6, prefix, rule->prefix) == 1)
+		rule->family = AF_INET6;
+    else
+		return -1;
+
+    bits = rule->family == AF_INET ? 32 : 128;
+    rule->len = bits;
+    if (slash) {
+		rule->len = strtol(slash, &end, 10);
+		if (end == slash || *end != '\0' || rule->len < 0 || rule->len > bits)
+			return -1;
+    }
+
+    /* clear the host bits, so that 10.1.2.3/8 means 10.0.0.0/8 */
+    for (i = 0; i < bits / 8; i++) {
+		if (rule->len <= i * 8)
+			rule->prefix[i] = 0;
+		else if (rule->len < (i + 1) * 8)
+			rule->prefix[i] &= 0xff << (8 - (rule->len - i * 8));
+    }
+    return 0;
+}
+
+/**
+ * Loads the rules of a file. Each line is "allow PREFIX", "deny PREFIX" or
+ * "default allow|deny" (allow if not given); # starts a comment.
+ *
+ * @param path (const char*) - File to read
+ *
+ * @return struct acl* - New ACL, or NULL if the file cannot be read or has an invalid line
+ */
+struct acl *acl_load(const char *path)
+{
+    struct acl *acl;
+    FILE *fp;
+    char line[256];
+    int lineno = 0, allocated = 0;
+    uint32_t i;
+
+    if (!(fp = fopen(path, "r"))) {
+		log_printf_err(log_err, "Cannot open the ACL %s", path);
+		return NULL;
+    }
+
+    acl = NOFAIL(calloc(1, sizeof(*acl)));
+    acl->default_allow = 1;
+
+    while (fgets(line, sizeof(line), fp)) {
+		char *words[3], *saveptr;
+		int n = 0;
+
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		while (n < 3 && (words[n] = strtok_r(n ? NULL : line, " \t", &saveptr)))
+			n++;
+		if (n == 0)
+			continue;
+
+		if (n == 2 && strcmp(words[0], "default") == 0 &&
+			(strcmp(words[1], "allow") == 0 || strcmp(words[1], "deny") == 0)) {
+			acl->default_allow = strcmp(words[1], "allow") == 0;
+			continue;
+		}
+
+		if (acl->nrules == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			acl->rules = NOFAIL(realloc(acl->rules, allocated * sizeof(*acl->rules)));
+		}
+		if (n != 2 || parse_rule(words[0], words[1], &acl->rules[acl->nrules]) < 0) {
+			log_printf(log_err, "%s:%d: expected allow PREFIX, deny PREFIX or default allow|deny", path,
+				lineno);
+			fclose(fp);
+			acl_free(acl);
+			return NULL;
+		}
+		acl->nrules++;
+    }
+    fclose(fp);
+
+    for (i = 1; i <= (uint32_t) acl->nrules; i++)
+		insert_rule(acl, i);
+
+    log_printf(log_info, "Loaded %d ACL rules from %s, %u IPv4 and %u IPv6 trie nodes", acl->nrules, path,
+		acl->v4.count ? acl->v4.count - 1 : 0, acl->v6.count ? acl->v6.count - 1 : 0);
+    return acl;
+}
+
+/**
+ * Releases an ACL.
+ *
+ * @param acl (struct acl*) - ACL to free, may be NULL
+ *
+ * @return void
+ */
+void acl_free(struct acl *acl)
+{
+    if (!acl)
+		return;
+    free(acl->v4.root);
+    free(acl->v4.nodes);
+    free(acl->v6.root);
+    free(acl->v6.nodes);
+    free(acl->rules);
+    free(acl);
+}
+
+/* returns the index + 1 of the most specific rule matching an address, 0 if none */
+static uint32_t lookup(const struct acl_trie *trie, const unsigned char *addr, int addr_bytes)
+{
+    const struct acl_entry *e;
+    uint32_t rule;
+    int i;
+
+    if (!trie->root)
+		return 0;
+
+    e = &trie->root[(addr[0] << 8) | addr[1]];
+    rule = e->rule;
+    for (i = ROOT_BITS / 8; e->child && i < addr_bytes; i++) {
+		e = &trie->nodes[e->child].e[addr[i]];
+		if (e->rule) // Deeper entries only hold longer prefixes
+			rule = e->rule;
+    }
+    return rule;
+}
+
+/**
+ * Decides whether packets from a source are accepted, and counts the hit.
+ * IPv4-mapped IPv6 addresses, as received by a dual-stack socket, match the
+ * IPv4 rules. Sources which are not IP addresses are always accepted.
+ *
+ * @param acl (struct acl*) - ACL
+ * @param addr (const struct sockaddr*) - Source address
+ *
+ * @return int - 1 if the source is allowed, 0 if it is denied
+ */
+int acl_check(struct acl *acl, const struct sockaddr *addr)
+{
+    uint32_t rule;
+
+    if (addr->sa_family == AF_INET) {
+		rule = lookup(&acl->v4, (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr, 4);
+    } else if (addr->sa_family == AF_INET6) {
+		const struct in6_addr *a6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+
+		if (IN6_IS_ADDR_V4MAPPED(a6))
+			rule = lookup(&acl->v4, a6->s6_addr + 12, 4);
+		else
+			rule = lookup(&acl->v6, a6->s6_addr, 16);
+    } else {
+		return 1;
+    }
+
+    if (!rule) {
+		acl->default_hits++;
+		return acl->default_allow;
+    }
+    acl->rules[rule - 1].hits++;
+    return acl->rules[rule - 1].allow;
+}
+
+/**
+ * Lists the rules with their hits, as "allow|deny PREFIX hits N" lines.
+ *
+ * @param acl (const struct acl*) - ACL to list
+ * @param buf (char*) - Output buffer, always NUL-terminated
+ * @param len (size_t) - Size of buf
+ *
+ * @return size_t - Length of the text, which may have been truncated as snprintf() does
+ */
+size_t acl_format(const struct acl *acl, char *buf, size_t len)
+{
+    size_t used = 0;
+    int i;
+
+    if (len)
+		buf[0] = '\0';
+    for (i = 0; i < acl->nrules; i++) {
+		const struct acl_rule *r = &acl->rules[i];
+		char addr[INET6_ADDRSTRLEN];
+
+		inet_ntop(r->family, r->prefix, addr, sizeof(addr));
+		used += snprintf(buf + (used < len ? used : len), used < len ? len - used : 0,
+			"%s %s/%d hits %llu\n", r->allow ? "allow" : "deny", addr, r->len,
+			(unsigned long long) r->hits);
+    }
+    used += snprintf(buf + (used < len ? used : len), used < len ? len - used : 0,
+		"default %s hits %llu\n", acl->default_allow ? "allow" : "deny", (unsigned long long) acl->default_hits);
+
+    return used;
+}
@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __ACL_H__
+    #define __ACL_H__
+
+    #include <stddef.h>
+    #include <sys/socket.h>
+
+    struct acl;
+
+    struct acl *acl_load(const char *path);
+
+    void acl_free(struct acl *acl);
+
+    int acl_check(struct acl *acl, const struct sockaddr *addr);
+
+    size_t acl_format(const struct acl *acl, char *buf, size_t len);
+
+#endif
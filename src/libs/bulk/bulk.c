@@ -0,0 +1,385 @@
+/*
+ * Bulk Library - Zero-copy TCP stream for large UDP payloads
+ *
+ * Moves the large packets of the tunnel without copying them between the
+ * process and the kernel. The framing of the stream does not change, so
+ * each end can use it or not independently of the other one.
+ *
+ * Components:
+ * - Send side: a ring of page-aligned buffers, each receiving one UDP
+ *   payload with room for its length prefix just before it. Payloads above
+ *   the threshold of the caller are sent with MSG_ZEROCOPY: the kernel pins
+ *   the pages instead of copying them, and the buffer is only reused once
+ *   the completion is read from the error queue of the socket.
+ * - Receive side: a read-only mapping of the TCP socket, which
+ *   TCP_ZEROCOPY_RECEIVE fills with the whole pages of the receive queue.
+ *   The packets are then decoded and sent as UDP straight from those pages.
+ *   The bytes which do not fill a page, or a queue below the threshold, are
+ *   read into the buffer of the caller instead.
+ *
+ * The pages can only be mapped when they hold nothing else than stream
+ * data: on loopback and veth that means that the sender used MSG_ZEROCOPY
+ * from page-aligned buffers, on a NIC that it splits the headers from the
+ * payloads. Otherwise every receive falls back to a copy.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for MSG_ZEROCOPY...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "bulk.h"
+#include "../relay/relay.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/errqueue.h>) && __has_include(<linux/tcp.h>)
+#define HAVE_ZEROCOPY
+#endif
+#endif
+
+#ifdef HAVE_ZEROCOPY
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
+#endif
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+/* largest UDP payload of a send buffer */
+#define BULK_PAYLOAD_SIZE 65536
+
+/**
+ * Send buffer, in flight until the kernel reports the completion of the
+ * MSG_ZEROCOPY send which uses it.
+ */
+struct bulk_slot {
+    uint32_t id;                   // Notification id of the send
+    int busy;                      // 1 while the kernel may still read the pages
+};
+
+/**
+ * Zero-copy state of one TCP connection.
+ */
+struct bulk {
+    int fd;                        // TCP socket, not owned
+    size_t page;                   // Page size, the alignment of the payloads
+
+    char *ring;                    // BULK_BUFFERS buffers, NULL if MSG_ZEROCOPY is not available
+    size_t stride;                 // Bytes between two buffers: a page for the prefix, then the payload
+    struct bulk_slot slots[BULK_BUFFERS];
+    int next;                      // Buffer returned by bulk_buffer()
+    uint32_t next_id;              // Notification id of the next MSG_ZEROCOPY send
+
+    char *map;                     // Mapping of the socket, NULL if TCP_ZEROCOPY_RECEIVE is not available
+    size_t mapped;                 // Bytes mapped by the last bulk_recv()
+    size_t queued;                 // Receive queue seen by the last bulk_recv(), to choose how to read the next
+
+    unsigned long long zerocopy_sends; // Sends which left the pages to the kernel
+    unsigned long long copied_sends;   // ... which the kernel copied all the same
+    unsigned long long ring_full;      // Payloads received outside the ring, all buffers in flight
+    unsigned long long rx_mapped;      // Stream bytes received in mapped pages
+    unsigned long long rx_copied;      // Stream bytes copied into the buffer of the caller
+};
+
+/**
+ * Sets up the zero-copy sends and receives of a TCP connection. Each of
+ * them is only used if the kernel supports it.
+ *
+ * @param tcp_fd (int) - Connected TCP socket, which must stay open until bulk_close()
+ *
+ * @return struct bulk* - New state, never NULL
+ */
+struct bulk *bulk_open(int tcp_fd)
+{
+    struct bulk *bulk = NOFAIL(calloc(1, sizeof(*bulk)));
+    int one = 1;
+
+    bulk->fd = tcp_fd;
+    bulk->page = sysconf(_SC_PAGESIZE);
+    bulk->stride = bulk->page + BULK_PAYLOAD_SIZE;
+
+    if (setsockopt(tcp_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		log_printf_err(log_debug, "setsockopt(SO_ZEROCOPY)");
+    } else {
+		bulk->ring = mmap(NULL, bulk->stride * BULK_BUFFERS, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bulk->ring == MAP_FAILED) {
+			log_printf_err(log_debug, "mmap(bulk buffers)");
+			bulk->ring = NULL;
+		}
+    }
+
+#ifdef HAVE_ZEROCOPY
+    bulk->map = mmap(NULL, BULK_MAP_SIZE, PROT_READ, MAP_SHARED, tcp_fd, 0);
+    if (bulk->map == MAP_FAILED) {
+		log_printf_err(log_debug, "mmap(tcp)");
+		bulk->map = NULL;
+    }
+#endif
+    return bulk;
+}
+
+#ifdef HAVE_ZEROCOPY
+
+/**
+ * Reads the completions of the MSG_ZEROCOPY sends, which free their buffers.
+ * A pending completion also makes the socket readable, so they must be read
+ * before waiting for the stream again.
+ *
+ * @param bulk (struct bulk*) - Zero-copy state
+ *
+ * @return void
+ */
+static void reap_completions(struct bulk *bulk)
+{
+    union {
+		char buf[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int i;
+
+    if (!bulk->ring)
+		return;
+
+    for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(bulk->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			struct sock_extended_err err;
+			uint32_t range;
+
+			if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+				(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+				continue;
+
+			/* the sends ee_info to ee_data are complete, ids may wrap */
+			range = err.ee_data - err.ee_info;
+			if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				bulk->copied_sends += range + 1;
+			for (i = 0; i < BULK_BUFFERS; i++)
+				if (bulk->slots[i].busy && bulk->slots[i].id - err.ee_info <= range)
+					bulk->slots[i].busy = 0;
+		}
+    }
+}
+
+#else
+
+static void reap_completions(struct bulk *bulk)
+{
+}
+
+#endif
+
+/**
+ * Returns the next free send buffer, for a UDP payload of up to 64 KB
+ * which is then sent with bulk_send(). The UDPTUNNEL_HEADER_SIZE bytes
+ * before it are reserved for the length prefix.
+ *
+ * @param bulk (struct bulk*) - Zero-copy state
+ *
+ * @return char* - Page-aligned buffer, or NULL if MSG_ZEROCOPY is not
+ *                 available or all the buffers are still in flight
+ */
+char *bulk_buffer(struct bulk *bulk)
+{
+    if (!bulk->ring)
+		return NULL;
+
+    if (bulk->slots[bulk->next].busy) {
+		reap_completions(bulk);
+		if (bulk->slots[bulk->next].busy) {
+			bulk->ring_full++;
+			return NULL;
+		}
+    }
+    return bulk->ring + (size_t) bulk->next * bulk->stride + bulk->page;
+}
+
+/**
+ * Sends a payload received in the buffer returned by bulk_buffer(), with its
+ * length prefix. With zerocopy the buffer stays in flight until the kernel
+ * is done with its pages, otherwise the payload is copied as by send().
+ *
+ * @param bulk (struct bulk*) - Zero-copy state
+ * @param payload (char*) - Buffer returned by the last bulk_buffer() call
+ * @param len (size_t) - Payload length, at most UDPTUNNEL_MAX_PAYLOAD
+ * @param zerocopy (int) - 1 to leave the pages to the kernel, for large payloads
+ *
+ * @return int - 0 on success, -1 with errno set
+ */
+int bulk_send(struct bulk *bulk, char *payload, size_t len, int zerocopy)
+{
+    struct bulk_slot *slot = &bulk->slots[bulk->next];
+    ssize_t res;
+
+    if (udptunnel_frame_header(len, payload - UDPTUNNEL_HEADER_SIZE) < 0) {
+		errno = EMSGSIZE;
+		return -1;
+    }
+
+    if (zerocopy) {
+		res = send(bulk->fd, payload - UDPTUNNEL_HEADER_SIZE, len + UDPTUNNEL_HEADER_SIZE, MSG_ZEROCOPY);
+		if (res >= 0) {
+			slot->id = bulk->next_id++;
+			slot->busy = 1;
+			bulk->next = (bulk->next + 1) % BULK_BUFFERS;
+			bulk->zerocopy_sends++;
+			return 0;
+		}
+		if (errno != ENOBUFS) // Otherwise over the limit of pinned memory: copy this one
+			return -1;
+    }
+
+    res = send(bulk->fd, payload - UDPTUNNEL_HEADER_SIZE, len + UDPTUNNEL_HEADER_SIZE, 0);
+    return res < 0 ? -1 : 0;
+}
+
+/**
+ * Receives stream data, mapping the whole pages of the receive queue when
+ * the last call saw at least threshold bytes queued. Otherwise, and for the
+ * bytes before the next whole page, the data is copied into buf, so a
+ * trickle of small packets costs a single recv(). Never waits.
+ * The mapped data stays valid until bulk_release() or the next call.
+ *
+ * @param bulk (struct bulk*) - Zero-copy state
+ * @param buf (char*) - Buffer for the copied data
+ * @param buflen (size_t) - Size of buf
+ * @param threshold (size_t) - Smallest receive queue which is mapped
+ * @param data (struct bulk_data*) - Output data
+ *
+ * @return int - 1 if data was received, 0 at the end of the stream, -1 with
+ *               errno set (EAGAIN if nothing is available)
+ */
+int bulk_recv(struct bulk *bulk, char *buf, size_t buflen, size_t threshold, struct bulk_data *data)
+{
+    ssize_t n;
+    int mapping = 0;
+
+    reap_completions(bulk);
+    bulk_release(bulk);
+    data->mapped = NULL;
+    data->len = 0;
+
+#ifdef HAVE_ZEROCOPY
+    if (bulk->map && bulk->queued >= threshold) {
+		struct tcp_zerocopy_receive zc;
+		socklen_t zclen = sizeof(zc);
+
+		memset(&zc, 0, sizeof(zc));
+		zc.address = (uintptr_t) bulk->map;
+		zc.length = BULK_MAP_SIZE;
+
+		if (getsockopt(bulk->fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zclen) == 0) {
+			mapping = 1;
+			if (zclen > offsetof(struct tcp_zerocopy_receive, inq)) // Older kernels do not report the queue
+				bulk->queued = zc.length + zc.inq;
+			if (zc.length > 0) {
+				bulk->mapped = zc.length;
+				data->mapped = bulk->map;
+				data->len = zc.length;
+				bulk->rx_mapped += data->len;
+				return 1;
+			}
+			if (zc.recv_skip_hint > 0 && zc.recv_skip_hint < buflen)
+				buflen = zc.recv_skip_hint; // Up to the next whole page
+		}
+		/* on failure, recv() reports the error or the end of the stream */
+    }
+#endif
+
+    n = recv(bulk->fd, buf, buflen, MSG_DONTWAIT);
+    if (n <= 0)
+		return n;
+    if (!mapping) // A full buffer means that more is queued
+		bulk->queued = (size_t) n < buflen ? (size_t) n : SIZE_MAX;
+    data->len = n;
+    bulk->rx_copied += n;
+    return 1;
+}
+
+/**
+ * Unmaps the pages returned by the last bulk_recv(), which gives them back
+ * to the kernel at once instead of on the next call.
+ *
+ * @param bulk (struct bulk*) - Zero-copy state
+ *
+ * @return void
+ */
+void bulk_release(struct bulk *bulk)
+{
+    if (!bulk->mapped)
+		return;
+    madvise(bulk->map, (bulk->mapped + bulk->page - 1) / bulk->page * bulk->page, MADV_DONTNEED);
+    bulk->mapped = 0;
+}
+
+/**
+ * Reports the sends and receives which avoided the copies.
+ *
+ * @param bulk (const struct bulk*) - Zero-copy state
+ * @param buf (char*) - Output buffer, always NUL-terminated
+ * @param len (size_t) - Size of buf
+ *
+ * @return size_t - Length of the text, which may have been truncated as snprintf() does
+ */
+size_t bulk_format(const struct bulk *bulk, char *buf, size_t len)
+{
+    return snprintf(buf, len, "bulk-zerocopy-sends %llu\nbulk-copied-sends %llu\nbulk-ring-full %llu\n"
+		"bulk-mapped-bytes %llu\nbulk-copied-bytes %llu\n", bulk->zerocopy_sends, bulk->copied_sends,
+		bulk->ring_full, bulk->rx_mapped, bulk->rx_copied);
+}
+
+/**
+ * Releases the buffers and the mapping. The TCP connection is left open.
+ * Pages still in flight stay pinned by the kernel until it is done with them.
+ *
+ * @param bulk (struct bulk*) - Zero-copy state, may be NULL
+ *
+ * @return void
+ */
+void bulk_close(struct bulk *bulk)
+{
+    if (!bulk)
+		return;
+    if (bulk->ring)
+		munmap(bulk->ring, bulk->stride * BULK_BUFFERS);
+    if (bulk->map)
+		munmap(bulk->map, BULK_MAP_SIZE);
+    free(bulk);
+}
@@ -0,0 +1,54 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+
+#ifndef __BULK_H__
+    #define __BULK_H__
+
+    #include <stddef.h>
+
+    /* page-aligned send buffers, each holding one UDP payload and its prefix */
+    #define BULK_BUFFERS 64
+
+    /* socket pages mapped by a single bulk_recv() call */
+    #define BULK_MAP_SIZE (2 * 1024 * 1024)
+
+    /**
+     * Stream data returned by bulk_recv(): mapped pages of the socket, or
+     * bytes copied into the buffer of the caller.
+     */
+    struct bulk_data {
+        const char *mapped;            // Start of the mapped data, NULL if it was copied
+        size_t len;                    // Bytes mapped or copied
+    };
+
+    struct bulk;
+
+    struct bulk *bulk_open(int tcp_fd);
+
+    char *bulk_buffer(struct bulk *bulk);
+
+    int bulk_send(struct bulk *bulk, char *payload, size_t len, int zerocopy);
+
+    int bulk_recv(struct bulk *bulk, char *buf, size_t buflen, size_t threshold, struct bulk_data *data);
+
+    void bulk_release(struct bulk *bulk);
+
+    size_t bulk_format(const struct bulk *bulk, char *buf, size_t len);
+
+    void bulk_close(struct bulk *bulk);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * Config Library - Program configuration model
+ *
+ * Holds the settings parsed from the command line. The settings which can be
+ * changed while the program runs (by the control socket, or carried over by
+ * a binary upgrade) are accessed by name with config_set(), which validates
+ * the value, and are listed by config_format() as "key value" lines, which
+ * config_parse() accepts back.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for struct mmsghdr, used by io.h...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+
+#include "config.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+/* for error messages which mention a limit */
+#define STR(x) #x
+#define EXPAND_STR(x) STR(x)
+
+/*
+ * A setting which can be changed at runtime. Plain integer settings have no
+ * functions: they are the int at offset in struct config, from min to max.
+ */
+struct config_key {
+	const char *name;
+	const char *(*set)(struct config *config, const char *value); // Returns NULL or an error message
+	void (*get)(const struct config *config, char *buf, size_t len);
+	size_t offset;
+	int min, max;
+	const char *error;             // Message for a value out of range
+};
+
+#define INT_KEY(name, field, min, max, error) { name, NULL, NULL, offsetof(struct config, field), min, max, error }
+
+/* names of the log levels, indexed by their value */
+static const char *const log_level_names[] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug", "nothing",
+};
+
+/**
+ * Parses a non-negative decimal integer, rejecting trailing garbage.
+ *
+ * @param value (const char*) - String to parse
+ * @param min (int) - Smallest accepted value
+ * @param max (int) - Largest accepted value
+ * @param result (int*) - Output value
+ *
+ * @return int - 0 on success, -1 if the string is not a number in the range
+ */
+static int parse_int(const char *value, int min, int max, int *result)
+{
+	char *end;
+	long n;
+
+	n = strtol(value, &end, 10);
+	if (end == value || *end != '\0' || n < min || n > max)
+		return -1;
+
+	*result = n;
+	return 0;
+}
+
+static void get_destination(const struct config *config, char *buf, size_t len)
+{
+	const char *dest = config->is_server ? config->udpaddr : config->tcpaddr;
+
+	snprintf(buf, len, "%s", dest ? dest : "-");
+}
+
+static const char *set_destination(struct config *config, const char *value)
+{
+	char current[256];
+
+	get_destination(config, current, sizeof(current));
+	if (strcmp(value, current) == 0)
+		return NULL;
+	if (!config->is_server) // The client has a single connection to its destination
+		return "the destination can only be changed in server mode";
+	if (!strchr(value, ':'))
+		return "expected ADDRESS:PORT or unixgram:PATH";
+
+	/* only the tunnels forked from now on use the new destination */
+	free(config->udpaddr);
+	config->udpaddr = NOFAIL(strdup(value));
+	return NULL;
+}
+
+static const char *set_log_level(struct config *config, const char *value)
+{
+	int level;
+
+	for (level = log_emerg; level <= log_nothing; level++)
+		if (strcmp(value, log_level_names[level]) == 0)
+			break;
+	if (level > log_nothing && parse_int(value, log_emerg, log_nothing, &level) < 0)
+		return "expected one of emerg, alert, crit, err, warning, notice, info, debug, nothing";
+
+	/* keep the destination flags */
+	log_set_options((log_get_filter_level() & ~LOG_LEVEL_MASK) | level);
+	return NULL;
+}
+
+static void get_log_level(const struct config *config, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s", log_level_names[log_get_filter_level() & LOG_LEVEL_MASK]);
+}
+
+static const struct config_key config_keys[] = {
+	{ "destination",	set_destination,	get_destination },
+	INT_KEY("timeout", timeout, 0, INT_MAX, "expected a number of seconds, 0 to disable"),
+	INT_KEY("batch", udp_batch, 1, UDP_BATCH_SIZE,
+		"expected a number of datagrams between 1 and " EXPAND_STR(UDP_BATCH_SIZE)),
+	INT_KEY("handshake-timeout", handshake_timeout, 1, 3600000, "expected a number of milliseconds"),
+	INT_KEY("health-check", health_check, 0, 1, "expected 1 to answer the health checks, 0 to reject them"),
+	INT_KEY("max-tunnels", limits.max_tunnels, 0, INT_MAX, "expected a number of tunnels, 0 for no limit"),
+	INT_KEY("max-region-tunnels", limits.max_region_tunnels, 0, INT_MAX,
+		"expected a number of tunnels, 0 for no limit"),
+	INT_KEY("max-lag", limits.max_lag, 0, INT_MAX, "expected a number of milliseconds, 0 for no limit"),
+	INT_KEY("min-memory", limits.min_memory, 0, INT_MAX, "expected a number of MB, 0 for no limit"),
+	INT_KEY("max-steal", limits.max_steal, 0, 100, "expected a percentage, 0 for no limit"),
+	INT_KEY("idle-disconnect", idle_disconnect, 0, INT_MAX,
+		"expected a number of seconds, 0 to keep the connection open"),
+	INT_KEY("source-rate", source_rate, 0, INT_MAX, "expected packets per second, 0 for no limit"),
+	INT_KEY("source-burst", source_burst, 1, 1000000, "expected a number of packets between 1 and 1000000"),
+	INT_KEY("wireguard-keepalive", wireguard_keepalive, 0, 86400,
+		"expected a number of seconds, 0 to relay all the keepalives"),
+	INT_KEY("dns-cache", dns_cache, 0, 65536, "expected a number of responses between 0 and 65536"),
+	INT_KEY("bulk-threshold", bulk_threshold, 0, 65535, "expected a number of bytes, 0 to always copy"),
+	INT_KEY("tproxy-timeout", tproxy_timeout, 1, 86400, "expected a number of seconds between 1 and 86400"),
+	INT_KEY("session-linger", session_linger, 1, 86400, "expected a number of seconds between 1 and 86400"),
+	INT_KEY("top-talkers", top_talkers, 0, 86400, "expected a number of seconds, 0 to not log the top talkers"),
+	{ "log-level",		set_log_level,		get_log_level },
+};
+
+/**
+ * Initializes the configuration with the default values.
+ *
+ * @param config (struct config*) - Configuration to initialize
+ *
+ * @return void
+ */
+void config_init(struct config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->udp_batch = UDP_BATCH_SIZE;
+	config->handshake_timeout = HANDSHAKE_TIMEOUT;
+	config->source_burst = SOURCE_BURST;
+	config->tproxy_timeout = TPROXY_TIMEOUT;
+	config->session_linger = SESSION_LINGER;
+}
+
+/**
+ * Changes a runtime setting.
+ *
+ * @param config (struct config*) - Configuration to update
+ * @param key (const char*) - Name of the setting
+ * @param value (const char*) - New value
+ *
+ * @return const char* - NULL on success, otherwise a message explaining the error
+ */
+const char *config_set(struct config *config, const char *key, const char *value)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); i++) {
+		const struct config_key *k = &config_keys[i];
+
+		if (strcmp(key, k->name) != 0)
+			continue;
+		if (k->set)
+			return k->set(config, value);
+		if (parse_int(value, k->min, k->max, (int *) ((char *) config + k->offset)) < 0)
+			return k->error;
+		return NULL;
+	}
+
+	return "unknown setting";
+}
+
+/**
+ * Lists the runtime settings as "key value" lines.
+ *
+ * @param config (const struct config*) - Configuration to list
+ * @param buf (char*) - Output buffer, always NUL-terminated
+ * @param len (size_t) - Size of buf
+ *
+ * @return size_t - Length of the text, which may have been truncated as snprintf() does
+ */
+size_t config_format(const struct config *config, char *buf, size_t len)
+{
+	size_t i, used = 0;
+
+	if (len)
+		buf[0] = '\0';
+	for (i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); i++) {
+		char value[256];
+
+		if (config_keys[i].get)
+			config_keys[i].get(config, value, sizeof(value));
+		else
+			snprintf(value, sizeof(value), "%d", *(const int *) ((const char *) config + config_keys[i].offset));
+		used += snprintf(buf + (used < len ? used : len), used < len ? len - used : 0,
+			"%s %s\n", config_keys[i].name, value);
+	}
+
+	return used;
+}
+
+/**
+ * Applies the settings listed by config_format().
+ * Lines which are not valid are skipped, and the first error is returned.
+ *
+ * @param config (struct config*) - Configuration to update
+ * @param text (const char*) - "key value" lines
+ *
+ * @return const char* - NULL on success, otherwise a message explaining the error
+ */
+const char *config_parse(struct config *config, const char *text)
+{
+	const char *error = NULL;
+	char *copy = NOFAIL(strdup(text));
+	char *line, *saveptr;
+
+	for (line = strtok_r(copy, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+		char *value = strchr(line, ' ');
+		const char *res;
+
+		if (!value) {
+			res = "expected a key and a value";
+		} else {
+			*value++ = '\0';
+			res = config_set(config, line, value);
+		}
+		if (res && !error)
+			error = res;
+	}
+
+	free(copy);
+	return error;
+}
@@ -0,0 +1,97 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __CONFIG_H__
+    #define __CONFIG_H__
+
+    #include <stddef.h>
+
+    #include "../io/simnet.h"
+    #include "../overload/overload.h"
+    #include "../filter/filter.h"
+
+    /*
+     * Maximum number of UDP datagrams queued by tcp_to_udp() before they are
+     * flushed with a single sendmmsg() call. One TCP read usually carries many
+     * small frames, so batching saves one system call per datagram.
+     */
+    #define UDP_BATCH_SIZE 64
+
+    /* milliseconds allowed to a new connection to send its handshake, in server mode */
+    #define HANDSHAKE_TIMEOUT 5000
+
+    /* packets which a UDP source may send at once when its rate is limited, in client mode */
+    #define SOURCE_BURST 100
+
+    /* seconds after which an idle flow of the transparent proxy mode is closed */
+    #define TPROXY_TIMEOUT 60
+
+    /* seconds a tunnel waits for its client to resume the session, in server mode */
+    #define SESSION_LINGER 60
+
+    /**
+     * Configuration of the program. The first group is fixed at startup, the
+     * second one can also be changed at runtime with config_set().
+     */
+    struct config {
+        int is_server;                 // 1 = server mode (TCP->UDP), 0 = client mode (UDP->TCP)
+        int use_inetd;                 // 1 = running under inetd/systemd, 0 = standalone
+        char *handshake;               // Authentication handshake string (32 bytes)
+        char *xdp_ifname;              // Interface for AF_XDP ingest (client mode), NULL if disabled
+        int xdp_queue;                 // RX queue bound by the AF_XDP socket
+        int xdp_native;                // 1 = attach the XDP program in driver mode, 0 = generic mode
+        char *shm_path;                // Unix socket where applications attach to the shared memory rings
+        int kcm;                       // 1 = let AF_KCM split the frames of the TCP stream, if available
+        int tproxy;                    // 1 = any-destination UDP, redirected by TPROXY to the client
+        int simulate;                  // 1 = run the client relay on the simulated network
+        struct simnet_config simnet;   // Parameters of the simulated network
+        char *control_path;            // Unix socket of the control interface, NULL if disabled
+        char *acl_path;                // Allow and deny rules for the UDP sources (client) or the TPROXY destinations (server), NULL if disabled
+        struct filter *filter;         // Kernel filter of the UDP listener (client), NULL if disabled
+        char *migrate_to;              // Server taking over the tunnels on SIGUSR1 (server), NULL if disabled
+        char *migrate_listen;          // Address accepting the tunnels of other servers (server), NULL if disabled
+        char *source_pool;             // Local addresses of the UDP sockets (server), NULL for the default
+        char *source_ports;            // Local port range of the source pool, NULL for the ephemeral range
+        int session;                   // 1 = resume the tunnel on the server node reached after reconnecting (client)
+        char *session_dir;             // Directory of the sessions shared by the server nodes, NULL if disabled
+        char *session_node;            // Tunnel address of this server node for the other nodes, NULL for the listener
+
+        char *udpaddr, *tcpaddr;       // Source and destination address strings
+        int timeout;                   // Idle connection timeout in seconds
+        int udp_batch;                 // Datagrams per sendmmsg() call, 1 to UDP_BATCH_SIZE
+        int handshake_timeout;         // Milliseconds allowed to send the handshake (server)
+        int health_check;              // 1 = answer HTTP health checks without starting a tunnel (server)
+        struct overload_limits limits; // Load shedding thresholds (server)
+        int idle_disconnect;           // Seconds before closing an idle connection, 0 = always connected (client)
+        int source_rate;               // Packets per second accepted from each UDP source, 0 = no limit (client)
+        int source_burst;              // Bucket size of the UDP sources, in packets (client)
+        int wireguard_keepalive;       // Seconds between the WireGuard keepalives relayed, 0 = relay all
+        int dns_cache;                 // DNS responses answered locally, 0 = no cache (client)
+        int bulk_threshold;            // Payload size from which the TCP stream is not copied, 0 = always copy
+        int tproxy_timeout;            // Seconds before an idle flow of the transparent proxy mode is closed
+        int session_linger;            // Seconds a tunnel waits for its client to resume the session (server)
+        int top_talkers;               // Seconds between two logs of the top UDP peers, 0 = not logged
+    };
+
+    void config_init(struct config *config);
+
+    const char *config_set(struct config *config, const char *key, const char *value);
+
+    size_t config_format(const struct config *config, char *buf, size_t len);
+
+    const char *config_parse(struct config *config, const char *text);
+
+#endif
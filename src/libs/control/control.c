@@ -0,0 +1,312 @@
+/*
+ * Control Library - Runtime control socket
+ *
+ * A unix stream socket accepting text commands, one per line, from tools like
+ * socat(1). Each command is split into words and dispatched to the handler
+ * registered for its first word; the reply is the text printed by the
+ * handler followed by a last line which is either "OK" or "ERR message".
+ *
+ * The descriptors are never waited on here: the event loop of the program
+ * watches the ones returned by control_fds() and calls control_poll() when
+ * any of them is readable, so commands are served between packets.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for accept4...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "../log/log.h"
+
+#define CONTROL_MAX_CLIENTS (CONTROL_MAX_FDS - 1)
+#define CONTROL_LINE_SIZE 1024     // Longest command line
+#define CONTROL_MAX_ARGS 16        // Most words in a command line
+
+/* a connected control client */
+struct control_client {
+    int fd;                        // -1 if the slot is free
+    size_t len;                    // Bytes of an incomplete line in buf
+    char buf[CONTROL_LINE_SIZE];
+};
+
+struct control {
+    int listen_fd;
+    const struct control_command *commands; // Terminated by an entry with a NULL name
+    void *ctx;                     // Passed to the handlers
+    struct control_client clients[CONTROL_MAX_CLIENTS];
+    struct control_reply reply;    // Reply being built, too large for the stack
+};
+
+/**
+ * Creates the control socket. Only the owner of the process may connect.
+ *
+ * @param path (const char*) - Filesystem path of the socket, replaced if it exists
+ * @param commands (const struct control_command*) - Commands, terminated by an entry with a NULL name
+ * @param ctx (void*) - Passed to the handlers
+ *
+ * @return struct control* - Control socket, exits on error
+ */
+struct control *control_listen(const char *path, const struct control_command *commands, void *ctx)
+{
+    struct control *control;
+    struct sockaddr_un sun;
+    struct stat st;
+    int i;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path))
+		log_printf_exit(2, log_err, "Invalid unix socket path '%s'!", path);
+    strcpy(sun.sun_path, path);
+
+    control = NOFAIL(calloc(1, sizeof(*control)));
+    control->commands = commands;
+    control->ctx = ctx;
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		control->clients[i].fd = -1;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+    if ((control->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+		err_sys("socket(AF_UNIX)");
+    if (bind(control->listen_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err_sys("Cannot bind to %s", path);
+    if (chmod(path, 0600) < 0)
+		err_sys("chmod(%s)", path);
+    if (listen(control->listen_fd, 8) < 0)
+		err_sys("listen");
+
+    log_printf(log_info, "Listening for control commands on %s", path);
+
+    return control;
+}
+
+/**
+ * Returns the descriptors which the event loop must watch for reading.
+ *
+ * @param control (const struct control*) - Control socket
+ * @param fds (int*) - Output array
+ * @param max (int) - Size of fds, CONTROL_MAX_FDS is always enough
+ *
+ * @return int - Number of descriptors stored
+ */
+int control_fds(const struct control *control, int *fds, int max)
+{
+    int i, n = 0;
+
+    if (n < max)
+		fds[n++] = control->listen_fd;
+    for (i = 0; i < CONTROL_MAX_CLIENTS && n < max; i++)
+		if (control->clients[i].fd >= 0)
+			fds[n++] = control->clients[i].fd;
+
+    return n;
+}
+
+/**
+ * Appends text to the reply of a command.
+ * Text which does not fit in the buffer is silently dropped.
+ *
+ * @param reply (struct control_reply*) - Reply being built
+ * @param format (const char*) - printf() format string
+ *
+ * @return void
+ */
+void control_printf(struct control_reply *reply, const char *format, ...)
+{
+    va_list ap;
+    int len;
+
+    if (reply->len >= sizeof(reply->buf) - 1)
+		return;
+
+    va_start(ap, format);
+    len = vsnprintf(reply->buf + reply->len, sizeof(reply->buf) - reply->len, format, ap);
+    va_end(ap);
+
+    if (len > 0)
+		reply->len += (size_t) len < sizeof(reply->buf) - reply->len ? (size_t) len
+			: sizeof(reply->buf) - reply->len - 1;
+}
+
+static void client_close(struct control_client *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->len = 0;
+}
+
+/**
+ * Runs a command line and sends the reply.
+ *
+ * @param control (struct control*) - Control socket
+ * @param client (struct control_client*) - Client which sent the line
+ * @param line (char*) - Command line, modified
+ *
+ * @return int - 0, or -1 if the client was closed
+ */
+static int run_command(struct control *control, struct control_client *client, char *line)
+{
+    struct control_reply *reply = &control->reply;
+    const struct control_command *cmd;
+    char *argv[CONTROL_MAX_ARGS];
+    char *saveptr;
+    int argc = 0;
+    int res = -1;
+
+    while (argc < CONTROL_MAX_ARGS && (argv[argc] = strtok_r(argc ? NULL : line, " \t\r", &saveptr)))
+		argc++;
+    if (argc == 0) // Empty line
+		return 0;
+
+    reply->len = 0;
+    reply->buf[0] = '\0';
+
+    if (strcmp(argv[0], "help") == 0) {
+		for (cmd = control->commands; cmd->name; cmd++)
+			control_printf(reply, "%s %s\n", cmd->name, cmd->usage);
+		res = 0;
+    } else {
+		for (cmd = control->commands; cmd->name; cmd++)
+			if (strcmp(argv[0], cmd->name) == 0)
+				break;
+
+		if (!cmd->name)
+			control_printf(reply, "unknown command, try help");
+		else if (argc - 1 < cmd->min_args || argc - 1 > cmd->max_args)
+			control_printf(reply, "usage: %s %s", cmd->name, cmd->usage);
+		else
+			res = cmd->handler(reply, argc - 1, argv + 1, control->ctx);
+    }
+
+    if (res < 0) { // The reply is the error message
+		char message[512];
+
+		log_printf(log_info, "Control command '%s' failed: %s", argv[0], reply->buf);
+		snprintf(message, sizeof(message), "ERR %.500s\n", reply->buf);
+		reply->len = 0;
+		control_printf(reply, "%s", message);
+    } else {
+		control_printf(reply, "OK\n");
+		log_printf(log_info, "Control command '%s' done", argv[0]);
+    }
+
+    /* the replies are small: a client which does not read them is dropped */
+    if (send(client->fd, reply->buf, reply->len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) reply->len) {
+		client_close(client);
+		return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the data sent by a client and runs the complete command lines.
+ *
+ * @param control (struct control*) - Control socket
+ * @param client (struct control_client*) - Readable client
+ *
+ * @return void
+ */
+static void client_read(struct control *control, struct control_client *client)
+{
+    ssize_t len;
+    char *line, *end;
+
+    len = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+    if (len <= 0) {
+		client_close(client);
+		return;
+    }
+    client->len += len;
+
+    line = client->buf;
+    while ((end = memchr(line, '\n', client->buf + client->len - line))) {
+		*end = '\0';
+		if (run_command(control, client, line) < 0)
+			return;
+		line = end + 1;
+    }
+
+    /* keep the incomplete line */
+    client->len -= line - client->buf;
+    memmove(client->buf, line, client->len);
+    if (client->len == sizeof(client->buf)) {
+		log_printf(log_info, "Control command line too long");
+		client_close(client);
+    }
+}
+
+/**
+ * Accepts the new clients and serves the pending commands, without blocking.
+ *
+ * @param control (struct control*) - Control socket
+ *
+ * @return void
+ */
+void control_poll(struct control *control)
+{
+    struct pollfd pfds[CONTROL_MAX_FDS];
+    struct control_client *owners[CONTROL_MAX_FDS];
+    int i, n = 0;
+
+    pfds[n].fd = control->listen_fd;
+    pfds[n].events = POLLIN;
+    owners[n++] = NULL;
+    for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (control->clients[i].fd < 0)
+			continue;
+		pfds[n].fd = control->clients[i].fd;
+		pfds[n].events = POLLIN;
+		owners[n++] = &control->clients[i];
+    }
+
+    if (poll(pfds, n, 0) <= 0)
+		return;
+
+    for (i = 1; i < n; i++)
+		if (pfds[i].revents)
+			client_read(control, owners[i]);
+
+    if (pfds[0].revents & POLLIN) {
+		int fd = accept4(control->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd < 0)
+			return;
+		for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+			if (control->clients[i].fd < 0) {
+				control->clients[i].fd = fd;
+				return;
+			}
+		}
+		log_printf(log_info, "Too many control clients, closing the new one");
+		close(fd);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __CONTROL_H__
+    #define __CONTROL_H__
+
+    #include <stddef.h>
+
+    #include "../utils/utils.h"
+
+    /* maximum number of descriptors returned by control_fds() */
+    #define CONTROL_MAX_FDS 9
+
+    /* size of the reply buffer of a command */
+    #define CONTROL_REPLY_SIZE 16384
+
+    /**
+     * Text produced by a command handler with control_printf().
+     */
+    struct control_reply {
+        size_t len;
+        char buf[CONTROL_REPLY_SIZE];
+    };
+
+    /**
+     * A command of the control protocol. The handler returns 0 on success, or
+     * -1 after printing the error message in the reply.
+     */
+    struct control_command {
+        const char *name;
+        const char *usage;                 // Arguments, shown by "help"
+        int min_args, max_args;
+        int (*handler)(struct control_reply *reply, int argc, char *argv[], void *ctx);
+    };
+
+    struct control;
+
+    struct control *control_listen(const char *path, const struct control_command *commands, void *ctx);
+
+    int control_fds(const struct control *control, int *fds, int max);
+
+    void control_poll(struct control *control);
+
+    __attribute__ ((format(printf, 2, 3)))
+    void control_printf(struct control_reply *reply, const char *format, ...);
+
+#endif
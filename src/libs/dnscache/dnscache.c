@@ -0,0 +1,407 @@
+/*
+ * DNS Cache Library - Local answers for the DNS queries crossing the tunnel
+ *
+ * Keeps the DNS responses coming back through the tunnel, and answers the
+ * same questions locally until their TTL expires, instead of paying the round
+ * trip through the TCP connection again.
+ *
+ * The cache key is the question (name compared without case, type and class)
+ * with the flags which change the answer: recursion desired, checking
+ * disabled and the presence of EDNS. A cached response is returned with the
+ * transaction ID and the question of the new query, so that the randomized
+ * ID and 0x20 case of the resolver match, and with its TTLs reduced by the
+ * time spent in the cache.
+ *
+ * The entries live in a fixed table of sets of 4, indexed by a hash of the
+ * key: a new response replaces an expired entry or the least recently used
+ * one of its set.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "dnscache.h"
+#include "../utils/utils.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_NAME 255           // Longest name in wire format
+#define DNS_TYPE_OPT 41            // EDNS pseudo-record, which has no TTL
+#define DNS_RCODE_NXDOMAIN 3
+#define MAX_TTL 86400              // Cap of the TTLs, as most resolvers do
+#define WAYS 4                     // Entries of a set, searched linearly
+#define PENDING 64                 // Queries remembered to measure the round trip
+
+/* question and flags of a query */
+struct dns_key {
+    uint16_t len;
+    unsigned char data[DNS_MAX_NAME + 5]; // Lowercase name, type, class and flags
+};
+
+struct dns_entry {
+    uint64_t hash;
+    uint64_t stored;               // CLOCK_MONOTONIC us when the response was stored
+    uint64_t expires;              // CLOCK_MONOTONIC us, 0 if the entry is free
+    uint64_t used;                 // CLOCK_MONOTONIC us of the last hit
+    struct dns_key key;
+    uint16_t len;
+    unsigned char response[DNSCACHE_MAX_RESPONSE];
+};
+
+/* a query which missed the cache, waiting for its response */
+struct pending_query {
+    uint16_t id;
+    uint64_t hash;
+    uint64_t sent;                 // CLOCK_MONOTONIC us, 0 if answered
+};
+
+struct dnscache {
+    struct dns_entry *entries;
+    uint32_t sets;                 // A power of 2
+    struct pending_query pending[PENDING];
+    int next_pending;
+
+    unsigned long long hits, misses, stored;
+    unsigned long long unsolicited; // Responses to no query which missed, never stored
+    uint64_t rtt;                  // Smoothed round trip of the misses, us
+    uint64_t saved;                // Round trips avoided by the hits, us
+};
+
+/**
+ * Creates an empty cache.
+ *
+ * @param entries (int) - Number of responses kept, rounded up to a power of 2 sets of 4
+ *
+ * @return struct dnscache* - New cache, exits if out of memory
+ */
+struct dnscache *dnscache_new(int entries)
+{
+    struct dnscache *cache = NOFAIL(calloc(1, sizeof(*cache)));
+
+    cache->sets = 1;
+    while (cache->sets * WAYS < (uint32_t) entries)
+		cache->sets *= 2;
+    cache->entries = NOFAIL(calloc(cache->sets * WAYS, sizeof(*cache->entries)));
+    return cache;
+}
+
+/**
+ * Releases a cache.
+ *
+ * @param cache (struct dnscache*) - Cache to free, may be NULL
+ *
+ * @return void
+ */
+void dnscache_free(struct dnscache *cache)
+{
+    if (!cache)
+		return;
+    free(cache->entries);
+    free(cache);
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* FNV-1a: the keys are short and already in a buffer */
+static uint64_t key_hash(const struct dns_key *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < key->len; i++)
+		h = (h ^ key->data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/**
+ * Parses the question of a message, which must not use name compression.
+ *
+ * @param msg (const unsigned char*) - DNS message
+ * @param len (size_t) - Length of msg
+ * @param key (struct dns_key*) - Output lowercase name, type and class
+ * @param end (size_t*) - Output offset of the first record
+ *
+ * @return int - 0 on success, -1 if the question is not valid
+ */
+static int parse_question(const unsigned char *msg, size_t len, struct dns_key *key, size_t *end)
+{
+    size_t off = DNS_HEADER_SIZE;
+
+    key->len = 0;
+    while (off < len && msg[off]) {
+		size_t label = msg[off];
+
+		if (label > 63 || off + label + 1 > len || key->len + label + 1 > DNS_MAX_NAME)
+			return -1;
+		key->data[key->len++] = label;
+		for (off++; label--; off++)
+			key->data[key->len++] = msg[off] >= 'A' && msg[off] <= 'Z' ? msg[off] + 'a' - 'A' : msg[off];
+    }
+    if (off + 5 > len)
+		return -1;
+    key->data[key->len++] = 0;
+    memcpy(key->data + key->len, msg + off + 1, 4); // Type and class
+    key->len += 4;
+
+    *end = off + 5;
+    return 0;
+}
+
+/* returns the offset after a name, which may end with a compression pointer, or 0 if it is not valid */
+static size_t skip_name(const unsigned char *msg, size_t len, size_t off)
+{
+    while (off < len) {
+		if (msg[off] == 0)
+			return off + 1;
+		if ((msg[off] & 0xc0) == 0xc0)
+			return off + 2 <= len ? off + 2 : 0;
+		if (msg[off] & 0xc0)
+			return 0;
+		off += msg[off] + 1;
+    }
+    return 0;
+}
+
+/**
+ * Walks the records of a message, finds their smallest TTL and whether one
+ * of them is an EDNS OPT pseudo-record, and optionally makes them older.
+ *
+ * @param msg (unsigned char*) - DNS message, modified if age is not 0
+ * @param len (size_t) - Length of msg
+ * @param off (size_t) - Offset of the first record
+ * @param count (int) - Number of records
+ * @param age (uint32_t) - Seconds to subtract from the TTLs
+ * @param min_ttl (uint32_t*) - Output smallest TTL, not changed if there is no record
+ * @param edns (int*) - Output 1 if there is an OPT record
+ *
+ * @return int - 0 on success, -1 if the records are not valid
+ */
+static int scan_records(unsigned char *msg, size_t len, size_t off, int count, uint32_t age, uint32_t *min_ttl,
+	int *edns)
+{
+    *edns = 0;
+    while (count--) {
+		uint32_t ttl;
+
+		if (!(off = skip_name(msg, len, off)) || off + 10 > len || off + 10 + get16(msg + off + 8) > len)
+			return -1;
+		if (get16(msg + off) == DNS_TYPE_OPT) { // The TTL field holds the extended flags
+			*edns = 1;
+		} else {
+			ttl = get32(msg + off + 4);
+			if (ttl > MAX_TTL)
+				ttl = MAX_TTL;
+			if (age)
+				put32(msg + off + 4, ttl > age ? ttl - age : 0);
+			if (ttl < *min_ttl)
+				*min_ttl = ttl;
+		}
+		off += 10 + get16(msg + off + 8);
+    }
+    return 0;
+}
+
+/* adds the flags which change the response to the key */
+static void key_flags(struct dns_key *key, const unsigned char *msg, int edns)
+{
+    key->data[key->len++] = (msg[2] & 0x01) | ((msg[3] & 0x10) >> 3) | (edns << 2); // RD, CD, EDNS
+}
+
+static struct dns_entry *find_entry(struct dnscache *cache, const struct dns_key *key, uint64_t hash)
+{
+    struct dns_entry *set = &cache->entries[(hash & (cache->sets - 1)) * WAYS];
+    int i;
+
+    for (i = 0; i < WAYS; i++)
+		if (set[i].expires && set[i].hash == hash && set[i].key.len == key->len &&
+			memcmp(set[i].key.data, key->data, key->len) == 0)
+			return &set[i];
+    return NULL;
+}
+
+/**
+ * Answers a query from the cache.
+ * A query which misses is remembered, to measure the round trip of its response.
+ *
+ * @param cache (struct dnscache*) - Cache
+ * @param query (const void*) - UDP payload, which may not be a DNS query
+ * @param len (size_t) - Length of query
+ * @param reply (void*) - Output response
+ * @param reply_len (size_t) - Size of reply
+ *
+ * @return size_t - Length of the response, 0 if the query must be sent through the tunnel
+ */
+size_t dnscache_lookup(struct dnscache *cache, const void *query, size_t len, void *reply, size_t reply_len)
+{
+    const unsigned char *q = query;
+    unsigned char *r = reply;
+    struct dns_entry *entry;
+    struct dns_key key;
+    uint32_t age, min_ttl = MAX_TTL;
+    uint64_t now, hash;
+    size_t end;
+    int edns;
+
+    /* a standard query with one question and at most the OPT record */
+    if (len < DNS_HEADER_SIZE || (q[2] & 0xf8) || get16(q + 4) != 1 || get16(q + 6) || get16(q + 8) ||
+		get16(q + 10) > 1 || parse_question(q, len, &key, &end) < 0)
+		return 0;
+    if (scan_records((unsigned char *) q, len, end, get16(q + 10), 0, &min_ttl, &edns) < 0)
+		return 0;
+    key_flags(&key, q, edns);
+    hash = key_hash(&key);
+    now = now_us();
+
+    entry = find_entry(cache, &key, hash);
+    if (!entry || entry->expires <= now || entry->len > reply_len) {
+		struct pending_query *pending = &cache->pending[cache->next_pending++ % PENDING];
+
+		pending->id = get16(q);
+		pending->hash = hash;
+		pending->sent = now;
+		cache->misses++;
+		return 0;
+    }
+
+    /* the ID and the question of the query, with the records of the cached response */
+    memcpy(r, entry->response, entry->len);
+    memcpy(r, q, 2);
+    memcpy(r + DNS_HEADER_SIZE, q + DNS_HEADER_SIZE, end - DNS_HEADER_SIZE);
+    age = (now - entry->stored) / 1000000;
+    if (age)
+		scan_records(r, entry->len, end, get16(r + 6) + get16(r + 8) + get16(r + 10), age, &min_ttl, &edns);
+
+    entry->used = now;
+    cache->hits++;
+    cache->saved += cache->rtt;
+    return entry->len;
+}
+
+/**
+ * Stores a response coming back through the tunnel, if it can be reused:
+ * a successful answer, or a name which does not exist, with a TTL. Only the
+ * answers to the queries which missed the cache are stored, so that a spoofed
+ * or unsolicited response is not served to the next clients.
+ *
+ * @param cache (struct dnscache*) - Cache
+ * @param response (const void*) - UDP payload, which may not be a DNS response
+ * @param len (size_t) - Length of response
+ *
+ * @return void
+ */
+void dnscache_store(struct dnscache *cache, const void *response, size_t len)
+{
+    const unsigned char *r = response;
+    struct dns_entry *set, *entry;
+    struct dns_key key;
+    uint32_t min_ttl = UINT32_MAX;
+    uint64_t now, hash;
+    size_t end;
+    int i, edns;
+
+    /* a standard response with one question, complete and not truncated */
+    if (len < DNS_HEADER_SIZE || (r[2] & 0xfa) != 0x80 || get16(r + 4) != 1 ||
+		((r[3] & 0x0f) != 0 && (r[3] & 0x0f) != DNS_RCODE_NXDOMAIN) || parse_question(r, len, &key, &end) < 0 ||
+		scan_records((unsigned char *) r, len, end, get16(r + 6) + get16(r + 8) + get16(r + 10), 0, &min_ttl,
+			&edns) < 0)
+		return;
+    key_flags(&key, r, edns);
+    hash = key_hash(&key);
+    now = now_us();
+
+    for (i = 0; i < PENDING; i++) { // Round trip of the query which missed
+		struct pending_query *pending = &cache->pending[i];
+
+		if (pending->sent && pending->id == get16(r) && pending->hash == hash) {
+			uint64_t rtt = now - pending->sent;
+
+			cache->rtt = cache->rtt ? cache->rtt - cache->rtt / 8 + rtt / 8 : rtt;
+			pending->sent = 0;
+			break;
+		}
+    }
+    if (i == PENDING) { // Same ID and question as no query sent through the tunnel
+		cache->unsolicited++;
+		return;
+    }
+
+    if (min_ttl == 0 || min_ttl == UINT32_MAX || len > DNSCACHE_MAX_RESPONSE) // Not to be reused, or no record
+		return;
+
+    if (!(entry = find_entry(cache, &key, hash))) { // A free or expired entry, else the least recently used
+		set = &cache->entries[(hash & (cache->sets - 1)) * WAYS];
+		entry = &set[0];
+		for (i = 0; i < WAYS && entry->expires > now; i++)
+			if (set[i].expires <= now || set[i].used < entry->used)
+				entry = &set[i];
+    }
+
+    entry->hash = hash;
+    entry->key = key;
+    entry->stored = now;
+    entry->used = now;
+    entry->expires = now + (uint64_t) min_ttl * 1000000;
+    entry->len = len;
+    memcpy(entry->response, r, len);
+    cache->stored++;
+}
+
+/**
+ * Reports the hits and misses of the cache, the measured round trip of the
+ * tunnel for DNS and the time saved by the hits.
+ *
+ * @param cache (const struct dnscache*) - Cache
+ * @param buf (char*) - Output buffer, always NUL-terminated
+ * @param len (size_t) - Size of buf
+ *
+ * @return size_t - Length of the text, which may have been truncated as snprintf() does
+ */
+size_t dnscache_format(const struct dnscache *cache, char *buf, size_t len)
+{
+    unsigned long long total = cache->hits + cache->misses;
+
+    return snprintf(buf, len, "dns-hits %llu\ndns-misses %llu\ndns-hit-rate %llu%%\ndns-stored %llu\n"
+		"dns-unsolicited %llu\ndns-rtt-us %llu\ndns-saved-ms %llu\n", cache->hits, cache->misses,
+		total ? cache->hits * 100 / total : 0, cache->stored, cache->unsolicited, (unsigned long long) cache->rtt,
+		(unsigned long long) cache->saved / 1000);
+}
@@ -0,0 +1,37 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __DNSCACHE_H__
+    #define __DNSCACHE_H__
+
+    #include <stddef.h>
+
+    /* largest response cached, the EDNS buffer size which avoids fragmentation */
+    #define DNSCACHE_MAX_RESPONSE 1232
+
+    struct dnscache;
+
+    struct dnscache *dnscache_new(int entries);
+
+    void dnscache_free(struct dnscache *cache);
+
+    size_t dnscache_lookup(struct dnscache *cache, const void *query, size_t len, void *reply, size_t reply_len);
+
+    void dnscache_store(struct dnscache *cache, const void *response, size_t len);
+
+    size_t dnscache_format(const struct dnscache *cache, char *buf, size_t len);
+
+#endif
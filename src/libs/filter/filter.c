@@ -0,0 +1,848 @@
+/*
+ * Filter Library - Kernel filter of the UDP listener
+ *
+ * Compiles filter expressions on the ports, the size, the first bytes of the
+ * payload and the source address of the datagrams to a classic BPF program,
+ * attached to the UDP listener with SO_ATTACH_FILTER. The kernel runs it
+ * before queueing a datagram to the socket, so unwanted traffic is dropped
+ * there, without waking up the relay or costing it a system call.
+ *
+ * Components:
+ * - Expressions: comma-separated conditions which must all hold, e.g.
+ *   "sport=53,len<=512" or "!src=10.0.0.0/8,prefix=0100"; a datagram is
+ *   accepted if it matches any of the expressions
+ * - Conditions: sport and dport (ranges with =, !=, <, <=, > and >=, or
+ *   A-B), len (the payload length, same operators), prefix (bytes in hex
+ *   starting the payload) and src (an IPv4 or IPv6 prefix), each of them
+ *   negated with a leading '!'
+ * - Code generation with labels: a condition which fails jumps to the next
+ *   expression, the last one drops the datagram; the jumps are resolved
+ *   once the program is complete
+ * - Hit counter: the classic program is translated to an eBPF socket filter
+ *   whose drop path increments a counter in an array map, so only the
+ *   datagrams rejected by the filter are counted. Without the privilege to
+ *   load it (CAP_BPF), the classic program is attached as it is and only the
+ *   drop counter of the socket (SK_MEMINFO_DROPS) is known, which also counts
+ *   the datagrams dropped because the receive buffer was full
+ *
+ * The filter sees the datagram from its UDP header: the ports are at offsets
+ * 0 and 2, the payload starts at offset 8, and the IP header is reached with
+ * the SKF_NET_OFF offsets.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for syscall()...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#include "filter.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#if defined __has_include
+#if __has_include(<linux/bpf.h>)
+#define HAVE_EBPF
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#endif
+#endif
+
+#ifndef SO_ATTACH_FILTER
+    #define SO_ATTACH_FILTER 26
+#endif
+#ifndef SO_ATTACH_BPF
+    #define SO_ATTACH_BPF 50
+#endif
+#ifndef SO_MEMINFO
+    #define SO_MEMINFO 55
+#endif
+
+#define UDP_HEADER 8               // Offset of the payload in the filtered datagram
+#define MAX_LABELS 256
+#define NEXT (-1)                  // Jump target: the next instruction
+
+enum filter_key {
+    KEY_SPORT,
+    KEY_DPORT,
+    KEY_LEN,
+    KEY_PREFIX,
+    KEY_SRC,
+};
+
+/* a test on one field of the datagram */
+struct condition {
+    enum filter_key key;
+    int negate;
+    uint32_t lo, hi;               // Range of the ports or of the payload length
+    unsigned char bytes[FILTER_MAX_PREFIX]; // Payload prefix, or source address
+    int nbytes;                    // Length of the payload prefix
+    int family;                    // Family of the source address
+    int bits;                      // Length of the source prefix
+};
+
+struct expression {
+    struct condition conditions[FILTER_MAX_CONDITIONS];
+    int count;
+};
+
+struct filter {
+    struct expression expressions[FILTER_MAX_EXPRESSIONS];
+    int count;
+    int instructions;              // Length of the attached program, 0 if none
+    int map_fd;                    // Counter of the eBPF program, -1 for the classic one
+    uint32_t drops;                // Drop counter of the socket when the classic filter was attached
+};
+
+/* a program being generated, the jumps referring to labels until it is complete */
+struct program {
+    struct sock_filter insns[BPF_MAXINSNS];
+    int jt[BPF_MAXINSNS], jf[BPF_MAXINSNS]; // Labels of the conditional jumps, or NEXT
+    int len;
+    int labels[MAX_LABELS];        // Instruction of each label
+    int nlabels;
+    int overflow;                  // 1 if the program or the labels did not fit
+};
+
+/**
+ * Parses a number of a range.
+ *
+ * @param s (const char*) - Decimal number, ending at end
+ * @param end (const char*) - End of the number
+ * @param max (uint32_t) - Largest value
+ * @param value (uint32_t*) - Output value
+ *
+ * @return int - 0 on success, -1 if it is not a number up to max
+ */
+static int parse_number(const char *s, const char *end, uint32_t max, uint32_t *value)
+{
+    unsigned long n = 0;
+
+    if (s == end)
+		return -1;
+    for (; s < end; s++) {
+		if (!isdigit((unsigned char) *s))
+			return -1;
+		n = n * 10 + (*s - '0');
+		if (n > max)
+			return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+/**
+ * Parses the operator and the value of a port or length condition.
+ *
+ * @param c (struct condition*) - Condition to fill
+ * @param op (const char*) - Operator: =, !=, <, <=, > or >=
+ * @param value (const char*) - Number, or range A-B with = and !=
+ * @param max (uint32_t) - Largest value of the field
+ *
+ * @return const char* - NULL on success, otherwise the error
+ */
+static const char *parse_range(struct condition *c, const char *op, const char *value, uint32_t max)
+{
+    const char *end = value + strlen(value);
+    const char *dash = strchr(value, '-');
+    uint32_t n;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "!=") == 0) {
+		if (parse_number(value, dash ? dash : end, max, &c->lo) < 0 ||
+			parse_number(dash ? dash + 1 : value, end, max, &c->hi) < 0 || c->lo > c->hi)
+			return "expected a number or a range A-B";
+		c->negate ^= op[0] == '!';
+		return NULL;
+    }
+
+    if (parse_number(value, end, max, &n) < 0)
+		return "expected a number";
+    c->lo = 0;
+    c->hi = max;
+    if (strcmp(op, "<") == 0 && n > 0)
+		c->hi = n - 1;
+    else if (strcmp(op, "<=") == 0)
+		c->hi = n;
+    else if (strcmp(op, ">") == 0 && n < max)
+		c->lo = n + 1;
+    else if (strcmp(op, ">=") == 0)
+		c->lo = n;
+    else
+		return "the condition can never hold";
+    return NULL;
+}
+
+/**
+ * Parses the hexadecimal bytes of a payload prefix.
+ *
+ * @param c (struct condition*) - Condition to fill
+ * @param value (const char*) - Hexadecimal digits, two per byte
+ *
+ * @return const char* - NULL on success, otherwise the error
+ */
+static const char *parse_prefix(struct condition *c, const char *value)
+{
+    size_t len = strlen(value), i;
+
+    if (len == 0 || len % 2 || len / 2 > FILTER_MAX_PREFIX)
+		return "expected 1 to 64 bytes in hexadecimal";
+    for (i = 0; i < len; i += 2) {
+		unsigned int byte;
+
+		if (!isxdigit((unsigned char) value[i]) || !isxdigit((unsigned char) value[i + 1]) ||
+			sscanf(value + i, "%2x", &byte) != 1)
+			return "expected hexadecimal digits";
+		c->bytes[i / 2] = byte;
+    }
+    c->nbytes = len / 2;
+    return NULL;
+}
+
+/**
+ * Parses a source address prefix.
+ *
+ * @param c (struct condition*) - Condition to fill
+ * @param value (const char*) - ADDRESS or ADDRESS/LENGTH
+ *
+ * @return const char* - NULL on success, otherwise the error
+ */
+static const char *parse_source(struct condition *c, const char *value)
+{
+    char address[INET6_ADDRSTRLEN];
+    const char *slash = strchr(value, '/');
+    size_t len = slash ? (size_t) (slash - value) : strlen(value);
+    uint32_t bits;
+
+    if (len >= sizeof(address))
+		return "expected an IPv4 or IPv6 prefix";
+    memcpy(address, value, len);
+    address[len] = '\0';
+    if (inet_pton(AF_INET, address, c->bytes) == 1)
+		c->family = AF_INET;
+    else if (inet_pton(AF_INET6, address, c->bytes) == 1)
+		c->family = AF_INET6;
+    else
+		return "expected an IPv4 or IPv6 prefix";
+
+    c->bits = c->family == AF_INET ? 32 : 128;
+    if (slash) {
+		if (parse_number(slash + 1, slash + 1 + strlen(slash + 1), c->bits, &bits) < 0)
+			return "invalid prefix length";
+		c->bits = bits;
+    }
+    return NULL;
+}
+
+/**
+ * Parses a condition of an expression.
+ *
+ * @param text (char*) - Condition, modified
+ * @param c (struct condition*) - Output condition
+ *
+ * @return const char* - NULL on success, otherwise the error
+ */
+static const char *parse_condition(char *text, struct condition *c)
+{
+    static const char *const ops[] = { "!=", "<=", ">=", "=", "<", ">" };
+    const char *op = NULL;
+    char *key, *value, *end;
+    size_t i;
+
+    memset(c, 0, sizeof(*c));
+    while (isspace((unsigned char) *text))
+		text++;
+    for (end = text + strlen(text); end > text && isspace((unsigned char) end[-1]); end--)
+		end[-1] = '\0';
+    if (*text == '!') {
+		c->negate = 1;
+		text++;
+    }
+
+    key = text;
+    for (value = text; isalpha((unsigned char) *value); value++)
+		;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]) && !op; i++) {
+		if (strncmp(value, ops[i], strlen(ops[i])) == 0)
+			op = ops[i];
+    }
+    if (!op)
+		return "expected KEY=VALUE, KEY<VALUE...";
+    *value = '\0'; // Terminates the key
+    value += strlen(op);
+
+    if (strcmp(key, "sport") == 0 || strcmp(key, "dport") == 0) {
+		c->key = key[0] == 's' ? KEY_SPORT : KEY_DPORT;
+		return parse_range(c, op, value, 65535);
+    }
+    if (strcmp(key, "len") == 0) {
+		c->key = KEY_LEN;
+		return parse_range(c, op, value, 65535);
+    }
+    if (strcmp(key, "prefix") && strcmp(key, "src"))
+		return "unknown key, expected sport, dport, len, prefix or src";
+    if (strcmp(op, "=") && strcmp(op, "!="))
+		return "prefix and src only support = and !=";
+    c->negate ^= op[0] == '!';
+    c->key = key[0] == 'p' ? KEY_PREFIX : KEY_SRC;
+    return c->key == KEY_PREFIX ? parse_prefix(c, value) : parse_source(c, value);
+}
+
+/**
+ * Creates an empty filter, which accepts every datagram.
+ *
+ * @return struct filter* - New filter
+ */
+struct filter *filter_new(void)
+{
+    struct filter *filter = NOFAIL(calloc(1, sizeof(struct filter)));
+
+    filter->map_fd = -1;
+    return filter;
+}
+
+/**
+ * Adds an expression to a filter: the datagrams which match any of its
+ * expressions are accepted.
+ *
+ * @param filter (struct filter*) - Filter
+ * @param expression (const char*) - Comma-separated conditions
+ *
+ * @return const char* - NULL on success, otherwise the error
+ */
+const char *filter_add(struct filter *filter, const char *expression)
+{
+    struct expression *e;
+    char *text, *token, *saveptr = NULL;
+    const char *error = NULL;
+
+    if (filter->count == FILTER_MAX_EXPRESSIONS)
+		return "too many expressions";
+    e = &filter->expressions[filter->count];
+    memset(e, 0, sizeof(*e));
+
+    text = NOFAIL(strdup(expression));
+    for (token = strtok_r(text, ",", &saveptr); token && !error; token = strtok_r(NULL, ",", &saveptr)) {
+		if (e->count == FILTER_MAX_CONDITIONS)
+			error = "too many conditions";
+		else
+			error = parse_condition(token, &e->conditions[e->count++]);
+    }
+    free(text);
+    if (!error && !e->count)
+		error = "no condition";
+    if (!error)
+		filter->count++;
+    return error;
+}
+
+/* a new label, placed later with place() */
+static int new_label(struct program *p)
+{
+    if (p->nlabels == MAX_LABELS) {
+		p->overflow = 1;
+		return 0;
+    }
+    p->labels[p->nlabels] = -1;
+    return p->nlabels++;
+}
+
+/* the label points to the next instruction */
+static void place(struct program *p, int label)
+{
+    p->labels[label] = p->len;
+}
+
+/* a statement, or a conditional jump to the labels jt and jf (NEXT to go on) */
+static void emit(struct program *p, uint16_t code, uint32_t k, int jt, int jf)
+{
+    struct sock_filter insn = BPF_STMT(code, k);
+
+    if (p->len == BPF_MAXINSNS) {
+		p->overflow = 1;
+		return;
+    }
+    p->jt[p->len] = jt;
+    p->jf[p->len] = jf;
+    p->insns[p->len++] = insn;
+}
+
+/* the value in the accumulator must be from lo to hi, or from 0 to max for no check */
+static void emit_range(struct program *p, uint32_t lo, uint32_t hi, uint32_t max, int mismatch)
+{
+    if (lo == hi) {
+		emit(p, BPF_JMP | BPF_JEQ | BPF_K, lo, NEXT, mismatch);
+		return;
+    }
+    if (lo > 0)
+		emit(p, BPF_JMP | BPF_JGE | BPF_K, lo, NEXT, mismatch);
+    if (hi < max)
+		emit(p, BPF_JMP | BPF_JGT | BPF_K, hi, mismatch, NEXT);
+}
+
+/**
+ * Generates the test of a condition: the program goes on if it holds,
+ * otherwise it jumps to mismatch. Negation is up to the caller.
+ *
+ * @param p (struct program*) - Program
+ * @param c (const struct condition*) - Condition
+ * @param mismatch (int) - Label jumped to when the datagram does not match
+ *
+ * @return void
+ */
+static void emit_condition(struct program *p, const struct condition *c, int mismatch)
+{
+    int i, size;
+
+    switch (c->key) {
+		case KEY_SPORT:
+		case KEY_DPORT:
+			emit(p, BPF_LD | BPF_H | BPF_ABS, c->key == KEY_SPORT ? 0 : 2, NEXT, NEXT);
+			emit_range(p, c->lo, c->hi, 65535, mismatch);
+			break;
+		case KEY_LEN:
+			emit(p, BPF_LD | BPF_W | BPF_LEN, 0, NEXT, NEXT);
+			emit_range(p, c->lo + UDP_HEADER, c->hi + UDP_HEADER, 65535 + UDP_HEADER, mismatch);
+			break;
+		case KEY_PREFIX:
+			/* a load beyond the end would end the program and drop the datagram */
+			emit(p, BPF_LD | BPF_W | BPF_LEN, 0, NEXT, NEXT);
+			emit(p, BPF_JMP | BPF_JGE | BPF_K, UDP_HEADER + c->nbytes, NEXT, mismatch);
+			for (i = 0; i < c->nbytes; i += size) {
+				uint32_t value = 0;
+				int j;
+
+				size = c->nbytes - i >= 4 ? 4 : c->nbytes - i >= 2 ? 2 : 1;
+				for (j = 0; j < size; j++) // The loads are big-endian
+					value = value << 8 | c->bytes[i + j];
+				emit(p, BPF_LD | (size == 4 ? BPF_W : size == 2 ? BPF_H : BPF_B) | BPF_ABS,
+					UDP_HEADER + i, NEXT, NEXT);
+				emit(p, BPF_JMP | BPF_JEQ | BPF_K, value, NEXT, mismatch);
+			}
+			break;
+		case KEY_SRC: {
+			int bits = c->bits;
+
+			/* the IP version, as a dual-stack socket gets both */
+			emit(p, BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF, NEXT, NEXT);
+			emit(p, BPF_ALU | BPF_AND | BPF_K, 0xf0, NEXT, NEXT);
+			emit(p, BPF_JMP | BPF_JEQ | BPF_K, c->family == AF_INET ? 0x40 : 0x60, NEXT, mismatch);
+			for (i = 0; bits > 0; i++, bits -= 32) {
+				uint32_t mask = bits >= 32 ? 0xffffffff : ~0u << (32 - bits);
+				uint32_t word = (uint32_t) c->bytes[4 * i] << 24 | c->bytes[4 * i + 1] << 16 |
+					c->bytes[4 * i + 2] << 8 | c->bytes[4 * i + 3];
+
+				emit(p, BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + (c->family == AF_INET ? 12 : 8) + 4 * i,
+					NEXT, NEXT);
+				if (mask != 0xffffffff)
+					emit(p, BPF_ALU | BPF_AND | BPF_K, mask, NEXT, NEXT);
+				emit(p, BPF_JMP | BPF_JEQ | BPF_K, word & mask, NEXT, mismatch);
+			}
+			break;
+		}
+    }
+}
+
+/**
+ * Generates the program of a filter and resolves its jumps.
+ *
+ * @param filter (const struct filter*) - Filter with at least one expression
+ * @param p (struct program*) - Output program
+ *
+ * @return int - 0 on success, -1 if the program is too large (logged)
+ */
+static int compile(const struct filter *filter, struct program *p)
+{
+    int i, j;
+
+    for (i = 0; i < filter->count; i++) {
+		const struct expression *e = &filter->expressions[i];
+		int fail = new_label(p); // The next expression
+
+		for (j = 0; j < e->count; j++) {
+			const struct condition *c = &e->conditions[j];
+
+			if (c->negate) { // Matching it is the failure
+				int holds = new_label(p);
+
+				emit_condition(p, c, holds);
+				emit(p, BPF_JMP | BPF_JA, 0, NEXT, NEXT);
+				p->jt[p->len - 1] = fail; // Resolved into k below
+				place(p, holds);
+			} else {
+				emit_condition(p, c, fail);
+			}
+		}
+		emit(p, BPF_RET | BPF_K, 0xffffffff, NEXT, NEXT); // The whole datagram
+		place(p, fail);
+    }
+    emit(p, BPF_RET | BPF_K, 0, NEXT, NEXT); // Matched no expression
+
+    if (p->overflow) {
+		log_printf(log_err, "The UDP filter is too large");
+		return -1;
+    }
+    for (i = 0; i < p->len; i++) {
+		struct sock_filter *insn = &p->insns[i];
+
+		if (BPF_CLASS(insn->code) != BPF_JMP)
+			continue;
+		if (BPF_OP(insn->code) == BPF_JA) {
+			insn->k = p->labels[p->jt[i]] - (i + 1);
+			continue;
+		}
+		for (j = 0; j < 2; j++) {
+			int label = j ? p->jf[i] : p->jt[i];
+			int offset = label == NEXT ? 0 : p->labels[label] - (i + 1);
+
+			if (offset > 255) { // Conditional jumps have 8 bits
+				log_printf(log_err, "The UDP filter is too large: split the long expressions");
+				return -1;
+			}
+			if (j)
+				insn->jf = offset;
+			else
+				insn->jt = offset;
+		}
+    }
+    return 0;
+}
+
+#ifdef HAVE_EBPF
+
+/*
+ * Minimal eBPF assembler: only the instruction forms of the translated
+ * program and of its drop counter.
+ */
+#define BPF_INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)          BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)          BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define MOV32_IMM(d, i)          BPF_INSN(BPF_ALU | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)          BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define LDX_MEM(sz, d, s, o)     BPF_INSN(BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define ST_MEM(sz, d, o, i)      BPF_INSN(BPF_ST | (sz) | BPF_MEM, d, 0, o, i)
+#define ATOMIC_ADD64(d, s, o)    BPF_INSN(BPF_STX | BPF_DW | BPF_ATOMIC, d, s, o, BPF_ADD)
+#define JMP_IMM(op, d, i, o)     BPF_INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMP32_IMM(op, d, i, o)   BPF_INSN(BPF_JMP32 | (op) | BPF_K, d, 0, o, i)
+#define JMP_ALWAYS(o)            BPF_INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define LD_MAP_FD(d, fd)         BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+                                 BPF_INSN(0, 0, 0, 0, 0)
+#define CALL(f)                  BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()                   BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* number of eBPF instructions translating a classic one */
+static int ebpf_size(const struct sock_filter *insn)
+{
+    if (BPF_CLASS(insn->code) == BPF_JMP && BPF_OP(insn->code) != BPF_JA && insn->jf)
+		return 2; // The false branch is a jump of its own
+    if (BPF_CLASS(insn->code) == BPF_RET && insn->k)
+		return 2;
+    return 1;
+}
+
+/**
+ * Translates a compiled classic program to an eBPF socket filter and loads
+ * it. The accumulator is r0, and r6 holds the context for the packet loads,
+ * which keep their classic encoding. The returns of 0 jump to a common drop
+ * path which increments the counter in the map.
+ *
+ * @param p (const struct program*) - Compiled program
+ * @param map_fd (int) - Array map of one 64-bit counter
+ *
+ * @return int - Program file descriptor, or -1 with errno set
+ */
+static int load_counted(const struct program *p, int map_fd)
+{
+    struct bpf_insn drop_path[] = {
+		ST_MEM(BPF_W, BPF_REG_10, -4, 0),                   // Key 0 on the stack
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, -4),
+		LD_MAP_FD(BPF_REG_1, map_fd),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2),
+		MOV64_IMM(BPF_REG_1, 1),
+		ATOMIC_ADD64(BPF_REG_0, BPF_REG_1, 0),
+		MOV64_IMM(BPF_REG_0, 0),                            // Drops the datagram
+		EXIT(),
+    };
+    static char verifier_log[4096];
+    struct bpf_insn *insns;
+    union bpf_attr attr;
+    int *start, i, n, drop, fd = -1;
+
+    /* the first eBPF instruction of each classic one, and the drop path after the last */
+    start = NOFAIL(malloc((p->len + 1) * sizeof(*start)));
+    start[0] = 1;
+    for (i = 0; i < p->len; i++)
+		start[i + 1] = start[i] + ebpf_size(&p->insns[i]);
+    drop = start[p->len];
+    insns = NOFAIL(malloc((drop + sizeof(drop_path) / sizeof(drop_path[0])) * sizeof(*insns)));
+
+    n = 0;
+    insns[n++] = MOV64_REG(BPF_REG_6, BPF_REG_1);
+    for (i = 0; i < p->len; i++) {
+		const struct sock_filter *insn = &p->insns[i];
+
+		switch (BPF_CLASS(insn->code)) {
+			case BPF_LD:
+				if (BPF_MODE(insn->code) == BPF_LEN)
+					insns[n] = LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_6, offsetof(struct __sk_buff, len));
+				else
+					insns[n] = BPF_INSN(insn->code, 0, 0, 0, insn->k);
+				n++;
+				break;
+			case BPF_ALU:
+				insns[n++] = BPF_INSN(insn->code, BPF_REG_0, 0, 0, insn->k);
+				break;
+			case BPF_JMP:
+				if (BPF_OP(insn->code) == BPF_JA) {
+					insns[n] = JMP_ALWAYS(start[i + 1 + insn->k] - (n + 1));
+					n++;
+					break;
+				}
+				/* 32-bit comparisons, as the classic constants are unsigned */
+				insns[n] = JMP32_IMM(BPF_OP(insn->code), BPF_REG_0, insn->k, start[i + 1 + insn->jt] - (n + 1));
+				n++;
+				if (insn->jf) {
+					insns[n] = JMP_ALWAYS(start[i + 1 + insn->jf] - (n + 1));
+					n++;
+				}
+				break;
+			case BPF_RET:
+				if (!insn->k) {
+					insns[n] = JMP_ALWAYS(drop - (n + 1));
+					n++;
+				} else {
+					insns[n++] = MOV32_IMM(BPF_REG_0, insn->k);
+					insns[n++] = EXIT();
+				}
+				break;
+			default: // Not generated by compile()
+				errno = EINVAL;
+				goto out;
+		}
+    }
+    memcpy(insns + n, drop_path, sizeof(drop_path));
+    n += sizeof(drop_path) / sizeof(drop_path[0]);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uintptr_t) insns;
+    attr.insn_cnt = n;
+    attr.license = (uintptr_t) "GPL";
+    attr.log_buf = (uintptr_t) verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+
+    verifier_log[0] = '\0';
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && verifier_log[0])
+		log_printf(log_debug, "UDP filter verifier log:\n%s", verifier_log);
+
+out:
+    free(insns);
+    free(start);
+    return fd;
+}
+
+/**
+ * Attaches the eBPF translation of a program, which counts its drops.
+ *
+ * @param filter (struct filter*) - Filter, whose map_fd is set on success
+ * @param p (const struct program*) - Compiled program
+ * @param fd (int) - UDP socket
+ *
+ * @return int - 0 on success, -1 with errno set if eBPF is not available
+ */
+static int attach_counted(struct filter *filter, const struct program *p, int fd)
+{
+    union bpf_attr attr;
+    int map_fd, prog_fd, res;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = 1;
+    if ((map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0)
+		return -1;
+    if ((prog_fd = load_counted(p, map_fd)) < 0) {
+		close(map_fd);
+		return -1;
+    }
+
+    res = setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF, &prog_fd, sizeof(prog_fd));
+    close(prog_fd); // The socket holds the program, which holds the map
+    if (res < 0) {
+		close(map_fd);
+		return -1;
+    }
+    if (filter->map_fd >= 0)
+		close(filter->map_fd);
+    filter->map_fd = map_fd;
+    return 0;
+}
+
+/**
+ * Reads the drop counter of the eBPF program.
+ *
+ * @param map_fd (int) - Counter map
+ *
+ * @return uint64_t - Datagrams dropped by the filter, 0 if unknown
+ */
+static uint64_t counted_drops(int map_fd)
+{
+    union bpf_attr attr;
+    uint32_t key = 0;
+    uint64_t value = 0;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) &value;
+    if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0)
+		return 0;
+    return value;
+}
+
+#else
+
+static int attach_counted(struct filter *filter, const struct program *p, int fd)
+{
+    (void) filter;
+    (void) p;
+    (void) fd;
+    errno = ENOSYS;
+    return -1;
+}
+
+static uint64_t counted_drops(int map_fd)
+{
+    (void) map_fd;
+    return 0;
+}
+
+#endif
+
+/**
+ * Reads the drop counter of a socket.
+ *
+ * @param fd (int) - Socket
+ *
+ * @return uint32_t - Datagrams dropped by the filter or for lack of buffer space, 0 if unknown
+ */
+static uint32_t socket_drops(int fd)
+{
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0 || len <= SK_MEMINFO_DROPS * sizeof(uint32_t))
+		return 0;
+    return meminfo[SK_MEMINFO_DROPS];
+}
+
+/**
+ * Compiles a filter and attaches it to a UDP socket. The datagrams which
+ * match none of the expressions are dropped by the kernel from then on.
+ * The program runs as eBPF with a drop counter if the process may load it,
+ * otherwise as classic BPF.
+ *
+ * @param filter (struct filter*) - Filter, which accepts everything without expressions
+ * @param fd (int) - UDP socket
+ *
+ * @return int - 0 on success, -1 on error (logged)
+ */
+int filter_attach(struct filter *filter, int fd)
+{
+    struct program *p;
+    struct sock_fprog prog;
+    int res = -1;
+
+    if (!filter->count)
+		return 0;
+
+    p = NOFAIL(calloc(1, sizeof(*p)));
+    if (compile(filter, p) < 0)
+		goto out;
+
+    if (attach_counted(filter, p, fd) == 0) {
+		log_printf(log_debug, "Attached an eBPF UDP filter of %d expressions and %d instructions",
+			filter->count, p->len);
+    } else {
+		log_printf_err(log_debug, "Cannot load the eBPF UDP filter, only the socket drops are counted");
+		if (filter->map_fd >= 0) {
+			close(filter->map_fd);
+			filter->map_fd = -1;
+		}
+		prog.len = p->len;
+		prog.filter = p->insns;
+		if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+			log_printf_err(log_err, "setsockopt(SO_ATTACH_FILTER)");
+			goto out;
+		}
+		filter->drops = socket_drops(fd);
+		log_printf(log_debug, "Attached a UDP filter of %d expressions and %d instructions", filter->count, p->len);
+    }
+    filter->instructions = p->len;
+    res = 0;
+
+out:
+    free(p);
+    return res;
+}
+
+/**
+ * Formats the state of the filter for the status command.
+ *
+ * @param filter (const struct filter*) - Filter
+ * @param fd (int) - Socket it is attached to
+ * @param buf (char*) - Output buffer
+ * @param len (size_t) - Size of the buffer
+ *
+ * @return size_t - Length of the text, as returned by snprintf()
+ */
+size_t filter_format(const struct filter *filter, int fd, char *buf, size_t len)
+{
+    if (filter->instructions && filter->map_fd < 0) // The classic program, without a counter
+		return snprintf(buf, len,
+			"filter-expressions %d\n"
+			"filter-instructions %d\n"
+			"filter-socket-drops %u\n",
+			filter->count, filter->instructions, socket_drops(fd) - filter->drops);
+    return snprintf(buf, len,
+		"filter-expressions %d\n"
+		"filter-instructions %d\n"
+		"filter-dropped %llu\n",
+		filter->count, filter->instructions,
+		(unsigned long long) (filter->map_fd >= 0 ? counted_drops(filter->map_fd) : 0));
+}
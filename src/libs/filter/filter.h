@@ -0,0 +1,39 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __FILTER_H__
+    #define __FILTER_H__
+
+    #include <stddef.h>
+
+    /* conditions of a filter expression, and expressions of a filter */
+    #define FILTER_MAX_CONDITIONS 8
+    #define FILTER_MAX_EXPRESSIONS 16
+
+    /* longest payload prefix matched by a condition, in bytes */
+    #define FILTER_MAX_PREFIX 64
+
+    struct filter;
+
+    struct filter *filter_new(void);
+
+    const char *filter_add(struct filter *filter, const char *expression);
+
+    int filter_attach(struct filter *filter, int fd);
+
+    size_t filter_format(const struct filter *filter, int fd, char *buf, size_t len);
+
+#endif
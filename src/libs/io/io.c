@@ -0,0 +1,63 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "io.h"
+
+#ifndef HAVE_SENDMMSG
+/**
+ * sendmmsg() emulation: sends the datagrams one at a time and, like the
+ * system call, reports an error only if the first one could not be sent.
+ */
+static int posix_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    unsigned int i;
+
+    for (i = 0; i < vlen; i++) {
+		ssize_t len = sendmsg(fd, &msgvec[i].msg_hdr, flags);
+
+		if (len < 0)
+			return i > 0 ? (int) i : -1;
+		msgvec[i].msg_len = len;
+    }
+
+    return vlen;
+}
+#endif
+
+const struct io_ops io_posix = {
+    .name = "posix",
+    .recvfrom = recvfrom,
+    .recvmsg = recvmsg,
+    .send = send,
+    .sendmsg = sendmsg,
+#ifdef HAVE_SENDMMSG
+    .sendmmsg = sendmmsg,
+#else
+    .sendmmsg = posix_sendmmsg,
+#endif
+    .read = read,
+    .select = select,
+    .accept = accept,
+    .time = time,
+};
+
+const struct io_ops *io = &io_posix;
@@ -0,0 +1,58 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __IO_H__
+    #define __IO_H__
+
+    #include <time.h>
+    #include <sys/types.h>
+    #include <sys/select.h>
+    #include <sys/socket.h>
+
+    #include "../utils/utils.h"
+
+    #ifndef HAVE_SENDMMSG
+        /* same layout as the Linux structure, io_posix sends the batch one sendmsg() at a time */
+        struct mmsghdr {
+            struct msghdr msg_hdr;
+            unsigned int msg_len;
+        };
+    #endif
+
+    /**
+     * I/O backend used by the relay once its sockets are set up.
+     * The functions have the semantics of the system calls they are named after.
+     */
+    struct io_ops {
+        const char *name;
+        ssize_t (*recvfrom)(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen);
+        ssize_t (*recvmsg)(int fd, struct msghdr *msg, int flags);
+        ssize_t (*send)(int fd, const void *buf, size_t len, int flags);
+        ssize_t (*sendmsg)(int fd, const struct msghdr *msg, int flags);
+        int (*sendmmsg)(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+        ssize_t (*read)(int fd, void *buf, size_t count);
+        int (*select)(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+        int (*accept)(int fd, struct sockaddr *addr, socklen_t *addrlen);
+        time_t (*time)(time_t *t);
+    };
+
+    /* the kernel sockets, used by default */
+    extern const struct io_ops io_posix;
+
+    /* the current backend */
+    extern const struct io_ops *io;
+
+#endif
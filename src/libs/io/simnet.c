@@ -0,0 +1,833 @@
+/*
+ * Simulated network I/O backend
+ *
+ * Replaces the sockets of a client mode relay with an in-memory network
+ * driven by a virtual clock, so that runs are deterministic and free of
+ * kernel and scheduling noise:
+ *
+ * - a traffic generator sends UDP packets to the relay at a fixed rate; the
+ *   packets queue in a receive buffer of limited size, as in the kernel
+ * - the TCP connection crosses a link with a configurable bandwidth, latency
+ *   and segment loss; a lost segment is delivered one retransmission delay
+ *   later (by default a round trip, as with fast retransmit) and, since TCP
+ *   delivers in order, delays everything sent after it
+ * - the far end of the link decodes the tunnel with the relay core and
+ *   echoes every packet back, like a server relaying to an echo service
+ * - the replies of the relay are timestamped to measure the round trip time
+ *
+ * The virtual clock only moves when the relay waits in select() or blocks
+ * in send() because its send buffer is full, so the relay itself runs in
+ * zero virtual time; its real processing time is measured separately from
+ * the time spent in the simulation. The run ends with EOF on the TCP connection when
+ * all the packets have been generated and delivered, and a report is printed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "simnet.h"
+#include "../relay/relay.h"
+#include "../log/log.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NEVER UINT64_MAX
+
+/* every generated payload starts with its sequence number and send time */
+#define PROBE_SIZE 16
+
+/* largest accepted values of the specification, far from the integer limits */
+#define SIM_MAX_DELAY (60 * NSEC_PER_SEC)  // latency and rto
+#define SIM_MAX_RATE 1e9                   // packets per second
+#define SIM_MAX_COUNT 1e12
+#define SIM_MAX_BANDWIDTH 1e15             // bit/s
+#define SIM_MAX_SEED 1e19                  // below 2^64
+
+/* round trip time histogram: 2^HIST_SUB_BITS linear buckets per power of two */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+/**
+ * Data in flight: a TCP segment on the link or a datagram in the UDP
+ * receive queue of the relay.
+ */
+struct segment {
+    struct segment *next;
+    uint64_t deliver_at;               // Virtual time of arrival
+    size_t len;                        // Length of data
+    size_t off;                        // Bytes already read by the relay
+    char data[];
+};
+
+/**
+ * One direction of the tunnel link.
+ */
+struct link {
+    uint64_t free_at;                  // End of the serialization of the last queued byte
+    uint64_t last_delivery;            // TCP delivers in order
+    struct segment *head, *tail;       // Segments not yet delivered or read
+    uint64_t segments, bytes, retransmissions;
+};
+
+static struct {
+    struct simnet_config config;
+    uint64_t now;                      // Virtual clock
+    uint64_t rng;                      // State of the loss generator
+    int udp_fd, tcp_fd;                // Placeholder descriptors seen by the relay
+    int eof;                           // 1 once the run is complete
+
+    /* traffic generator and UDP receive queue of the relay */
+    uint64_t generated;
+    struct segment *udp_head, *udp_tail;
+    uint32_t udp_queued, udp_max_queued;
+    uint64_t udp_drops;
+
+    /* tunnel link and remote end */
+    struct link up, down;
+    struct udptunnel *server;
+    uint64_t max_backlog;              // Largest amount of unsent data in the relay send buffer
+    uint64_t blocked;                  // Virtual time spent blocked in send()
+
+    /* replies received back from the relay */
+    uint64_t received, rtt_min, rtt_max;
+    double rtt_sum;                    // Can exceed 2^64 ns over long runs with large latencies
+    uint64_t hist[HIST_BUCKETS];
+
+    /* cost of the relay */
+    uint64_t calls;                    // Backend calls made by the relay
+    uint64_t start, sim_time;          // Real time at start and spent in the simulation
+} sim;
+
+/*
+ * The process never sleeps during a run, so the monotonic clock measures its
+ * CPU time without the system call needed by CLOCK_PROCESS_CPUTIME_ID.
+ */
+static uint64_t real_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* time spent inside the backend is charged to the simulation */
+#define SIM_ENTER uint64_t sim_entry = real_ns(); sim.calls++
+#define SIM_LEAVE sim.sim_time += real_ns() - sim_entry
+
+/**
+ * Returns a pseudo-random number in [0, 1) from a xorshift64* generator,
+ * so that a given seed always loses the same segments.
+ */
+static double sim_random(void)
+{
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+    return ((sim.rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static struct segment *segment_new(const void *data, size_t len, uint64_t deliver_at)
+{
+    struct segment *seg = NOFAIL(malloc(sizeof(*seg) + len));
+
+    seg->next = NULL;
+    seg->deliver_at = deliver_at;
+    seg->len = len;
+    seg->off = 0;
+    if (data)
+		memcpy(seg->data, data, len);
+    return seg;
+}
+
+/**
+ * Queues data on a direction of the tunnel link.
+ *
+ * @param link (struct link*) - Link direction
+ * @param start (uint64_t) - Virtual time when the data is handed to the link
+ * @param seg (struct segment*) - Data, its delivery time is computed here
+ */
+static void link_transmit(struct link *link, uint64_t start, struct segment *seg)
+{
+    if (start < link->free_at)
+		start = link->free_at;
+    link->free_at = start;
+    if (sim.config.bandwidth)
+		link->free_at += seg->len * 8 * NSEC_PER_SEC / sim.config.bandwidth;
+
+    seg->deliver_at = link->free_at + sim.config.latency;
+    if (sim.config.loss > 0 && sim_random() < sim.config.loss) {
+		seg->deliver_at += sim.config.rto;
+		link->retransmissions++;
+    }
+    if (seg->deliver_at < link->last_delivery)
+		seg->deliver_at = link->last_delivery;
+    link->last_delivery = seg->deliver_at;
+
+    if (link->tail)
+		link->tail->next = seg;
+    else
+		link->head = seg;
+    link->tail = seg;
+    link->segments++;
+    link->bytes += seg->len;
+}
+
+static struct segment *queue_pop(struct segment **head, struct segment **tail)
+{
+    struct segment *seg = *head;
+
+    if ((*head = seg->next) == NULL)
+		*tail = NULL;
+    return seg;
+}
+
+/**
+ * Returns the bytes sent by the relay which have not left its send buffer yet.
+ */
+static uint64_t send_backlog(void)
+{
+    if (!sim.config.bandwidth || sim.up.free_at <= sim.now)
+		return 0;
+    return (double) (sim.up.free_at - sim.now) * sim.config.bandwidth / 8 / NSEC_PER_SEC;
+}
+
+static uint64_t next_generation(void)
+{
+    if (sim.generated >= sim.config.count)
+		return NEVER;
+    return sim.generated * NSEC_PER_SEC / sim.config.rate;
+}
+
+/**
+ * Sends the next generated packet to the UDP socket of the relay.
+ */
+static void generate_packet(uint64_t at)
+{
+    struct segment *seg;
+    uint64_t probe[2];
+
+    sim.generated++;
+    if (sim.udp_queued + sim.config.size > sim.config.rcvbuf) { // Receive buffer full
+		sim.udp_drops++;
+		return;
+    }
+
+    seg = segment_new(NULL, sim.config.size, at);
+    memset(seg->data, 0, seg->len);
+    probe[0] = sim.generated;
+    probe[1] = at;
+    memcpy(seg->data, probe, sizeof(probe));
+
+    if (sim.udp_tail)
+		sim.udp_tail->next = seg;
+    else
+		sim.udp_head = seg;
+    sim.udp_tail = seg;
+    sim.udp_queued += seg->len;
+    if (sim.udp_queued > sim.udp_max_queued)
+		sim.udp_max_queued = sim.udp_queued;
+}
+
+/**
+ * The remote end receives a segment: it decodes the packets and echoes them
+ * back over the link, all in one segment. The packets may have started in
+ * earlier segments, up to the size of the reassembly buffer.
+ */
+static void server_receive(struct segment *seg)
+{
+    size_t size = seg->len + UDPTUNNEL_BUFFER_SIZE;
+    struct segment *reply = segment_new(NULL, size, 0);
+    size_t off = 0;
+    const char *packet;
+    size_t len;
+    int res;
+
+    reply->len = 0;
+    while (off < seg->len) {
+		if ((res = udptunnel_tcp_in(sim.server, seg->data + off, seg->len - off)) < 0)
+			log_printf_exit(1, log_err, "simnet: the remote end failed: %s", udptunnel_strerror(res));
+		off += res;
+
+		while ((res = udptunnel_udp_next(sim.server, &packet, &len)) > 0)
+			reply->len += udptunnel_udp_in(sim.server, packet, len, reply->data + reply->len, size - reply->len);
+		if (res < 0)
+			log_printf_exit(1, log_err, "simnet: the remote end failed: %s", udptunnel_strerror(res));
+    }
+
+    if (reply->len)
+		link_transmit(&sim.down, seg->deliver_at, reply);
+    else
+		free(reply);
+}
+
+/**
+ * Moves the virtual clock forward, running the generator and the remote end.
+ */
+static void advance(uint64_t until)
+{
+    while (1) {
+		uint64_t gen = next_generation();
+		uint64_t up = sim.up.head ? sim.up.head->deliver_at : NEVER;
+
+		if (gen <= up && gen <= until) {
+			generate_packet(gen);
+		} else if (up < gen && up <= until) {
+			server_receive(sim.up.head);
+			free(queue_pop(&sim.up.head, &sim.up.tail));
+		} else {
+			break;
+		}
+    }
+
+    if (until > sim.now)
+		sim.now = until;
+}
+
+/**
+ * Sends data on the TCP connection, waiting like a blocking socket while
+ * the send buffer is full.
+ */
+static void tcp_send(const void *buf, size_t len)
+{
+    uint64_t backlog;
+
+    if (sim.config.bandwidth && send_backlog() + len > sim.config.sndbuf) {
+		uint64_t room = len < sim.config.sndbuf ? sim.config.sndbuf - len : 0;
+		uint64_t until = sim.up.free_at - room * 8 * NSEC_PER_SEC / sim.config.bandwidth;
+
+		if (until > sim.now) {
+			sim.blocked += until - sim.now;
+			advance(until);
+		}
+    }
+
+    link_transmit(&sim.up, sim.now, segment_new(buf, len, 0));
+
+    if ((backlog = send_backlog()) > sim.max_backlog)
+		sim.max_backlog = backlog;
+}
+
+/**
+ * A reply of the relay reaches the traffic generator.
+ */
+static void udp_deliver(const void *buf, size_t len)
+{
+    uint64_t probe[2], rtt;
+    int bucket;
+
+    sim.received++;
+    if (len < PROBE_SIZE)
+		return;
+
+    memcpy(probe, buf, sizeof(probe));
+    rtt = sim.now - probe[1];
+    sim.rtt_sum += rtt;
+    if (sim.received == 1 || rtt < sim.rtt_min)
+		sim.rtt_min = rtt;
+    if (rtt > sim.rtt_max)
+		sim.rtt_max = rtt;
+
+    if (rtt < (1 << HIST_SUB_BITS)) {
+		bucket = rtt;
+    } else {
+		int shift = 63 - __builtin_clzll(rtt) - HIST_SUB_BITS;
+
+		bucket = ((shift + 1) << HIST_SUB_BITS) + ((rtt >> shift) & ((1 << HIST_SUB_BITS) - 1));
+    }
+    sim.hist[bucket]++;
+}
+
+/**
+ * Returns the lower bound of the histogram bucket holding a percentile,
+ * within the range of the measured values.
+ */
+static uint64_t rtt_percentile(double p)
+{
+    uint64_t rank = p * sim.received, seen = 0, value;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += sim.hist[i];
+		if (seen > rank)
+			break;
+    }
+    if (i < (1 << HIST_SUB_BITS))
+		value = i;
+    else
+		value = (uint64_t) ((1 << HIST_SUB_BITS) + (i & ((1 << HIST_SUB_BITS) - 1))) << ((i >> HIST_SUB_BITS) - 1);
+
+    return value < sim.rtt_min ? sim.rtt_min : value > sim.rtt_max ? sim.rtt_max : value;
+}
+
+static ssize_t simnet_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen)
+{
+    struct segment *seg;
+    SIM_ENTER;
+
+    if (fd != sim.udp_fd || !sim.udp_head) {
+		SIM_LEAVE;
+		errno = fd != sim.udp_fd ? EBADF : EAGAIN;
+		return -1;
+    }
+
+    seg = queue_pop(&sim.udp_head, &sim.udp_tail);
+    sim.udp_queued -= seg->len;
+    if (len > seg->len)
+		len = seg->len;
+    memcpy(buf, seg->data, len);
+    free(seg);
+
+    if (addr && addrlen) { // The generator uses an address of TEST-NET-1
+		struct sockaddr_in sin;
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(0xc0000201);
+		sin.sin_port = htons(5000);
+		memcpy(addr, &sin, *addrlen < sizeof(sin) ? *addrlen : sizeof(sin));
+		*addrlen = sizeof(sin);
+    }
+
+    SIM_LEAVE;
+    return len;
+}
+
+/* the generated datagrams carry no control messages */
+static ssize_t simnet_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    socklen_t addrlen = msg->msg_namelen;
+    ssize_t len;
+
+    if (msg->msg_iovlen < 1) {
+		errno = EINVAL;
+		return -1;
+    }
+    len = simnet_recvfrom(fd, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len, flags, msg->msg_name,
+		msg->msg_name ? &addrlen : NULL);
+    if (len >= 0) {
+		msg->msg_namelen = msg->msg_name ? addrlen : 0;
+		msg->msg_controllen = 0;
+		msg->msg_flags = 0;
+    }
+    return len;
+}
+
+/**
+ * Hands data sent by the relay to the simulated network.
+ */
+static ssize_t sim_transmit(int fd, const void *buf, size_t len)
+{
+    if (fd == sim.tcp_fd) {
+		tcp_send(buf, len);
+    } else if (fd == sim.udp_fd) {
+		udp_deliver(buf, len);
+    } else {
+		errno = EBADF;
+		return -1;
+    }
+
+    return len;
+}
+
+/**
+ * Gathers the vectors of a message, as the kernel would copy them, and sends it.
+ */
+static ssize_t sim_sendmsg(int fd, const struct msghdr *msg)
+{
+    struct segment *seg;
+    size_t i, len = 0;
+    ssize_t res;
+
+    for (i = 0; i < msg->msg_iovlen; i++)
+		len += msg->msg_iov[i].iov_len;
+
+    seg = segment_new(NULL, len, 0);
+    for (i = 0, len = 0; i < msg->msg_iovlen; i++) {
+		memcpy(seg->data + len, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		len += msg->msg_iov[i].iov_len;
+    }
+
+    res = sim_transmit(fd, seg->data, seg->len);
+    free(seg);
+    return res;
+}
+
+static ssize_t simnet_send(int fd, const void *buf, size_t len, int flags)
+{
+    ssize_t res;
+    SIM_ENTER;
+
+    res = sim_transmit(fd, buf, len);
+    SIM_LEAVE;
+    return res;
+}
+
+static ssize_t simnet_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    ssize_t res;
+    SIM_ENTER;
+
+    res = sim_sendmsg(fd, msg);
+    SIM_LEAVE;
+    return res;
+}
+
+static int simnet_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    unsigned int i;
+    SIM_ENTER;
+
+    for (i = 0; i < vlen; i++) {
+		ssize_t len = sim_sendmsg(fd, &msgvec[i].msg_hdr);
+
+		if (len < 0) {
+			SIM_LEAVE;
+			return i > 0 ? (int) i : -1;
+		}
+		msgvec[i].msg_len = len;
+    }
+
+    SIM_LEAVE;
+    return vlen;
+}
+
+static ssize_t simnet_read(int fd, void *buf, size_t count)
+{
+    size_t done = 0;
+    SIM_ENTER;
+
+    if (fd != sim.tcp_fd) {
+		SIM_LEAVE;
+		errno = EBADF;
+		return -1;
+    }
+
+    while (done < count && sim.down.head && sim.down.head->deliver_at <= sim.now) {
+		struct segment *seg = sim.down.head;
+		size_t len = seg->len - seg->off;
+
+		if (len > count - done)
+			len = count - done;
+		memcpy((char *) buf + done, seg->data + seg->off, len);
+		done += len;
+		if ((seg->off += len) == seg->len)
+			free(queue_pop(&sim.down.head, &sim.down.tail));
+    }
+
+    SIM_LEAVE;
+    if (done == 0 && !sim.eof) {
+		errno = EAGAIN;
+		return -1;
+    }
+    return done;
+}
+
+/**
+ * Waits for the simulated sockets, moving the virtual clock to the next
+ * event until one of them is readable or the timeout expires.
+ */
+static int simnet_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout)
+{
+    int want_udp = sim.udp_fd < nfds && FD_ISSET(sim.udp_fd, readfds);
+    int want_tcp = sim.tcp_fd < nfds && FD_ISSET(sim.tcp_fd, readfds);
+    uint64_t limit = NEVER;
+    int ready = 0;
+    SIM_ENTER;
+
+    if (timeout)
+		limit = sim.now + timeout->tv_sec * NSEC_PER_SEC + timeout->tv_usec * 1000ULL;
+
+    while (1) {
+		int udp_ready = want_udp && sim.udp_head;
+		int tcp_ready = want_tcp && (sim.eof || (sim.down.head && sim.down.head->deliver_at <= sim.now));
+		uint64_t next = next_generation();
+
+		if (udp_ready || tcp_ready) {
+			FD_ZERO(readfds);
+			if (udp_ready) {
+				FD_SET(sim.udp_fd, readfds);
+				ready++;
+			}
+			if (tcp_ready) {
+				FD_SET(sim.tcp_fd, readfds);
+				ready++;
+			}
+			break;
+		}
+
+		if (sim.up.head && sim.up.head->deliver_at < next)
+			next = sim.up.head->deliver_at;
+		if (sim.down.head && sim.down.head->deliver_at < next)
+			next = sim.down.head->deliver_at;
+
+		if (next == NEVER && !sim.udp_head && !sim.eof) { // Everything was generated and delivered
+			sim.eof = 1;
+			continue;
+		}
+		if (next > limit || next == NEVER) {
+			if (limit == NEVER) { // Nothing will ever happen to the requested descriptors
+				SIM_LEAVE;
+				errno = EINVAL;
+				return -1;
+			}
+			advance(limit);
+			FD_ZERO(readfds);
+			break;
+		}
+		advance(next);
+    }
+
+    if (writefds)
+		FD_ZERO(writefds);
+    if (exceptfds)
+		FD_ZERO(exceptfds);
+    SIM_LEAVE;
+    return ready;
+}
+
+static int simnet_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+static time_t simnet_time(time_t *t)
+{
+    time_t now = sim.now / NSEC_PER_SEC;
+
+    if (t)
+		*t = now;
+    return now;
+}
+
+const struct io_ops io_simnet = {
+    .name = "simnet",
+    .recvfrom = simnet_recvfrom,
+    .recvmsg = simnet_recvmsg,
+    .send = simnet_send,
+    .sendmsg = simnet_sendmsg,
+    .sendmmsg = simnet_sendmmsg,
+    .read = simnet_read,
+    .select = simnet_select,
+    .accept = simnet_accept,
+    .time = simnet_time,
+};
+
+/**
+ * Prints the results of the run when the relay exits.
+ */
+static void simnet_report(void)
+{
+    uint64_t relay_time = real_ns() - sim.start - sim.sim_time;
+    uint64_t delivered = sim.generated - sim.udp_drops;
+
+    printf("simnet: %llu packets of %u bytes at %llu/s, link %llu bit/s, latency %.3f ms, loss %g, seed %llu\n",
+		(unsigned long long) sim.generated, sim.config.size, (unsigned long long) sim.config.rate,
+		(unsigned long long) sim.config.bandwidth, sim.config.latency / 1e6, sim.config.loss,
+		(unsigned long long) sim.config.seed);
+    printf("simnet: virtual time %.6f s, %llu replies received, %llu dropped by the UDP receive buffer (max %u bytes queued)\n",
+		sim.now / 1e9, (unsigned long long) sim.received, (unsigned long long) sim.udp_drops, sim.udp_max_queued);
+    if (sim.received)
+		printf("simnet: round trip time min %.3f avg %.3f p50 %.3f p99 %.3f max %.3f ms\n",
+			sim.rtt_min / 1e6, sim.rtt_sum / sim.received / 1e6, rtt_percentile(0.5) / 1e6,
+			rtt_percentile(0.99) / 1e6, sim.rtt_max / 1e6);
+    printf("simnet: tunnel %llu segments (%llu bytes, %llu retransmitted) up, %llu segments down, "
+		"max send backlog %llu bytes, blocked in send() %.3f ms\n",
+		(unsigned long long) sim.up.segments, (unsigned long long) sim.up.bytes,
+		(unsigned long long) sim.up.retransmissions, (unsigned long long) sim.down.segments,
+		(unsigned long long) sim.max_backlog, sim.blocked / 1e6);
+    printf("simnet: relay processing time %.3f ms, %.1f ns and %.2f backend calls per packet\n",
+		relay_time / 1e6, delivered ? (double) relay_time / delivered : 0.0,
+		delivered ? (double) sim.calls / delivered : 0.0);
+    fflush(stdout);
+}
+
+/**
+ * Parses a number with an optional unit suffix.
+ *
+ * @param value (const char*) - String to parse
+ * @param time (int) - 1 if the value is a time (ns, us, ms or s, default s),
+ *                     0 for a plain number (k, M or G multipliers)
+ * @param max (double) - Largest accepted value, in nanoseconds for times
+ * @param result (double*) - Output value, in nanoseconds for times
+ *
+ * @return int - 0 on success, -1 on syntax errors and values above max
+ */
+static int parse_value(const char *value, int time, double max, double *result)
+{
+    char *end;
+    double v = strtod(value, &end);
+
+    if (end == value || v < 0)
+		return -1;
+
+    if (time) {
+		if (*end == '\0' || strcmp(end, "s") == 0)
+			v *= 1e9;
+		else if (strcmp(end, "ms") == 0)
+			v *= 1e6;
+		else if (strcmp(end, "us") == 0)
+			v *= 1e3;
+		else if (strcmp(end, "ns") != 0)
+			return -1;
+    } else {
+		if (*end == 'k')
+			v *= 1e3;
+		else if (*end == 'M')
+			v *= 1e6;
+		else if (*end == 'G')
+			v *= 1e9;
+		if (*end != '\0' && end[1] != '\0')
+			return -1;
+    }
+
+    if (!(v <= max)) // Also rejects NaN, and values that would not fit the fields
+		return -1;
+
+    *result = v;
+    return 0;
+}
+
+/**
+ * Parses a simulation specification, a comma-separated list of key=value
+ * pairs: rate, size, count, bw, latency, loss, rto, rcvbuf, sndbuf and seed.
+ *
+ * @param spec (const char*) - Specification string
+ * @param config (struct simnet_config*) - Output configuration, defaults are set here
+ *
+ * @return int - 0 on success, -1 on invalid specifications
+ */
+int simnet_parse(const char *spec, struct simnet_config *config)
+{
+    char *copy = NOFAIL(strdup(spec)), *item, *saveptr = NULL;
+    int res = 0;
+
+    config->rate = 10000;
+    config->size = 512;
+    config->count = 100000;
+    config->bandwidth = 0;
+    config->latency = 1000000;
+    config->loss = 0;
+    config->rto = 0;                       // one round trip, see simnet_setup()
+    config->rcvbuf = 212992;               // default net.core.rmem_default
+    config->sndbuf = 4194304;
+    config->seed = 1;
+
+    for (item = strtok_r(copy, ",", &saveptr); item && res == 0; item = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(item, '=');
+		double v;
+
+		if (!value) {
+			res = -1;
+			break;
+		}
+		*value++ = '\0';
+
+		if (strcasecmp(item, "latency") == 0) {
+			if ((res = parse_value(value, 1, SIM_MAX_DELAY, &v)) == 0)
+				config->latency = v;
+		} else if (strcasecmp(item, "rto") == 0) {
+			if ((res = parse_value(value, 1, SIM_MAX_DELAY, &v)) == 0)
+				config->rto = v;
+		} else if (strcasecmp(item, "rate") == 0) {
+			if ((res = parse_value(value, 0, SIM_MAX_RATE, &v)) == 0)
+				config->rate = v;
+		} else if (strcasecmp(item, "size") == 0) {
+			if ((res = parse_value(value, 0, UDPTUNNEL_MAX_PAYLOAD, &v)) == 0)
+				config->size = v;
+		} else if (strcasecmp(item, "count") == 0) {
+			if ((res = parse_value(value, 0, SIM_MAX_COUNT, &v)) == 0)
+				config->count = v;
+		} else if (strcasecmp(item, "bw") == 0) {
+			if ((res = parse_value(value, 0, SIM_MAX_BANDWIDTH, &v)) == 0)
+				config->bandwidth = v;
+		} else if (strcasecmp(item, "loss") == 0) {
+			if ((res = parse_value(value, 0, 1, &v)) == 0)
+				config->loss = v;
+		} else if (strcasecmp(item, "rcvbuf") == 0) {
+			if ((res = parse_value(value, 0, INT32_MAX, &v)) == 0)
+				config->rcvbuf = v;
+		} else if (strcasecmp(item, "sndbuf") == 0) {
+			if ((res = parse_value(value, 0, INT32_MAX, &v)) == 0)
+				config->sndbuf = v;
+		} else if (strcasecmp(item, "seed") == 0) {
+			if ((res = parse_value(value, 0, SIM_MAX_SEED, &v)) == 0)
+				config->seed = v;
+		} else {
+			res = -1;
+		}
+    }
+    free(copy);
+
+    if (config->rate == 0 || config->count == 0 || config->loss >= 1 ||
+		config->size < PROBE_SIZE || config->size > UDPTUNNEL_MAX_PAYLOAD)
+		res = -1;
+
+    return res;
+}
+
+/**
+ * Creates the simulated sockets and makes io_simnet the current backend.
+ *
+ * @param config (const struct simnet_config*) - Simulation parameters
+ * @param handshake (const char*) - Handshake expected by the remote end
+ * @param udp_sock (int*) - Output UDP socket of the relay
+ * @param tcp_sock (int*) - Output TCP socket of the relay, already connected
+ *
+ * @return void - exits program on errors
+ */
+void simnet_setup(const struct simnet_config *config, const char *handshake, int *udp_sock, int *tcp_sock)
+{
+    struct udptunnel_config server_config;
+    int res;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.config = *config;
+    sim.rng = config->seed ? config->seed : 1;
+    if (!sim.config.rto)
+		sim.config.rto = 2 * sim.config.latency;
+
+    /* real descriptors reserve the numbers, so they cannot clash with other files */
+    if ((sim.udp_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0 ||
+		(sim.tcp_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+		err_sys("open(/dev/null)");
+    if (sim.udp_fd >= FD_SETSIZE || sim.tcp_fd >= FD_SETSIZE)
+		log_printf_exit(2, log_err, "simnet: descriptor too large for select()");
+
+    memset(&server_config, 0, sizeof(server_config));
+    server_config.handshake = handshake;
+    server_config.expect_handshake = 1;
+    if ((res = udptunnel_new(&sim.server, &server_config, NULL)) < 0)
+		log_printf_exit(1, log_err, "simnet: %s", udptunnel_strerror(res));
+
+    *udp_sock = sim.udp_fd;
+    *tcp_sock = sim.tcp_fd;
+    io = &io_simnet;
+
+    atexit(simnet_report);
+    sim.start = real_ns();
+}
@@ -0,0 +1,47 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SIMNET_H__
+    #define __SIMNET_H__
+
+    #include <stdint.h>
+
+    #include "io.h"
+
+    /**
+     * Parameters of a simulation run. Times are in nanoseconds of virtual time.
+     */
+    struct simnet_config {
+        uint64_t rate;                     // UDP packets generated per second
+        uint32_t size;                     // UDP payload size
+        uint64_t count;                    // Number of UDP packets generated
+        uint64_t bandwidth;                // Tunnel link bandwidth in bit/s in each direction, 0 = unlimited
+        uint64_t latency;                  // One-way tunnel link latency
+        double loss;                       // Probability that a TCP segment needs a retransmission
+        uint64_t rto;                      // Delay added by a retransmission, 0 = one round trip
+        uint32_t rcvbuf;                   // UDP receive buffer of the relay, in bytes
+        uint32_t sndbuf;                   // TCP send buffer of the relay, in bytes
+        uint64_t seed;                     // Seed of the loss generator
+    };
+
+    /* the simulated network, selected by simnet_setup() */
+    extern const struct io_ops io_simnet;
+
+    int simnet_parse(const char *spec, struct simnet_config *config);
+
+    void simnet_setup(const struct simnet_config *config, const char *handshake, int *udp_sock, int *tcp_sock);
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * KCM Library - Frame delineation of the tunnel stream by the kernel
+ *
+ * Attaches the TCP connection to an AF_KCM (Kernel Connection Multiplexor)
+ * socket, whose stream parser splits the [2-byte length][payload] frames
+ * with a tiny BPF program. Each frame is then received as one message, so
+ * the process neither reassembles the stream nor moves the partial frames
+ * left at the end of each read.
+ *
+ * Components:
+ * - A BPF socket filter program, assembled here and loaded with bpf(2),
+ *   which returns the length of the frame starting at the head of the
+ *   stream: the big-endian prefix plus its own 2 bytes.
+ * - A KCM socket with the TCP connection attached through SIOCKCMATTACH.
+ *   Once attached, the connection must only be used through the KCM socket:
+ *   frames are written to it as messages and read from it with recvmmsg().
+ *
+ * The stream must be at a frame boundary when the connection is attached,
+ * since the parser starts at the head of its receive queue. When AF_KCM is
+ * not available kcm_attach() returns NULL and the caller keeps parsing the
+ * stream itself.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for syscall() and recvmmsg()...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "kcm.h"
+#include "../relay/relay.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/kcm.h>) && __has_include(<linux/bpf.h>)
+#define HAVE_AF_KCM
+#endif
+#endif
+
+#ifdef HAVE_AF_KCM
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/kcm.h>
+#include <linux/bpf.h>
+
+#ifndef AF_KCM
+#define AF_KCM 41
+#endif
+
+/* largest frame: a 16-bit length and its prefix */
+#define KCM_FRAME_SIZE (UDPTUNNEL_HEADER_SIZE + 65535)
+
+/**
+ * KCM socket attached to the TCP connection, with the receive buffers of a
+ * batch of frames.
+ */
+struct kcm_mux {
+    int fd;                        // KCM socket
+    int prog_fd;                   // Frame length parser
+    char *buf;                     // KCM_BATCH_SIZE slots of KCM_FRAME_SIZE bytes
+    struct mmsghdr msgs[KCM_BATCH_SIZE];
+    struct iovec iov[KCM_BATCH_SIZE];
+};
+
+/*
+ * Minimal eBPF assembler: only the instruction forms used by the parser
+ * program below.
+ */
+#define BPF_INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)          BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define ADD64_IMM(d, i)          BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define LD_ABS(sz, o)            BPF_INSN(BPF_LD | (sz) | BPF_ABS, 0, 0, 0, o)
+#define EXIT()                   BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Loads the program which returns the length of the next frame.
+ * LD_ABS converts the prefix to host byte order, and ends the program with
+ * 0 (more data needed) when fewer than 2 bytes were received.
+ *
+ * @return int - Program file descriptor, or -1 with errno set
+ */
+static int load_parser_prog(void)
+{
+    struct bpf_insn prog[] = {
+		MOV64_REG(BPF_REG_6, BPF_REG_1),                               // LD_ABS expects the skb in r6
+		LD_ABS(BPF_H, 0),                                              // r0 = frame length prefix
+		ADD64_IMM(BPF_REG_0, UDPTUNNEL_HEADER_SIZE),
+		EXIT(),
+    };
+    static char verifier_log[4096];
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uintptr_t) prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uintptr_t) "GPL";
+    attr.log_buf = (uintptr_t) verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && verifier_log[0])
+		log_printf(log_debug, "KCM parser verifier log:\n%s", verifier_log);
+    return fd;
+}
+
+/**
+ * Attaches a TCP connection to a new KCM socket. The connection must be at
+ * a frame boundary, with no partial frame already read from it.
+ *
+ * @param tcp_fd (int) - Connected TCP socket
+ *
+ * @return struct kcm_mux* - New multiplexor, or NULL with errno set if AF_KCM
+ *                           or BPF are not available
+ */
+struct kcm_mux *kcm_attach(int tcp_fd)
+{
+    struct kcm_mux *mux = NOFAIL(calloc(1, sizeof(*mux)));
+    struct kcm_attach attach;
+    int i, saved_errno;
+
+    mux->prog_fd = -1;
+    if ((mux->fd = socket(AF_KCM, SOCK_DGRAM, KCMPROTO_CONNECTED)) < 0)
+		goto fail;
+    if ((mux->prog_fd = load_parser_prog()) < 0)
+		goto fail;
+
+    memset(&attach, 0, sizeof(attach));
+    attach.fd = tcp_fd;
+    attach.bpf_fd = mux->prog_fd;
+    if (ioctl(mux->fd, SIOCKCMATTACH, &attach) < 0)
+		goto fail;
+
+    mux->buf = NOFAIL(malloc((size_t) KCM_BATCH_SIZE * KCM_FRAME_SIZE));
+    for (i = 0; i < KCM_BATCH_SIZE; i++) {
+		mux->iov[i].iov_base = mux->buf + (size_t) i * KCM_FRAME_SIZE;
+		mux->iov[i].iov_len = KCM_FRAME_SIZE;
+		mux->msgs[i].msg_hdr.msg_iov = &mux->iov[i];
+		mux->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return mux;
+
+fail:
+    saved_errno = errno;
+    if (mux->prog_fd >= 0)
+		close(mux->prog_fd);
+    if (mux->fd >= 0)
+		close(mux->fd);
+    free(mux);
+    errno = saved_errno;
+    return NULL;
+}
+
+/**
+ * Returns the KCM socket, which is readable when frames are available and
+ * which takes the frames to send.
+ */
+int kcm_fd(const struct kcm_mux *mux)
+{
+    return mux->fd;
+}
+
+/**
+ * Receives the frames already parsed by the kernel, without waiting.
+ * Every frame is checked against its own length prefix: a mismatch means
+ * that the parser lost the frame boundaries.
+ *
+ * @param mux (struct kcm_mux*) - Multiplexor
+ * @param frames (struct kcm_frame*) - Output array of frames
+ * @param max (int) - Size of frames, at most KCM_BATCH_SIZE
+ *
+ * @return int - Number of frames, 0 if none is available, or -1 with errno
+ *               set (EPROTO for a malformed frame)
+ */
+int kcm_recv(struct kcm_mux *mux, struct kcm_frame *frames, int max)
+{
+    int n, i;
+
+    if (max > KCM_BATCH_SIZE)
+		max = KCM_BATCH_SIZE;
+
+    n = recvmmsg(mux->fd, mux->msgs, max, MSG_DONTWAIT, NULL);
+    if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    for (i = 0; i < n; i++) {
+		const unsigned char *frame = mux->iov[i].iov_base;
+		size_t len = mux->msgs[i].msg_len;
+
+		if (len < UDPTUNNEL_HEADER_SIZE || (mux->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+			((frame[0] << 8) | frame[1]) != len - UDPTUNNEL_HEADER_SIZE) {
+			errno = EPROTO;
+			return -1;
+		}
+		frames[i].payload = (const char *) frame + UDPTUNNEL_HEADER_SIZE;
+		frames[i].length = len - UDPTUNNEL_HEADER_SIZE;
+    }
+    return n;
+}
+
+/**
+ * Closes the KCM socket, which detaches the TCP connection. The connection
+ * itself is left open.
+ *
+ * @param mux (struct kcm_mux*) - Multiplexor, may be NULL
+ */
+void kcm_close(struct kcm_mux *mux)
+{
+    if (!mux)
+		return;
+    close(mux->fd);
+    close(mux->prog_fd);
+    free(mux->buf);
+    free(mux);
+}
+
+#else
+
+struct kcm_mux *kcm_attach(int tcp_fd)
+{
+    errno = EAFNOSUPPORT;
+    return NULL;
+}
+
+int kcm_fd(const struct kcm_mux *mux)
+{
+    return -1;
+}
+
+int kcm_recv(struct kcm_mux *mux, struct kcm_frame *frames, int max)
+{
+    return 0;
+}
+
+void kcm_close(struct kcm_mux *mux)
+{
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __KCM_H__
+    #define __KCM_H__
+
+    #include <stddef.h>
+
+    /* maximum number of frames returned by a single kcm_recv() call */
+    #define KCM_BATCH_SIZE 16
+
+    /**
+     * A frame of the tunnel stream delivered whole by the kernel. The payload
+     * stays valid until the next kcm_recv() call.
+     */
+    struct kcm_frame {
+        const char *payload;           // UDP payload, after the length prefix
+        size_t length;                 // UDP payload length
+    };
+
+    struct kcm_mux;
+
+    struct kcm_mux *kcm_attach(int tcp_fd);
+
+    int kcm_fd(const struct kcm_mux *mux);
+
+    int kcm_recv(struct kcm_mux *mux, struct kcm_frame *frames, int max);
+
+    void kcm_close(struct kcm_mux *mux);
+
+#endif
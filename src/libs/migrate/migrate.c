@@ -0,0 +1,500 @@
+/*
+ * Migrate Library - Moving a live TCP connection to another host
+ *
+ * A tunnel is taken over by another server without the client noticing:
+ * the kernel state of its TCP connection is read with TCP_REPAIR, sent to
+ * the other server with the state of the relay, and loaded there into a new
+ * socket bound to the same addresses. Once the address of the server is
+ * routed to the other host, the retransmissions of the client reach the new
+ * socket and the connection goes on.
+ *
+ * Components:
+ * - Freezing: a classic BPF filter dropping every segment is attached to the
+ *   socket before it enters the repair mode, so that nothing received after
+ *   the dump is acknowledged by the old host. The client retransmits it.
+ * - Dump: addresses, sequence numbers, negotiated options, window and the
+ *   data of both queues. The sent part of the send queue is restored as
+ *   already sent and retransmitted by the new socket when needed, the part
+ *   not sent yet is written again normally.
+ * - Transfer: a header with the handshake of the tunnels, which the other
+ *   server checks, the freezing time and the two states.
+ *
+ * The state is in the byte order of the host: the servers exchanging tunnels
+ * run the same build. TCP_REPAIR needs CAP_NET_ADMIN.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for the TCP_REPAIR definitions of netinet/tcp.h...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <linux/sockios.h>
+
+#include "migrate.h"
+#include "../relay/relay.h"
+#include "../utils/utils.h"
+
+#define STATE_MAGIC 0x55544d43     // "UTMC", connection state
+#define WIRE_MAGIC 0x55544d57      // "UTMW", message header
+
+/* connection state, followed by the send queue then the receive queue */
+struct tcp_state {
+    uint32_t magic;
+    struct sockaddr_storage local, remote;
+    uint32_t snd_seq;              // Sequence number after the send queue
+    uint32_t rcv_seq;              // Sequence number after the receive queue
+    uint32_t outq_len;             // Bytes of the send queue
+    uint32_t notsent_len;          // Bytes at the end of the send queue never sent
+    uint32_t inq_len;              // Bytes of the receive queue
+    uint32_t mss;
+    uint32_t timestamp;            // Current TSval, if timestamps were negotiated
+    uint8_t options;               // TCPI_OPT_* flags
+    uint8_t snd_wscale, rcv_wscale;
+    struct tcp_repair_window window;
+};
+
+struct wire_header {
+    uint32_t magic;
+    char handshake[UDPTUNNEL_HANDSHAKE_SIZE];
+    int64_t frozen;
+    uint32_t tcp_len, relay_len;
+};
+
+/**
+ * Current time, comparable between the hosts as far as their clocks are
+ * synchronized.
+ *
+ * @return long long - CLOCK_REALTIME milliseconds
+ */
+long long migrate_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_int(int fd, int level, int name, int value)
+{
+    return setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+static int get_int(int fd, int level, int name, int *value)
+{
+    socklen_t len = sizeof(*value);
+
+    return getsockopt(fd, level, name, value, &len);
+}
+
+/**
+ * Stops the connection: the segments received are dropped before TCP sees
+ * them, and the socket enters the repair mode, where it sends nothing.
+ *
+ * @param fd (int) - Connected TCP socket
+ *
+ * @return int - 0 on success, -1 with errno set, the socket being left as it was
+ */
+int migrate_freeze(int fd)
+{
+    struct sock_filter drop_all[] = {
+		BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { .len = 1, .filter = drop_all };
+    int saved_errno;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+		return -1;
+    if (set_int(fd, IPPROTO_TCP, TCP_REPAIR, TCP_REPAIR_ON) < 0) {
+		saved_errno = errno;
+		setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+		errno = saved_errno;
+		return -1;
+    }
+    return 0;
+}
+
+/**
+ * Resumes a connection frozen by migrate_freeze(), after a failed migration.
+ * The peer retransmits what was dropped in the meantime.
+ *
+ * @param fd (int) - Frozen TCP socket
+ *
+ * @return void
+ */
+void migrate_thaw(int fd)
+{
+    set_int(fd, IPPROTO_TCP, TCP_REPAIR, TCP_REPAIR_OFF);
+    setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+}
+
+/* the sequence number after the queue selected */
+static int queue_seq(int fd, int queue, uint32_t *seq)
+{
+    int value;
+
+    if (set_int(fd, IPPROTO_TCP, TCP_REPAIR_QUEUE, queue) < 0 || get_int(fd, IPPROTO_TCP, TCP_QUEUE_SEQ, &value) < 0)
+		return -1;
+    *seq = value;
+    return 0;
+}
+
+/* copies the data of a queue, which is left as it is */
+static int peek_queue(int fd, int queue, char *buf, size_t len)
+{
+    ssize_t res;
+
+    if (!len)
+		return 0;
+    if (set_int(fd, IPPROTO_TCP, TCP_REPAIR_QUEUE, queue) < 0)
+		return -1;
+    res = recv(fd, buf, len, MSG_PEEK | MSG_DONTWAIT);
+    if (res < 0)
+		return -1;
+    if ((size_t) res != len) {
+		errno = EAGAIN;
+		return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the state of a frozen connection.
+ *
+ * @param fd (int) - TCP socket frozen by migrate_freeze()
+ * @param len (size_t*) - Output length of the state
+ *
+ * @return char* - State to free(), or NULL with errno set
+ */
+char *migrate_dump(int fd, size_t *len)
+{
+    struct tcp_state st;
+    struct tcp_info info;
+    socklen_t optlen;
+    int outq, notsent, inq, value;
+    char *state;
+
+    memset(&st, 0, sizeof(st));
+    st.magic = STATE_MAGIC;
+    optlen = sizeof(st.local);
+    if (getsockname(fd, (struct sockaddr *) &st.local, &optlen) < 0)
+		return NULL;
+    optlen = sizeof(st.remote);
+    if (getpeername(fd, (struct sockaddr *) &st.remote, &optlen) < 0)
+		return NULL;
+
+    if (ioctl(fd, SIOCOUTQ, &outq) < 0 || ioctl(fd, SIOCOUTQNSD, &notsent) < 0 || ioctl(fd, SIOCINQ, &inq) < 0)
+		return NULL;
+    st.outq_len = outq;
+    st.notsent_len = notsent;
+    st.inq_len = inq;
+    if (queue_seq(fd, TCP_SEND_QUEUE, &st.snd_seq) < 0 || queue_seq(fd, TCP_RECV_QUEUE, &st.rcv_seq) < 0)
+		return NULL;
+
+    optlen = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &optlen) < 0)
+		return NULL;
+    st.options = info.tcpi_options;
+    st.snd_wscale = info.tcpi_snd_wscale;
+    st.rcv_wscale = info.tcpi_rcv_wscale;
+    if (get_int(fd, IPPROTO_TCP, TCP_MAXSEG, &value) < 0)
+		return NULL;
+    st.mss = value;
+    if (st.options & TCPI_OPT_TIMESTAMPS) {
+		if (get_int(fd, IPPROTO_TCP, TCP_TIMESTAMP, &value) < 0)
+			return NULL;
+		st.timestamp = value;
+    }
+    optlen = sizeof(st.window);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_REPAIR_WINDOW, &st.window, &optlen) < 0)
+		return NULL;
+
+    state = NOFAIL(malloc(sizeof(st) + st.outq_len + st.inq_len));
+    memcpy(state, &st, sizeof(st));
+    if (peek_queue(fd, TCP_SEND_QUEUE, state + sizeof(st), st.outq_len) < 0 ||
+		peek_queue(fd, TCP_RECV_QUEUE, state + sizeof(st) + st.outq_len, st.inq_len) < 0) {
+		int saved_errno = errno;
+
+		free(state);
+		errno = saved_errno;
+		return NULL;
+    }
+    *len = sizeof(st) + st.outq_len + st.inq_len;
+    return state;
+}
+
+/* writes data which the socket may split */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while (len) {
+		if ((res = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += res;
+		len -= res;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t res;
+
+    while (len) {
+		if ((res = recv(fd, p, len, 0)) <= 0) {
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (!res)
+				errno = ECONNRESET;
+			return -1;
+		}
+		p += res;
+		len -= res;
+    }
+    return 0;
+}
+
+/* fills a queue of a socket in repair mode */
+static int fill_queue(int fd, int queue, const char *data, size_t len)
+{
+    if (!len)
+		return 0;
+    if (set_int(fd, IPPROTO_TCP, TCP_REPAIR_QUEUE, queue) < 0)
+		return -1;
+    return write_all(fd, data, len);
+}
+
+/* whether a listener is bound to the address, or to the wildcard address of its port */
+static int is_listened(const struct sockaddr_storage *addr, const struct sockaddr_storage listeners[], int n)
+{
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *) addr;
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) addr;
+    int i;
+
+    for (i = 0; i < n; i++) {
+		const struct sockaddr_in *l4 = (const struct sockaddr_in *) &listeners[i];
+		const struct sockaddr_in6 *l6 = (const struct sockaddr_in6 *) &listeners[i];
+
+		if (listeners[i].ss_family != addr->ss_family)
+			continue;
+		if (addr->ss_family == AF_INET && l4->sin_port == a4->sin_port &&
+			(l4->sin_addr.s_addr == htonl(INADDR_ANY) || l4->sin_addr.s_addr == a4->sin_addr.s_addr))
+			return 1;
+		if (addr->ss_family == AF_INET6 && l6->sin6_port == a6->sin6_port &&
+			(IN6_IS_ADDR_UNSPECIFIED(&l6->sin6_addr) || IN6_ARE_ADDR_EQUAL(&l6->sin6_addr, &a6->sin6_addr)))
+			return 1;
+    }
+    return 0;
+}
+
+/**
+ * Creates a socket with the state of a connection dumped on another host.
+ * The local address may not be configured on this host yet, hence the
+ * transparent socket: the connection only receives segments once the address
+ * is routed here. It must be the address of one of the listeners of the
+ * tunnels, or a migration could make this host send data from any address.
+ *
+ * @param state (const char*) - State from migrate_dump()
+ * @param len (size_t) - Length of state
+ * @param listeners (const struct sockaddr_storage[]) - Addresses of the listeners of the tunnels
+ * @param nlisteners (int) - Number of listeners
+ * @param peer (struct sockaddr_storage*) - Output address of the peer
+ *
+ * @return int - Connected TCP socket, or -1 with errno set (EINVAL for a state not valid,
+ *               EADDRNOTAVAIL for a local address which is not listened to)
+ */
+int migrate_restore(const char *state, size_t len, const struct sockaddr_storage listeners[], int nlisteners,
+	struct sockaddr_storage *peer)
+{
+    struct tcp_state st;
+    struct tcp_repair_opt opts[4];
+    const char *outq, *inq;
+    int fd, nopts = 0, saved_errno;
+
+    if (len < sizeof(st)) {
+		errno = EINVAL;
+		return -1;
+    }
+    memcpy(&st, state, sizeof(st));
+    if (st.magic != STATE_MAGIC || len != sizeof(st) + (size_t) st.outq_len + st.inq_len ||
+		st.notsent_len > st.outq_len || (st.local.ss_family != AF_INET && st.local.ss_family != AF_INET6) ||
+		st.remote.ss_family != st.local.ss_family) {
+		errno = EINVAL;
+		return -1;
+    }
+    if (!is_listened(&st.local, listeners, nlisteners)) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+    }
+    outq = state + sizeof(st);
+    inq = outq + st.outq_len;
+
+    if ((fd = socket(st.local.ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		return -1;
+    /* the repair mode lets the socket bind to the port of the listeners */
+    if (set_int(fd, IPPROTO_TCP, TCP_REPAIR, TCP_REPAIR_ON) < 0)
+		goto fail;
+    /* the address may not be configured here yet: bind and route from it anyway */
+    if (set_int(fd, st.local.ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP,
+		st.local.ss_family == AF_INET6 ? IPV6_TRANSPARENT : IP_TRANSPARENT, 1) < 0)
+		goto fail;
+    if (bind(fd, (struct sockaddr *) &st.local, sizeof(st.local)) < 0)
+		goto fail;
+
+    /* the queues are filled again below, which moves the sequence numbers to their ends */
+    if (set_int(fd, IPPROTO_TCP, TCP_REPAIR_QUEUE, TCP_SEND_QUEUE) < 0 ||
+		set_int(fd, IPPROTO_TCP, TCP_QUEUE_SEQ, st.snd_seq - st.outq_len) < 0 ||
+		set_int(fd, IPPROTO_TCP, TCP_REPAIR_QUEUE, TCP_RECV_QUEUE) < 0 ||
+		set_int(fd, IPPROTO_TCP, TCP_QUEUE_SEQ, st.rcv_seq - st.inq_len) < 0)
+		goto fail;
+
+    /* established at once, without any segment */
+    if (connect(fd, (struct sockaddr *) &st.remote, sizeof(st.remote)) < 0)
+		goto fail;
+
+    opts[nopts].opt_code = TCPOPT_MAXSEG;
+    opts[nopts++].opt_val = st.mss;
+    if (st.options & TCPI_OPT_WSCALE) {
+		opts[nopts].opt_code = TCPOPT_WINDOW;
+		opts[nopts++].opt_val = st.snd_wscale | (st.rcv_wscale << 16);
+    }
+    if (st.options & TCPI_OPT_SACK) {
+		opts[nopts].opt_code = TCPOPT_SACK_PERMITTED;
+		opts[nopts++].opt_val = 0;
+    }
+    if (st.options & TCPI_OPT_TIMESTAMPS) {
+		opts[nopts].opt_code = TCPOPT_TIMESTAMP;
+		opts[nopts++].opt_val = 0;
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_REPAIR_OPTIONS, opts, nopts * sizeof(opts[0])) < 0)
+		goto fail;
+    if ((st.options & TCPI_OPT_TIMESTAMPS) && set_int(fd, IPPROTO_TCP, TCP_TIMESTAMP, st.timestamp) < 0)
+		goto fail;
+
+    if (fill_queue(fd, TCP_RECV_QUEUE, inq, st.inq_len) < 0 ||
+		fill_queue(fd, TCP_SEND_QUEUE, outq, st.outq_len - st.notsent_len) < 0)
+		goto fail;
+    /* checked against the receive queue, which must be restored first */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_REPAIR_WINDOW, &st.window, sizeof(st.window)) < 0)
+		goto fail;
+
+    if (set_int(fd, IPPROTO_TCP, TCP_REPAIR, TCP_REPAIR_OFF) < 0)
+		goto fail;
+    if (write_all(fd, outq + st.outq_len - st.notsent_len, st.notsent_len) < 0)
+		goto fail;
+
+    *peer = st.remote;
+    return fd;
+
+fail:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+/**
+ * Sends the state of a tunnel to the server taking it over.
+ *
+ * @param conn (int) - Connection to the other server
+ * @param handshake (const char*) - Handshake of the tunnels, UDPTUNNEL_HANDSHAKE_SIZE bytes
+ * @param msg (const struct migrate_message*) - State to send
+ *
+ * @return int - 0 on success, -1 with errno set
+ */
+int migrate_send(int conn, const char *handshake, const struct migrate_message *msg)
+{
+    struct wire_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = WIRE_MAGIC;
+    memcpy(hdr.handshake, handshake, sizeof(hdr.handshake));
+    hdr.frozen = msg->frozen;
+    hdr.tcp_len = msg->tcp_len;
+    hdr.relay_len = msg->relay_len;
+
+    if (write_all(conn, (const char *) &hdr, sizeof(hdr)) < 0 || write_all(conn, msg->tcp, msg->tcp_len) < 0 ||
+		write_all(conn, msg->relay, msg->relay_len) < 0)
+		return -1;
+    return 0;
+}
+
+/**
+ * Receives the state of a tunnel sent by migrate_send(). Only the servers
+ * knowing the handshake of the tunnels may send one.
+ *
+ * @param conn (int) - Connection from the other server, with a receive timeout
+ * @param handshake (const char*) - Handshake of the tunnels, UDPTUNNEL_HANDSHAKE_SIZE bytes
+ * @param msg (struct migrate_message*) - Output state, to release with migrate_free()
+ *
+ * @return int - 0 on success, -1 with errno set (EACCES for a wrong handshake,
+ *               EPROTO for a message not valid)
+ */
+int migrate_receive(int conn, const char *handshake, struct migrate_message *msg)
+{
+    struct wire_header hdr;
+
+    memset(msg, 0, sizeof(*msg));
+    if (read_all(conn, &hdr, sizeof(hdr)) < 0)
+		return -1;
+    if (hdr.magic != WIRE_MAGIC || hdr.tcp_len > MIGRATE_MAX_STATE || hdr.relay_len > MIGRATE_MAX_STATE) {
+		errno = EPROTO;
+		return -1;
+    }
+    if (memcmp(hdr.handshake, handshake, sizeof(hdr.handshake)) != 0) {
+		errno = EACCES;
+		return -1;
+    }
+
+    msg->frozen = hdr.frozen;
+    msg->tcp_len = hdr.tcp_len;
+    msg->relay_len = hdr.relay_len;
+    msg->tcp = NOFAIL(malloc(msg->tcp_len + msg->relay_len + 1));
+    msg->relay = msg->tcp + msg->tcp_len;
+    if (read_all(conn, msg->tcp, msg->tcp_len + msg->relay_len) < 0) {
+		migrate_free(msg);
+		return -1;
+    }
+    return 0;
+}
+
+/**
+ * Releases a state received by migrate_receive().
+ *
+ * @param msg (struct migrate_message*) - State, may have been released already
+ *
+ * @return void
+ */
+void migrate_free(struct migrate_message *msg)
+{
+    free(msg->tcp);
+    memset(msg, 0, sizeof(*msg));
+}
@@ -0,0 +1,54 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __MIGRATE_H__
+    #define __MIGRATE_H__
+
+    #include <stddef.h>
+    #include <sys/socket.h>
+
+    /* largest state accepted from another server: the queues follow the socket buffers */
+    #define MIGRATE_MAX_STATE (64 * 1024 * 1024)
+
+    /**
+     * What a server sends to take over one of its tunnels.
+     */
+    struct migrate_message {
+        long long frozen;              // CLOCK_REALTIME ms when the connection was frozen
+        char *tcp;                     // Connection state from migrate_dump()
+        size_t tcp_len;
+        char *relay;                   // State of the relay, opaque to this library
+        size_t relay_len;
+    };
+
+    long long migrate_clock(void);
+
+    int migrate_freeze(int fd);
+
+    void migrate_thaw(int fd);
+
+    char *migrate_dump(int fd, size_t *len);
+
+    int migrate_restore(const char *state, size_t len, const struct sockaddr_storage listeners[], int nlisteners,
+        struct sockaddr_storage *peer);
+
+    int migrate_send(int conn, const char *handshake, const struct migrate_message *msg);
+
+    int migrate_receive(int conn, const char *handshake, struct migrate_message *msg);
+
+    void migrate_free(struct migrate_message *msg);
+
+#endif
@@ -9,7 +9,11 @@
  * - print_addr_port(): Format socket addresses for logging and display
  * - udp_listener()/tcp_listener(): Create listening sockets with address resolution
  * - udp_client()/tcp_client(): Create client connections with automatic retry
- * - accept_connections(): Multi-socket connection acceptance with process forking
+ *   (udp_client() also accepts "unixgram:/path" for local AF_UNIX datagram delivery)
+ * - vsock:CID:PORT addresses for the stream side, for VM-to-host tunnels
+ *   without a virtual NIC and TCP/IP in the path
+ * - accept_connections(): Multi-socket connection acceptance with process forking,
+ *   after the handshake has been checked and health probes have been answered
  * 
  * Dependencies: POSIX sockets, getaddrinfo/getnameinfo for address resolution
  * 
@@ -39,15 +43,48 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/vm_sockets.h>
+#endif
 
 #include "network.h"
 #include "../utils/utils.h"
 #include "../log/log.h"
+#include "../io/io.h"
+
+#define ACCEPT_MAX_PENDING 64      // Connections waiting for their handshake
+#define TCP_DEFER_SECONDS 5        // How long the kernel holds a connection which sent no data
+
+/* a connection accepted but not forked yet */
+struct pending_conn {
+    int fd;                        // -1 if the slot is free
+    size_t len;                    // Bytes received so far
+    long long deadline;            // CLOCK_MONOTONIC time in ms when the connection is dropped
+    struct sockaddr_storage addr;  // Peer address, for the logs
+    socklen_t addrlen;
+    char buf[64 + ADMISSION_MAX_SESSION]; // Start of the stream, long enough for any handshake and session record
+    int session;                   // 1 if a session record follows the handshake
+};
+
+static struct pending_conn pending[ACCEPT_MAX_PENDING];
+static int pending_initialized;
+
+/* requests of the HTTP health checks of the load balancers */
+static const char *const probe_methods[] = { "GET ", "HEAD ", "OPTIONS " };
+
+static const char probe_reply[] =
+    "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 3\r\nConnection: close\r\n\r\nOK\n";
 
 /**
  * Formats a socket address into a human-readable string with address and port.
@@ -66,6 +103,32 @@ char *print_addr_port(const struct sockaddr *addr, socklen_t addrlen)
     static char buf[1100], address[1025], port[32];	// Static buffers for thread-unsafe but simple usage
     int err;
 
+    /*
+     * AF_UNIX peers have no host/port: print the path, an "@" prefix for
+     * abstract names (leading NUL byte) or "unnamed" for unbound sockets.
+     */
+    if (addr->sa_family == AF_UNIX) {
+		const struct sockaddr_un *sun = (const struct sockaddr_un *) addr;
+		int len = addrlen - offsetof(struct sockaddr_un, sun_path);
+
+		if (len <= 0)
+			snprintf(buf, sizeof(buf) - 1, "unixgram:(unnamed)");
+		else if (sun->sun_path[0] == '\0')
+			snprintf(buf, sizeof(buf) - 1, "unixgram:@%.*s", len - 1, sun->sun_path + 1);
+		else
+			snprintf(buf, sizeof(buf) - 1, "unixgram:%.*s", len, sun->sun_path);
+		return buf;
+    }
+
+#ifdef AF_VSOCK
+    if (addr->sa_family == AF_VSOCK) {
+		const struct sockaddr_vm *svm = (const struct sockaddr_vm *) addr;
+
+		snprintf(buf, sizeof(buf) - 1, "vsock:%u:%u", svm->svm_cid, svm->svm_port);
+		return buf;
+    }
+#endif
+
     /*
      * Convert binary socket address to human-readable strings.
      * NI_NUMERICHOST | NI_NUMERICSERV forces numeric output instead of
@@ -73,9 +136,9 @@ char *print_addr_port(const struct sockaddr *addr, socklen_t addrlen)
      */
     err = getnameinfo(addr, addrlen, address, sizeof(address), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
     if (err == EAI_SYSTEM)
-		  err_sys("getnameinfo");			// System error (errno set)
+		err_sys("getnameinfo");			// System error (errno set)
     else if (err)
-		  log_printf_exit(1, log_err, "getnameinfo: %s", gai_strerror(err));	// GAI error
+		log_printf_exit(1, log_err, "getnameinfo: %s", gai_strerror(err));	// GAI error
 
     /*
      * Format according to standard conventions:
@@ -83,13 +146,41 @@ char *print_addr_port(const struct sockaddr *addr, socklen_t addrlen)
      * IPv4: address:port (no brackets needed)
      */
     if (addr->sa_family == AF_INET6)
-		  snprintf(buf, sizeof(buf) - 1, "[%s]:%s", address, port);
+		snprintf(buf, sizeof(buf) - 1, "[%s]:%s", address, port);
     else
-		  snprintf(buf, sizeof(buf) - 1, "%s:%s", address, port);
+		snprintf(buf, sizeof(buf) - 1, "%s:%s", address, port);
 
     return buf;							// Return pointer to static buffer - caller must not free
 }
 
+/**
+ * Returns the length of a socket address as expected by sendto()/connect().
+ * IP addresses have a fixed size per family, while AF_UNIX addresses must
+ * not be passed with trailing bytes beyond struct sockaddr_un.
+ *
+ * @param addr (const struct sockaddr*) - Socket address to measure
+ *
+ * @return socklen_t - Number of significant bytes in the address
+ */
+socklen_t addr_len(const struct sockaddr *addr)
+{
+    const struct sockaddr_un *sun = (const struct sockaddr_un *) addr;
+
+    switch (addr->sa_family) {
+		case AF_INET:
+			return sizeof(struct sockaddr_in);
+		case AF_INET6:
+			return sizeof(struct sockaddr_in6);
+		case AF_UNIX:
+			/* a path filling sun_path completely has no terminating NUL */
+			if (strnlen(sun->sun_path, sizeof(sun->sun_path)) == sizeof(sun->sun_path))
+				return sizeof(struct sockaddr_un);
+			return offsetof(struct sockaddr_un, sun_path) + strlen(sun->sun_path) + 1;
+		default:
+			return sizeof(struct sockaddr_storage);
+    }
+}
+
 /*
  * Convenience wrapper to format addrinfo structure addresses.
  * Used internally for logging resolved addresses during socket operations.
@@ -183,6 +274,140 @@ static void parse_address_port(const char *input, char **address, char **port)
   }
 }
 
+/**
+ * Checks whether an address specification uses the vsock: scheme.
+ *
+ * @param s (const char*) - Address specification string
+ *
+ * @return int - 1 if the address is a vsock address, 0 otherwise
+ */
+static int is_vsock_address(const char *s)
+{
+    return strncmp(s, "vsock:", 6) == 0;
+}
+
+#ifdef AF_VSOCK
+/**
+ * Parses a "vsock:CID:PORT" or "vsock:PORT" address specification.
+ * The CID can be a number or one of the symbolic names "any", "local" and
+ * "host". When only the port is given the CID defaults to VMADDR_CID_ANY,
+ * which is only meaningful for listening sockets.
+ *
+ * @param s (const char*) - Address specification string, including the "vsock:" prefix
+ * @param svm (struct sockaddr_vm*) - Output address structure
+ *
+ * @return void - Function exits on malformed addresses
+ */
+static void parse_vsock_address(const char *s, struct sockaddr_vm *svm)
+{
+    const char *cid = s + 6, *port;
+    char *end;
+    unsigned long value;
+
+    memset(svm, 0, sizeof(*svm));
+    svm->svm_family = AF_VSOCK;
+    svm->svm_cid = VMADDR_CID_ANY;
+
+    if ((port = strrchr(cid, ':'))) {
+		port++;
+		if (strncmp(cid, "any:", 4) == 0)
+			svm->svm_cid = VMADDR_CID_ANY;
+		else if (strncmp(cid, "local:", 6) == 0)
+			svm->svm_cid = VMADDR_CID_LOCAL;
+		else if (strncmp(cid, "host:", 5) == 0)
+			svm->svm_cid = VMADDR_CID_HOST;
+		else {
+			value = strtoul(cid, &end, 10);
+			if (end == cid || *end != ':')
+				log_printf_exit(2, log_err, "Invalid vsock CID in '%s'!", s);
+			svm->svm_cid = value;
+		}
+    } else {
+		port = cid;
+    }
+
+    value = strtoul(port, &end, 10);
+    if (end == port || *end != '\0')
+		log_printf_exit(2, log_err, "Missing port in '%s'!", s);
+    svm->svm_port = value;
+}
+
+/**
+ * Creates a listening AF_VSOCK stream socket.
+ * Returns the same -1 terminated array as tcp_listener() so that
+ * accept_connections() can serve it unchanged.
+ *
+ * @param s (const char*) - Address specification, e.g. "vsock:5000" or "vsock:any:5000"
+ *
+ * @return int* - Dynamically allocated array holding the listening socket,
+ *               terminated with -1. Function exits on error.
+ */
+static int *vsock_listener(const char *s)
+{
+    struct sockaddr_vm svm;
+    int *fd_list;
+    int fd;
+
+    parse_vsock_address(s, &svm);
+
+    if ((fd = socket(AF_VSOCK, SOCK_STREAM, 0)) < 0)
+		err_sys("socket(AF_VSOCK)");
+    if (bind(fd, (struct sockaddr *) &svm, sizeof(svm)) < 0)
+		err_sys("Cannot bind to %s", s);
+    if (listen(fd, 128) < 0)
+		err_sys("listen");
+
+    fd_list = NOFAIL(malloc(2 * sizeof(int)));
+    fd_list[0] = fd;
+    fd_list[1] = -1;
+
+    log_printf(log_info, "Listening for TCP connections on %s", print_addr_port((struct sockaddr *) &svm, sizeof(svm)));
+
+    return fd_list;
+}
+
+/**
+ * Connects an AF_VSOCK stream socket to the specified CID and port.
+ *
+ * @param s (const char*) - Address specification, e.g. "vsock:2:5000" or "vsock:host:5000"
+ *
+ * @return int - File descriptor of the connected socket, or -1 if the connection failed.
+ *              Function exits on other errors.
+ */
+static int vsock_client(const char *s)
+{
+    struct sockaddr_vm svm;
+    int fd;
+
+    parse_vsock_address(s, &svm);
+
+    if (svm.svm_cid == VMADDR_CID_ANY)
+		log_printf_exit(2, log_err, "Missing CID in '%s'!", s);
+
+    if ((fd = socket(AF_VSOCK, SOCK_STREAM, 0)) < 0)
+		err_sys("socket(AF_VSOCK)");
+    if (connect(fd, (struct sockaddr *) &svm, sizeof(svm)) < 0) {
+		log_printf_err(log_err, "Cannot connect to %s", s);
+		close(fd);
+		return -1;
+    }
+
+    log_printf(log_info, "TCP connection opened to %s", print_addr_port((struct sockaddr *) &svm, sizeof(svm)));
+
+    return fd;
+}
+#else
+static int *vsock_listener(const char *s)
+{
+    log_printf_exit(2, log_err, "vsock addresses are not supported on this platform: '%s'", s);
+}
+
+static int vsock_client(const char *s)
+{
+    log_printf_exit(2, log_err, "vsock addresses are not supported on this platform: '%s'", s);
+}
+#endif
+
 /**
  * Creates a UDP listening socket bound to the specified address and port.
  * Performs address resolution and attempts to bind to the first available
@@ -256,6 +481,50 @@ int udp_listener(const char *s)
   return fd;
 }
 
+/**
+ * Asks the kernel to complete accept() only once the client has sent some
+ * data, so that the connections of port scanners and of TCP health checks
+ * which never send anything do not wake up the acceptor.
+ * Errors are ignored: the option is an optimization, and it does not exist
+ * for AF_VSOCK listeners.
+ *
+ * @param fd (int) - Listening TCP socket
+ *
+ * @return void
+ */
+void tcp_defer_accept(int fd)
+{
+#ifdef TCP_DEFER_ACCEPT
+  int seconds = TCP_DEFER_SECONDS;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+#else
+  (void) fd;
+#endif
+}
+
+/**
+ * Lets the kernel probe an idle TCP connection, which keeps the state of the
+ * NAT and firewalls on its path without waking up the process.
+ * Errors are ignored, as for tcp_defer_accept(); AF_VSOCK has no such option.
+ *
+ * @param fd (int) - Connected TCP socket
+ * @param idle (int) - Seconds without data before the first probe
+ *
+ * @return void
+ */
+void tcp_keepalive(int fd, int idle)
+{
+  int opt = 1;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) < 0)
+	return;
+#ifdef TCP_KEEPIDLE
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+#endif
+}
+
 /**
  * Creates multiple TCP listening sockets for all available address families.
  * Unlike udp_listener(), this function creates sockets for all resolved addresses
@@ -263,7 +532,8 @@ int udp_listener(const char *s)
  * allocated array of file descriptors terminated with -1.
  *
  * @param s (const char*) - Address specification string (parsed by parse_address_port)
- *                         Examples: "8080", "192.168.1.1:8080", "[::1]:8080"
+ *                         Examples: "8080", "192.168.1.1:8080", "[::1]:8080",
+ *                         or "vsock:PORT" / "vsock:CID:PORT" for an AF_VSOCK listener
  *
  * @return int* - Dynamically allocated array of TCP socket file descriptors,
  *               terminated with -1. Caller must free() the returned array.
@@ -278,6 +548,9 @@ int *tcp_listener(const char *s)
   int *fd_list = NULL;
   size_t allocated_fds = 0;
 
+  if (is_vsock_address(s))
+    return vsock_listener(s);
+
   parse_address_port(s, &address, &port);
 
   if (!port)
@@ -339,6 +612,7 @@ int *tcp_listener(const char *s)
     /* success */
     if (listen(fd, 128) < 0)
       err_sys("listen");
+    tcp_defer_accept(fd);
 
    /*
     * Grow the fd_list array dynamically. We need space for:
@@ -377,6 +651,299 @@ int *tcp_listener(const char *s)
   return fd_list;
 }
 
+/**
+ * Returns the current CLOCK_MONOTONIC time.
+ *
+ * @return long long - Time in milliseconds
+ */
+static long long monotonic_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Closes a pending connection and frees its slot.
+ *
+ * @param c (struct pending_conn*) - Pending connection
+ *
+ * @return void
+ */
+static void pending_close(struct pending_conn *c)
+{
+  close(c->fd);
+  c->fd = -1;
+}
+
+/**
+ * Answers a load balancer health check and closes the connection.
+ * The rest of the request is read before closing, or the kernel would reset
+ * the connection and the prober could lose the reply.
+ *
+ * @param c (struct pending_conn*) - Pending connection which sent an HTTP request
+ *
+ * @return void
+ */
+static void answer_probe(struct pending_conn *c)
+{
+  char discard[1024];
+
+  if (send(c->fd, probe_reply, sizeof(probe_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    log_printf_err(log_debug, "send(health check)");
+  shutdown(c->fd, SHUT_WR);
+  while (recv(c->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+    ;
+  pending_close(c);
+}
+
+/**
+ * Reads the session record which may follow the handshake. The record starts
+ * with 0xffff, a frame length which the stream never uses, so the first bytes
+ * of a frame tell that there is no record; they are kept for the tunnel.
+ * Until bytes follow the handshake nothing is decided: the record may come
+ * in a later segment. A client which sends nothing by the handshake deadline
+ * has no record (see accept_connections()).
+ *
+ * @param c (struct pending_conn*) - Pending connection which sent its handshake
+ * @param adm (struct admission*) - Admission checks, the counters are updated
+ *
+ * @return int - 1 if the record is complete or absent, 0 if more data is needed,
+ *              -1 if the connection was closed
+ */
+static int pending_session(struct pending_conn *c, struct admission *adm)
+{
+  const unsigned char *record = (unsigned char *) c->buf + adm->handshake_len;
+  size_t got;
+  ssize_t len;
+
+  len = io->read(c->fd, c->buf + c->len, adm->handshake_len + adm->session_len - c->len);
+  if (len > 0)
+    c->len += len;
+  got = c->len - adm->handshake_len;
+
+  if (got > 0 && (record[0] != 0xff || (got > 1 && record[1] != 0xff)))
+    return 1; // No record: what was read starts the stream of the tunnel
+  if (got > 0 && got == adm->session_len) {
+    c->session = 1;
+    return 1;
+  }
+  if (len < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+
+  log_printf(log_info, "Rejected the TCP connection from %s: %s",
+    print_addr_port((struct sockaddr *) &c->addr, c->addrlen),
+    got ? "incomplete session record" : "closed after the handshake");
+  adm->rejected++;
+  pending_close(c);
+  return -1;
+}
+
+/**
+ * Reads the start of the stream of a pending connection and decides its fate.
+ * Connections are only closed here: the caller forks a tunnel for the ones
+ * which sent the whole handshake.
+ *
+ * @param c (struct pending_conn*) - Readable pending connection
+ * @param adm (struct admission*) - Admission checks, the counters are updated
+ *
+ * @return int - 1 if the handshake is complete, 0 if more data is needed,
+ *              -1 if the connection was closed
+ */
+static int pending_check(struct pending_conn *c, struct admission *adm)
+{
+  const char *reason;
+  ssize_t len;
+  size_t i;
+
+  if (c->len >= adm->handshake_len) // The rest of a session record
+    return pending_session(c, adm);
+
+  len = io->read(c->fd, c->buf + c->len, adm->handshake_len - c->len);
+  if (len < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+
+  if (len == 0 && c->len == 0) { // A TCP health check: connect and close
+    log_printf(log_debug, "TCP probe from %s", print_addr_port((struct sockaddr *) &c->addr, c->addrlen));
+    adm->probes++;
+    pending_close(c);
+    return -1;
+  }
+  if (len <= 0) {
+    reason = len == 0 ? "closed before the handshake" : strerror(errno);
+    goto reject;
+  }
+  c->len += len;
+
+  if (memcmp(c->buf, adm->handshake, c->len) == 0) {
+    if (c->len < adm->handshake_len)
+      return 0;
+    return adm->session_len ? pending_session(c, adm) : 1;
+  }
+
+  for (i = 0; i < sizeof(probe_methods) / sizeof(probe_methods[0]); i++) {
+    size_t mlen = strlen(probe_methods[i]);
+
+    if (memcmp(c->buf, probe_methods[i], c->len < mlen ? c->len : mlen) != 0)
+      continue;
+    if (c->len < mlen) // May still become an HTTP request
+      return 0;
+    if (!adm->health_check)
+      break;
+    log_printf(log_debug, "HTTP health check from %s", print_addr_port((struct sockaddr *) &c->addr, c->addrlen));
+    adm->probes++;
+    answer_probe(c);
+    return -1;
+  }
+  reason = "bad handshake";
+
+reject:
+  log_printf(log_info, "Rejected the TCP connection from %s: %s",
+    print_addr_port((struct sockaddr *) &c->addr, c->addrlen), reason);
+  adm->rejected++;
+  pending_close(c);
+  return -1;
+}
+
+/**
+ * Closes in a tunnel process what it inherited from the parent: the
+ * listening sockets, the watched descriptors and the other connections
+ * still waiting for their handshake.
+ */
+static void close_inherited(int listening_sockets[], const int watch[])
+{
+  int i;
+
+  for (i = 0; listening_sockets[i] != -1; i++)
+    close(listening_sockets[i]);
+  for (i = 0; watch && watch[i] != -1; i++)
+    close(watch[i]);
+  for (i = 0; i < ACCEPT_MAX_PENDING; i++)
+    if (pending[i].fd >= 0)
+      pending_close(&pending[i]);
+}
+
+/**
+ * Forks the process which will run the tunnel of an admitted connection.
+ *
+ * @param c (struct pending_conn*) - Admitted connection, its slot is freed in both processes
+ * @param listening_sockets (int[]) - Listening sockets, closed by the child
+ * @param watch (const int[]) - Watched descriptors, closed by the child, or NULL
+ * @param adm (struct admission*) - Admission checks, counting the tunnels, or NULL
+ *
+ * @return int - In child process: file descriptor of the connection
+ *              In parent process: -1
+ *              Function exits on system call errors
+ */
+static int fork_tunnel(struct pending_conn *c, int listening_sockets[], const int watch[],
+  struct admission *adm)
+{
+  int fd = c->fd;
+  int flags;
+  pid_t pid;
+
+  /* the relay expects a blocking socket */
+  if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+    err_sys("fcntl(F_GETFL)");
+  if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    err_sys("fcntl(F_SETFL)");
+
+  log_printf(log_notice, "Received a TCP connection from %s", print_addr_port((struct sockaddr *) &c->addr, c->addrlen));
+
+#if 0
+  /*
+  * Testing mode: handle connections in the same process.
+  * This simplifies debugging but prevents concurrent connections.
+  */
+  pid = 0;
+#else
+  /*
+  * Production mode: fork a child process for each connection.
+  * This provides isolation between tunnel sessions and allows
+  * concurrent handling of multiple clients.
+  */
+  fflush(NULL);			// Or the child would print the buffered log lines again
+  pid = fork();
+#endif
+
+  if (pid < 0)
+    err_sys("fork");
+
+  if (pid > 0) {
+    /* Parent process: close client socket and continue listening */
+    pending_close(c);
+    if (adm)
+      adm->accepted++;
+    if (adm && adm->forked)
+      adm->forked(pid, (struct sockaddr *) &c->addr, adm->ctx);
+    return -1;
+  }
+
+  /* Child process: return the client connection for tunnel processing */
+  if (adm) {
+    adm->received_len = c->len - adm->handshake_len;
+    memcpy(adm->received, c->buf + adm->handshake_len, adm->received_len);
+    adm->has_session = c->session;
+  }
+  c->fd = -1;
+  close_inherited(listening_sockets, watch);
+  return fd;
+}
+
+/**
+ * Starts the tunnel of an admitted connection: a connection which sent a
+ * session record is first offered to the resume() hook, which may hand it
+ * over to the tunnel of the session.
+ *
+ * @param c (struct pending_conn*) - Admitted connection, its slot is freed in both processes
+ * @param listening_sockets (int[]) - Listening sockets, closed by the child
+ * @param watch (const int[]) - Watched descriptors, closed by the child, or NULL
+ * @param adm (struct admission*) - Admission checks, or NULL
+ *
+ * @return int - In child process: file descriptor of the connection
+ *              In parent process: -1
+ */
+static int start_tunnel(struct pending_conn *c, int listening_sockets[], const int watch[],
+  struct admission *adm)
+{
+  int flags;
+
+  if (adm && adm->resume && c->session) {
+    /* the tunnel which takes it over expects a blocking socket too */
+    if ((flags = fcntl(c->fd, F_GETFL, 0)) < 0 || fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+      err_sys("fcntl");
+    if (adm->resume(c->fd, c->buf + adm->handshake_len, adm->ctx)) {
+      pending_close(c);
+      return -1;
+    }
+  }
+  return fork_tunnel(c, listening_sockets, watch, adm);
+}
+
+/**
+ * Forks the process of a tunnel which was not accepted by
+ * accept_connections(), such as one migrated from another server.
+ * The child closes the same descriptors as the children of accept_connections().
+ *
+ * @param listening_sockets (int[]) - Listeners of the server, terminated with -1
+ * @param watch (const int[]) - Other descriptors of the parent, terminated with -1, or NULL
+ *
+ * @return pid_t - Process of the tunnel in the parent, 0 in the child
+ *                Function exits if fork() fails
+ */
+pid_t tunnel_fork(int listening_sockets[], const int watch[])
+{
+  pid_t pid;
+
+  fflush(NULL);			// Or the child would print the buffered log lines again
+  if ((pid = fork()) < 0)
+    err_sys("fork");
+  if (pid == 0)
+    close_inherited(listening_sockets, watch);
+  return pid;
+}
+
 /**
  * Accepts incoming TCP connections on multiple listening sockets using select().
  * For each accepted connection, forks a child process to handle it while the
@@ -387,28 +954,92 @@ int *tcp_listener(const char *s)
  * client connection is handled by a separate process, providing isolation
  * between tunnel sessions.
  *
+ * With admission checks the parent first reads the handshake of each
+ * connection, without blocking and within a deadline, so that health checks,
+ * port scanners and clients with a wrong handshake never cost a fork().
+ * The connections waiting for their handshake are kept across calls.
+ *
  * @param listening_sockets (int[]) - Array of listening socket descriptors
  *                                   terminated with -1 (from tcp_listener)
+ * @param watch (const int[]) - Other descriptors which make the parent return
+ *                             when readable, terminated with -1, or NULL.
+ *                             The child process closes them too.
+ * @param interrupt (volatile sig_atomic_t*) - Flag set by a signal handler to make
+ *                                            the parent return, or NULL
+ * @param adm (struct admission*) - Checks done before forking, or NULL to fork
+ *                                 for every connection. The handshake has been
+ *                                 consumed from the returned connection.
  *
  * @return int - In child process: file descriptor of accepted connection
- *              In parent process: Never returns normally (infinite loop)
+ *              In parent process: -1 once *interrupt has been set or a watched
+ *              descriptor is readable, the listening sockets are left open
  *              Function exits on system call errors
  */
-int accept_connections(int listening_sockets[])
+int accept_connections(int listening_sockets[], const int watch[], volatile sig_atomic_t *interrupt,
+  struct admission *adm)
 {
+  int i;
+
+  if (!pending_initialized) {
+    for (i = 0; i < ACCEPT_MAX_PENDING; i++)
+      pending[i].fd = -1;
+    pending_initialized = 1;
+  }
+
   while (1) {
     int max = 0;
-    int i, fd;
+    int fd, free_slots = 0;
+    long long now, next_deadline = -1;
+    struct timeval tv;
     fd_set readfds;
-    pid_t pid;
+
+    if (interrupt && *interrupt)
+      return -1;
+
+    FD_ZERO(&readfds);				// Clear the file descriptor set
+
+    /*
+    * Drop the connections which did not send their handshake in time,
+    * and wait for the others until the earliest deadline.
+    */
+    now = monotonic_ms();
+    for (i = 0; i < ACCEPT_MAX_PENDING; i++) {
+      struct pending_conn *c = &pending[i];
+
+      if (c->fd < 0) {
+        free_slots++;
+        continue;
+      }
+      if (c->deadline <= now && adm && adm->session_len && c->len == adm->handshake_len) {
+        /* a handshake and nothing else: no session record, the tunnel starts idle */
+        if ((fd = start_tunnel(c, listening_sockets, watch, adm)) >= 0)
+          return fd;
+        free_slots++;
+        continue;
+      }
+      if (c->deadline <= now) {
+        log_printf(log_info, "Rejected the TCP connection from %s: handshake timeout",
+          print_addr_port((struct sockaddr *) &c->addr, c->addrlen));
+        if (adm)
+          adm->rejected++;
+        pending_close(c);
+        free_slots++;
+        continue;
+      }
+      FD_SET(c->fd, &readfds);
+      SET_MAX(c->fd);
+      if (next_deadline < 0 || c->deadline < next_deadline)
+        next_deadline = c->deadline;
+    }
 
     /*
     * Prepare for select() by setting up the file descriptor set.
     * Make all listening sockets non-blocking to prevent hanging
     * on accept() if another process steals the connection.
+    * When too many connections are waiting for their handshake the
+    * new ones are left in the kernel backlog.
     */
-    FD_ZERO(&readfds);				// Clear the file descriptor set
-    for (i = 0; listening_sockets[i] != -1; i++) {
+    for (i = 0; free_slots && listening_sockets[i] != -1; i++) {
       int flags;
 
       /* Set socket to non-blocking mode */
@@ -421,82 +1052,143 @@ int accept_connections(int listening_sockets[])
       FD_SET(listening_sockets[i], &readfds);
       SET_MAX(listening_sockets[i]);		// Track highest fd number for select()
     }
+    for (i = 0; watch && watch[i] != -1; i++) {
+      FD_SET(watch[i], &readfds);
+      SET_MAX(watch[i]);
+    }
+
+    if (next_deadline >= 0) {
+      tv.tv_sec = (next_deadline - now) / 1000;
+      tv.tv_usec = (next_deadline - now) % 1000 * 1000;
+    }
 
     /*
-    * Block until at least one listening socket has an incoming connection.
+    * Block until at least one listening socket has an incoming connection,
+    * or a pending connection sent data or reached its deadline.
     * select() modifies readfds to indicate which sockets are ready.
     */
-    if (select(max, &readfds, NULL, NULL, NULL) < 0) {
+    if (io->select(max, &readfds, NULL, NULL, next_deadline >= 0 ? &tv : NULL) < 0) {
       if (errno == EINTR || errno == EAGAIN)
-        continue;			// Handle interrupted system calls gracefully
+        continue;			// Handle interrupted system calls gracefully (and check *interrupt)
       err_sys("select");
     }
 
+    /* let the caller serve the watched descriptors before accepting */
+    for (i = 0; watch && watch[i] != -1; i++)
+      if (FD_ISSET(watch[i], &readfds))
+        return -1;
+
+    for (i = 0; i < ACCEPT_MAX_PENDING; i++) {
+      if (pending[i].fd < 0 || !FD_ISSET(pending[i].fd, &readfds))
+        continue;
+      if (pending_check(&pending[i], adm) > 0 && (fd = start_tunnel(&pending[i], listening_sockets, watch, adm)) >= 0)
+        return fd;
+    }
+
     /*
     * Check each listening socket that select() indicated is ready.
-    * Accept the first available connection and fork to handle it.
+    * Accept the first available connection, and fork to handle it
+    * once it has passed the admission checks.
     */
-    for (i = 0; listening_sockets[i] != -1; i++) {
-      int listen_sock;
-      struct sockaddr_storage client_addr;	// Storage for client address
-      socklen_t addrlen = sizeof(client_addr);
+    for (i = 0; free_slots && listening_sockets[i] != -1; i++) {
+      struct pending_conn *c;
+      const char *reason;
+      int slot;
 
       /* Skip sockets that aren't ready (not set by select) */
       if (!FD_ISSET(listening_sockets[i], &readfds))
         continue;
-      listen_sock = listening_sockets[i];
+
+      for (slot = 0; pending[slot].fd >= 0; slot++)
+        ;
+      c = &pending[slot];
 
       /* Accept the incoming connection */
-      fd = accept(listen_sock, (struct sockaddr *) &client_addr, &addrlen);
+      c->addrlen = sizeof(c->addr);
+      fd = io->accept(listening_sockets[i], (struct sockaddr *) &c->addr, &c->addrlen);
       if (fd < 0) {
-        if (errno == EAGAIN)		// Would block (shouldn't happen after select)
+        if (errno == EAGAIN || errno == ECONNABORTED)	// Would block (shouldn't happen after select)
           continue;
         err_sys("accept");
       }
 
-      log_printf(log_notice, "Received a TCP connection from %s", print_addr_port((struct sockaddr *) &client_addr, addrlen));
-
-#if 0
-      /*
-      * Testing mode: handle connections in the same process.
-      * This simplifies debugging but prevents concurrent connections.
-      */
-      pid = 0;
-#else
-      /*
-      * Production mode: fork a child process for each connection.
-      * This provides isolation between tunnel sessions and allows
-      * concurrent handling of multiple clients.
-      */
-      pid = fork();
-#endif
-
-      if (pid < 0)
-        err_sys("fork");
-
-      if (pid > 0) {
-        /* Parent process: close client socket and continue listening */
+      /* under overload the connection is closed before anything is spent on it */
+      if (adm && adm->admit && (reason = adm->admit((struct sockaddr *) &c->addr, adm->ctx))) {
+        log_printf(log_debug, "Shed the TCP connection from %s: %s",
+          print_addr_port((struct sockaddr *) &c->addr, c->addrlen), reason);
+        adm->shed++;
         close(fd);
-      } else {
-        /*
-        * Child process: close all listening sockets (inherited from parent)
-        * and return the client connection for tunnel processing.
-        */
-        for (i = 0; listening_sockets[i] != -1; i++)
-          close(listening_sockets[i]);
-        return fd;
+        continue;
       }
+
+      /* not inherited by a new binary after an upgrade, which only gets the listeners */
+      if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+        err_sys("fcntl");
+      c->fd = fd;
+      c->len = 0;
+      c->session = 0;
+      c->deadline = monotonic_ms() + (adm ? adm->timeout : 0);
+      free_slots--;
+
+      /* with TCP_DEFER_ACCEPT the handshake has usually arrived already */
+      if ((!adm || pending_check(c, adm) > 0) && (fd = start_tunnel(c, listening_sockets, watch, adm)) >= 0)
+        return fd;
     }
   }
 }
 
+/**
+ * Creates an AF_UNIX datagram socket for delivering packets to a local application.
+ * The socket is autobound to an abstract address so that the application can
+ * answer to the sender address it sees in recvfrom(), exactly as it would do
+ * with a UDP peer.
+ *
+ * @param path (const char*) - Filesystem path of the application's SOCK_DGRAM socket
+ * @param remote_udpaddr (struct sockaddr_storage*) - Buffer to store the destination address
+ *
+ * @return int - File descriptor of the unix datagram socket
+ *              Function exits on error (path too long or socket failure)
+ */
+static int unixgram_client(const char *path, struct sockaddr_storage *remote_udpaddr)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (*path == '\0' || strlen(path) >= sizeof(sun.sun_path))
+		log_printf_exit(2, log_err, "Invalid unix socket path '%s'!", path);
+    strcpy(sun.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+		err_sys("socket(AF_UNIX)");
+
+    /*
+     * Binding with only the address family asks Linux to autobind the socket
+     * to a unique abstract name, which gives replies a return address without
+     * leaving files behind in the filesystem.
+     */
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sa_family_t)) < 0)
+		err_sys("bind(AF_UNIX, autobind)");
+
+    log_printf(log_debug, "The UDP destination is unixgram:%s", sun.sun_path);
+
+    if (remote_udpaddr) {
+		memset(remote_udpaddr, 0, sizeof(*remote_udpaddr));
+		memcpy(remote_udpaddr, &sun, sizeof(sun));
+    }
+
+    return fd;
+}
+
 /**
  * Creates a UDP client socket and resolves the remote peer address.
  * Sets up a UDP socket for sending packets to the specified destination.
  * The resolved address is stored for use in sendto() calls by the caller.
  *
  * @param s (const char*) - Remote address specification (must include both address and port)
- *                         Examples: "192.168.1.1:8080", "[2001:db8::1]:8080"
+ *                         Examples: "192.168.1.1:8080", "[2001:db8::1]:8080",
+ *                         or "unixgram:/run/app.sock" for a local AF_UNIX datagram socket
  * @param remote_udpaddr (struct sockaddr_storage*) - Buffer to store resolved remote address
  *                                                   Used as destination for subsequent UDP sends
  *
@@ -504,15 +1196,43 @@ int accept_connections(int listening_sockets[])
  *              Function exits on error (address resolution or socket creation failure)
  */
 int udp_client(const char *s, struct sockaddr_storage *remote_udpaddr)
+{
+    return udp_client_bound(s, remote_udpaddr, -1);
+}
+
+/**
+ * Like udp_client(), but connects a UDP socket already bound by the caller
+ * to a source address and port, when the destination has an address of
+ * its family. Otherwise the socket is closed and a new one is created.
+ *
+ * @param s (const char*) - Remote address specification, as for udp_client()
+ * @param remote_udpaddr (struct sockaddr_storage*) - Buffer to store resolved remote address
+ * @param bound (int) - Bound UDP socket, or -1 to create one
+ *
+ * @return int - File descriptor of the UDP client socket, exits on error
+ */
+int udp_client_bound(const char *s, struct sockaddr_storage *remote_udpaddr, int bound)
 {
     char *address, *port;
-    struct addrinfo hints, *res, *ai;
-    int err, fd;
+    struct addrinfo hints, *res, *ai = NULL;
+    struct sockaddr_storage local;
+    socklen_t locallen = sizeof(local);
+    int err, fd = -1;
+
+    if (bound >= 0 && (strncmp(s, "unixgram:", 9) == 0 ||
+		getsockname(bound, (struct sockaddr *) &local, &locallen) < 0)) {
+		log_printf(log_warning, "The UDP destination %s cannot use a bound source address", s);
+		close(bound);
+		bound = -1;
+    }
+
+    if (strncmp(s, "unixgram:", 9) == 0)
+		return unixgram_client(s + 9, remote_udpaddr);
 
     parse_address_port(s, &address, &port);
 
     if (!address || !port)
-		  log_printf_exit(2, log_err, "Missing address or port in '%s'!", s);
+		log_printf_exit(2, log_err, "Missing address or port in '%s'!", s);
 
     /*
      * Set up address resolution hints for UDP client:
@@ -529,32 +1249,46 @@ int udp_client(const char *s, struct sockaddr_storage *remote_udpaddr)
 
     err = getaddrinfo(address, port, &hints, &res);
     if (err == EAI_SYSTEM)
-		  err_sys("getaddrinfo(%s:%s)", address, port);
+		err_sys("getaddrinfo(%s:%s)", address, port);
     else if (err)
-		  log_printf_exit(1, log_err, "Cannot resolve %s:%s: %s", address, port, gai_strerror(err));
+		log_printf_exit(1, log_err, "Cannot resolve %s:%s: %s", address, port, gai_strerror(err));
 
     /*
      * Clean up dynamically allocated memory from parse_address_port().
      * These strings were allocated with malloc/strdup and must be freed.
      */
     if (address)
-		  free(address);
+		free(address);
     if (port)
-		  free(port);
+		free(port);
 
     /*
      * Create UDP socket for the first resolvable address family.
-     * Unlike TCP clients, UDP sockets don't need to "connect" - we just
-     * need a socket of the appropriate family for sendto() operations.
+     * The socket is also connected to the destination: the kernel then keeps
+     * the route and the source address, instead of looking them up for every
+     * datagram, and only the destination can send packets back. A failure is
+     * not fatal, the packets are then sent with an explicit address.
      */
-    for (ai = res; ai; ai = ai->ai_next) {
+    if (bound >= 0) { // The first address of the family of the bound socket
+      for (ai = res; ai && ai->ai_family != local.ss_family; ai = ai->ai_next)
+        ;
+      if (ai) {
+        fd = bound;
+      } else {
+        log_printf(log_warning, "The UDP destination %s has no address of the family of the bound source address", s);
+        close(bound);
+      }
+    }
+    for (ai = fd < 0 ? res : ai; fd < 0 && ai; ai = ai->ai_next) {
       if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
         continue;		// ignore socket creation failure, try next address
       break;				// success - have a UDP socket
     }
 
     if (!ai)
-		  err_sys("socket");
+		err_sys("socket");
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+		log_printf_err(log_info, "connect(udp, %s)", ai_print_addr_port(ai));
 
     log_printf(log_debug, "The UDP destination is %s", ai_print_addr_port(ai));
 
@@ -564,34 +1298,85 @@ int udp_client(const char *s, struct sockaddr_storage *remote_udpaddr)
      * for each packet transmission. This avoids repeated address resolution.
      */
     if (remote_udpaddr)
-		  memcpy(remote_udpaddr, ai->ai_addr, ai->ai_addrlen);
+		memcpy(remote_udpaddr, ai->ai_addr, ai->ai_addrlen);
 
     freeaddrinfo(res);
 
     return fd;
 }
 
+/**
+ * Tells whether a UDP socket is connected to its peer, in which case the
+ * datagrams must be sent without a destination address to use the route
+ * cached by the kernel.
+ *
+ * @param fd (int) - UDP or AF_UNIX datagram socket
+ *
+ * @return int - 1 if the socket is connected, 0 otherwise
+ */
+int udp_connected(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    return getpeername(fd, (struct sockaddr *) &addr, &addrlen) == 0;
+}
+
+/**
+ * Asks the kernel to report the destination address of each datagram
+ * received by a socket bound to the wildcard address, so that the replies
+ * can be sent from the address which the peer used, on a multi-homed host.
+ * Sockets bound to a specific address already send from it.
+ *
+ * @param fd (int) - UDP listener socket
+ *
+ * @return int - 1 if the address is reported as IP_PKTINFO or IPV6_PKTINFO
+ *               control messages, 0 otherwise
+ */
+int udp_pktinfo(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int opt = 1;
+
+    if (getsockname(fd, (struct sockaddr *) &addr, &addrlen) < 0)
+		return 0;
+
+    if (addr.ss_family == AF_INET && ((struct sockaddr_in *) &addr)->sin_addr.s_addr == htonl(INADDR_ANY))
+		return setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &opt, sizeof(opt)) == 0;
+    if (addr.ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &addr)->sin6_addr))
+		return setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &opt, sizeof(opt)) == 0; // Also IPv4-mapped
+    return 0;
+}
+
 /**
  * Creates a TCP client connection to the specified remote address and port.
  * Attempts to connect to all resolved addresses until one succeeds, supporting
- * dual-stack connectivity. Used for establishing the TCP side of tunnel connections.
+ * dual-stack connectivity. Unlike tcp_client(), failures to resolve or to
+ * connect are not fatal, so that a tunnel can be reopened later.
  *
  * @param s (const char*) - Remote address specification (must include both address and port)
- *                         Examples: "192.168.1.1:8080", "[2001:db8::1]:8080", "example.com:8080"
+ *                         Examples: "192.168.1.1:8080", "[2001:db8::1]:8080", "example.com:8080",
+ *                         or "vsock:CID:PORT" to connect over AF_VSOCK
+ * @param timeout (int) - Seconds allowed to each connection attempt, 0 for the system default
  *
- * @return int - File descriptor of the connected TCP socket
- *              Function exits on error (address resolution or connection failure)
+ * @return int - File descriptor of the connected TCP socket, or -1 after logging the error
+ *              Function exits on invalid addresses
  */
-int tcp_client(const char *s)
+int tcp_connect(const char *s, int timeout)
 {
     char *address, *port;
     struct addrinfo hints, *res, *ai;
-    int err, fd;
+    struct timeval tv;
+    int err, fd = -1;
+
+    if (is_vsock_address(s))
+		return vsock_client(s);
 
     parse_address_port(s, &address, &port);
 
     if (!address || !port)
-		  log_printf_exit(2, log_err, "Missing address or port in '%s'!", s);
+		log_printf_exit(2, log_err, "Missing address or port in '%s'!", s);
 
     /*
      * Set up address resolution hints for TCP client:
@@ -607,35 +1392,55 @@ int tcp_client(const char *s)
     hints.ai_flags = AI_ADDRCONFIG | AI_IDN;
 
     err = getaddrinfo(address, port, &hints, &res);
-    if (err == EAI_SYSTEM)
-		  err_sys("getaddrinfo(%s:%s)", address, port);
-    else if (err)
-		  log_printf_exit(1, log_err, "Cannot resolve %s:%s: %s", address, port, gai_strerror(err));
+    if (err) {
+		if (err == EAI_SYSTEM)
+			log_printf_err(log_err, "getaddrinfo(%s:%s)", address, port);
+		else
+			log_printf(log_err, "Cannot resolve %s:%s: %s", address, port, gai_strerror(err));
+		free(address);
+		free(port);
+		return -1;
+    }
 
     /*
      * Clean up dynamically allocated memory from parse_address_port().
      * These strings were allocated with malloc/strdup and must be freed.
      */
     if (address)
-		  free(address);
+		free(address);
     if (port)
-		  free(port);
+		free(port);
 
     /*
      * Attempt to connect to each resolved address until one succeeds.
      * This implements "happy eyeballs" style connectivity - try IPv6 first
      * if available, fall back to IPv4 if IPv6 fails.
+     * On Linux SO_SNDTIMEO also bounds a blocking connect().
      */
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
     for (ai = res; ai; ai = ai->ai_next) {
       if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
         continue;			// ignore socket creation failure, try next address
+      if (timeout)
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
       if (connect(fd, (struct sockaddr *) ai->ai_addr, ai->ai_addrlen) == 0)
         break;				// success - connected to remote host
       close(fd);					// connection failed, clean up and try next
+      fd = -1;
     }
 
-    if (!ai)
-	  	err_sys("Cannot connect to %s", s);
+    if (!ai) {
+	  	log_printf_err(log_err, "Cannot connect to %s", s);
+	  	freeaddrinfo(res);
+	  	return -1;
+    }
+
+    /* the timeout must not apply to the writes of the tunnel */
+    if (timeout) {
+      tv.tv_sec = 0;
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
 
     log_printf(log_info, "TCP connection opened to %s", ai_print_addr_port(ai));
 
@@ -643,3 +1448,22 @@ int tcp_client(const char *s)
 
     return fd;
 }
+
+/**
+ * Creates a TCP client connection to the specified remote address and port.
+ * Used for establishing the TCP side of tunnel connections.
+ *
+ * @param s (const char*) - Remote address specification, as for tcp_connect()
+ *
+ * @return int - File descriptor of the connected TCP socket
+ *              Function exits on error (address resolution or connection failure)
+ */
+int tcp_client(const char *s)
+{
+    int fd = tcp_connect(s, 0);
+
+    if (fd < 0)
+		exit(1);
+
+    return fd;
+}
@@ -21,20 +21,68 @@
 
     #define SET_MAX(fd) do { if (max < (fd) + 1) { max = (fd) + 1; } } while (0)
 
+    /* longest session record which may follow the handshake */
+    #define ADMISSION_MAX_SESSION 32
+
+    /**
+     * Checks done by accept_connections() before forking the process of a
+     * tunnel, and their counters.
+     */
+    struct admission {
+        const char *handshake;         // Bytes each connection must start with, consumed before the fork
+        size_t handshake_len;          // 1 to 64
+        int timeout;                   // Milliseconds allowed to receive the handshake
+        int health_check;              // 1 = answer HTTP requests with "200 OK", 0 = reject them
+        unsigned long accepted;        // Tunnels forked
+        unsigned long rejected;        // Bad handshakes and timeouts
+        unsigned long probes;          // Health checks answered and connections closed without data
+        unsigned long shed;            // Connections closed at once because admit() refused them
+        size_t session_len;            // Session record which may follow the handshake, starting with 0xffff, 0 = none
+
+        /* optional hooks: admit() returns why a new connection must be closed at once, or NULL */
+        const char *(*admit)(const struct sockaddr *addr, void *ctx);
+        void (*forked)(pid_t pid, const struct sockaddr *addr, void *ctx); // Told of each tunnel
+        /* resume() takes over a blocking connection which sent a session record and returns 1, or 0 to fork */
+        int (*resume)(int fd, const char *record, void *ctx);
+        void *ctx;
+
+        /* in the tunnel process: what was read after the handshake */
+        char received[ADMISSION_MAX_SESSION]; // The session record, or the start of the stream
+        size_t received_len;
+        int has_session;               // 1 if received holds a session record
+    };
+
     char *print_addr_port(const struct sockaddr *addr, socklen_t addrlen);
 
+    socklen_t addr_len(const struct sockaddr *addr);
+
     int udp_listener(const char *s);
 
     int *tcp_listener(const char *s);
 
+    void tcp_defer_accept(int fd);
+
+    void tcp_keepalive(int fd, int idle);
+
     int udp_listener_sa(const int num);
 
     int *tcp_listener_sa(const int num);
 
     int udp_client(const char *s, struct sockaddr_storage *remote_udpaddr);
 
+    int udp_client_bound(const char *s, struct sockaddr_storage *remote_udpaddr, int bound);
+
+    int udp_connected(int fd);
+
+    int udp_pktinfo(int fd);
+
     int tcp_client(const char *s);
 
-    int accept_connections(int listening_sockets[]);
+    int tcp_connect(const char *s, int timeout);
+
+    int accept_connections(int listening_sockets[], const int watch[], volatile sig_atomic_t *interrupt,
+		struct admission *adm);
+
+    pid_t tunnel_fork(int listening_sockets[], const int watch[]);
 
 #endif
@@ -0,0 +1,593 @@
+/*
+ * Overload Library - Load shedding for the server
+ *
+ * Tracks the tunnel processes forked by the server and measures the signals
+ * which tell that the host cannot take more: the lag of the event loop of
+ * the acceptor (how late a 100 ms timer fires), the memory available to the
+ * system, the CPU time stolen by the hypervisor and the number of tunnels.
+ *
+ * Past a threshold new connections are rejected right after accept(), before
+ * any handshake or fork. The tunnels are grouped by source network (/24 for
+ * IPv4, /48 for IPv6) so that a single region can be capped, and when the
+ * overload persists the newest tunnel of the largest region is terminated
+ * first, once per second.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "overload.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#define SAMPLE_MS 1000             // Interval between two samples of the host state
+#define DROP_AFTER 3               // Consecutive overloaded samples before tunnels are dropped
+
+/* source network of a tunnel, compared as a whole */
+struct region {
+    uint16_t family;
+    unsigned char prefix[6];       // First 3 bytes of an IPv4 address or 6 bytes of an IPv6 one
+};
+
+/* a tunnel process */
+struct tunnel {
+    int32_t pid;
+    uint32_t reserved;
+    int64_t started;               // CLOCK_MONOTONIC ms, kept by binary upgrades
+    struct region region;
+};
+
+/* header of the tunnel table written by overload_export() */
+struct overload_export_header {
+    uint32_t magic;                // OVERLOAD_EXPORT_MAGIC
+    uint32_t entry_size;           // sizeof(struct tunnel) in the previous binary
+    uint32_t count;                // Tunnels following the header
+    uint32_t reserved;
+};
+
+#define OVERLOAD_EXPORT_MAGIC 0x55544f31  // "UTO1", bump when the layout changes
+
+struct overload {
+    const struct overload_limits *limits;
+    int timer_fd;
+
+    struct tunnel *tunnels;
+    int count, allocated;
+
+    long long last_sample;         // CLOCK_MONOTONIC ms of the last sample
+    int window_lag;                // Largest lag since the last sample
+    int lag;                       // Largest lag during the last sample interval, ms
+    long memory;                   // MemAvailable in MB, -1 if unknown
+    int steal;                     // Percent of CPU time stolen, -1 if unknown
+    unsigned long long cpu_total, cpu_steal; // /proc/stat counters of the last sample
+
+    const char *reason;            // Why the host is overloaded, NULL if it is not
+    int overloaded_samples;        // Consecutive samples with reason set
+    pid_t dropping;                // Tunnel terminated and not reaped yet, 0 if none
+
+    unsigned long shed_tunnels, shed_region, shed_lag, shed_memory, shed_steal;
+    unsigned long dropped;
+};
+
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Computes the source network of an address. Addresses which are not IP
+ * (e.g. AF_VSOCK) all belong to the region of their family.
+ */
+static void address_region(const struct sockaddr *addr, struct region *region)
+{
+    memset(region, 0, sizeof(*region));
+    region->family = addr->sa_family;
+
+    if (addr->sa_family == AF_INET) {
+		memcpy(region->prefix, &((const struct sockaddr_in *) addr)->sin_addr, 3);
+    } else if (addr->sa_family == AF_INET6) {
+		const struct in6_addr *a = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+
+		if (IN6_IS_ADDR_V4MAPPED(a)) { // Same region as the native IPv4 address
+			region->family = AF_INET;
+			memcpy(region->prefix, &a->s6_addr[12], 3);
+		} else {
+			memcpy(region->prefix, a->s6_addr, 6);
+		}
+    }
+}
+
+static void print_region(const struct region *region, char *buf, size_t len)
+{
+    unsigned char a[16];
+    char s[INET6_ADDRSTRLEN];
+
+    memset(a, 0, sizeof(a));
+    if (region->family == AF_INET) {
+		memcpy(a, region->prefix, 3);
+		inet_ntop(AF_INET, a, s, sizeof(s));
+		snprintf(buf, len, "%s/24", s);
+    } else if (region->family == AF_INET6) {
+		memcpy(a, region->prefix, 6);
+		inet_ntop(AF_INET6, a, s, sizeof(s));
+		snprintf(buf, len, "%s/48", s);
+    } else {
+		snprintf(buf, len, "family-%d", region->family);
+    }
+}
+
+static int region_count(const struct overload *o, const struct region *region)
+{
+    int i, n = 0;
+
+    for (i = 0; i < o->count; i++)
+		if (memcmp(&o->tunnels[i].region, region, sizeof(*region)) == 0)
+			n++;
+    return n;
+}
+
+static int compare_tunnel_regions(const void *a, const void *b)
+{
+    return memcmp(&((const struct tunnel *) a)->region, &((const struct tunnel *) b)->region,
+		sizeof(struct region));
+}
+
+/**
+ * Finds the region with the most tunnels, sorting a copy of the table so that
+ * the cost stays O(n log n) with thousands of tunnels.
+ *
+ * @param o (const struct overload*) - Tracker
+ * @param region (struct region*) - Output, the largest region
+ *
+ * @return int - Number of tunnels of the region, 0 if there are no tunnels
+ */
+static int largest_region(const struct overload *o, struct region *region)
+{
+    struct tunnel *sorted;
+    int i, run = 0, best = 0;
+
+    if (!o->count)
+		return 0;
+    sorted = NOFAIL(malloc(o->count * sizeof(*sorted)));
+    memcpy(sorted, o->tunnels, o->count * sizeof(*sorted));
+    qsort(sorted, o->count, sizeof(*sorted), compare_tunnel_regions);
+
+    for (i = 0; i < o->count; i++) {
+		run = i && compare_tunnel_regions(&sorted[i - 1], &sorted[i]) == 0 ? run + 1 : 1;
+		if (run > best) {
+			best = run;
+			*region = sorted[i].region;
+		}
+    }
+
+    free(sorted);
+    return best;
+}
+
+/**
+ * Appends an entry to the tunnel table.
+ */
+static struct tunnel *new_tunnel(struct overload *o)
+{
+    if (o->count == o->allocated) {
+		o->allocated = o->allocated ? o->allocated * 2 : 64;
+		o->tunnels = NOFAIL(realloc(o->tunnels, o->allocated * sizeof(*o->tunnels)));
+    }
+    return &o->tunnels[o->count++];
+}
+
+/**
+ * Creates the tracker and its timer.
+ *
+ * @param limits (const struct overload_limits*) - Thresholds, read at every check so they can change
+ *
+ * @return struct overload* - Tracker, exits on error
+ */
+struct overload *overload_new(const struct overload_limits *limits)
+{
+    struct overload *o = NOFAIL(calloc(1, sizeof(*o)));
+    struct itimerspec its;
+
+    o->limits = limits;
+    o->memory = -1;
+    o->steal = -1;
+    o->last_sample = monotonic_ms();
+
+    if ((o->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		err_sys("timerfd_create");
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = OVERLOAD_TICK_MS * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(o->timer_fd, 0, &its, NULL) < 0)
+		err_sys("timerfd_settime");
+
+    return o;
+}
+
+/**
+ * Returns the descriptor which the event loop must watch for reading and
+ * which makes it call overload_tick().
+ */
+int overload_fd(const struct overload *overload)
+{
+    return overload->timer_fd;
+}
+
+/**
+ * Reads the memory available to the system.
+ *
+ * @return long - MemAvailable in MB, -1 if unknown
+ */
+static long read_memory(void)
+{
+    FILE *fp = fopen("/proc/meminfo", "r");
+    char line[128];
+    long kb = -1;
+
+    if (!fp)
+		return -1;
+    while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "MemAvailable: %ld kB", &kb) == 1)
+			break;
+    fclose(fp);
+
+    return kb < 0 ? -1 : kb / 1024;
+}
+
+/**
+ * Computes the share of CPU time stolen since the previous sample.
+ *
+ * @return int - Percent, -1 if unknown
+ */
+static int read_steal(struct overload *o)
+{
+    unsigned long long v[8], total = 0, dt, ds;
+    FILE *fp = fopen("/proc/stat", "r");
+    int i, n, steal = -1;
+
+    if (!fp)
+		return -1;
+    n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    fclose(fp);
+    if (n != 8)
+		return -1;
+
+    for (i = 0; i < 8; i++)
+		total += v[i];
+    dt = total - o->cpu_total;
+    ds = v[7] - o->cpu_steal;
+    if (o->cpu_total && dt)
+		steal = ds * 100 / dt;
+    o->cpu_total = total;
+    o->cpu_steal = v[7];
+
+    return steal;
+}
+
+/**
+ * Tells whether the host as a whole is overloaded, with the last sample.
+ *
+ * @return const char* - Reason, NULL if the host is not overloaded
+ */
+static const char *host_overloaded(const struct overload *o)
+{
+    const struct overload_limits *l = o->limits;
+
+    if (l->max_tunnels && o->count >= l->max_tunnels)
+		return "too many tunnels";
+    if (l->max_lag && o->lag > l->max_lag)
+		return "event loop lag";
+    if (l->min_memory && o->memory >= 0 && o->memory < l->min_memory)
+		return "low memory";
+    if (l->max_steal && o->steal > l->max_steal)
+		return "CPU steal";
+    return NULL;
+}
+
+/**
+ * Terminates the newest tunnel of the largest region, if the overload is
+ * caused by the tunnels themselves and none is already being terminated.
+ */
+static void drop_tunnel(struct overload *o)
+{
+    const struct overload_limits *l = o->limits;
+    struct region largest;
+    char region[64];
+    int i, victim, count;
+
+    if (o->dropping) // Wait until the previous one has exited
+		return;
+    /* the stolen CPU time is not caused by the tunnels, and reaching max_tunnels only stops new ones */
+    if (!(l->max_tunnels && o->count > l->max_tunnels) &&
+		!(l->max_lag && o->lag > l->max_lag) &&
+		!(l->min_memory && o->memory >= 0 && o->memory < l->min_memory))
+		return;
+
+    if (!(count = largest_region(o, &largest)))
+		return;
+    for (i = 0, victim = -1; i < o->count; i++)
+		if (memcmp(&o->tunnels[i].region, &largest, sizeof(largest)) == 0 &&
+			(victim < 0 || o->tunnels[i].started >= o->tunnels[victim].started))
+			victim = i;
+
+    print_region(&o->tunnels[victim].region, region, sizeof(region));
+    log_printf(log_warning, "Overloaded (%s): terminating tunnel %d from %s, which has %d tunnels",
+		o->reason, (int) o->tunnels[victim].pid, region, count);
+    if (kill(o->tunnels[victim].pid, SIGTERM) == 0) {
+		o->dropping = o->tunnels[victim].pid;
+		o->dropped++;
+    }
+}
+
+/**
+ * Measures the lag of the event loop and, once per second, samples the host
+ * and sheds the load if needed. Called when the timer descriptor is readable.
+ *
+ * @param overload (struct overload*) - Tracker
+ *
+ * @return void
+ */
+void overload_tick(struct overload *overload)
+{
+    struct overload *o = overload;
+    struct itimerspec its;
+    uint64_t expirations;
+    const char *reason;
+    long long now;
+    int lag;
+
+    if (read(o->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+    /* the timer fired expirations times since we last read it, the last time OVERLOAD_TICK_MS - remaining ago */
+    if (timerfd_gettime(o->timer_fd, &its) == 0) {
+		lag = (expirations - 1) * OVERLOAD_TICK_MS + OVERLOAD_TICK_MS
+			- (its.it_value.tv_sec * 1000 + its.it_value.tv_nsec / 1000000);
+		if (lag > o->window_lag)
+			o->window_lag = lag;
+    }
+
+    now = monotonic_ms();
+    if (now - o->last_sample < SAMPLE_MS)
+		return;
+    o->last_sample = now;
+
+    o->lag = o->window_lag;
+    o->window_lag = 0;
+    o->memory = read_memory();
+    o->steal = read_steal(o);
+
+    reason = host_overloaded(o);
+    if (reason && !o->reason)
+		log_printf(log_warning, "Overloaded (%s): shedding new connections", reason);
+    else if (!reason && o->reason)
+		log_printf(log_notice, "No longer overloaded");
+    o->reason = reason;
+    o->overloaded_samples = reason ? o->overloaded_samples + 1 : 0;
+
+    if (reason && o->overloaded_samples >= DROP_AFTER)
+		drop_tunnel(o);
+}
+
+/**
+ * Decides whether a new connection may start a tunnel.
+ *
+ * @param overload (struct overload*) - Tracker, the shed counters are updated
+ * @param addr (const struct sockaddr*) - Address of the client
+ *
+ * @return const char* - NULL to accept the connection, otherwise why it must be rejected
+ */
+const char *overload_admit(struct overload *overload, const struct sockaddr *addr)
+{
+    struct overload *o = overload;
+    const struct overload_limits *l = o->limits;
+    struct region region;
+
+    if (l->max_tunnels && o->count >= l->max_tunnels) {
+		o->shed_tunnels++;
+		return "too many tunnels";
+    }
+    if (l->max_region_tunnels) {
+		address_region(addr, &region);
+		if (region_count(o, &region) >= l->max_region_tunnels) {
+			o->shed_region++;
+			return "too many tunnels from the region";
+		}
+    }
+    if (l->max_lag && o->lag > l->max_lag) {
+		o->shed_lag++;
+		return "event loop lag";
+    }
+    if (l->min_memory && o->memory >= 0 && o->memory < l->min_memory) {
+		o->shed_memory++;
+		return "low memory";
+    }
+    if (l->max_steal && o->steal > l->max_steal) {
+		o->shed_steal++;
+		return "CPU steal";
+    }
+    return NULL;
+}
+
+/**
+ * Records a tunnel process.
+ *
+ * @param overload (struct overload*) - Tracker
+ * @param pid (pid_t) - Process of the tunnel
+ * @param addr (const struct sockaddr*) - Address of the client
+ *
+ * @return void
+ */
+void overload_add(struct overload *overload, pid_t pid, const struct sockaddr *addr)
+{
+    struct tunnel *t = new_tunnel(overload);
+
+    t->pid = pid;
+    t->started = monotonic_ms();
+    address_region(addr, &t->region);
+}
+
+/**
+ * Forgets a tunnel process which has exited.
+ *
+ * @param overload (struct overload*) - Tracker
+ * @param pid (pid_t) - Process reaped by waitpid(), it may be unknown
+ *
+ * @return void
+ */
+void overload_remove(struct overload *overload, pid_t pid)
+{
+    struct overload *o = overload;
+    int i;
+
+    if (pid == o->dropping)
+		o->dropping = 0;
+    for (i = 0; i < o->count; i++) {
+		if (o->tunnels[i].pid == pid) {
+			o->tunnels[i] = o->tunnels[--o->count];
+			return;
+		}
+    }
+}
+
+/**
+ * Sends a signal to every tunnel process.
+ *
+ * @param overload (const struct overload*) - Tracker
+ * @param sig (int) - Signal number
+ *
+ * @return int - Number of tunnels signaled
+ */
+int overload_signal(const struct overload *overload, int sig)
+{
+    int i, n = 0;
+
+    for (i = 0; i < overload->count; i++)
+		if (kill(overload->tunnels[i].pid, sig) == 0)
+			n++;
+    return n;
+}
+
+/**
+ * Lists the measured signals and the shed counters as "key value" lines.
+ *
+ * @param overload (const struct overload*) - Tracker
+ * @param buf (char*) - Output buffer, always NUL-terminated
+ * @param len (size_t) - Size of buf
+ *
+ * @return size_t - Length of the text, which may have been truncated as snprintf() does
+ */
+size_t overload_format(const struct overload *overload, char *buf, size_t len)
+{
+    const struct overload *o = overload;
+    struct region largest;
+    char region[64] = "-";
+    int count;
+
+    if ((count = largest_region(o, &largest)))
+		print_region(&largest, region, sizeof(region));
+
+    return snprintf(buf, len,
+		"tunnels %d\n"
+		"largest-region %s %d\n"
+		"lag-ms %d\n"
+		"memory-available-mb %ld\n"
+		"cpu-steal-pct %d\n"
+		"overloaded %s\n"
+		"shed-tunnels %lu\n"
+		"shed-region %lu\n"
+		"shed-lag %lu\n"
+		"shed-memory %lu\n"
+		"shed-steal %lu\n"
+		"dropped %lu\n",
+		o->count, region, count, o->lag, o->memory, o->steal, o->reason ? o->reason : "no",
+		o->shed_tunnels, o->shed_region, o->shed_lag, o->shed_memory, o->shed_steal, o->dropped);
+}
+
+/**
+ * Serializes the tunnel table, for the next binary after an upgrade.
+ * If the buffer is too small the newest tunnels are left out.
+ *
+ * @param overload (const struct overload*) - Tracker
+ * @param buf (void*) - Output buffer
+ * @param len (size_t) - Size of buf
+ *
+ * @return size_t - Number of bytes written, 0 if not even the header fits
+ */
+size_t overload_export(const struct overload *overload, void *buf, size_t len)
+{
+    struct overload_export_header header;
+    size_t n = overload->count, room;
+
+    if (len < sizeof(header))
+		return 0;
+    room = (len - sizeof(header)) / sizeof(struct tunnel);
+    if (n > room) {
+		log_printf(log_warning, "Upgrade: %zu tunnels will not be tracked", n - room);
+		n = room;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = OVERLOAD_EXPORT_MAGIC;
+    header.entry_size = sizeof(struct tunnel);
+    header.count = n;
+    memcpy(buf, &header, sizeof(header));
+    memcpy((char *) buf + sizeof(header), overload->tunnels, n * sizeof(struct tunnel));
+    return sizeof(header) + n * sizeof(struct tunnel);
+}
+
+/**
+ * Restores the tunnel table serialized by overload_export().
+ *
+ * @param overload (struct overload*) - Tracker
+ * @param buf (const void*) - Serialized table
+ * @param len (size_t) - Length of buf
+ *
+ * @return int - 0 on success, -1 if the table has another layout (nothing imported)
+ */
+int overload_import(struct overload *overload, const void *buf, size_t len)
+{
+    struct overload_export_header header;
+    const char *t = (const char *) buf + sizeof(header);
+    size_t i;
+
+    if (len == 0) // Not even the header fitted
+		return 0;
+    if (len < sizeof(header))
+		return -1;
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != OVERLOAD_EXPORT_MAGIC || header.entry_size != sizeof(struct tunnel) ||
+		len != sizeof(header) + (size_t) header.count * sizeof(struct tunnel))
+		return -1;
+
+    for (i = 0; i < header.count; i++)
+		memcpy(new_tunnel(overload), t + i * sizeof(struct tunnel), sizeof(struct tunnel));
+    return 0;
+}
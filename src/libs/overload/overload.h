@@ -0,0 +1,60 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __OVERLOAD_H__
+    #define __OVERLOAD_H__
+
+    #include <stddef.h>
+    #include <sys/types.h>
+    #include <sys/socket.h>
+
+    /* interval of the timer measuring the event loop lag */
+    #define OVERLOAD_TICK_MS 100
+
+    /**
+     * Thresholds of the overload protection, 0 disables a check.
+     */
+    struct overload_limits {
+        int max_tunnels;               // Tunnels running at the same time
+        int max_region_tunnels;        // Tunnels from a single /24 (IPv4) or /48 (IPv6) network
+        int max_lag;                   // Event loop lag in milliseconds
+        int min_memory;                // Memory available to the system in MB
+        int max_steal;                 // CPU time stolen by the hypervisor, in percent
+    };
+
+    struct overload;
+
+    struct overload *overload_new(const struct overload_limits *limits);
+
+    int overload_fd(const struct overload *overload);
+
+    void overload_tick(struct overload *overload);
+
+    const char *overload_admit(struct overload *overload, const struct sockaddr *addr);
+
+    void overload_add(struct overload *overload, pid_t pid, const struct sockaddr *addr);
+
+    void overload_remove(struct overload *overload, pid_t pid);
+
+    int overload_signal(const struct overload *overload, int sig);
+
+    size_t overload_format(const struct overload *overload, char *buf, size_t len);
+
+    size_t overload_export(const struct overload *overload, void *buf, size_t len);
+
+    int overload_import(struct overload *overload, const void *buf, size_t len);
+
+#endif
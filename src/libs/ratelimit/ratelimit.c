@@ -0,0 +1,222 @@
+/*
+ * Rate Limit Library - Token buckets per UDP source address
+ *
+ * Each source address gets a bucket of packets which refills at a fixed rate,
+ * so one sender cannot take all the capacity of the tunnel, and the packets
+ * dropped are counted for each source.
+ *
+ * The buckets live in a fixed table of 1024 sets of 4 entries, indexed by a
+ * hash of the address: a new source replaces the least recently seen entry
+ * of its set. A flood from random spoofed addresses thus only recycles
+ * entries and the memory never grows. A new entry holds a single packet, and
+ * the sources which enter the table share one more bucket of the same rate
+ * and size: neither a spoofed flood nor a source which was evicted gets more
+ * than one source would. The table holds no pointers, so it can be cleared
+ * or shared as a single block.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ratelimit.h"
+#include "../utils/utils.h"
+
+#define SETS 1024                  // A power of 2
+#define WAYS 4                     // Entries of a set, searched linearly
+#define TOKEN 1000                 // A packet, in thousandths of token
+#define TOP_DROPS 16               // Sources listed by ratelimit_format()
+
+/* bucket of a source address */
+struct source {
+    struct in6_addr addr;          // IPv4 addresses are stored IPv4-mapped
+    uint32_t last;                 // CLOCK_MONOTONIC ms of the last packet, 0 if the entry is free
+    uint32_t tokens;               // Thousandths of packet available
+    uint32_t drops;                // Packets dropped since the source entered the table
+};
+
+struct ratelimit {
+    struct source sets[SETS][WAYS];
+    struct source unknown;         // Bucket shared by the sources entering the table
+    unsigned long long passed, dropped;
+};
+
+/**
+ * Creates an empty table of buckets.
+ *
+ * @return struct ratelimit* - New table, exits if out of memory
+ */
+struct ratelimit *ratelimit_new(void)
+{
+    return NOFAIL(calloc(1, sizeof(struct ratelimit)));
+}
+
+/* coarse clock: a few ms of precision are enough for the refills, and it costs no system call */
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint32_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) | 1; // Never 0, which means free
+}
+
+static uint32_t set_index(const struct in6_addr *addr)
+{
+    uint64_t hi, lo;
+
+    memcpy(&hi, addr->s6_addr, sizeof(hi));
+    memcpy(&lo, addr->s6_addr + sizeof(hi), sizeof(lo));
+    lo ^= hi * 0x9e3779b97f4a7c15ULL;
+    lo *= 0xbf58476d1ce4e5b9ULL;
+    return (lo >> 32) & (SETS - 1);
+}
+
+/* refills a bucket for the time elapsed since its last packet, a bucket never used is full */
+static void refill(struct source *src, uint32_t now, int rate, uint32_t capacity)
+{
+    uint64_t tokens;
+
+    if (!src->last) {
+		src->tokens = capacity;
+		return;
+    }
+    tokens = src->tokens + (uint64_t) (now - src->last) * rate; // rate is at most INT_MAX: no overflow
+    src->tokens = tokens < capacity ? tokens : capacity;
+}
+
+/**
+ * Takes a packet from the bucket of a source, after refilling it for the
+ * time elapsed since its last packet. The first packet of a source which is
+ * not in the table is taken from the bucket of the unknown sources.
+ *
+ * @param ratelimit (struct ratelimit*) - Table of buckets
+ * @param addr (const struct sockaddr*) - Source of the packet
+ * @param rate (int) - Packets per second allowed to each source, 0 for no limit
+ * @param burst (int) - Size of the buckets, in packets
+ *
+ * @return int - 1 if the packet may pass, 0 if it must be dropped
+ */
+int ratelimit_check(struct ratelimit *ratelimit, const struct sockaddr *addr, int rate, int burst)
+{
+    struct in6_addr key;
+    struct source *set, *src = NULL;
+    uint32_t now, capacity;
+    int i;
+
+    if (rate <= 0)
+		return 1;
+
+    if (addr->sa_family == AF_INET) {
+		memset(&key, 0, sizeof(key));
+		key.s6_addr[10] = key.s6_addr[11] = 0xff;
+		memcpy(key.s6_addr + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+    } else if (addr->sa_family == AF_INET6) {
+		key = ((const struct sockaddr_in6 *) addr)->sin6_addr;
+    } else { // Local AF_UNIX senders are not limited
+		return 1;
+    }
+
+    now = now_ms();
+    capacity = (uint32_t) burst * TOKEN;
+    set = ratelimit->sets[set_index(&key)];
+    for (i = 0; i < WAYS; i++) {
+		if (set[i].last && memcmp(&set[i].addr, &key, sizeof(key)) == 0) {
+			src = &set[i];
+			break;
+		}
+    }
+
+    if (!src) { // New source: evict the least recently seen one of the set
+		refill(&ratelimit->unknown, now, rate, capacity);
+		ratelimit->unknown.last = now;
+		if (ratelimit->unknown.tokens < TOKEN) {
+			ratelimit->unknown.drops++;
+			ratelimit->dropped++;
+			return 0;
+		}
+		ratelimit->unknown.tokens -= TOKEN;
+		src = &set[0];
+		for (i = 1; i < WAYS && src->last; i++)
+			if (!set[i].last || (int32_t) (set[i].last - src->last) < 0)
+				src = &set[i];
+		src->addr = key;
+		src->tokens = TOKEN;
+		src->drops = 0;
+    } else {
+		refill(src, now, rate, capacity);
+    }
+    src->last = now;
+
+    if (src->tokens < TOKEN) {
+		src->drops++;
+		ratelimit->dropped++;
+		return 0;
+    }
+    src->tokens -= TOKEN;
+    ratelimit->passed++;
+    return 1;
+}
+
+/**
+ * Reports the packets passed and dropped, and the sources which had the most
+ * drops among the ones still in the table.
+ *
+ * @param ratelimit (const struct ratelimit*) - Table of buckets
+ * @param buf (char*) - Output buffer, always NUL-terminated
+ * @param len (size_t) - Size of buf
+ *
+ * @return size_t - Length of the text, which may have been truncated as snprintf() does
+ */
+size_t ratelimit_format(const struct ratelimit *ratelimit, char *buf, size_t len)
+{
+    const struct source *top[TOP_DROPS];
+    size_t used;
+    int n = 0, i, j;
+
+    used = snprintf(buf, len, "rate-passed %llu\nrate-dropped %llu\nrate-dropped-unknown %u\n",
+		ratelimit->passed, ratelimit->dropped, ratelimit->unknown.drops);
+
+    /* insertion in a short sorted list: the table is only scanned when asked */
+    for (i = 0; i < SETS * WAYS; i++) {
+		const struct source *src = &ratelimit->sets[i / WAYS][i % WAYS];
+
+		if (!src->last || !src->drops || (n == TOP_DROPS && src->drops <= top[n - 1]->drops))
+			continue;
+		if (n < TOP_DROPS)
+			n++;
+		for (j = n - 1; j > 0 && top[j - 1]->drops < src->drops; j--)
+			top[j] = top[j - 1];
+		top[j] = src;
+    }
+
+    for (i = 0; i < n; i++) {
+		char addr[INET6_ADDRSTRLEN];
+
+		if (IN6_IS_ADDR_V4MAPPED(&top[i]->addr))
+			inet_ntop(AF_INET, top[i]->addr.s6_addr + 12, addr, sizeof(addr));
+		else
+			inet_ntop(AF_INET6, &top[i]->addr, addr, sizeof(addr));
+		used += snprintf(buf + (used < len ? used : len), used < len ? len - used : 0,
+			"rate-drops %s %u\n", addr, top[i]->drops);
+    }
+
+    return used;
+}
@@ -0,0 +1,31 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __RATELIMIT_H__
+    #define __RATELIMIT_H__
+
+    #include <stddef.h>
+    #include <sys/socket.h>
+
+    struct ratelimit;
+
+    struct ratelimit *ratelimit_new(void);
+
+    int ratelimit_check(struct ratelimit *ratelimit, const struct sockaddr *addr, int rate, int burst);
+
+    size_t ratelimit_format(const struct ratelimit *ratelimit, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * libudptunnel - Embeddable udptunnel relay core
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "relay.h"
+
+/* header of the state written by udptunnel_export() */
+struct udptunnel_export_header {
+    uint32_t magic;                // UDPTUNNEL_EXPORT_MAGIC
+    uint32_t state;                // Parser state
+    uint32_t packet_length;        // Expected length of the current stream element
+    uint32_t data_len;             // Unparsed bytes following the header
+    char handshake[UDPTUNNEL_HANDSHAKE_SIZE];
+};
+
+#define UDPTUNNEL_EXPORT_MAGIC 0x55545331  // "UTS1", bump when the layout changes
+
+/**
+ * Relay handle: TCP stream parsing state and reassembly buffer.
+ */
+struct udptunnel {
+    struct udptunnel_allocator allocator; // Allocator which owns this handle
+    char handshake[UDPTUNNEL_HANDSHAKE_SIZE]; // Handshake sent or expected
+    size_t data_start;             // Start of the unparsed data in buf
+    size_t data_end;               // End of the valid data in buf
+    size_t packet_length;          // Expected length of the current stream element
+    enum {
+		reading_handshake,         // Expecting handshake data from TCP peer
+		reading_length,            // Reading 2-byte length prefix
+		reading_packet,            // Reading UDP payload data
+		failed,                    // Bad handshake received, nothing more is parsed
+    } state;                       // TCP stream parsing state machine
+    char buf[UDPTUNNEL_BUFFER_SIZE]; // TCP stream buffer for parsing packets
+};
+
+/*
+ * Default 32-byte handshake authentication token:
+ * - Bytes 0-15: "udptunnel by md." + 3 null terminators (human-readable signature)
+ * - Bytes 16-31: Binary entropy sequence \x01\x03\x06\x10\x15\x21\x28\x36\x45\x55\x66\x78\x91
+ *   providing additional randomness and making the handshake harder to forge accidentally.
+ *   The specific byte values create a distinctive fingerprint for protocol validation.
+ */
+const char udptunnel_default_handshake[UDPTUNNEL_HANDSHAKE_SIZE] =
+    "udptunnel by md.\0\0\0\x01\x03\x06\x10\x15\x21\x28\x36\x45\x55\x66\x78\x91";
+
+static void *default_alloc(size_t size, void *ctx)
+{
+    return malloc(size);
+}
+
+static void default_free(void *ptr, void *ctx)
+{
+    free(ptr);
+}
+
+/**
+ * Creates a relay handle.
+ *
+ * @param tunnel (struct udptunnel**) - Output handle
+ * @param config (const struct udptunnel_config*) - Relay parameters
+ * @param allocator (const struct udptunnel_allocator*) - Allocator, NULL to use malloc()
+ *
+ * @return int - 0 on success, UDPTUNNEL_ENOMEM or UDPTUNNEL_EINVAL
+ */
+int udptunnel_new(struct udptunnel **tunnel, const struct udptunnel_config *config,
+	const struct udptunnel_allocator *allocator)
+{
+    const struct udptunnel_allocator malloc_allocator = { default_alloc, default_free, NULL };
+    struct udptunnel *t;
+
+    if (!tunnel || !config)
+		return UDPTUNNEL_EINVAL;
+    if (!allocator)
+		allocator = &malloc_allocator;
+    if (!allocator->alloc || !allocator->free)
+		return UDPTUNNEL_EINVAL;
+
+    if (!(t = allocator->alloc(sizeof(*t), allocator->ctx)))
+		return UDPTUNNEL_ENOMEM;
+
+    t->allocator = *allocator;
+    memcpy(t->handshake, config->handshake ? config->handshake : udptunnel_default_handshake,
+		sizeof(t->handshake));
+    t->data_start = t->data_end = 0;
+    if (config->expect_handshake) {
+		t->state = reading_handshake;
+		t->packet_length = sizeof(t->handshake); // Expect 32-byte handshake first
+    } else {
+		t->state = reading_length;
+		t->packet_length = UDPTUNNEL_HEADER_SIZE; // Expect 2-byte length prefix
+    }
+
+    *tunnel = t;
+    return 0;
+}
+
+/**
+ * Frees a relay handle with the allocator it was created with.
+ */
+void udptunnel_free(struct udptunnel *tunnel)
+{
+    if (tunnel)
+		tunnel->allocator.free(tunnel, tunnel->allocator.ctx);
+}
+
+/**
+ * Returns a description of an error code.
+ */
+const char *udptunnel_strerror(int err)
+{
+    switch (err) {
+		case 0:
+			return "Success";
+		case UDPTUNNEL_ENOMEM:
+			return "Out of memory";
+		case UDPTUNNEL_EINVAL:
+			return "Invalid argument";
+		case UDPTUNNEL_EMSGSIZE:
+			return "Packet too large";
+		case UDPTUNNEL_ENOSPC:
+			return "Buffer too small";
+		case UDPTUNNEL_EHANDSHAKE:
+			return "Bad handshake";
+		default:
+			return "Unknown error";
+    }
+}
+
+/**
+ * Copies the handshake which the client must send before any packet.
+ *
+ * @param tunnel (const struct udptunnel*) - Relay handle
+ * @param out (void*) - Output buffer
+ * @param outlen (size_t) - Size of out
+ *
+ * @return int - Number of bytes written, or UDPTUNNEL_ENOSPC
+ */
+int udptunnel_handshake(const struct udptunnel *tunnel, void *out, size_t outlen)
+{
+    if (outlen < sizeof(tunnel->handshake))
+		return UDPTUNNEL_ENOSPC;
+
+    memcpy(out, tunnel->handshake, sizeof(tunnel->handshake));
+    return sizeof(tunnel->handshake);
+}
+
+/**
+ * Tells whether the peer handshake has been validated.
+ *
+ * @return int - 1 once packets can be decoded, 0 otherwise
+ */
+int udptunnel_established(const struct udptunnel *tunnel)
+{
+    return tunnel->state == reading_length || tunnel->state == reading_packet;
+}
+
+/**
+ * Tells whether all the stream data received so far has been decoded, and
+ * the next byte of the stream starts a new packet. The stream can then be
+ * handed over to another parser, such as the kernel one of AF_KCM.
+ *
+ * @return int - 1 at a packet boundary with nothing buffered, 0 otherwise
+ */
+int udptunnel_tcp_drained(const struct udptunnel *tunnel)
+{
+    return tunnel->state == reading_length && tunnel->data_start == tunnel->data_end;
+}
+
+/**
+ * Writes the length prefix of a packet, for callers which send the payload
+ * from their own buffer with a vectored write.
+ *
+ * @param len (size_t) - Packet length
+ * @param header (void*) - Output buffer of UDPTUNNEL_HEADER_SIZE bytes
+ *
+ * @return int - UDPTUNNEL_HEADER_SIZE, or UDPTUNNEL_EMSGSIZE
+ */
+int udptunnel_frame_header(size_t len, void *header)
+{
+    uint16_t length;
+
+    if (len > UDPTUNNEL_MAX_PAYLOAD)
+		return UDPTUNNEL_EMSGSIZE;
+
+    length = htons(len);
+    memcpy(header, &length, sizeof(length));
+    return sizeof(length);
+}
+
+/**
+ * Encapsulates a UDP packet for the TCP stream.
+ *
+ * @param tunnel (struct udptunnel*) - Relay handle
+ * @param packet (const void*) - UDP payload
+ * @param len (size_t) - Payload length
+ * @param out (void*) - Output buffer, which may not overlap packet
+ * @param outlen (size_t) - Size of out, at least len + UDPTUNNEL_HEADER_SIZE
+ *
+ * @return int - Number of bytes to write to the stream, or UDPTUNNEL_EMSGSIZE
+ *               or UDPTUNNEL_ENOSPC
+ */
+int udptunnel_udp_in(struct udptunnel *tunnel, const void *packet, size_t len, void *out, size_t outlen)
+{
+    int res;
+
+    if (len > UDPTUNNEL_MAX_PAYLOAD)
+		return UDPTUNNEL_EMSGSIZE;
+    if (outlen < len + UDPTUNNEL_HEADER_SIZE)
+		return UDPTUNNEL_ENOSPC;
+
+    res = udptunnel_frame_header(len, out);
+    memcpy((char *) out + res, packet, len);
+    return res + len;
+}
+
+/**
+ * Returns the free space of the reassembly buffer, so that the caller can
+ * read from the stream in place and then call udptunnel_tcp_commit().
+ * The packets returned by udptunnel_udp_next() become invalid.
+ *
+ * @param tunnel (struct udptunnel*) - Relay handle
+ * @param space (void**) - Output pointer to the free space
+ * @param len (size_t*) - Output size of the free space, never 0
+ *
+ * @return int - 0 on success, UDPTUNNEL_EHANDSHAKE after a bad handshake
+ */
+int udptunnel_tcp_buffer(struct udptunnel *tunnel, void **space, size_t *len)
+{
+    if (tunnel->state == failed)
+		return UDPTUNNEL_EHANDSHAKE;
+
+    /*
+     * Compact buffer: move any remaining unprocessed data to the start of the buffer.
+     * Doing it once per read instead of once per packet avoids moving the tail
+     * of the buffer again for every small frame. An incomplete element is never
+     * longer than the buffer, so some space is always left.
+     */
+    if (tunnel->data_start != 0) {
+		memmove(tunnel->buf, tunnel->buf + tunnel->data_start, tunnel->data_end - tunnel->data_start);
+		tunnel->data_end -= tunnel->data_start;
+		tunnel->data_start = 0;
+    }
+
+    *space = tunnel->buf + tunnel->data_end;
+    *len = sizeof(tunnel->buf) - tunnel->data_end;
+    return 0;
+}
+
+/**
+ * Accounts for the bytes stored by the caller in the space returned by
+ * udptunnel_tcp_buffer().
+ *
+ * @return int - 0 on success, UDPTUNNEL_EINVAL if len exceeds the free space
+ */
+int udptunnel_tcp_commit(struct udptunnel *tunnel, size_t len)
+{
+    if (len > sizeof(tunnel->buf) - tunnel->data_end)
+		return UDPTUNNEL_EINVAL;
+
+    tunnel->data_end += len;
+    return 0;
+}
+
+/**
+ * Feeds bytes received from the TCP stream.
+ * Fewer bytes than offered are accepted when the buffer is full: the caller
+ * must pull the decoded packets and offer the rest again.
+ *
+ * @param tunnel (struct udptunnel*) - Relay handle
+ * @param data (const void*) - Stream data
+ * @param len (size_t) - Length of data
+ *
+ * @return int - Number of bytes accepted, or UDPTUNNEL_EHANDSHAKE
+ */
+int udptunnel_tcp_in(struct udptunnel *tunnel, const void *data, size_t len)
+{
+    void *space;
+    size_t space_len;
+    int res;
+
+    if ((res = udptunnel_tcp_buffer(tunnel, &space, &space_len)) < 0)
+		return res;
+
+    if (len > space_len)
+		len = space_len;
+    if (len > INT32_MAX)
+		len = INT32_MAX;
+    memcpy(space, data, len);
+    tunnel->data_end += len;
+    return len;
+}
+
+/**
+ * Decodes one complete stream element, the next tunnel->packet_length bytes
+ * at start. The caller then skips those bytes, whatever the result.
+ *
+ * @return int - 1 if the element was a packet, 0 for a handshake or a length
+ *               prefix, UDPTUNNEL_EHANDSHAKE if the peer sent a bad handshake
+ */
+static int decode_element(struct udptunnel *tunnel, const char *start, const char **packet, size_t *len)
+{
+    if (tunnel->state == reading_handshake) {
+		/* check the handshake string */
+		if (memcmp(start, tunnel->handshake, sizeof(tunnel->handshake)) != 0) {
+			tunnel->state = failed;
+			return UDPTUNNEL_EHANDSHAKE;
+		}
+		tunnel->state = reading_length;
+		tunnel->packet_length = UDPTUNNEL_HEADER_SIZE;
+		return 0;
+    } else if (tunnel->state == reading_length) {
+		/* Extract packet length from network byte order */
+		uint16_t length;
+
+		memcpy(&length, start, sizeof(length));
+		tunnel->packet_length = ntohs(length); // Convert from big-endian
+		tunnel->state = reading_packet;
+		return 0;
+    } else if (tunnel->state == reading_packet) {
+		*packet = start;
+		*len = tunnel->packet_length;
+		tunnel->state = reading_length;
+		tunnel->packet_length = UDPTUNNEL_HEADER_SIZE;
+		return 1;
+    }
+    return UDPTUNNEL_EHANDSHAKE;
+}
+
+/**
+ * Decodes the next packet of the TCP stream without copying it.
+ * The packet stays valid until the next udptunnel_tcp_in() or
+ * udptunnel_tcp_buffer() call, so a batch of packets can be sent at once.
+ *
+ * @param tunnel (struct udptunnel*) - Relay handle
+ * @param packet (const char**) - Output pointer to the UDP payload
+ * @param len (size_t*) - Output payload length
+ *
+ * @return int - 1 if a packet was returned, 0 if more stream data is needed,
+ *               UDPTUNNEL_EHANDSHAKE if the peer sent a bad handshake
+ */
+int udptunnel_udp_next(struct udptunnel *tunnel, const char **packet, size_t *len)
+{
+    while (tunnel->data_end - tunnel->data_start >= tunnel->packet_length) { // Process complete elements
+		size_t element = tunnel->packet_length;
+		int res;
+
+		if ((res = decode_element(tunnel, tunnel->buf + tunnel->data_start, packet, len)) < 0)
+			return res;
+		tunnel->data_start += element; // Skip past the handshake, prefix or returned payload
+		if (res > 0)
+			return res;
+    }
+
+    return tunnel->state == failed ? UDPTUNNEL_EHANDSHAKE : 0;
+}
+
+/**
+ * Decodes the next packet from stream data which stays in the caller memory,
+ * such as socket pages mapped with TCP_ZEROCOPY_RECEIVE. An element partly
+ * buffered by an earlier call is completed in the handle; the following ones
+ * are returned in place, without being copied.
+ * When 0 is returned, the *len bytes left are the start of an incomplete
+ * element: the caller feeds them with udptunnel_tcp_in() once it no longer
+ * uses the packets returned, since that call may overwrite them.
+ *
+ * @param tunnel (struct udptunnel*) - Relay handle
+ * @param data (const char**) - Stream data, advanced past the decoded bytes
+ * @param datalen (size_t*) - Length of data, decreased accordingly
+ * @param packet (const char**) - Output pointer to the UDP payload
+ * @param len (size_t*) - Output payload length
+ *
+ * @return int - 1 if a packet was returned, 0 if more stream data is needed,
+ *               UDPTUNNEL_EHANDSHAKE if the peer sent a bad handshake
+ */
+int udptunnel_udp_scan(struct udptunnel *tunnel, const char **data, size_t *datalen,
+	const char **packet, size_t *len)
+{
+    int res;
+
+    /* finish in the buffer the element started there */
+    while (tunnel->data_start != tunnel->data_end) {
+		size_t buffered = tunnel->data_end - tunnel->data_start;
+		size_t missing = tunnel->packet_length > buffered ? tunnel->packet_length - buffered : 0;
+
+		if (missing > *datalen)
+			return 0;
+		if ((res = udptunnel_tcp_in(tunnel, *data, missing)) < 0)
+			return res;
+		*data += missing;
+		*datalen -= missing;
+		if ((res = udptunnel_udp_next(tunnel, packet, len)) != 0)
+			return res;
+    }
+
+    while (*datalen >= tunnel->packet_length) {
+		size_t element = tunnel->packet_length;
+
+		if ((res = decode_element(tunnel, *data, packet, len)) < 0)
+			return res;
+		*data += element;
+		*datalen -= element;
+		if (res > 0)
+			return res;
+    }
+
+    return tunnel->state == failed ? UDPTUNNEL_EHANDSHAKE : 0;
+}
+
+/**
+ * Decodes the next packet of the TCP stream into a caller buffer.
+ *
+ * @param tunnel (struct udptunnel*) - Relay handle
+ * @param buf (void*) - Output buffer
+ * @param buflen (size_t) - Size of buf
+ * @param len (size_t*) - Output payload length
+ *
+ * @return int - 1 if a packet was copied, 0 if more stream data is needed,
+ *               UDPTUNNEL_ENOSPC if buf is too small for the packet (which is
+ *               kept for the next call), UDPTUNNEL_EHANDSHAKE
+ */
+int udptunnel_udp_out(struct udptunnel *tunnel, void *buf, size_t buflen, size_t *len)
+{
+    const char *packet;
+    size_t packet_len;
+    size_t data_start = tunnel->data_start, packet_length = tunnel->packet_length;
+    int state = tunnel->state;
+    int res;
+
+    if ((res = udptunnel_udp_next(tunnel, &packet, &packet_len)) <= 0)
+		return res;
+
+    if (packet_len > buflen) { // Rewind the parser, the packet will be returned again
+		tunnel->data_start = data_start;
+		tunnel->packet_length = packet_length;
+		tunnel->state = state;
+		return UDPTUNNEL_ENOSPC;
+    }
+
+    memcpy(buf, packet, packet_len);
+    *len = packet_len;
+    return 1;
+}
+
+/**
+ * Serializes the parser state and the unparsed stream data, so that another
+ * process can continue the same stream with udptunnel_import().
+ * Packets returned by udptunnel_udp_next() are not part of the state.
+ *
+ * @param tunnel (const struct udptunnel*) - Relay handle
+ * @param out (void*) - Output buffer, UDPTUNNEL_EXPORT_SIZE bytes are always enough
+ * @param outlen (size_t) - Size of out
+ *
+ * @return int - Number of bytes written, or UDPTUNNEL_ENOSPC
+ */
+int udptunnel_export(const struct udptunnel *tunnel, void *out, size_t outlen)
+{
+    struct udptunnel_export_header header;
+
+    header.magic = UDPTUNNEL_EXPORT_MAGIC;
+    header.state = tunnel->state;
+    header.packet_length = tunnel->packet_length;
+    header.data_len = tunnel->data_end - tunnel->data_start;
+    memcpy(header.handshake, tunnel->handshake, sizeof(header.handshake));
+
+    if (outlen < sizeof(header) + header.data_len)
+		return UDPTUNNEL_ENOSPC;
+
+    memcpy(out, &header, sizeof(header));
+    memcpy((char *) out + sizeof(header), tunnel->buf + tunnel->data_start, header.data_len);
+    return sizeof(header) + header.data_len;
+}
+
+/**
+ * Restores a state written by udptunnel_export(), replacing the current one.
+ *
+ * @param tunnel (struct udptunnel*) - Relay handle
+ * @param in (const void*) - Exported state
+ * @param len (size_t) - Length of in
+ *
+ * @return int - 0 on success, UDPTUNNEL_EINVAL if the state is not valid
+ */
+int udptunnel_import(struct udptunnel *tunnel, const void *in, size_t len)
+{
+    struct udptunnel_export_header header;
+
+    if (len < sizeof(header))
+		return UDPTUNNEL_EINVAL;
+    memcpy(&header, in, sizeof(header));
+
+    if (header.magic != UDPTUNNEL_EXPORT_MAGIC || header.state > failed ||
+		header.data_len > sizeof(tunnel->buf) || len != sizeof(header) + header.data_len)
+		return UDPTUNNEL_EINVAL;
+    if (header.packet_length > UINT16_MAX)
+		return UDPTUNNEL_EINVAL;
+
+    tunnel->state = header.state;
+    tunnel->packet_length = header.packet_length;
+    memcpy(tunnel->handshake, header.handshake, sizeof(tunnel->handshake));
+    memcpy(tunnel->buf, (const char *) in + sizeof(header), header.data_len);
+    tunnel->data_start = 0;
+    tunnel->data_end = header.data_len;
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * libudptunnel - Embeddable udptunnel relay core
+ *
+ * The relay core converts between UDP packets and the udptunnel TCP stream
+ * format without doing any I/O, so it can be driven by any event loop:
+ *
+ * - UDP -> TCP: udptunnel_udp_in() encapsulates a packet into the caller
+ *   buffer, ready to be written to the stream (or udptunnel_frame_header()
+ *   builds just the length prefix for vectored writes).
+ * - TCP -> UDP: the bytes read from the stream are fed with udptunnel_tcp_in()
+ *   (or read in place with udptunnel_tcp_buffer()/udptunnel_tcp_commit()),
+ *   then the decoded packets are pulled with udptunnel_udp_next() or
+ *   udptunnel_udp_out() until they return 0. Stream data which is already
+ *   in memory, such as mapped socket pages, can instead be decoded in place
+ *   with udptunnel_udp_scan().
+ *
+ * udptunnel_export() and udptunnel_import() move the parsing state of a
+ * handle to another process, e.g. to continue the stream after an upgrade.
+ *
+ * Functions never exit or log: errors are returned as negative UDPTUNNEL_E*
+ * codes. A handle must be used by a single thread at a time.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __RELAY_H__
+    #define __RELAY_H__
+
+    #include <stddef.h>
+
+    #define UDPTUNNEL_HANDSHAKE_SIZE 32    // Authentication string sent first by the client
+    #define UDPTUNNEL_HEADER_SIZE 2        // Big-endian length prefix of each packet
+    #define UDPTUNNEL_MAX_PAYLOAD 65534    // Largest packet accepted by udptunnel_udp_in()
+    #define UDPTUNNEL_BUFFER_SIZE 65536    // Stream reassembly buffer of each handle
+    #define UDPTUNNEL_EXPORT_SIZE (48 + UDPTUNNEL_BUFFER_SIZE) // Largest state written by udptunnel_export()
+
+    /* error codes, always negative */
+    enum {
+        UDPTUNNEL_ENOMEM = -1,             // The allocator failed
+        UDPTUNNEL_EINVAL = -2,             // Invalid argument
+        UDPTUNNEL_EMSGSIZE = -3,           // Packet larger than UDPTUNNEL_MAX_PAYLOAD
+        UDPTUNNEL_ENOSPC = -4,             // Output buffer too small
+        UDPTUNNEL_EHANDSHAKE = -5,         // The peer sent a bad handshake, the handle is unusable
+    };
+
+    /**
+     * Memory allocator used for the handle. ctx is passed back unchanged.
+     */
+    struct udptunnel_allocator {
+        void *(*alloc)(size_t size, void *ctx);
+        void (*free)(void *ptr, void *ctx);
+        void *ctx;
+    };
+
+    /**
+     * Relay parameters.
+     */
+    struct udptunnel_config {
+        const char *handshake;             // UDPTUNNEL_HANDSHAKE_SIZE bytes, NULL for the default one
+        int expect_handshake;              // 1 = the stream starts with the peer handshake (server side)
+    };
+
+    struct udptunnel;
+
+    extern const char udptunnel_default_handshake[UDPTUNNEL_HANDSHAKE_SIZE];
+
+    int udptunnel_new(struct udptunnel **tunnel, const struct udptunnel_config *config,
+		const struct udptunnel_allocator *allocator);
+
+    void udptunnel_free(struct udptunnel *tunnel);
+
+    const char *udptunnel_strerror(int err);
+
+    int udptunnel_handshake(const struct udptunnel *tunnel, void *out, size_t outlen);
+
+    int udptunnel_established(const struct udptunnel *tunnel);
+
+    int udptunnel_tcp_drained(const struct udptunnel *tunnel);
+
+    int udptunnel_frame_header(size_t len, void *header);
+
+    int udptunnel_udp_in(struct udptunnel *tunnel, const void *packet, size_t len, void *out, size_t outlen);
+
+    int udptunnel_tcp_in(struct udptunnel *tunnel, const void *data, size_t len);
+
+    int udptunnel_tcp_buffer(struct udptunnel *tunnel, void **space, size_t *len);
+
+    int udptunnel_tcp_commit(struct udptunnel *tunnel, size_t len);
+
+    int udptunnel_udp_next(struct udptunnel *tunnel, const char **packet, size_t *len);
+
+    int udptunnel_udp_scan(struct udptunnel *tunnel, const char **data, size_t *datalen,
+		const char **packet, size_t *len);
+
+    int udptunnel_udp_out(struct udptunnel *tunnel, void *buf, size_t buflen, size_t *len);
+
+    int udptunnel_export(const struct udptunnel *tunnel, void *out, size_t outlen);
+
+    int udptunnel_import(struct udptunnel *tunnel, const void *in, size_t len);
+
+#endif
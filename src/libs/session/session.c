@@ -0,0 +1,639 @@
+/*
+ * Session Library - Tunnels which outlive the TCP connection of their client
+ *
+ * Behind a load balancer, a client which reconnects usually reaches another
+ * server node, and a new tunnel there would use another UDP socket: the
+ * destination would see a new source port and the datagrams sent in the
+ * meantime would be lost. A client with a session sends a random session ID
+ * after its handshake; the tunnel of the session stays alive for a while
+ * when the connection ends, and the nodes find it through a directory.
+ *
+ * Components:
+ * - Session record: 0xffff, a frame length which the stream never uses, then
+ *   the 16-byte session ID, right after the handshake
+ * - Directory: one small file per session in a directory shared by the nodes
+ *   (a local directory on a single host, a shared filesystem otherwise),
+ *   naming the owner node, the tunnel process, the UDP binding and the unix
+ *   socket of the tunnel; it is written with rename() so that readers never
+ *   see a partial entry
+ * - Handoff: the owner node passes a resumed connection to the tunnel of the
+ *   session with SCM_RIGHTS, on a unix socket named after the session ID in
+ *   the directory; a refused handoff means that the tunnel is gone. The
+ *   directory must be private to the user of the servers (mode 0700), so that
+ *   no other local user can pass a descriptor to a tunnel or take one
+ * - Proxy: another node connects to the owner node as the client would, with
+ *   the same handshake and session record, and copies the bytes both ways
+ * - Replay buffer: while its client is away the tunnel keeps the frames from
+ *   the destination, up to SESSION_REPLAY_SIZE bytes, and sends them first on
+ *   the resumed connection
+ *
+ * A session whose tunnel is gone is adopted by the node which receives it:
+ * the new tunnel binds its UDP socket to the address and port of the previous
+ * one when it can, so that the destination still sees the same source.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "session.h"
+#include "../network/network.h"
+#include "../relay/relay.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#define REPLAY_SUFFIX ".sock"
+
+struct session_dir {
+    char *path;
+    char *node;                    // Tunnel address of this node, as the other nodes reach it
+    unsigned long resumed, forwarded, started;
+};
+
+struct session {
+    struct session_dir *dir;
+    unsigned char id[SESSION_ID_SIZE];
+    int fd;                        // Unix socket taking the resumed connections
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)]; // Its path in the directory
+    ino_t inode;                   // Its inode, not unlinked once another tunnel replaced it
+    time_t parked;                 // When the session expires while its client is away, 0 while connected
+    char *replay;                  // Frames from the destination kept while the client is away
+    size_t replay_len;
+    unsigned long dropped;         // Frames which did not fit in the replay buffer
+};
+
+/* the session of this tunnel process, removed from the directory on exit */
+static struct session *current;
+
+/**
+ * Generates a random session ID.
+ *
+ * @param id (unsigned char*) - Output, SESSION_ID_SIZE bytes
+ *
+ * @return void - exits if the random source cannot be read
+ */
+void session_new_id(unsigned char *id)
+{
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || read(fd, id, SESSION_ID_SIZE) != SESSION_ID_SIZE)
+		err_sys("read(/dev/urandom)");
+    close(fd);
+}
+
+/**
+ * Builds the session record which follows the handshake.
+ *
+ * @param id (const unsigned char*) - Session ID
+ * @param record (char*) - Output, SESSION_RECORD_SIZE bytes
+ *
+ * @return void
+ */
+void session_record(const unsigned char *id, char *record)
+{
+    record[0] = record[1] = (char) 0xff;
+    memcpy(record + 2, id, SESSION_ID_SIZE);
+}
+
+/**
+ * Formats a session ID in hexadecimal, for the logs and the names.
+ *
+ * @param id (const unsigned char*) - Session ID
+ *
+ * @return const char* - Static buffer, overwritten by the next call
+ */
+const char *session_id_str(const unsigned char *id)
+{
+    static char buf[2 * SESSION_ID_SIZE + 1];
+    int i;
+
+    for (i = 0; i < SESSION_ID_SIZE; i++)
+		sprintf(buf + 2 * i, "%02x", id[i]);
+    return buf;
+}
+
+/* the file of the entry of a session */
+static void entry_path(const struct session_dir *dir, const unsigned char *id, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/%s", dir->path, session_id_str(id));
+}
+
+/* fills the address of the unix socket of a session, whose path length is checked by session_dir_open() */
+static socklen_t replay_addr(const char *path, struct sockaddr_un *sun)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    snprintf(sun->sun_path, sizeof(sun->sun_path), "%s", path);
+    return offsetof(struct sockaddr_un, sun_path) + strlen(sun->sun_path) + 1;
+}
+
+/**
+ * Opens the session directory shared by the server nodes, creating it if
+ * needed.
+ *
+ * @param path (const char*) - Directory
+ * @param node (const char*) - Tunnel address of this node, as the other nodes reach it
+ *
+ * @return struct session_dir* - Directory, exits on error
+ */
+struct session_dir *session_dir_open(const char *path, const char *node)
+{
+    struct session_dir *dir;
+    struct stat st;
+
+    if (strlen(path) + 1 + 2 * SESSION_ID_SIZE + sizeof(REPLAY_SUFFIX) > sizeof(((struct sockaddr_un *) 0)->sun_path))
+		log_printf_exit(2, log_err, "%s is too long for the unix sockets of the sessions", path);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		err_sys("mkdir(%s)", path);
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		log_printf_exit(2, log_err, "%s is not a directory", path);
+    if (st.st_uid != geteuid() || (st.st_mode & 077))
+		log_printf_exit(2, log_err, "%s must belong to this user and be private to it (chmod 700): "
+			"its sockets hand the connections over to the tunnels", path);
+
+    dir = NOFAIL(calloc(1, sizeof(*dir)));
+    dir->path = NOFAIL(strdup(path));
+    dir->node = NOFAIL(strdup(node));
+    return dir;
+}
+
+/**
+ * Returns the tunnel address of this node.
+ *
+ * @param dir (const struct session_dir*) - Directory
+ *
+ * @return const char* - Address, as written in the entries
+ */
+const char *session_dir_node(const struct session_dir *dir)
+{
+    return dir->node;
+}
+
+/**
+ * Finds where the tunnel of a session runs.
+ *
+ * @param dir (const struct session_dir*) - Directory
+ * @param record (const char*) - Session record received after the handshake
+ * @param id (unsigned char*) - Output session ID, SESSION_ID_SIZE bytes
+ * @param entry (struct session_entry*) - Output entry
+ *
+ * @return int - 0 if the session has an entry, -1 if it is unknown
+ */
+int session_lookup(const struct session_dir *dir, const char *record, unsigned char *id,
+	struct session_entry *entry)
+{
+    char path[PATH_MAX], line[512];
+    FILE *fp;
+
+    memcpy(id, record + 2, SESSION_ID_SIZE);
+    memset(entry, 0, sizeof(*entry));
+    entry_path(dir, id, path, sizeof(path));
+    if (!(fp = fopen(path, "re")))
+		return -1;
+    while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, "node ", 5) == 0)
+			snprintf(entry->node, sizeof(entry->node), "%.*s", (int) sizeof(entry->node) - 1, line + 5);
+		else if (strncmp(line, "pid ", 4) == 0)
+			entry->pid = strtol(line + 4, NULL, 10);
+		else if (strncmp(line, "binding ", 8) == 0)
+			snprintf(entry->binding, sizeof(entry->binding), "%.*s", (int) sizeof(entry->binding) - 1, line + 8);
+		else if (strncmp(line, "replay ", 7) == 0)
+			snprintf(entry->replay, sizeof(entry->replay), "%.*s", (int) sizeof(entry->replay) - 1, line + 7);
+    }
+    fclose(fp);
+    return entry->node[0] && entry->replay[0] ? 0 : -1;
+}
+
+/**
+ * Passes a resumed connection to the tunnel of its session, on this host.
+ *
+ * @param replay (const char*) - Unix socket of the tunnel, from the entry
+ * @param fd (int) - Blocking connection of the client, the handshake and the record consumed
+ *
+ * @return int - 0 if the tunnel took it, -1 if the tunnel is gone (errno set)
+ */
+int session_handoff(const char *replay, int fd)
+{
+    struct sockaddr_un sun;
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    char byte = 0;
+    int sock, res, saved;
+
+    if ((sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_name = &sun;
+    msg.msg_namelen = replay_addr(replay, &sun);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    res = sendmsg(sock, &msg, MSG_DONTWAIT);
+    saved = errno;
+    close(sock);
+    errno = saved;
+    return res < 0 ? -1 : 0;
+}
+
+/**
+ * Creates a UDP socket bound to the binding of an adopted session, so that
+ * the destination keeps seeing the same source address and port.
+ *
+ * @param binding (const char*) - ADDRESS:PORT or [ADDRESS]:PORT, from the entry
+ *
+ * @return int - Bound socket, or -1 if the address is not local or still in use
+ */
+int session_bind(const char *binding)
+{
+    struct sockaddr_storage ss;
+    struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+    char address[INET6_ADDRSTRLEN + 2];
+    const char *colon = strrchr(binding, ':');
+    size_t len;
+    int fd;
+
+    if (!colon || (len = colon - binding) >= sizeof(address))
+		return -1;
+    memcpy(address, binding, len);
+    address[len] = '\0';
+
+    memset(&ss, 0, sizeof(ss));
+    if (address[0] == '[' && address[len - 1] == ']') {
+		address[len - 1] = '\0';
+		if (inet_pton(AF_INET6, address + 1, &sin6->sin6_addr) != 1)
+			return -1;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(atoi(colon + 1));
+    } else {
+		if (inet_pton(AF_INET, address, &sin->sin_addr) != 1)
+			return -1;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(atoi(colon + 1));
+    }
+
+    if ((fd = socket(ss.ss_family, SOCK_DGRAM, 0)) < 0)
+		return -1;
+    if (bind(fd, (struct sockaddr *) &ss, addr_len((struct sockaddr *) &ss)) < 0) {
+		log_printf_err(log_info, "Cannot bind to the previous source %s of the session", binding);
+		close(fd);
+		return -1;
+    }
+    return fd;
+}
+
+/* writes all of buf, 0 on success */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while (len) {
+		if ((res = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += res;
+		len -= res;
+    }
+    return 0;
+}
+
+/**
+ * Copies the bytes between a client and the owner node of its session,
+ * until either of them closes its connection.
+ *
+ * @param client (int) - Connection of the client
+ * @param owner (int) - Connection to the owner node, the handshake and the record sent
+ *
+ * @return void
+ */
+void session_proxy(int client, int owner)
+{
+    static char buf[65536];
+    int fds[2] = { client, owner };
+
+    while (1) {
+		fd_set readfds;
+		int max = 0;
+		int i;
+		ssize_t len;
+
+		FD_ZERO(&readfds);
+		for (i = 0; i < 2; i++) {
+			FD_SET(fds[i], &readfds);
+			SET_MAX(fds[i]);
+		}
+		if (select(max, &readfds, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			err_sys("select");
+		}
+		for (i = 0; i < 2; i++) {
+			if (!FD_ISSET(fds[i], &readfds))
+				continue;
+			if ((len = read(fds[i], buf, sizeof(buf))) <= 0 || write_all(fds[!i], buf, len) < 0)
+				return;
+		}
+    }
+}
+
+/**
+ * Counts what the server did with a connection which sent a session record.
+ *
+ * @param dir (struct session_dir*) - Directory
+ * @param outcome (enum session_outcome) - What was done
+ *
+ * @return void
+ */
+void session_count(struct session_dir *dir, enum session_outcome outcome)
+{
+    if (outcome == SESSION_RESUMED)
+		dir->resumed++;
+    else if (outcome == SESSION_FORWARDED)
+		dir->forwarded++;
+    else
+		dir->started++;
+}
+
+/**
+ * Formats the counters of the sessions for the status command.
+ *
+ * @param dir (const struct session_dir*) - Directory
+ * @param buf (char*) - Output buffer
+ * @param len (size_t) - Size of the buffer
+ *
+ * @return size_t - Length of the text, as returned by snprintf()
+ */
+size_t session_dir_format(const struct session_dir *dir, char *buf, size_t len)
+{
+    return snprintf(buf, len,
+		"session-node %s\n"
+		"sessions-resumed %lu\n"
+		"sessions-forwarded %lu\n"
+		"sessions-started %lu\n",
+		dir->node, dir->resumed, dir->forwarded, dir->started);
+}
+
+/* removes the entry of the session of this process, unless another one took it over */
+static void unpublish(void)
+{
+    struct session_entry entry;
+    char record[SESSION_RECORD_SIZE], path[PATH_MAX];
+    unsigned char id[SESSION_ID_SIZE];
+    struct stat st;
+
+    if (!current)
+		return;
+    if (stat(current->path, &st) == 0 && st.st_ino == current->inode) // Not a socket of another tunnel
+		unlink(current->path);
+    session_record(current->id, record);
+    if (session_lookup(current->dir, record, id, &entry) == 0 && entry.pid == (long) getpid() &&
+		strcmp(entry.node, current->dir->node) == 0) {
+		entry_path(current->dir, id, path, sizeof(path));
+		unlink(path);
+    }
+}
+
+/* removes the socket of a session whose tunnel is gone, -1 if a tunnel of this host still listens on it */
+static int replay_stale(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd, res;
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+    res = connect(fd, (struct sockaddr *) &sun, replay_addr(path, &sun));
+    close(fd);
+    if (res == 0 || errno != ECONNREFUSED) {
+		errno = EADDRINUSE;
+		return -1;
+    }
+    return unlink(path);
+}
+
+/**
+ * Makes the tunnel of this process the owner of a session: it listens for
+ * the resumed connections and publishes its entry in the directory, which
+ * is removed when the process exits.
+ *
+ * @param dir (struct session_dir*) - Directory
+ * @param id (const unsigned char*) - Session ID
+ * @param udp_sock (int) - UDP socket of the tunnel, whose binding is published
+ *
+ * @return struct session* - Session, or NULL if another process still serves it
+ */
+struct session *session_open(struct session_dir *dir, const unsigned char *id, int udp_sock)
+{
+    struct session *session;
+    struct sockaddr_un sun;
+    struct sockaddr_storage local;
+    socklen_t locallen = sizeof(local);
+    char replay[sizeof(sun.sun_path)];
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct stat st;
+    FILE *fp;
+    int fd;
+
+    snprintf(replay, sizeof(replay), "%s/%s" REPLAY_SUFFIX, dir->path, session_id_str(id));
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		err_sys("socket(AF_UNIX)");
+    if (bind(fd, (struct sockaddr *) &sun, replay_addr(replay, &sun)) < 0 &&
+		(errno != EADDRINUSE || replay_stale(replay) < 0 ||
+		bind(fd, (struct sockaddr *) &sun, replay_addr(replay, &sun)) < 0)) {
+		log_printf_err(log_warning, "Cannot take over the session %s", session_id_str(id));
+		close(fd);
+		return NULL;
+    }
+
+    session = NOFAIL(calloc(1, sizeof(*session)));
+    session->dir = dir;
+    memcpy(session->id, id, SESSION_ID_SIZE);
+    session->fd = fd;
+    snprintf(session->path, sizeof(session->path), "%s", replay);
+    session->inode = stat(replay, &st) == 0 ? st.st_ino : 0;
+
+    entry_path(dir, id, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%ld", dir->path, session_id_str(id), (long) getpid());
+    if (!(fp = fopen(tmp, "we"))) {
+		log_printf_err(log_err, "Cannot publish the session in %s", tmp);
+		return session; // Only resumable on this node
+    }
+    fprintf(fp, "node %s\npid %ld\nbinding %s\nreplay %s\n", dir->node, (long) getpid(),
+		udp_sock >= 0 && getsockname(udp_sock, (struct sockaddr *) &local, &locallen) == 0 ?
+		print_addr_port((struct sockaddr *) &local, locallen) : "-", replay);
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		log_printf_err(log_err, "Cannot publish the session in %s", path);
+		unlink(tmp);
+		return session;
+    }
+
+    if (!current)
+		atexit(unpublish);
+    current = session;
+    return session;
+}
+
+/**
+ * Returns the unix socket of the resumed connections, to wait for them.
+ *
+ * @param session (const struct session*) - Session
+ *
+ * @return int - File descriptor
+ */
+int session_fd(const struct session *session)
+{
+    return session->fd;
+}
+
+/**
+ * Receives a resumed connection of the client. The replay buffer is then
+ * sent with session_replay().
+ *
+ * @param session (struct session*) - Session with a readable socket
+ *
+ * @return int - Connection, or -1 if none was received
+ */
+int session_accept(struct session *session)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    char byte;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(session->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) < 0)
+		return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * Keeps the session alive without a client until a deadline.
+ *
+ * @param session (struct session*) - Session
+ * @param until (time_t) - When the tunnel gives up waiting for its client
+ *
+ * @return void
+ */
+void session_park(struct session *session, time_t until)
+{
+    session->parked = until;
+}
+
+/**
+ * Tells whether the client of the session is away.
+ *
+ * @param session (const struct session*) - Session
+ *
+ * @return time_t - When the session expires, 0 if its client is connected
+ */
+time_t session_parked(const struct session *session)
+{
+    return session->parked;
+}
+
+/**
+ * Keeps a packet from the destination for the client which is away. The
+ * packets which do not fit in the replay buffer are dropped.
+ *
+ * @param session (struct session*) - Parked session
+ * @param packet (const char*) - Payload
+ * @param len (size_t) - Length of the payload
+ *
+ * @return void
+ */
+void session_keep(struct session *session, const char *packet, size_t len)
+{
+    if (!session->replay)
+		session->replay = NOFAIL(malloc(SESSION_REPLAY_SIZE));
+    if (len > UDPTUNNEL_MAX_PAYLOAD || session->replay_len + UDPTUNNEL_HEADER_SIZE + len > SESSION_REPLAY_SIZE) {
+		session->dropped++;
+		return;
+    }
+    udptunnel_frame_header(len, session->replay + session->replay_len);
+    memcpy(session->replay + session->replay_len + UDPTUNNEL_HEADER_SIZE, packet, len);
+    session->replay_len += UDPTUNNEL_HEADER_SIZE + len;
+}
+
+/**
+ * Sends the packets kept while the client was away on its new connection,
+ * before anything else.
+ *
+ * @param session (struct session*) - Session
+ * @param fd (int) - Resumed connection
+ *
+ * @return int - 0 on success, -1 on error (errno set)
+ */
+int session_replay(struct session *session, int fd)
+{
+    size_t len = session->replay_len;
+
+    session->replay_len = 0;
+    if (session->dropped)
+		log_printf(log_info, "Dropped %lu packets which did not fit in the replay buffer", session->dropped);
+    session->dropped = 0;
+    if (!len)
+		return 0;
+    log_printf(log_debug, "Replaying %zu bytes kept while the client was away", len);
+    return write_all(fd, session->replay, len);
+}
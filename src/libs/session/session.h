@@ -0,0 +1,89 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SESSION_H__
+    #define __SESSION_H__
+
+    #include <stddef.h>
+    #include <time.h>
+
+    /* random identifier of the session of a client */
+    #define SESSION_ID_SIZE 16
+
+    /* record sent by the client after the handshake: 0xffff, then the session ID */
+    #define SESSION_RECORD_SIZE (2 + SESSION_ID_SIZE)
+
+    /* frames from the destination kept for a client while it reconnects, in bytes */
+    #define SESSION_REPLAY_SIZE (256 * 1024)
+
+    /**
+     * Entry of the session directory: where the tunnel of a session runs.
+     */
+    struct session_entry {
+        char node[256];                // Tunnel address of the owner server, as the other nodes reach it
+        long pid;                      // Tunnel process of the session on the owner
+        char binding[128];             // Local address and port of the UDP socket of the session
+        char replay[128];              // Unix socket of the tunnel in the directory, which takes the connections
+    };
+
+    /* what the server did with a connection which sent a session record */
+    enum session_outcome {
+        SESSION_RESUMED,               // Handed over to the local tunnel of the session
+        SESSION_FORWARDED,             // Forked to reach the tunnel on another node
+        SESSION_STARTED,               // Forked to start the session, or to adopt it
+    };
+
+    struct session_dir;
+    struct session;
+
+    void session_new_id(unsigned char *id);
+
+    void session_record(const unsigned char *id, char *record);
+
+    const char *session_id_str(const unsigned char *id);
+
+    struct session_dir *session_dir_open(const char *path, const char *node);
+
+    const char *session_dir_node(const struct session_dir *dir);
+
+    int session_lookup(const struct session_dir *dir, const char *record, unsigned char *id,
+		struct session_entry *entry);
+
+    int session_handoff(const char *replay, int fd);
+
+    int session_bind(const char *binding);
+
+    void session_proxy(int client, int owner);
+
+    void session_count(struct session_dir *dir, enum session_outcome outcome);
+
+    size_t session_dir_format(const struct session_dir *dir, char *buf, size_t len);
+
+    struct session *session_open(struct session_dir *dir, const unsigned char *id, int udp_sock);
+
+    int session_fd(const struct session *session);
+
+    int session_accept(struct session *session);
+
+    void session_park(struct session *session, time_t until);
+
+    time_t session_parked(const struct session *session);
+
+    void session_keep(struct session *session, const char *packet, size_t len);
+
+    int session_replay(struct session *session, int fd);
+
+#endif
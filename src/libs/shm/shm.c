@@ -0,0 +1,372 @@
+/*
+ * Shared Memory Library - Packet transport for co-located applications
+ *
+ * Applications running on the same host as udptunnel can exchange packets
+ * with it through a pair of lock-free SPSC rings in a memfd, instead of
+ * using a UDP socket. An application attaches by connecting to a unix
+ * stream socket: udptunnel answers with the memfd and two eventfds used as
+ * doorbells, and the unix connection is then only used to notice when the
+ * application goes away. Only one application can be attached at a time.
+ *
+ * The application side is implemented by the udptunnel_shm client library.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for memfd_create...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shm.h"
+#include "shm_ring.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+/**
+ * Tunnel side of the shared memory transport.
+ */
+struct shm_tunnel {
+    int listen_fd;                 // Unix stream socket applications attach to
+    int conn_fd;                   // Connection of the attached application, -1 if none
+    int rx_efd, tx_efd;            // Doorbells: ours and the application's
+    struct shm_area *area;         // Mapped memfd
+    size_t area_size;
+    struct shm_ring *rx, *tx;      // Application -> tunnel and tunnel -> application rings
+    uint32_t ring_size;            // Trusted copy of the ring size
+    uint32_t rx_pos;               // Consumer cursor of the packets handed out by shm_tunnel_recv()
+    unsigned long tx_drops;        // Packets dropped because the application ring was full
+};
+
+/**
+ * Creates the unix socket on which applications attach.
+ * A stale socket left by a previous instance is removed first.
+ *
+ * @param path (const char*) - Filesystem path of the attach socket
+ * @param ring_size (uint32_t) - Data bytes of each ring, a power of two
+ *
+ * @return struct shm_tunnel* - Tunnel side state. Function exits on error.
+ */
+struct shm_tunnel *shm_tunnel_listen(const char *path, uint32_t ring_size)
+{
+    struct shm_tunnel *shm;
+    struct sockaddr_un sun;
+    struct stat st;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path))
+		log_printf_exit(2, log_err, "Invalid unix socket path '%s'!", path);
+    strcpy(sun.sun_path, path);
+
+    shm = NOFAIL(calloc(1, sizeof(*shm)));
+    shm->conn_fd = shm->rx_efd = shm->tx_efd = -1;
+    shm->ring_size = ring_size;
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+    if ((shm->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		err_sys("socket(AF_UNIX)");
+    if (bind(shm->listen_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err_sys("Cannot bind to %s", path);
+    if (listen(shm->listen_fd, 8) < 0)
+		err_sys("listen");
+
+    log_printf(log_info, "Listening for shared memory clients on %s", path);
+
+    return shm;
+}
+
+int shm_tunnel_listen_fd(const struct shm_tunnel *shm)
+{
+    return shm->listen_fd;
+}
+
+/**
+ * Returns the connection of the attached application, or -1.
+ */
+int shm_tunnel_conn_fd(const struct shm_tunnel *shm)
+{
+    return shm->conn_fd;
+}
+
+/**
+ * Returns the eventfd signalled by the application, or -1 if none is attached.
+ */
+int shm_tunnel_doorbell_fd(const struct shm_tunnel *shm)
+{
+    return shm->rx_efd;
+}
+
+/**
+ * Releases the resources of the attached application.
+ */
+static void shm_tunnel_detach(struct shm_tunnel *shm)
+{
+    if (shm->area)
+		munmap(shm->area, shm->area_size);
+    if (shm->rx_efd >= 0)
+		close(shm->rx_efd);
+    if (shm->tx_efd >= 0)
+		close(shm->tx_efd);
+    if (shm->conn_fd >= 0)
+		close(shm->conn_fd);
+
+    if (shm->tx_drops)
+		log_printf(log_info, "Shared memory client dropped %lu packets for a full ring", shm->tx_drops);
+
+    shm->area = NULL;
+    shm->rx = shm->tx = NULL;
+    shm->conn_fd = shm->rx_efd = shm->tx_efd = -1;
+    shm->tx_drops = 0;
+}
+
+/**
+ * Accepts an application and sends it the shared area and the doorbells.
+ * Failures only affect the application being attached.
+ *
+ * @param shm (struct shm_tunnel*) - Tunnel side state
+ *
+ * @return void
+ */
+void shm_tunnel_accept(struct shm_tunnel *shm)
+{
+    struct shm_attach_msg hello;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+    } control;
+    int fds[3];
+    int fd, memfd;
+
+    if ((fd = accept(shm->listen_fd, NULL, NULL)) < 0) {
+		if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)
+			return;
+		err_sys("accept(shm)");
+    }
+
+    if (shm->conn_fd >= 0) {
+		log_printf(log_notice, "Rejecting a shared memory client: another one is attached");
+		close(fd);
+		return;
+    }
+
+    shm->conn_fd = fd;
+    shm->area_size = shm_area_size(shm->ring_size);
+
+    if ((memfd = memfd_create("udptunnel-shm", MFD_CLOEXEC)) < 0) {
+		log_printf_err(log_err, "memfd_create");
+		goto fail;
+    }
+    if (ftruncate(memfd, shm->area_size) < 0) {
+		log_printf_err(log_err, "ftruncate(memfd)");
+		close(memfd);
+		goto fail;
+    }
+    shm->area = mmap(NULL, shm->area_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm->area == MAP_FAILED) {
+		shm->area = NULL;
+		log_printf_err(log_err, "mmap(memfd)");
+		close(memfd);
+		goto fail;
+    }
+
+    /* keep our own ring pointers: the header is writable by the application */
+    shm_area_init(shm->area, shm->ring_size);
+    shm->rx = shm_area_ring(shm->area, SHM_RING_TO_TUNNEL);
+    shm->tx = shm_area_ring(shm->area, SHM_RING_TO_APP);
+    shm->rx_pos = 0;
+
+    shm->rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm->tx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shm->rx_efd < 0 || shm->tx_efd < 0) {
+		log_printf_err(log_err, "eventfd");
+		close(memfd);
+		goto fail;
+    }
+
+    hello.magic = SHM_MAGIC;
+    hello.area_size = shm->area_size;
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    fds[0] = memfd;
+    fds[1] = shm->rx_efd;
+    fds[2] = shm->tx_efd;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		log_printf_err(log_err, "sendmsg(shm)");
+		close(memfd);
+		goto fail;
+    }
+    close(memfd); // the mapping keeps the memory alive
+
+    log_printf(log_notice, "Shared memory client attached (%u bytes per ring)", shm->ring_size);
+    return;
+
+fail:
+    shm_tunnel_detach(shm);
+}
+
+/**
+ * Handles activity on the connection of the attached application.
+ * The application does not send anything: readability means that it closed
+ * the connection or died.
+ */
+void shm_tunnel_conn_event(struct shm_tunnel *shm)
+{
+    char buf[64];
+    ssize_t len = read(shm->conn_fd, buf, sizeof(buf));
+
+    if (len > 0 || (len < 0 && (errno == EAGAIN || errno == EINTR)))
+		return;
+
+    log_printf(log_notice, "Shared memory client detached");
+    shm_tunnel_detach(shm);
+}
+
+/**
+ * Arms the doorbell before the main loop sleeps.
+ *
+ * @return int - 1 if packets are already waiting and the caller must not block
+ */
+int shm_tunnel_prepare_sleep(struct shm_tunnel *shm)
+{
+    if (!shm->rx)
+		return 0;
+
+    return shm_ring_prepare_sleep(shm->rx);
+}
+
+/**
+ * Takes up to max packets from the application ring without copying them.
+ * shm_tunnel_release() must be called before the next shm_tunnel_recv().
+ *
+ * @param shm (struct shm_tunnel*) - Tunnel side state
+ * @param pkts (struct shm_packet*) - Output array
+ * @param max (int) - Size of pkts
+ *
+ * @return int - Number of packets stored in pkts
+ */
+int shm_tunnel_recv(struct shm_tunnel *shm, struct shm_packet *pkts, int max)
+{
+    uint64_t count;
+    int n = 0, res = 0;
+
+    if (!shm->rx)
+		return 0;
+
+    /* reset the doorbell if the application may have rung it */
+    if (shm->rx->need_wakeup) {
+		shm_ring_woken(shm->rx);
+		if (read(shm->rx_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			err_sys("read(eventfd)");
+    }
+
+    while (n < max && (res = shm_ring_peek(shm->rx, shm->ring_size, &shm->rx_pos, &pkts[n].payload, &pkts[n].length)) > 0)
+		n++;
+
+    if (res < 0) {
+		log_printf(log_err, "Corrupted shared memory ring, detaching the client");
+		shm_tunnel_detach(shm);
+		return 0;
+    }
+
+    return n;
+}
+
+/**
+ * Gives the space of the packets returned by shm_tunnel_recv() back to the application.
+ */
+void shm_tunnel_release(struct shm_tunnel *shm)
+{
+    if (shm->rx)
+		shm_ring_consume(shm->rx, shm->rx_pos);
+}
+
+/**
+ * Copies a packet to the application ring, ringing its doorbell if it sleeps.
+ * Like a full UDP socket buffer, a full ring drops the packet.
+ *
+ * @param shm (struct shm_tunnel*) - Tunnel side state
+ * @param buf (const char*) - Packet data
+ * @param len (uint32_t) - Packet length
+ *
+ * @return int - 0 on success, -1 if no application is attached or the packet was dropped
+ */
+int shm_tunnel_send(struct shm_tunnel *shm, const char *buf, uint32_t len)
+{
+    uint64_t one = 1;
+
+    if (!shm->tx)
+		return -1;
+
+    if (shm_ring_push(shm->tx, shm->ring_size, buf, len) < 0) {
+		shm->tx_drops++;
+		return -1;
+    }
+
+    if (shm_ring_wakeup_needed(shm->tx) && write(shm->tx_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		err_sys("write(eventfd)");
+
+    return 0;
+}
+
+#else
+
+struct shm_tunnel *shm_tunnel_listen(const char *path, uint32_t ring_size)
+{
+    log_printf_exit(2, log_err, "The shared memory transport is not supported on this platform");
+}
+
+int shm_tunnel_listen_fd(const struct shm_tunnel *shm) { return -1; }
+int shm_tunnel_conn_fd(const struct shm_tunnel *shm) { return -1; }
+int shm_tunnel_doorbell_fd(const struct shm_tunnel *shm) { return -1; }
+void shm_tunnel_accept(struct shm_tunnel *shm) { }
+void shm_tunnel_conn_event(struct shm_tunnel *shm) { }
+int shm_tunnel_prepare_sleep(struct shm_tunnel *shm) { return 0; }
+int shm_tunnel_recv(struct shm_tunnel *shm, struct shm_packet *pkts, int max) { return 0; }
+void shm_tunnel_release(struct shm_tunnel *shm) { }
+int shm_tunnel_send(struct shm_tunnel *shm, const char *buf, uint32_t len) { return -1; }
+
+#endif
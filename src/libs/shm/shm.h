@@ -0,0 +1,56 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SHM_H__
+    #define __SHM_H__
+
+    #include <stdint.h>
+
+    /* maximum number of packets returned by a single shm_tunnel_recv() call */
+    #define SHM_BATCH_SIZE 64
+
+    /**
+     * A packet taken from the application ring. The payload points into the
+     * shared memory and stays valid until shm_tunnel_release().
+     */
+    struct shm_packet {
+        char *payload;
+        uint32_t length;
+    };
+
+    struct shm_tunnel;
+
+    struct shm_tunnel *shm_tunnel_listen(const char *path, uint32_t ring_size);
+
+    int shm_tunnel_listen_fd(const struct shm_tunnel *shm);
+
+    int shm_tunnel_conn_fd(const struct shm_tunnel *shm);
+
+    int shm_tunnel_doorbell_fd(const struct shm_tunnel *shm);
+
+    void shm_tunnel_accept(struct shm_tunnel *shm);
+
+    void shm_tunnel_conn_event(struct shm_tunnel *shm);
+
+    int shm_tunnel_prepare_sleep(struct shm_tunnel *shm);
+
+    int shm_tunnel_recv(struct shm_tunnel *shm, struct shm_packet *pkts, int max);
+
+    void shm_tunnel_release(struct shm_tunnel *shm);
+
+    int shm_tunnel_send(struct shm_tunnel *shm, const char *buf, uint32_t len);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * Shared Memory Ring - Lock-free SPSC packet rings
+ *
+ * Used both by udptunnel and by the application-side client library, so
+ * this file must not log or exit: errors are reported with return values.
+ *
+ * Wakeup protocol: a consumer about to sleep sets need_wakeup and checks the
+ * ring again; a producer publishes the new head and then checks need_wakeup,
+ * signalling the consumer's eventfd only if it is set. The full fences on
+ * both sides guarantee that at least one of them sees the other's store, so
+ * no wakeup is lost and no system call is made while the consumer is busy.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "shm_ring.h"
+
+#define SHM_PAD_RECORD 0xffffffffU         // Marks the unused tail of the data area
+#define SHM_RECORD_SIZE(len) ((4 + (len) + 7) & ~7U)
+
+/**
+ * Computes the size of a shared area holding two rings.
+ *
+ * @param ring_size (uint32_t) - Data bytes of each ring, a power of two
+ *
+ * @return size_t - Size of the area in bytes
+ */
+size_t shm_area_size(uint32_t ring_size)
+{
+    return sizeof(struct shm_area) + 2 * (sizeof(struct shm_ring) + ring_size);
+}
+
+/**
+ * Initializes a zero-filled shared area.
+ *
+ * @param area (struct shm_area*) - Area of shm_area_size(ring_size) bytes
+ * @param ring_size (uint32_t) - Data bytes of each ring, a power of two
+ *
+ * @return void
+ */
+void shm_area_init(struct shm_area *area, uint32_t ring_size)
+{
+    area->magic = SHM_MAGIC;
+    area->version = SHM_VERSION;
+    area->ring_size = ring_size;
+    area->ring_offset[SHM_RING_TO_TUNNEL] = sizeof(struct shm_area);
+    area->ring_offset[SHM_RING_TO_APP] = sizeof(struct shm_area) + sizeof(struct shm_ring) + ring_size;
+    shm_area_ring(area, SHM_RING_TO_TUNNEL)->size = ring_size;
+    shm_area_ring(area, SHM_RING_TO_APP)->size = ring_size;
+}
+
+/**
+ * Validates the header of a shared area received from the other side.
+ *
+ * @param area (const struct shm_area*) - Mapped area
+ * @param area_size (size_t) - Size of the mapping
+ *
+ * @return int - 0 if the area is usable, -1 otherwise
+ */
+int shm_area_check(const struct shm_area *area, size_t area_size)
+{
+    uint32_t size = area->ring_size;
+
+    if (area_size < sizeof(*area) || area->magic != SHM_MAGIC || area->version != SHM_VERSION)
+		return -1;
+    if (size < 64 || (size & (size - 1)) || shm_area_size(size) > area_size)
+		return -1;
+    if (area->ring_offset[SHM_RING_TO_TUNNEL] != sizeof(struct shm_area) ||
+		area->ring_offset[SHM_RING_TO_APP] != sizeof(struct shm_area) + sizeof(struct shm_ring) + size)
+		return -1;
+
+    return 0;
+}
+
+/**
+ * Returns one of the two rings of a shared area.
+ */
+struct shm_ring *shm_area_ring(struct shm_area *area, int which)
+{
+    return (struct shm_ring *) ((char *) area + area->ring_offset[which]);
+}
+
+/**
+ * Copies a packet into the ring.
+ *
+ * @param ring (struct shm_ring*) - Ring owned by the caller as producer
+ * @param size (uint32_t) - Ring data size as known by the caller
+ * @param buf (const void*) - Packet data
+ * @param len (uint32_t) - Packet length
+ *
+ * @return int - 0 on success, -1 with errno set to EAGAIN if the ring is full
+ *               or EMSGSIZE if the packet can never fit
+ */
+int shm_ring_push(struct shm_ring *ring, uint32_t size, const void *buf, uint32_t len)
+{
+    uint32_t need = SHM_RECORD_SIZE(len);
+    uint32_t head = ring->head;            // only the producer writes head
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t off = head & (size - 1);
+    uint32_t till_end = size - off;
+    uint32_t total = need + (till_end < need ? till_end : 0);
+    uint32_t pad = SHM_PAD_RECORD;
+
+    if (len > size / 2 || need > size / 2) {
+		errno = EMSGSIZE;
+		return -1;
+    }
+    if (size - (head - tail) < total) {
+		errno = EAGAIN;
+		return -1;
+    }
+
+    /* records are contiguous: skip the end of the data area if needed */
+    if (till_end < need) {
+		memcpy(ring->data + off, &pad, 4);
+		head += till_end;
+		off = 0;
+    }
+
+    memcpy(ring->data + off, &len, 4);
+    memcpy(ring->data + off + 4, buf, len);
+
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Returns the packet at the consumer cursor without removing it.
+ * The cursor starts at the ring tail and is advanced past the returned
+ * packet, so several packets can be peeked before shm_ring_consume()
+ * releases them all at once. Lengths written by the producer are validated,
+ * since the other side of the ring may not be trusted. For the same reason
+ * the ring size is never read back from the shared memory.
+ *
+ * @param ring (struct shm_ring*) - Ring owned by the caller as consumer
+ * @param size (uint32_t) - Ring data size as known by the caller
+ * @param pos (uint32_t*) - Consumer cursor, initialized from ring->tail
+ * @param payload (char**) - Output pointer to the packet data in the ring
+ * @param len (uint32_t*) - Output packet length
+ *
+ * @return int - 1 if a packet was returned, 0 if the ring is empty,
+ *               -1 if the ring content is corrupted
+ */
+int shm_ring_peek(struct shm_ring *ring, uint32_t size, uint32_t *pos, char **payload, uint32_t *len)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t off, length;
+
+    if (*pos == head)
+		return 0;
+
+    off = *pos & (size - 1);
+    memcpy(&length, ring->data + off, 4);
+
+    if (length == SHM_PAD_RECORD) {
+		if (head - *pos <= size - off)
+			return -1;             // a padding record is always followed by a packet
+		*pos += size - off;
+		off = 0;
+		memcpy(&length, ring->data, 4);
+    }
+
+    if (length > size / 2 || SHM_RECORD_SIZE(length) > head - *pos)
+		return -1;
+
+    *payload = ring->data + off + 4;
+    *len = length;
+    *pos += SHM_RECORD_SIZE(length);
+
+    return 1;
+}
+
+/**
+ * Releases every packet before the consumer cursor to the producer.
+ */
+void shm_ring_consume(struct shm_ring *ring, uint32_t pos)
+{
+    __atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+}
+
+/**
+ * Tells the producer, after a push, whether the consumer must be signalled.
+ *
+ * @return int - 1 if the consumer is sleeping on its eventfd
+ */
+int shm_ring_wakeup_needed(struct shm_ring *ring)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->need_wakeup, __ATOMIC_RELAXED);
+}
+
+/**
+ * Announces that the consumer is going to sleep on its eventfd.
+ *
+ * @return int - 1 if packets arrived meanwhile and the consumer must not
+ *               sleep (the flag is cleared again), 0 if it can sleep
+ */
+int shm_ring_prepare_sleep(struct shm_ring *ring)
+{
+    __atomic_store_n(&ring->need_wakeup, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+		shm_ring_woken(ring);
+		return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Clears the sleeping flag once the consumer is running again.
+ */
+void shm_ring_woken(struct shm_ring *ring)
+{
+    __atomic_store_n(&ring->need_wakeup, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SHM_RING_H__
+    #define __SHM_RING_H__
+
+    #include <stddef.h>
+    #include <stdint.h>
+
+    #define SHM_MAGIC 0x55445453           // "UDTS"
+    #define SHM_VERSION 1
+
+    /* ring indexes in the shared area */
+    #define SHM_RING_TO_TUNNEL 0           // application -> udptunnel
+    #define SHM_RING_TO_APP 1              // udptunnel -> application
+
+    /**
+     * Lock-free single-producer/single-consumer packet ring.
+     * Each packet is stored as a 4-byte length followed by the payload, padded
+     * to 8 bytes. The producer and consumer indexes are free-running byte
+     * counters living on separate cache lines.
+     */
+    struct shm_ring {
+        uint32_t head;                     // Producer position
+        uint32_t need_wakeup;              // Set by the consumer before sleeping on its eventfd
+        char pad1[56];
+        uint32_t tail;                     // Consumer position
+        char pad2[60];
+        uint32_t size;                     // Size of data, a power of two (informational)
+        char pad3[60];
+        char data[];
+    };
+
+    /**
+     * Header of the memfd-backed area shared by udptunnel and the application,
+     * followed by the two rings.
+     */
+    struct shm_area {
+        uint32_t magic;                    // SHM_MAGIC
+        uint32_t version;                  // SHM_VERSION
+        uint32_t ring_size;                // Data bytes of each ring
+        uint32_t ring_offset[2];           // Offset of each ring from the area start
+        char pad[44];
+    };
+
+    /* Attach message sent by udptunnel along with the memfd and the two eventfds */
+    struct shm_attach_msg {
+        uint32_t magic;
+        uint32_t area_size;
+    };
+
+    size_t shm_area_size(uint32_t ring_size);
+
+    void shm_area_init(struct shm_area *area, uint32_t ring_size);
+
+    int shm_area_check(const struct shm_area *area, size_t area_size);
+
+    struct shm_ring *shm_area_ring(struct shm_area *area, int which);
+
+    int shm_ring_push(struct shm_ring *ring, uint32_t size, const void *buf, uint32_t len);
+
+    int shm_ring_peek(struct shm_ring *ring, uint32_t size, uint32_t *pos, char **payload, uint32_t *len);
+
+    void shm_ring_consume(struct shm_ring *ring, uint32_t pos);
+
+    int shm_ring_wakeup_needed(struct shm_ring *ring);
+
+    int shm_ring_prepare_sleep(struct shm_ring *ring);
+
+    void shm_ring_woken(struct shm_ring *ring);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * udptunnel shared memory client library - Application side
+ *
+ * Errors are reported with return values and errno: this code runs inside
+ * the application and must never log or exit on its behalf.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "udptunnel_shm.h"
+#include "shm_ring.h"
+
+/**
+ * Application side of the shared memory transport.
+ */
+struct udptunnel_shm {
+    int sock_fd;                   // Attach connection, closed by udptunnel when it exits
+    int tx_efd;                    // Doorbell of udptunnel
+    int rx_efd;                    // Our doorbell
+    struct shm_area *area;
+    size_t area_size;
+    uint32_t ring_size;
+    struct shm_ring *tx, *rx;      // Application -> tunnel and tunnel -> application rings
+};
+
+/**
+ * Connects to a udptunnel shared memory socket and maps the rings.
+ *
+ * @param path (const char*) - Path given to udptunnel with --shm
+ *
+ * @return struct udptunnel_shm* - Handle, or NULL with errno set
+ */
+struct udptunnel_shm *udptunnel_shm_attach(const char *path)
+{
+    struct udptunnel_shm *shm;
+    struct sockaddr_un sun;
+    struct shm_attach_msg hello;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+    } control;
+    int fds[3] = { -1, -1, -1 };
+    int saved_errno;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+    }
+    strcpy(sun.sun_path, path);
+
+    if (!(shm = calloc(1, sizeof(*shm))))
+		return NULL;
+    shm->tx_efd = shm->rx_efd = -1;
+
+    if ((shm->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		goto fail;
+    if (connect(shm->sock_fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		goto fail;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    /* udptunnel closes the connection without a message if another client is attached */
+    if (recvmsg(shm->sock_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello.magic != SHM_MAGIC) {
+		errno = EBUSY;
+		goto fail;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		errno = EPROTO;
+		goto fail;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    /* the doorbells are named from the point of view of udptunnel */
+    shm->tx_efd = fds[1];
+    shm->rx_efd = fds[2];
+
+    shm->area_size = hello.area_size;
+    shm->area = mmap(NULL, shm->area_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shm->area == MAP_FAILED) {
+		shm->area = NULL;
+		goto fail;
+    }
+    close(fds[0]);
+    fds[0] = -1;
+
+    if (shm_area_check(shm->area, shm->area_size) < 0) {
+		errno = EPROTO;
+		goto fail;
+    }
+    shm->ring_size = shm->area->ring_size;
+    shm->tx = shm_area_ring(shm->area, SHM_RING_TO_TUNNEL);
+    shm->rx = shm_area_ring(shm->area, SHM_RING_TO_APP);
+
+    return shm;
+
+fail:
+    saved_errno = errno;
+    if (fds[0] >= 0)
+		close(fds[0]);
+    udptunnel_shm_detach(shm);
+    errno = saved_errno;
+    return NULL;
+}
+
+/**
+ * Queues a packet for udptunnel.
+ *
+ * @param shm (struct udptunnel_shm*) - Handle
+ * @param buf (const void*) - Packet data
+ * @param len (size_t) - Packet length, at most 65534 bytes
+ *
+ * @return int - 0 on success, -1 with errno set to EAGAIN if the ring is full
+ *               or EMSGSIZE if the packet is too large
+ */
+int udptunnel_shm_send(struct udptunnel_shm *shm, const void *buf, size_t len)
+{
+    uint64_t one = 1;
+
+    if (len > 65534) {
+		errno = EMSGSIZE;
+		return -1;
+    }
+    if (shm_ring_push(shm->tx, shm->ring_size, buf, len) < 0)
+		return -1;
+
+    /* a system call is needed only if udptunnel is sleeping */
+    if (shm_ring_wakeup_needed(shm->tx) && write(shm->tx_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -1;
+
+    return 0;
+}
+
+/**
+ * Receives a packet sent by udptunnel.
+ *
+ * @param shm (struct udptunnel_shm*) - Handle
+ * @param buf (void*) - Output buffer, longer packets are truncated
+ * @param len (size_t) - Size of buf
+ * @param block (int) - 1 to wait for a packet, 0 to fail with EAGAIN if none is queued
+ *
+ * @return ssize_t - Length of the packet, or -1 with errno set (ECONNRESET
+ *                   if udptunnel went away)
+ */
+ssize_t udptunnel_shm_recv(struct udptunnel_shm *shm, void *buf, size_t len, int block)
+{
+    uint32_t pos, length;
+    uint64_t count;
+    char *payload;
+    int res;
+
+    while (1) {
+		struct pollfd pfd[2];
+
+		/* we are running: no doorbell needed, and reset it if it was rung */
+		if (__atomic_load_n(&shm->rx->need_wakeup, __ATOMIC_RELAXED)) {
+			shm_ring_woken(shm->rx);
+			if (read(shm->rx_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				return -1;
+		}
+
+		pos = shm->rx->tail;
+		if ((res = shm_ring_peek(shm->rx, shm->ring_size, &pos, &payload, &length)) < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (res > 0) {
+			memcpy(buf, payload, length < len ? length : len);
+			shm_ring_consume(shm->rx, pos);
+			return length;
+		}
+
+		/* the ring is empty: arm the doorbell unless a packet just arrived */
+		if (shm_ring_prepare_sleep(shm->rx))
+			continue;
+		if (!block) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		pfd[0].fd = shm->rx_efd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = shm->sock_fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			return -1;
+		if (pfd[1].revents) {
+			errno = ECONNRESET;
+			return -1;
+		}
+    }
+}
+
+/**
+ * Returns the file descriptor which becomes readable when packets arrive.
+ */
+int udptunnel_shm_fd(const struct udptunnel_shm *shm)
+{
+    return shm->rx_efd;
+}
+
+/**
+ * Detaches from udptunnel and frees the handle.
+ */
+void udptunnel_shm_detach(struct udptunnel_shm *shm)
+{
+    if (!shm)
+		return;
+    if (shm->area)
+		munmap(shm->area, shm->area_size);
+    if (shm->tx_efd >= 0)
+		close(shm->tx_efd);
+    if (shm->rx_efd >= 0)
+		close(shm->rx_efd);
+    if (shm->sock_fd >= 0)
+		close(shm->sock_fd);
+    free(shm);
+}
@@ -0,0 +1,50 @@
+/*
+ * udptunnel shared memory client library
+ *
+ * Lets an application on the same host exchange packets with a udptunnel
+ * started with --shm PATH, without system calls on the data path:
+ *
+ *     struct udptunnel_shm *t = udptunnel_shm_attach("/run/udptunnel.shm");
+ *     udptunnel_shm_send(t, query, query_len);
+ *     len = udptunnel_shm_recv(t, reply, sizeof(reply), 1);
+ *
+ * Event-driven applications can poll udptunnel_shm_fd() for readability and
+ * then call udptunnel_shm_recv() in non-blocking mode until it fails with
+ * EAGAIN, which re-arms the notification.
+ *
+ * A handle must be used by a single thread at a time.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __UDPTUNNEL_SHM_H__
+    #define __UDPTUNNEL_SHM_H__
+
+    #include <stddef.h>
+    #include <sys/types.h>
+
+    struct udptunnel_shm;
+
+    struct udptunnel_shm *udptunnel_shm_attach(const char *path);
+
+    int udptunnel_shm_send(struct udptunnel_shm *shm, const void *buf, size_t len);
+
+    ssize_t udptunnel_shm_recv(struct udptunnel_shm *shm, void *buf, size_t len, int block);
+
+    int udptunnel_shm_fd(const struct udptunnel_shm *shm);
+
+    void udptunnel_shm_detach(struct udptunnel_shm *shm);
+
+#endif
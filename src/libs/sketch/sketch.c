@@ -0,0 +1,410 @@
+/*
+ * Sketch Library - Top talkers and distinct peers in bounded memory
+ *
+ * Counts the traffic exchanged with each UDP peer without a table of all the
+ * peers: a Count-Min sketch (with conservative update) estimates the bytes
+ * and the packets of any peer, never below the real value, and two min-heaps
+ * keep the peers with the largest estimates, one by bytes and one by packets.
+ * A HyperLogLog estimates the number of distinct peers with an error of about
+ * 1.6%.
+ *
+ * The memory used does not depend on the number of peers, and an update is a
+ * hash of the address, a few counters and a scan of the small heaps, so it
+ * can be done for every packet.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "sketch.h"
+#include "../utils/utils.h"
+
+#define CM_DEPTH 4                 // Rows of the Count-Min sketch
+#define CM_WIDTH_BITS 10           // Each row takes its own bits of the hash
+#define CM_WIDTH (1 << CM_WIDTH_BITS)
+#define HLL_BITS 12                // The first bits of the hash select a HyperLogLog register
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+/* a peer in a top list, ordered as a min-heap on count */
+struct top_slot {
+    uint64_t key;                  // Hash of the address
+    uint64_t count;                // Estimate at the last update
+    int entry;                     // Index of the address in struct top
+};
+
+struct top {
+    struct top_slot heap[SKETCH_TOP_SIZE];
+    int n;
+    struct {
+		struct sockaddr_storage addr;
+		socklen_t addrlen;
+    } addrs[SKETCH_TOP_SIZE];
+};
+
+/* the bytes and the packets of a counter share a cache line */
+struct cm_cell {
+    uint64_t bytes, packets;
+};
+
+struct sketch {
+    struct cm_cell cm[CM_DEPTH][CM_WIDTH];
+    struct top top_bytes, top_packets;
+    uint8_t hll[HLL_REGISTERS];
+};
+
+/**
+ * Creates an empty sketch.
+ *
+ * @return struct sketch* - New sketch, exits if out of memory
+ */
+struct sketch *sketch_new(void)
+{
+    return NOFAIL(calloc(1, sizeof(struct sketch)));
+}
+
+/**
+ * Forgets all the traffic counted so far.
+ *
+ * @param sketch (struct sketch*) - Sketch to clear
+ *
+ * @return void
+ */
+void sketch_reset(struct sketch *sketch)
+{
+    memset(sketch, 0, sizeof(*sketch));
+}
+
+/* finalizer of splitmix64: every bit of x affects every bit of the result */
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * Hashes the address and port of a peer. Only the meaningful fields are
+ * used, so the padding and the IPv6 flow label do not split a peer.
+ *
+ * @param addr (const struct sockaddr*) - Peer address
+ * @param addrlen (socklen_t) - Length of addr
+ *
+ * @return uint64_t - 64-bit hash
+ */
+static uint64_t address_hash(const struct sockaddr *addr, socklen_t addrlen)
+{
+    const unsigned char *p = (const unsigned char *) addr;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    socklen_t i;
+
+    if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) addr;
+
+		return mix64(((uint64_t) AF_INET << 48) | ((uint64_t) sin->sin_addr.s_addr << 16) | sin->sin_port);
+    }
+    if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) addr;
+		uint64_t lo, hi;
+
+		memcpy(&hi, sin6->sin6_addr.s6_addr, sizeof(hi));
+		memcpy(&lo, sin6->sin6_addr.s6_addr + sizeof(hi), sizeof(lo));
+		return mix64(hi ^ mix64(lo ^ ((uint64_t) AF_INET6 << 48) ^ sin6->sin6_port));
+    }
+
+    /* AF_UNIX paths: FNV-1a over the whole address */
+    for (i = 0; i < addrlen; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+    return mix64(h);
+}
+
+/*
+ * Counter of each row for a key. The rows use distinct bits of the hash, so
+ * two keys share all their counters only if 40 bits of their hashes match.
+ */
+static void cm_columns(uint64_t key, uint32_t columns[CM_DEPTH])
+{
+    int i;
+
+    for (i = 0; i < CM_DEPTH; i++)
+		columns[i] = (key >> (i * CM_WIDTH_BITS)) & (CM_WIDTH - 1);
+}
+
+/**
+ * Estimates the traffic of a key: the smallest of its counters, which is
+ * the least inflated by the other keys.
+ *
+ * @param cm (const struct cm_cell[][]) - Count-Min sketch
+ * @param columns (const uint32_t*) - Counter of the key in each row
+ * @param estimate (struct cm_cell*) - Output bytes and packets
+ *
+ * @return void
+ */
+static void cm_query(const struct cm_cell cm[CM_DEPTH][CM_WIDTH], const uint32_t columns[CM_DEPTH],
+	struct cm_cell *estimate)
+{
+    int i;
+
+    *estimate = cm[0][columns[0]];
+    for (i = 1; i < CM_DEPTH; i++) {
+		if (cm[i][columns[i]].bytes < estimate->bytes)
+			estimate->bytes = cm[i][columns[i]].bytes;
+		if (cm[i][columns[i]].packets < estimate->packets)
+			estimate->packets = cm[i][columns[i]].packets;
+    }
+}
+
+/**
+ * Counts a packet of a key with the conservative update: the counters are
+ * only raised up to the new estimate, which keeps the collisions from
+ * inflating the estimates of the other keys more than needed.
+ *
+ * @param cm (struct cm_cell[][]) - Count-Min sketch
+ * @param columns (const uint32_t*) - Counter of the key in each row
+ * @param bytes (uint64_t) - Size of the packet
+ * @param estimate (struct cm_cell*) - Output new bytes and packets of the key
+ *
+ * @return void
+ */
+static void cm_update(struct cm_cell cm[CM_DEPTH][CM_WIDTH], const uint32_t columns[CM_DEPTH], uint64_t bytes,
+	struct cm_cell *estimate)
+{
+    int i;
+
+    cm_query((const struct cm_cell (*)[CM_WIDTH]) cm, columns, estimate);
+    estimate->bytes += bytes;
+    estimate->packets++;
+    for (i = 0; i < CM_DEPTH; i++) {
+		struct cm_cell *cell = &cm[i][columns[i]];
+
+		if (cell->bytes < estimate->bytes)
+			cell->bytes = estimate->bytes;
+		if (cell->packets < estimate->packets)
+			cell->packets = estimate->packets;
+    }
+}
+
+static void top_swap(struct top *top, int a, int b)
+{
+    struct top_slot tmp = top->heap[a];
+
+    top->heap[a] = top->heap[b];
+    top->heap[b] = tmp;
+}
+
+static void top_sift_down(struct top *top, int i)
+{
+    while (1) {
+		int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+
+		if (left < top->n && top->heap[left].count < top->heap[smallest].count)
+			smallest = left;
+		if (right < top->n && top->heap[right].count < top->heap[smallest].count)
+			smallest = right;
+		if (smallest == i)
+			return;
+		top_swap(top, i, smallest);
+		i = smallest;
+    }
+}
+
+static void top_sift_up(struct top *top, int i)
+{
+    while (i > 0 && top->heap[(i - 1) / 2].count > top->heap[i].count) {
+		top_swap(top, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+    }
+}
+
+/**
+ * Updates a top list with the new estimate of a key. A key which is not in
+ * the list replaces the smallest one when its estimate is larger.
+ *
+ * @param top (struct top*) - Top list
+ * @param key (uint64_t) - Hash of the address
+ * @param count (uint64_t) - New estimate of the key
+ * @param addr (const struct sockaddr*) - Address, stored if the key enters the list
+ * @param addrlen (socklen_t) - Length of addr
+ *
+ * @return void
+ */
+static void top_update(struct top *top, uint64_t key, uint64_t count, const struct sockaddr *addr,
+	socklen_t addrlen)
+{
+    int i, entry;
+
+    /*
+     * The estimate of a key in the list grew past the count stored for it,
+     * which is at least the smallest one: the small peers, which make most
+     * of the updates, are rejected here without a scan.
+     */
+    if (top->n == SKETCH_TOP_SIZE && count <= top->heap[0].count)
+		return;
+
+    for (i = 0; i < top->n; i++) {
+		if (top->heap[i].key == key) { // Estimates only grow: move towards the leaves
+			top->heap[i].count = count;
+			top_sift_down(top, i);
+			return;
+		}
+    }
+
+    if (top->n < SKETCH_TOP_SIZE) {
+		i = top->n++;
+		entry = i;
+    } else if (count > top->heap[0].count) { // Evict the smallest
+		i = 0;
+		entry = top->heap[0].entry;
+    } else {
+		return;
+    }
+
+    top->heap[i].key = key;
+    top->heap[i].count = count;
+    top->heap[i].entry = entry;
+    if (addrlen > sizeof(top->addrs[entry].addr))
+		addrlen = sizeof(top->addrs[entry].addr);
+    memset(&top->addrs[entry].addr, 0, sizeof(top->addrs[entry].addr));
+    memcpy(&top->addrs[entry].addr, addr, addrlen);
+    top->addrs[entry].addrlen = addrlen;
+
+    if (i == 0)
+		top_sift_down(top, 0);
+    else
+		top_sift_up(top, i);
+}
+
+/**
+ * Counts a packet exchanged with a peer, in either direction.
+ *
+ * @param sketch (struct sketch*) - Sketch to update
+ * @param addr (const struct sockaddr*) - Address of the peer
+ * @param addrlen (socklen_t) - Length of addr
+ * @param bytes (size_t) - Size of the packet
+ *
+ * @return void
+ */
+void sketch_update(struct sketch *sketch, const struct sockaddr *addr, socklen_t addrlen, size_t bytes)
+{
+    uint64_t key = address_hash(addr, addrlen);
+    uint32_t columns[CM_DEPTH];
+    struct cm_cell estimate;
+    uint64_t rest = key << HLL_BITS;
+    uint8_t rank;
+    int reg;
+
+    cm_columns(key, columns);
+    cm_update(sketch->cm, columns, bytes, &estimate);
+    top_update(&sketch->top_bytes, key, estimate.bytes, addr, addrlen);
+    top_update(&sketch->top_packets, key, estimate.packets, addr, addrlen);
+
+    /* HyperLogLog: the register keeps the longest run of leading zeros of the rest of the hash */
+    reg = key >> (64 - HLL_BITS);
+    rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+    if (rank > sketch->hll[reg])
+		sketch->hll[reg] = rank;
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+    const struct top_slot *sa = a, *sb = b;
+
+    return sa->count < sb->count ? 1 : sa->count > sb->count ? -1 : 0;
+}
+
+/**
+ * Lists the top talkers, largest first.
+ *
+ * @param sketch (const struct sketch*) - Sketch to read
+ * @param by_packets (int) - 1 to rank by packets, 0 by bytes
+ * @param entries (struct sketch_entry*) - Output array
+ * @param max (int) - Size of entries
+ *
+ * @return int - Number of entries stored
+ */
+int sketch_top(const struct sketch *sketch, int by_packets, struct sketch_entry *entries, int max)
+{
+    const struct top *top = by_packets ? &sketch->top_packets : &sketch->top_bytes;
+    struct top_slot slots[SKETCH_TOP_SIZE];
+    int i;
+
+    memcpy(slots, top->heap, top->n * sizeof(slots[0]));
+    qsort(slots, top->n, sizeof(slots[0]), compare_slots);
+
+    for (i = 0; i < top->n && i < max; i++) {
+		uint32_t columns[CM_DEPTH];
+		struct cm_cell estimate;
+
+		cm_columns(slots[i].key, columns);
+		cm_query(sketch->cm, columns, &estimate);
+		entries[i].addr = top->addrs[slots[i].entry].addr;
+		entries[i].addrlen = top->addrs[slots[i].entry].addrlen;
+		entries[i].bytes = estimate.bytes;
+		entries[i].packets = estimate.packets;
+    }
+    return i;
+}
+
+/* natural logarithm of x >= 1, without libm: x = y * 2^e with y in [1, 2), then ln(y) = 2 atanh((y - 1) / (y + 1)) */
+static double ln(double x)
+{
+    double t, t2, term, sum = 0;
+    int e = 0, k;
+
+    while (x >= 2) {
+		x /= 2;
+		e++;
+    }
+    t = (x - 1) / (x + 1);
+    t2 = t * t;
+    term = t;
+    for (k = 1; k < 30; k += 2) { // t <= 1/3: 15 terms are far beyond double precision
+		sum += term / k;
+		term *= t2;
+    }
+    return 2 * sum + e * 0.69314718055994530942;
+}
+
+/**
+ * Estimates the number of distinct peers seen.
+ *
+ * @param sketch (const struct sketch*) - Sketch to read
+ *
+ * @return uint64_t - Estimated count
+ */
+uint64_t sketch_distinct(const struct sketch *sketch)
+{
+    const double m = HLL_REGISTERS;
+    double sum = 0, estimate;
+    int i, zeros = 0;
+
+    for (i = 0; i < HLL_REGISTERS; i++) {
+		sum += 1.0 / (double) (1ULL << sketch->hll[i]);
+		if (!sketch->hll[i])
+			zeros++;
+    }
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    /* few peers: linear counting of the empty registers is more accurate */
+    if (estimate <= 2.5 * m && zeros)
+		estimate = m * ln(m / zeros);
+
+    return (uint64_t) (estimate + 0.5);
+}
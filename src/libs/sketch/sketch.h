@@ -0,0 +1,48 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SKETCH_H__
+    #define __SKETCH_H__
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <sys/socket.h>
+
+    /* number of top talkers tracked for each of bytes and packets */
+    #define SKETCH_TOP_SIZE 16
+
+    /**
+     * A top talker, with the estimated traffic exchanged with it.
+     */
+    struct sketch_entry {
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        uint64_t bytes, packets;
+    };
+
+    struct sketch;
+
+    struct sketch *sketch_new(void);
+
+    void sketch_update(struct sketch *sketch, const struct sockaddr *addr, socklen_t addrlen, size_t bytes);
+
+    int sketch_top(const struct sketch *sketch, int by_packets, struct sketch_entry *entries, int max);
+
+    uint64_t sketch_distinct(const struct sketch *sketch);
+
+    void sketch_reset(struct sketch *sketch);
+
+#endif
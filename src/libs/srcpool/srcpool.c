@@ -0,0 +1,476 @@
+/*
+ * Source Pool Library - Local addresses and ports of the server UDP sockets
+ *
+ * A UDP socket is identified by its 4-tuple, and the destination of all the
+ * tunnels of a server is the same, so without help every tunnel takes one of
+ * the ephemeral ports of a single source address, and a busy server runs out
+ * of them. The pool spreads the tunnels over several local addresses: every
+ * (address, port) pair is a slot, and the sockets are bound explicitly to a
+ * free slot before they are connected.
+ *
+ * Components:
+ * - Slots numbered port-major (slot = port index * addresses + address index),
+ *   so that consecutive tunnels take different addresses
+ * - A bitmap of the slots in use, searched a 64-bit word at a time from a
+ *   cursor which only moves forward: a released slot is reused last
+ * - The bind() of the kernel as the final check: a slot found bound by another
+ *   socket (another program, or a tunnel of the previous binary after an
+ *   upgrade) is marked foreign, and the foreign slots are probed again only
+ *   when the pool is otherwise exhausted
+ * - One socket reserved in advance by the server parent, inherited by the next
+ *   tunnel process, so that the allocation stays in a single process
+ *
+ * IP_BIND_ADDRESS_NO_PORT does not help here: it delays the choice of the port
+ * of a TCP socket until connect() knows the destination, but a UDP socket
+ * takes its port at connect() from the same ephemeral range whatever the
+ * destination. Only an explicit port extends the 4-tuple space.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "srcpool.h"
+#include "../network/network.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#define NO_SLOT SIZE_MAX
+#define PORT_RANGE_FILE "/proc/sys/net/ipv4/ip_local_port_range"
+
+/* slot of a tunnel process */
+struct owner {
+    pid_t pid;
+    size_t slot;
+};
+
+struct srcpool {
+    int family;
+    struct sockaddr_storage addrs[SRCPOOL_MAX_ADDRESSES];
+    int naddrs;
+    int low, high;                 // Port range, inclusive
+
+    size_t nslots;
+    uint64_t *used;                // Slots of the tunnels, the reserved one and the foreign ones
+    uint64_t *foreign;             // Slots found bound by another socket
+    size_t cursor;                 // Last slot reserved, the search starts after it
+    size_t nforeign;
+
+    int pending;                   // Socket bound to the reserved slot, or -1
+    size_t pending_slot;
+
+    struct owner *owners;
+    int count, allocated;
+    unsigned long tunnels[SRCPOOL_MAX_ADDRESSES]; // Tunnels of each address
+    unsigned long exhausted;       // Reservations which found no free slot
+};
+
+/**
+ * Parses a list of local addresses, all of the same family.
+ *
+ * @param pool (struct srcpool*) - Pool to fill
+ * @param addresses (const char*) - Comma-separated IPv4 or IPv6 addresses,
+ *                                  the IPv6 ones optionally in brackets
+ *
+ * @return int - 0 on success, -1 on error (logged)
+ */
+static int parse_addresses(struct srcpool *pool, const char *addresses)
+{
+    char *list = NOFAIL(strdup(addresses));
+    char *token, *saveptr = NULL;
+
+    for (token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		struct sockaddr_storage *ss = &pool->addrs[pool->naddrs];
+		struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+		size_t len = strlen(token);
+
+		if (pool->naddrs == SRCPOOL_MAX_ADDRESSES) {
+			log_printf(log_err, "More than %d addresses in the source pool", SRCPOOL_MAX_ADDRESSES);
+			goto error;
+		}
+		if (len > 2 && token[0] == '[' && token[len - 1] == ']') {
+			token[len - 1] = '\0';
+			token++;
+		}
+		memset(ss, 0, sizeof(*ss));
+		if (inet_pton(AF_INET, token, &sin->sin_addr) == 1) {
+			sin->sin_family = AF_INET;
+		} else if (inet_pton(AF_INET6, token, &sin6->sin6_addr) == 1) {
+			sin6->sin6_family = AF_INET6;
+		} else {
+			log_printf(log_err, "Invalid address in the source pool: %s", token);
+			goto error;
+		}
+		if (pool->naddrs && ss->ss_family != pool->family) {
+			log_printf(log_err, "The addresses of the source pool must be of the same family");
+			goto error;
+		}
+		pool->family = ss->ss_family;
+		pool->naddrs++;
+    }
+    free(list);
+    if (!pool->naddrs) {
+		log_printf(log_err, "No address in the source pool");
+		return -1;
+    }
+    return 0;
+
+error:
+    free(list);
+    return -1;
+}
+
+/**
+ * Parses the port range of the pool, by default the ephemeral port range
+ * of the system.
+ *
+ * @param pool (struct srcpool*) - Pool to fill
+ * @param ports (const char*) - "LOW-HIGH", or NULL for the default
+ *
+ * @return int - 0 on success, -1 on error (logged)
+ */
+static int parse_ports(struct srcpool *pool, const char *ports)
+{
+    pool->low = 32768; // Default of Linux when the file cannot be read
+    pool->high = 60999;
+
+    if (ports) {
+		char end;
+
+		if (sscanf(ports, "%d-%d%c", &pool->low, &pool->high, &end) != 2) {
+			log_printf(log_err, "Invalid source port range: %s", ports);
+			return -1;
+		}
+    } else {
+		FILE *fp = fopen(PORT_RANGE_FILE, "r");
+		int low, high;
+
+		if (fp) {
+			if (fscanf(fp, "%d %d", &low, &high) == 2) {
+				pool->low = low;
+				pool->high = high;
+			}
+			fclose(fp);
+		}
+    }
+
+    if (pool->low < 1 || pool->high > 65535 || pool->low > pool->high) {
+		log_printf(log_err, "Invalid source port range: %d-%d", pool->low, pool->high);
+		return -1;
+    }
+    return 0;
+}
+
+/**
+ * Builds the address of a slot.
+ *
+ * @param pool (const struct srcpool*) - Pool
+ * @param slot (size_t) - Slot number
+ * @param ss (struct sockaddr_storage*) - Output address and port
+ *
+ * @return socklen_t - Length of the address
+ */
+static socklen_t slot_address(const struct srcpool *pool, size_t slot, struct sockaddr_storage *ss)
+{
+    uint16_t port = htons(pool->low + slot / pool->naddrs);
+
+    *ss = pool->addrs[slot % pool->naddrs];
+    if (pool->family == AF_INET) {
+		((struct sockaddr_in *) ss)->sin_port = port;
+		return sizeof(struct sockaddr_in);
+    }
+    ((struct sockaddr_in6 *) ss)->sin6_port = port;
+    return sizeof(struct sockaddr_in6);
+}
+
+/**
+ * Finds the first free slot after the cursor, wrapping around.
+ *
+ * @param pool (const struct srcpool*) - Pool
+ *
+ * @return size_t - Free slot, or NO_SLOT if all are used
+ */
+static size_t next_free(const struct srcpool *pool)
+{
+    size_t words = (pool->nslots + 63) / 64;
+    size_t start = (pool->cursor + 1) % pool->nslots;
+    size_t i;
+
+    /* the word of the start is visited twice: its bits after, then before the start */
+    for (i = 0; i <= words; i++) {
+		size_t w = (start / 64 + i) % words;
+		uint64_t free_bits = ~pool->used[w];
+
+		if (i == 0)
+			free_bits &= ~0ULL << (start % 64);
+		else if (i == words)
+			free_bits &= (1ULL << (start % 64)) - 1;
+		if (w == words - 1 && pool->nslots % 64)
+			free_bits &= (1ULL << (pool->nslots % 64)) - 1;
+		if (free_bits)
+			return w * 64 + __builtin_ctzll(free_bits);
+    }
+    return NO_SLOT;
+}
+
+/**
+ * Forgets the foreign slots, so that they are probed again.
+ *
+ * @param pool (struct srcpool*) - Pool
+ *
+ * @return void
+ */
+static void clear_foreign(struct srcpool *pool)
+{
+    size_t words = (pool->nslots + 63) / 64;
+    size_t w;
+
+    for (w = 0; w < words; w++) {
+		pool->used[w] &= ~pool->foreign[w];
+		pool->foreign[w] = 0;
+    }
+    pool->nforeign = 0;
+}
+
+/**
+ * Binds a new UDP socket to a free slot and marks the slot as used.
+ *
+ * @param pool (struct srcpool*) - Pool
+ * @param slot (size_t*) - Output slot of the socket
+ *
+ * @return int - Socket, or -1 if the pool is exhausted or on error (logged)
+ */
+static int reserve(struct srcpool *pool, size_t *slot)
+{
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+		size_t s;
+
+		while ((s = next_free(pool)) != NO_SLOT) {
+			struct sockaddr_storage ss;
+			socklen_t sslen = slot_address(pool, s, &ss);
+			int fd;
+
+			if ((fd = socket(pool->family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+				log_printf_err(log_err, "socket");
+				return -1;
+			}
+			pool->cursor = s;
+			pool->used[s / 64] |= 1ULL << (s % 64);
+			if (bind(fd, (struct sockaddr *) &ss, sslen) == 0) {
+				*slot = s;
+				return fd;
+			}
+			close(fd);
+			if (errno != EADDRINUSE) {
+				pool->used[s / 64] &= ~(1ULL << (s % 64));
+				log_printf_err(log_err, "bind(%s)", print_addr_port((struct sockaddr *) &ss, sslen));
+				return -1;
+			}
+			pool->foreign[s / 64] |= 1ULL << (s % 64);
+			pool->nforeign++;
+		}
+		if (pass || !pool->nforeign)
+			break;
+		clear_foreign(pool); // Some may have been released since
+    }
+
+    pool->exhausted++;
+    return -1;
+}
+
+/**
+ * Creates a pool and checks that its addresses are local.
+ *
+ * @param addresses (const char*) - Comma-separated local addresses
+ * @param ports (const char*) - Port range "LOW-HIGH", or NULL for the
+ *                              ephemeral port range of the system
+ *
+ * @return struct srcpool* - New pool, exits on error
+ */
+struct srcpool *srcpool_new(const char *addresses, const char *ports)
+{
+    struct srcpool *pool = NOFAIL(calloc(1, sizeof(*pool)));
+    size_t words;
+    int i;
+
+    if (parse_addresses(pool, addresses) < 0 || parse_ports(pool, ports) < 0)
+		log_printf_exit(2, log_err, "Invalid source pool");
+
+    /* bind() fails with EADDRNOTAVAIL for an address which is not local */
+    for (i = 0; i < pool->naddrs; i++) {
+		struct sockaddr_storage ss = pool->addrs[i];
+		socklen_t sslen = pool->family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+		int fd = socket(pool->family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+		if (fd < 0)
+			err_sys("socket");
+		if (bind(fd, (struct sockaddr *) &ss, sslen) < 0)
+			log_printf_exit(2, log_err, "Cannot use %s in the source pool: %s",
+				print_addr_port((struct sockaddr *) &ss, sslen), strerror(errno));
+		close(fd);
+    }
+
+    pool->nslots = (size_t) pool->naddrs * (pool->high - pool->low + 1);
+    words = (pool->nslots + 63) / 64;
+    pool->used = NOFAIL(calloc(words, sizeof(uint64_t)));
+    pool->foreign = NOFAIL(calloc(words, sizeof(uint64_t)));
+    pool->cursor = pool->nslots - 1; // The first slot is the first one reserved
+    pool->pending = -1;
+
+    log_printf(log_info, "Source pool of %d addresses and ports %d-%d: %zu slots",
+		pool->naddrs, pool->low, pool->high, pool->nslots);
+    return pool;
+}
+
+/**
+ * Makes sure that a socket is reserved for the next tunnel.
+ * Called by the server parent before it accepts a connection.
+ *
+ * @param pool (struct srcpool*) - Pool
+ *
+ * @return int - 1 if a socket is reserved, 0 if the pool is exhausted
+ */
+int srcpool_ready(struct srcpool *pool)
+{
+    if (pool->pending < 0)
+		pool->pending = reserve(pool, &pool->pending_slot);
+    return pool->pending >= 0;
+}
+
+/**
+ * Gives the reserved socket to a tunnel process, in the server parent,
+ * and reserves the next one.
+ *
+ * @param pool (struct srcpool*) - Pool
+ * @param pid (pid_t) - Process of the tunnel, which inherited the socket
+ *
+ * @return void
+ */
+void srcpool_forked(struct srcpool *pool, pid_t pid)
+{
+    struct owner *owner;
+
+    if (pool->pending < 0) // Exhausted when the tunnel was accepted
+		return;
+
+    if (pool->count == pool->allocated) {
+		pool->allocated = pool->allocated ? pool->allocated * 2 : 64;
+		pool->owners = NOFAIL(realloc(pool->owners, pool->allocated * sizeof(*pool->owners)));
+    }
+    owner = &pool->owners[pool->count++];
+    owner->pid = pid;
+    owner->slot = pool->pending_slot;
+    pool->tunnels[owner->slot % pool->naddrs]++;
+
+    close(pool->pending);
+    pool->pending = reserve(pool, &pool->pending_slot);
+}
+
+/**
+ * Takes the reserved socket, in the tunnel process.
+ * A process which did not inherit one (with inetd, or when the pool was
+ * exhausted at the fork) binds its own: the kernel then keeps the slots
+ * of two processes apart, and the parent will see it as foreign.
+ *
+ * @param pool (struct srcpool*) - Pool, as inherited from the parent
+ *
+ * @return int - Bound UDP socket, -1 if the pool is exhausted
+ */
+int srcpool_take(struct srcpool *pool)
+{
+    size_t slot;
+    int fd;
+
+    if (pool->pending >= 0) {
+		fd = pool->pending;
+		pool->pending = -1;
+		return fd;
+    }
+    return reserve(pool, &slot);
+}
+
+/**
+ * Frees the slot of a tunnel process which has exited.
+ *
+ * @param pool (struct srcpool*) - Pool
+ * @param pid (pid_t) - Process reaped by waitpid(), it may be unknown
+ *
+ * @return void
+ */
+void srcpool_release(struct srcpool *pool, pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < pool->count; i++) {
+		if (pool->owners[i].pid == pid) {
+			size_t slot = pool->owners[i].slot;
+
+			pool->used[slot / 64] &= ~(1ULL << (slot % 64));
+			pool->tunnels[slot % pool->naddrs]--;
+			pool->owners[i] = pool->owners[--pool->count];
+			return;
+		}
+    }
+}
+
+/**
+ * Formats the usage of the pool for the status command.
+ *
+ * @param pool (const struct srcpool*) - Pool
+ * @param buf (char*) - Output buffer
+ * @param len (size_t) - Size of the buffer
+ *
+ * @return size_t - Length of the text, as returned by snprintf()
+ */
+size_t srcpool_format(const struct srcpool *pool, char *buf, size_t len)
+{
+    size_t per_address = pool->nslots / pool->naddrs;
+    size_t used = 0;
+    int i;
+
+    used += snprintf(buf, len,
+		"source-pool-slots %zu\n"
+		"source-pool-tunnels %d\n"
+		"source-pool-foreign %zu\n"
+		"source-pool-free %zu\n"
+		"source-pool-exhausted %lu\n",
+		pool->nslots, pool->count, pool->nforeign,
+		pool->nslots - pool->count - pool->nforeign - (pool->pending >= 0), pool->exhausted);
+
+    for (i = 0; i < pool->naddrs; i++) {
+		char addr[INET6_ADDRSTRLEN] = "?";
+		const struct sockaddr_storage *ss = &pool->addrs[i];
+
+		inet_ntop(pool->family, pool->family == AF_INET ?
+			(const void *) &((const struct sockaddr_in *) ss)->sin_addr :
+			(const void *) &((const struct sockaddr_in6 *) ss)->sin6_addr, addr, sizeof(addr));
+		if (used < len)
+			used += snprintf(buf + used, len - used, "source-pool-address %s %lu/%zu\n",
+				addr, pool->tunnels[i], per_address);
+    }
+    return used;
+}
@@ -0,0 +1,40 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SRCPOOL_H__
+    #define __SRCPOOL_H__
+
+    #include <stddef.h>
+    #include <sys/types.h>
+
+    /* largest number of local addresses in a pool */
+    #define SRCPOOL_MAX_ADDRESSES 64
+
+    struct srcpool;
+
+    struct srcpool *srcpool_new(const char *addresses, const char *ports);
+
+    int srcpool_ready(struct srcpool *pool);
+
+    void srcpool_forked(struct srcpool *pool, pid_t pid);
+
+    int srcpool_take(struct srcpool *pool);
+
+    void srcpool_release(struct srcpool *pool, pid_t pid);
+
+    size_t srcpool_format(const struct srcpool *pool, char *buf, size_t len);
+
+#endif
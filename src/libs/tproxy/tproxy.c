@@ -0,0 +1,661 @@
+/*
+ * TProxy Library - Any-destination UDP through a single tunnel
+ *
+ * In the transparent proxy mode the client does not relay a single UDP port
+ * to a fixed destination: the firewall redirects the UDP traffic of any
+ * destination to its listener (iptables -j TPROXY), which sees the original
+ * destination of each datagram with IP_RECVORIGDSTADDR. Every frame of the
+ * tunnel then starts with the original destination and the source of the
+ * datagram, and the server sends the payload to that destination.
+ *
+ * Components:
+ * - Address header of the frames: the family (4 or 6), then the original
+ *   destination and the source, each as its address and port in network
+ *   byte order; the replies carry the same header as the datagrams they
+ *   answer
+ * - Flow table keyed by (destination, source), with one UDP socket per flow,
+ *   all watched with a single epoll descriptor. In the server the socket is
+ *   connected to the destination. In the client it is bound to the original
+ *   destination with IP_TRANSPARENT and connected to the source, so that the
+ *   replies come from the address the application sent to; the kernel then
+ *   also delivers the next datagrams of the flow to this socket rather than
+ *   to the listener, hence it is read as well
+ * - Flows closed once idle for the tproxy-timeout setting, and the least
+ *   recently used one when the table is full
+ * - Destinations checked before the server opens a flow: never the loopback
+ *   or link-local addresses of the server host, and only the ones allowed
+ *   by the ACL of the server when it has one, so that the tunnel is not an
+ *   open relay into its networks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include "tproxy.h"
+#include "../acl/acl.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#define BUCKETS 2048               // Hash buckets of the flow table, a power of 2
+#define READY_EVENTS 64            // Events collected by each epoll_wait()
+#define LISTENER UINT32_MAX        // Event data of the listener, the flows use their index
+
+/* a (destination, source) pair and its socket */
+struct flow {
+    int fd;                        // -1 if the entry is free
+    struct sockaddr_storage dst, src;
+    time_t used;                   // Last datagram in either direction
+    int next;                      // Next flow of the bucket, or next free entry, -1 at the end
+};
+
+struct tproxy {
+    int listener;                  // Transparent socket of the client, -1 in the server
+    int epoll_fd;
+    const int *timeout;            // Seconds before an idle flow is closed
+
+    struct flow *flows;
+    int buckets[BUCKETS];
+    int free_flows;                // First free entry, -1 if the table is full
+    int count;
+    time_t last_expire;
+
+    struct epoll_event ready[READY_EVENTS];
+    int nready, iready;            // Events of the last epoll_wait(), and the next one to serve
+
+    unsigned long opened, expired, evicted, dropped, denied;
+};
+
+/**
+ * Turns an IPv4-mapped IPv6 address into an IPv4 one, as a dual-stack
+ * listener reports the IPv4 sources.
+ *
+ * @param ss (struct sockaddr_storage*) - Address to convert in place
+ *
+ * @return void
+ */
+static void unmap_address(struct sockaddr_storage *ss)
+{
+    struct sockaddr_in6 sin6;
+    struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+    if (ss->ss_family != AF_INET6)
+		return;
+    memcpy(&sin6, ss, sizeof(sin6));
+    if (!IN6_IS_ADDR_V4MAPPED(&sin6.sin6_addr))
+		return;
+    memset(ss, 0, sizeof(*ss));
+    sin->sin_family = AF_INET;
+    sin->sin_port = sin6.sin6_port;
+    memcpy(&sin->sin_addr, &sin6.sin6_addr.s6_addr[12], 4);
+}
+
+/**
+ * Compares two addresses and their ports.
+ *
+ * @param a (const struct sockaddr_storage*) - First address
+ * @param b (const struct sockaddr_storage*) - Second address
+ *
+ * @return int - 1 if they are the same, 0 otherwise
+ */
+static int same_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *) a, *b4 = (const struct sockaddr_in *) b;
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) a, *b6 = (const struct sockaddr_in6 *) b;
+
+    if (a->ss_family != b->ss_family)
+		return 0;
+    if (a->ss_family == AF_INET)
+		return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
+}
+
+/**
+ * Tells whether the server may send to a destination. The loopback and
+ * link-local addresses, and the unspecified ones which reach the host too,
+ * are always refused, including as IPv4-mapped IPv6 addresses.
+ *
+ * @param dst (const struct sockaddr_storage*) - Original destination
+ * @param acl (struct acl*) - Destinations allowed, or NULL for all the others
+ *
+ * @return int - 1 if the destination is allowed, 0 otherwise
+ */
+static int allowed_destination(const struct sockaddr_storage *dst, struct acl *acl)
+{
+    const struct in6_addr *a6 = &((const struct sockaddr_in6 *) dst)->sin6_addr;
+    const unsigned char *a4 = NULL;
+
+    if (dst->ss_family == AF_INET)
+		a4 = (const unsigned char *) &((const struct sockaddr_in *) dst)->sin_addr;
+    else if (IN6_IS_ADDR_V4MAPPED(a6))
+		a4 = a6->s6_addr + 12;
+    else if (IN6_IS_ADDR_LOOPBACK(a6) || IN6_IS_ADDR_LINKLOCAL(a6) || IN6_IS_ADDR_UNSPECIFIED(a6))
+		return 0;
+    if (a4 && (a4[0] == 127 || a4[0] == 0 || (a4[0] == 169 && a4[1] == 254)))
+		return 0;
+    return !acl || acl_check(acl, (const struct sockaddr *) dst);
+}
+
+/**
+ * Writes an address and its port, as in the address header.
+ *
+ * @param ss (const struct sockaddr_storage*) - IPv4 or IPv6 address
+ * @param out (unsigned char*) - 18 bytes at least
+ *
+ * @return size_t - Bytes written: 6 for IPv4, 18 for IPv6
+ */
+static size_t put_address(const struct sockaddr_storage *ss, unsigned char *out)
+{
+    if (ss->ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+
+		memcpy(out, &sin->sin_addr, 4);
+		memcpy(out + 4, &sin->sin_port, 2);
+		return 6;
+    } else {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ss;
+
+		memcpy(out, &sin6->sin6_addr, 16);
+		memcpy(out + 16, &sin6->sin6_port, 2);
+		return 18;
+    }
+}
+
+/**
+ * Reads an address and its port from a header.
+ *
+ * @param in (const unsigned char*) - Address then port
+ * @param family (int) - AF_INET or AF_INET6
+ * @param ss (struct sockaddr_storage*) - Output address
+ *
+ * @return size_t - Bytes read
+ */
+static size_t get_address(const unsigned char *in, int family, struct sockaddr_storage *ss)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->ss_family = family;
+    if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+		memcpy(&sin->sin_addr, in, 4);
+		memcpy(&sin->sin_port, in + 4, 2);
+		return 6;
+    } else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+		memcpy(&sin6->sin6_addr, in, 16);
+		memcpy(&sin6->sin6_port, in + 16, 2);
+		return 18;
+    }
+}
+
+/**
+ * Writes the address header of a frame.
+ *
+ * @param out (unsigned char*) - TPROXY_HEADER_MAX bytes at least
+ * @param dst (const struct sockaddr_storage*) - Original destination
+ * @param src (const struct sockaddr_storage*) - Source, of the same family
+ *
+ * @return size_t - Length of the header
+ */
+static size_t put_header(unsigned char *out, const struct sockaddr_storage *dst, const struct sockaddr_storage *src)
+{
+    size_t len = 1;
+
+    out[0] = dst->ss_family == AF_INET ? 4 : 6;
+    len += put_address(dst, out + len);
+    len += put_address(src, out + len);
+    return len;
+}
+
+/**
+ * Reads the address header of a frame.
+ *
+ * @param in (const unsigned char*) - Frame
+ * @param len (size_t) - Length of the frame
+ * @param dst (struct sockaddr_storage*) - Output original destination
+ * @param src (struct sockaddr_storage*) - Output source
+ *
+ * @return int - Length of the header, -1 if the frame does not start with one
+ */
+static int get_header(const unsigned char *in, size_t len, struct sockaddr_storage *dst,
+		struct sockaddr_storage *src)
+{
+    int family;
+    size_t used = 1;
+
+    if (len < 1 + 2 * 6 || (in[0] != 4 && in[0] != 6) || (in[0] == 6 && len < 1 + 2 * 18))
+		return -1;
+    family = in[0] == 4 ? AF_INET : AF_INET6;
+    used += get_address(in + used, family, dst);
+    used += get_address(in + used, family, src);
+    return used;
+}
+
+/**
+ * Hashes the key of a flow.
+ *
+ * @param dst (const struct sockaddr_storage*) - Original destination
+ * @param src (const struct sockaddr_storage*) - Source
+ *
+ * @return unsigned int - Bucket of the flow
+ */
+static unsigned int flow_bucket(const struct sockaddr_storage *dst, const struct sockaddr_storage *src)
+{
+    unsigned char key[TPROXY_HEADER_MAX];
+    size_t len = put_header(key, dst, src);
+    uint32_t hash = 2166136261u; // FNV-1a
+    size_t i;
+
+    for (i = 0; i < len; i++)
+		hash = (hash ^ key[i]) * 16777619u;
+    return hash & (BUCKETS - 1);
+}
+
+/**
+ * Closes a flow and returns its entry to the free list.
+ *
+ * @param t (struct tproxy*) - Flow table
+ * @param index (int) - Entry of the flow
+ *
+ * @return void
+ */
+static void close_flow(struct tproxy *t, int index)
+{
+    struct flow *f = &t->flows[index];
+    int *link = &t->buckets[flow_bucket(&f->dst, &f->src)];
+
+    while (*link != index)
+		link = &t->flows[*link].next;
+    *link = f->next;
+
+    close(f->fd); // Also removes it from the epoll set
+    f->fd = -1;
+    f->next = t->free_flows;
+    t->free_flows = index;
+    t->count--;
+    t->nready = t->iready = 0; // The events collected may be for this entry
+}
+
+/**
+ * Closes the idle flows, at most once per second, and the least recently
+ * used one if the table is still full and a flow must be opened.
+ *
+ * @param t (struct tproxy*) - Flow table
+ * @param make_room (int) - 1 if an entry must be freed
+ *
+ * @return void
+ */
+static void expire_flows(struct tproxy *t, int make_room)
+{
+    time_t now = time(NULL);
+    int i, oldest = -1;
+
+    if (now != t->last_expire) {
+		t->last_expire = now;
+		for (i = 0; i < TPROXY_MAX_FLOWS; i++) {
+			struct flow *f = &t->flows[i];
+
+			if (f->fd < 0 || now - f->used < *t->timeout)
+				continue;
+			if (recv(f->fd, NULL, 0, MSG_PEEK | MSG_DONTWAIT) >= 0) { // A datagram came in the meantime
+				f->used = now;
+				continue;
+			}
+			close_flow(t, i);
+			t->expired++;
+		}
+    }
+    if (!make_room || t->free_flows >= 0)
+		return;
+
+    for (i = 0; i < TPROXY_MAX_FLOWS; i++)
+		if (oldest < 0 || t->flows[i].used < t->flows[oldest].used)
+			oldest = i;
+    close_flow(t, oldest);
+    t->evicted++;
+}
+
+/**
+ * Opens the socket of a new flow and adds it to the table.
+ *
+ * @param t (struct tproxy*) - Flow table
+ * @param dst (const struct sockaddr_storage*) - Original destination
+ * @param src (const struct sockaddr_storage*) - Source
+ *
+ * @return int - Entry of the flow, -1 on error
+ */
+static int open_flow(struct tproxy *t, const struct sockaddr_storage *dst, const struct sockaddr_storage *src)
+{
+    socklen_t len = dst->ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    struct epoll_event ev;
+    struct flow *f;
+    int fd, index, on = 1;
+    unsigned int bucket;
+
+    if ((fd = socket(dst->ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+    if (t->listener >= 0) { // Replies from the original destination, to the source
+		if ((dst->ss_family == AF_INET ?
+				setsockopt(fd, IPPROTO_IP, IP_TRANSPARENT, &on, sizeof(on)) :
+				setsockopt(fd, IPPROTO_IPV6, IPV6_TRANSPARENT, &on, sizeof(on))) < 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+			bind(fd, (const struct sockaddr *) dst, len) < 0 ||
+			connect(fd, (const struct sockaddr *) src, len) < 0)
+			goto error;
+    } else if (connect(fd, (const struct sockaddr *) dst, len) < 0) {
+		goto error;
+    }
+
+    expire_flows(t, 1);
+    index = t->free_flows;
+    f = &t->flows[index];
+    t->free_flows = f->next;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = index;
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		err_sys("epoll_ctl");
+
+    f->fd = fd;
+    f->dst = *dst;
+    f->src = *src;
+    bucket = flow_bucket(dst, src);
+    f->next = t->buckets[bucket];
+    t->buckets[bucket] = index;
+    t->count++;
+    t->opened++;
+    return index;
+
+error:
+    close(fd);
+    return -1;
+}
+
+/**
+ * Creates the flow table of the transparent proxy mode.
+ * In the client, the listener receives the redirected datagrams: it is made
+ * transparent and reports their original destination.
+ *
+ * @param listener (int) - UDP socket of the client, -1 in the server
+ * @param timeout (const int*) - Seconds before an idle flow is closed, read on each use
+ *
+ * @return struct tproxy* - New flow table, exits on error
+ */
+struct tproxy *tproxy_new(int listener, const int *timeout)
+{
+    struct tproxy *t = NOFAIL(calloc(1, sizeof(*t)));
+    int i, on = 1;
+
+    t->listener = listener;
+    t->timeout = timeout;
+    t->flows = NOFAIL(calloc(TPROXY_MAX_FLOWS, sizeof(*t->flows)));
+    for (i = 0; i < TPROXY_MAX_FLOWS; i++) {
+		t->flows[i].fd = -1;
+		t->flows[i].next = i + 1 < TPROXY_MAX_FLOWS ? i + 1 : -1;
+    }
+    for (i = 0; i < BUCKETS; i++)
+		t->buckets[i] = -1;
+
+    if ((t->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		err_sys("epoll_create1");
+
+    if (listener >= 0) {
+		struct sockaddr_storage local;
+		socklen_t locallen = sizeof(local);
+		struct epoll_event ev;
+
+		if (getsockname(listener, (struct sockaddr *) &local, &locallen) < 0)
+			err_sys("getsockname(udp)");
+		if (local.ss_family == AF_INET6) { // A dual-stack socket also gets the IPv4 destinations
+			if (setsockopt(listener, IPPROTO_IPV6, IPV6_TRANSPARENT, &on, sizeof(on)) < 0)
+				err_sys("setsockopt(IPV6_TRANSPARENT)");
+			if (setsockopt(listener, IPPROTO_IPV6, IPV6_RECVORIGDSTADDR, &on, sizeof(on)) < 0)
+				err_sys("setsockopt(IPV6_RECVORIGDSTADDR)");
+			setsockopt(listener, IPPROTO_IP, IP_RECVORIGDSTADDR, &on, sizeof(on));
+		} else if (local.ss_family == AF_INET) {
+			if (setsockopt(listener, IPPROTO_IP, IP_TRANSPARENT, &on, sizeof(on)) < 0)
+				err_sys("setsockopt(IP_TRANSPARENT)");
+			if (setsockopt(listener, IPPROTO_IP, IP_RECVORIGDSTADDR, &on, sizeof(on)) < 0)
+				err_sys("setsockopt(IP_RECVORIGDSTADDR)");
+		} else {
+			log_printf_exit(2, log_err, "The transparent proxy mode needs an IPv4 or IPv6 listener");
+		}
+		/* the sockets of the flows are bound to the destinations, maybe on the port of the listener */
+		if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+			err_sys("setsockopt(SO_REUSEADDR)");
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = LISTENER;
+		if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, listener, &ev) < 0)
+			err_sys("epoll_ctl");
+    }
+    return t;
+}
+
+/**
+ * Descriptor to watch for the datagrams of the listener and of the flows.
+ *
+ * @param tproxy (const struct tproxy*) - Flow table
+ *
+ * @return int - epoll descriptor
+ */
+int tproxy_fd(const struct tproxy *tproxy)
+{
+    return tproxy->epoll_fd;
+}
+
+/**
+ * Receives a datagram redirected to the listener of the client.
+ *
+ * @param t (struct tproxy*) - Flow table
+ * @param payload (char*) - Output buffer
+ * @param room (size_t) - Size of payload
+ * @param dst (struct sockaddr_storage*) - Output original destination
+ * @param src (struct sockaddr_storage*) - Output source
+ *
+ * @return ssize_t - Length of the datagram (larger than room if truncated),
+ *                   -1 on error or if it has no original destination
+ */
+static ssize_t receive_redirected(struct tproxy *t, char *payload, size_t room,
+		struct sockaddr_storage *dst, struct sockaddr_storage *src)
+{
+    struct iovec iov = { payload, room };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+		char buf[256];             // Also room for IP_PKTINFO and the like
+		struct cmsghdr align;
+    } control;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = src;
+    msg.msg_namelen = sizeof(*src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(t->listener, &msg, MSG_DONTWAIT | MSG_TRUNC)) < 0)
+		return -1;
+
+    dst->ss_family = AF_UNSPEC;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_ORIGDSTADDR) {
+			memset(dst, 0, sizeof(*dst));
+			memcpy(dst, CMSG_DATA(cmsg), sizeof(struct sockaddr_in));
+		} else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_ORIGDSTADDR) {
+			memset(dst, 0, sizeof(*dst));
+			memcpy(dst, CMSG_DATA(cmsg), sizeof(struct sockaddr_in6));
+		}
+    }
+    unmap_address(dst);
+    unmap_address(src);
+    if (dst->ss_family == AF_UNSPEC || dst->ss_family != src->ss_family) {
+		errno = EDESTADDRREQ;
+		return -1;
+    }
+    return n;
+}
+
+/**
+ * Receives the next datagram, from the listener of the client or from a flow,
+ * and prefixes it with its address header. The flows are served in turn,
+ * one datagram each.
+ *
+ * @param tproxy (struct tproxy*) - Flow table
+ * @param buf (char*) - Buffer: TPROXY_HEADER_MAX bytes for the header, then the payload
+ * @param buflen (size_t) - Size of buf, the datagrams which do not fit are dropped
+ * @param frame (char**) - Output start of the header, followed by the payload
+ * @param src (struct sockaddr_storage*) - Output source of the flow
+ *
+ * @return int - Length of the header and payload at frame, -1 with errno EAGAIN when no datagram is
+ *               left, or with the errno of epoll_wait(). The errors of the sockets are counted as drops
+ */
+int tproxy_recv(struct tproxy *tproxy, char *buf, size_t buflen, char **frame, struct sockaddr_storage *src)
+{
+    struct tproxy *t = tproxy;
+    char *payload = buf + TPROXY_HEADER_MAX;
+    size_t room = buflen - TPROXY_HEADER_MAX;
+    struct sockaddr_storage dst;
+
+    expire_flows(t, 0);
+    while (1) {
+		struct epoll_event *ev;
+		struct flow *f = NULL;
+		ssize_t n;
+		size_t hdrlen;
+
+		if (t->iready == t->nready) {
+			int res = epoll_wait(t->epoll_fd, t->ready, READY_EVENTS, 0);
+
+			t->nready = t->iready = 0;
+			if (res <= 0) {
+				if (res == 0)
+					errno = EAGAIN;
+				return -1;
+			}
+			t->nready = res;
+		}
+		ev = &t->ready[t->iready++];
+
+		if (ev->data.u32 == LISTENER) {
+			n = receive_redirected(t, payload, room, &dst, src);
+		} else {
+			f = &t->flows[ev->data.u32];
+			if (f->fd < 0)
+				continue;
+			n = recv(f->fd, payload, room, MSG_DONTWAIT | MSG_TRUNC);
+			dst = f->dst;
+			*src = f->src;
+		}
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED)
+				t->dropped++; // Not redirected, or an error queued by the kernel
+			continue;
+		}
+		if ((size_t) n > room) { // Truncated: cannot be relayed with its header
+			t->dropped++;
+			continue;
+		}
+		if (f)
+			f->used = time(NULL);
+
+		hdrlen = put_header((unsigned char *) payload - TPROXY_HEADER_MAX, &dst, src);
+		*frame = payload - hdrlen;
+		memmove(*frame, payload - TPROXY_HEADER_MAX, hdrlen);
+		return hdrlen + n;
+    }
+}
+
+/**
+ * Sends the payload of a frame to its flow, opened if needed: to the
+ * original destination in the server, to the source in the client.
+ * The server only opens a flow to a destination allowed by
+ * allowed_destination().
+ *
+ * @param tproxy (struct tproxy*) - Flow table
+ * @param frame (const char*) - Address header and payload
+ * @param len (size_t) - Length of frame
+ * @param acl (struct acl*) - Destinations allowed to the server, or NULL
+ *
+ * @return int - 0 on success, -1 if the datagram was dropped
+ */
+int tproxy_send(struct tproxy *tproxy, const char *frame, size_t len, struct acl *acl)
+{
+    struct tproxy *t = tproxy;
+    struct sockaddr_storage dst, src;
+    int hdrlen, index;
+
+    if ((hdrlen = get_header((const unsigned char *) frame, len, &dst, &src)) < 0) {
+		t->dropped++;
+		return -1;
+    }
+
+    expire_flows(t, 0);
+    for (index = t->buckets[flow_bucket(&dst, &src)]; index >= 0; index = t->flows[index].next)
+		if (same_address(&t->flows[index].dst, &dst) && same_address(&t->flows[index].src, &src))
+			break;
+    if (index < 0 && t->listener < 0 && !allowed_destination(&dst, acl)) {
+		t->denied++;
+		return -1;
+    }
+    if (index < 0 && (index = open_flow(t, &dst, &src)) < 0) {
+		log_printf_err(log_debug, "Cannot open a flow");
+		t->dropped++;
+		return -1;
+    }
+
+    t->flows[index].used = time(NULL);
+    if (send(t->flows[index].fd, frame + hdrlen, len - hdrlen, MSG_DONTWAIT) < 0 && errno != ECONNREFUSED) {
+		t->dropped++;
+		return -1;
+    }
+    return 0;
+}
+
+/**
+ * Formats the state of the flow table for the status command.
+ *
+ * @param tproxy (const struct tproxy*) - Flow table
+ * @param buf (char*) - Output buffer
+ * @param len (size_t) - Size of the buffer
+ *
+ * @return size_t - Length of the text, as returned by snprintf()
+ */
+size_t tproxy_format(const struct tproxy *tproxy, char *buf, size_t len)
+{
+    const struct tproxy *t = tproxy;
+
+    return snprintf(buf, len,
+		"tproxy-flows %d\n"
+		"tproxy-flows-opened %lu\n"
+		"tproxy-flows-expired %lu\n"
+		"tproxy-flows-evicted %lu\n"
+		"tproxy-dropped %lu\n"
+		"tproxy-denied %lu\n",
+		t->count, t->opened, t->expired, t->evicted, t->dropped, t->denied);
+}
@@ -0,0 +1,42 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __TPROXY_H__
+    #define __TPROXY_H__
+
+    #include <stddef.h>
+    #include <sys/socket.h>
+
+    /* largest address header before the payload in a frame: family, then two IPv6 addresses and ports */
+    #define TPROXY_HEADER_MAX 37
+
+    /* flows open at the same time, the least recently used one is closed beyond */
+    #define TPROXY_MAX_FLOWS 1024
+
+    struct tproxy;
+    struct acl;
+
+    struct tproxy *tproxy_new(int listener, const int *timeout);
+
+    int tproxy_fd(const struct tproxy *tproxy);
+
+    int tproxy_recv(struct tproxy *tproxy, char *buf, size_t buflen, char **frame, struct sockaddr_storage *src);
+
+    int tproxy_send(struct tproxy *tproxy, const char *frame, size_t len, struct acl *acl);
+
+    size_t tproxy_format(const struct tproxy *tproxy, char *buf, size_t len);
+
+#endif
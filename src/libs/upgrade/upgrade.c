@@ -0,0 +1,294 @@
+/*
+ * Upgrade Library - Binary upgrade without closing the sockets
+ *
+ * On request the running process re-executes its own executable, which may
+ * have been replaced in the meantime by a new version. The sockets which must
+ * survive (listeners, or the UDP and TCP sockets of a tunnel) and an opaque
+ * state are queued as a single SCM_RIGHTS message on a unix socket pair just
+ * before execv(): only the receiving end of the pair is inherited, and the new
+ * binary finds it in the UDPTUNNEL_UPGRADE_FD environment variable.
+ *
+ * The process ID does not change, so a supervisor (systemd, a container
+ * runtime) does not notice the upgrade and the forked children stay attached
+ * to their parent. Packets arriving while execv() runs wait in the kernel
+ * socket buffers. If execv() fails the old binary just keeps running.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for SOCK_CLOEXEC...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "upgrade.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#define UPGRADE_ENV "UDPTUNNEL_UPGRADE_FD"
+#define UPGRADE_MAGIC 0x55545550   // "UTUP", bump when the header changes
+
+/* header of the message queued for the new binary */
+struct upgrade_header {
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t nfds;
+    uint32_t length;               // Length of the state following the header
+    uint64_t started;              // CLOCK_MONOTONIC time in ns when the old binary stopped
+};
+
+static char exe_path[PATH_MAX];    // Executable started at upgrade time
+static char **exe_argv;            // Arguments of the current process, reused as they are
+
+/**
+ * Returns the current CLOCK_MONOTONIC time, which is not reset by execv().
+ *
+ * @return uint64_t - Time in nanoseconds
+ */
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Records how to start the new binary. The executable path is resolved now,
+ * because after a package upgrade /proc/self/exe points to the deleted file.
+ *
+ * @param argv (char*[]) - Arguments of the program, passed unchanged to the new binary
+ *
+ * @return void
+ */
+void upgrade_init(char *argv[])
+{
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+
+    if (len <= 0) { // No procfs: hope that argv[0] is a usable path
+		strncpy(exe_path, argv[0], sizeof(exe_path) - 1);
+		len = strlen(exe_path);
+    }
+    exe_path[len] = '\0';
+    exe_argv = argv;
+}
+
+/**
+ * Replaces the current process with a new instance of the executable, which
+ * will receive the descriptors and the state with upgrade_receive().
+ * Only the descriptors listed are inherited by the new binary.
+ *
+ * @param kind (enum upgrade_kind) - What the descriptors and the state are
+ * @param fds (const int*) - Descriptors to hand over
+ * @param nfds (int) - Number of descriptors, at most UPGRADE_MAX_FDS
+ * @param data (const void*) - Opaque state, may be NULL
+ * @param length (uint32_t) - Length of data, at most UPGRADE_MAX_STATE
+ *
+ * @return void - returns only if the upgrade failed, and then nothing has changed
+ */
+void upgrade_exec(enum upgrade_kind kind, const int *fds, int nfds, const void *data, uint32_t length)
+{
+    struct upgrade_header header;
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    union {                        // Ensure proper alignment for cmsg
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+		struct cmsghdr align;
+    } control;
+    sigset_t sigs, oldsigs;
+    char env[16];
+    int sv[2];
+    int i;
+
+    if (!exe_argv || nfds < 1 || nfds > UPGRADE_MAX_FDS || length > UPGRADE_MAX_STATE) {
+		log_printf(log_err, "Cannot upgrade: invalid state");
+		return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		log_printf_err(log_err, "socketpair");
+		return;
+    }
+
+    header.magic = UPGRADE_MAGIC;
+    header.kind = kind;
+    header.nfds = nfds;
+    header.length = length;
+    header.started = monotonic_ns();
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = length;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length ? 2 : 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    /* the message stays queued in the receiving end after the sender is closed */
+    if (sendmsg(sv[0], &msg, MSG_NOSIGNAL) < 0) {
+		log_printf_err(log_err, "sendmsg(upgrade)");
+		close(sv[0]);
+		close(sv[1]);
+		return;
+    }
+    close(sv[0]);
+
+    /* the copies in the message are enough: do not leak the originals */
+    for (i = 0; i < nfds; i++)
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    if (fcntl(sv[1], F_SETFD, 0) < 0) {
+		log_printf_err(log_err, "fcntl(F_SETFD)");
+		close(sv[1]);
+		return;
+    }
+
+    snprintf(env, sizeof(env), "%d", sv[1]);
+    setenv(UPGRADE_ENV, env, 1);
+
+    /*
+     * The handlers are reset by execv() while the signal mask is kept: block
+     * another upgrade request until the new binary is ready to handle it,
+     * since the default action of SIGUSR2 would terminate the process.
+     */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &sigs, &oldsigs);
+
+    log_printf(log_notice, "Upgrading to %s", exe_path);
+    fflush(NULL);
+
+    execv(exe_path, exe_argv);
+
+    /* still the old binary: roll back */
+    log_printf_err(log_err, "execv(%s)", exe_path);
+    sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+    unsetenv(UPGRADE_ENV);
+    close(sv[1]);
+}
+
+/**
+ * Collects the descriptors and the state passed by upgrade_exec(), if the
+ * process was started by an upgrade.
+ *
+ * @param state (struct upgrade_state*) - Output, kind is UPGRADE_NONE if there was no upgrade
+ *
+ * @return int - 1 if the process was started by an upgrade, 0 otherwise
+ *              Function exits if the state cannot be received
+ */
+int upgrade_receive(struct upgrade_state *state)
+{
+    const char *env = getenv(UPGRADE_ENV);
+    struct upgrade_header header;
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct cmsghdr *cmsg;
+    union {                        // Ensure proper alignment for cmsg
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+		struct cmsghdr align;
+    } control;
+    ssize_t len;
+    int fd;
+
+    memset(state, 0, sizeof(*state));
+    state->fds[0] = -1;
+    if (!env)
+		return 0;
+
+    fd = atoi(env);
+    unsetenv(UPGRADE_ENV); // Not for our children
+
+    state->data = NOFAIL(malloc(UPGRADE_MAX_STATE));
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = state->data;
+    iov[1].iov_len = UPGRADE_MAX_STATE;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    len = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (len < 0)
+		err_sys("recvmsg(upgrade)");
+    close(fd);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || len < (ssize_t) sizeof(header) ||
+		header.magic != UPGRADE_MAGIC || header.nfds > UPGRADE_MAX_FDS ||
+		len != (ssize_t) (sizeof(header) + header.length) || !cmsg ||
+		cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+		cmsg->cmsg_len != CMSG_LEN(sizeof(int) * header.nfds))
+		log_printf_exit(1, log_err, "Invalid upgrade state received");
+
+    state->kind = header.kind;
+    state->nfds = header.nfds;
+    memcpy(state->fds, CMSG_DATA(cmsg), sizeof(int) * header.nfds);
+    state->fds[state->nfds] = -1;
+    state->length = header.length;
+    state->started = header.started;
+
+    log_printf(log_info, "Received %d socket(s) from the previous binary", state->nfds);
+    return 1;
+}
+
+/**
+ * Called when the new binary is ready to handle traffic again: reports how
+ * long the sockets were not served and accepts new upgrade requests.
+ *
+ * @param state (struct upgrade_state*) - State from upgrade_receive(), the data is freed
+ *
+ * @return void
+ */
+void upgrade_complete(struct upgrade_state *state)
+{
+    sigset_t sigs;
+
+    if (state->kind == UPGRADE_NONE)
+		return;
+
+    log_printf(log_notice, "Upgrade completed, the sockets were not served for %.3f ms",
+		(monotonic_ns() - state->started) / 1e6);
+
+    free(state->data);
+    state->data = NULL;
+    state->kind = UPGRADE_NONE;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR2);
+    sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+}
@@ -0,0 +1,55 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __UPGRADE_H__
+    #define __UPGRADE_H__
+
+    #include <stdint.h>
+
+    /* maximum number of descriptors handed over to the new binary */
+    #define UPGRADE_MAX_FDS 32
+
+    /* maximum size of the opaque state handed over to the new binary */
+    #define UPGRADE_MAX_STATE (128 * 1024)
+
+    /* what the previous binary was doing when it was upgraded */
+    enum upgrade_kind {
+        UPGRADE_NONE = 0,                  // Not started by an upgrade
+        UPGRADE_LISTENERS = 1,             // Server parent: listening sockets only
+        UPGRADE_RELAY = 2,                 // A tunnel: UDP and TCP sockets plus the relay state
+    };
+
+    /**
+     * What the new binary received from the previous one.
+     */
+    struct upgrade_state {
+        enum upgrade_kind kind;
+        int fds[UPGRADE_MAX_FDS + 1];      // Inherited descriptors, terminated by -1
+        int nfds;
+        char *data;                        // Opaque state, NULL if none
+        uint32_t length;                   // Length of data
+        uint64_t started;                  // CLOCK_MONOTONIC time when the previous binary stopped
+    };
+
+    void upgrade_init(char *argv[]);
+
+    void upgrade_exec(enum upgrade_kind kind, const int *fds, int nfds, const void *data, uint32_t length);
+
+    int upgrade_receive(struct upgrade_state *state);
+
+    void upgrade_complete(struct upgrade_state *state);
+
+#endif
@@ -42,6 +42,10 @@
         #define HAVE_GETOPT_LONG
     #endif
 
+    #if defined __linux__
+        #define HAVE_SENDMMSG
+    #endif
+
     #ifdef HAVE_GETOPT_LONG
         #define GETOPT_LONGISH(c, v, o, l, i) getopt_long(c, v, o, l, i)
     #else
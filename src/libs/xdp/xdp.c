@@ -0,0 +1,581 @@
+/*
+ * AF_XDP Library - Kernel-bypass UDP ingest for the client listener
+ *
+ * Redirects the datagrams addressed to the tunneled UDP port into a UMEM
+ * area shared with the process, so that they can be framed and written to
+ * the TCP connection without going through the UDP socket layer.
+ *
+ * Components:
+ * - A tiny XDP program, assembled here and loaded with bpf(2), that matches
+ *   IPv4/IPv6 UDP packets for the listener port and redirects them to an
+ *   XSKMAP entry. Everything else (and every packet received on a queue
+ *   without an AF_XDP socket) continues to the normal network stack.
+ * - An AF_XDP socket with its UMEM, fill, completion and RX rings.
+ * - A bpf_link attaching the program to the interface: the program is
+ *   detached automatically when the process exits, even when it is killed.
+ *
+ * No libbpf/libxdp is required, only the kernel UAPI headers. When AF_XDP is
+ * not available xdp_ingest_open() returns NULL and the caller keeps using the
+ * regular socket path.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+// for syscall()...
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xdp.h"
+#include "../utils/utils.h"
+#include "../log/log.h"
+
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#define HAVE_AF_XDP
+#endif
+#endif
+
+#ifdef HAVE_AF_XDP
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/*
+ * UMEM geometry: one chunk per ring slot keeps the accounting trivial, since
+ * a chunk is either in the fill ring, owned by the kernel, or handed out by
+ * the last xdp_ingest_recv() call. 2048 bytes per chunk fit a standard MTU
+ * frame after the XDP headroom; interfaces with a larger MTU (jumbo frames)
+ * keep using the UDP socket, since their datagrams would not fit.
+ */
+#define XDP_RING_SIZE 2048
+#define XDP_FRAME_SIZE 2048
+#define XDP_NUM_FRAMES XDP_RING_SIZE
+
+/* Ethernet header and one VLAN tag in front of the IP packet */
+#define XDP_LINK_HEADROOM (ETH_HLEN + 4)
+
+/**
+ * Memory-mapped single-producer/single-consumer ring shared with the kernel.
+ */
+struct xdp_ring {
+    uint32_t *producer;            // Producer index (written by the producer side)
+    uint32_t *consumer;            // Consumer index (written by the consumer side)
+    void *descs;                   // Ring entries: uint64_t or struct xdp_desc
+    uint32_t mask;                 // Ring size - 1
+    void *map;                     // Base of the mapping, for munmap()
+    size_t map_len;                // Length of the mapping
+};
+
+/**
+ * AF_XDP ingest state: socket, UMEM, rings and the BPF objects.
+ */
+struct xdp_ingest {
+    int xsk_fd;                    // AF_XDP socket
+    int map_fd, prog_fd, link_fd;  // XSKMAP, XDP program and bpf_link
+    char *umem;                    // Packet buffer area registered as UMEM
+    size_t umem_len;
+    struct xdp_ring fill, comp, rx;
+    uint64_t pending[XDP_BATCH_SIZE]; // Chunks handed out by the last xdp_ingest_recv()
+    int pending_len;
+};
+
+/*
+ * Minimal eBPF assembler: only the instruction forms used by the redirect
+ * program below.
+ */
+#define BPF_INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)          BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)          BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)          BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND64_IMM(d, i)          BPF_INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LDX_MEM(sz, d, s, o)     BPF_INSN(BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define JMP_REG(op, d, s, o)     BPF_INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define JMP_IMM(op, d, i, o)     BPF_INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMP_ALWAYS(o)            BPF_INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define LD_MAP_FD(d, fd)         BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+                                 BPF_INSN(0, 0, 0, 0, 0)
+#define CALL(f)                  BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()                   BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Loads the XDP redirect program for the given UDP port.
+ * Values loaded from the packet are compared with constants in network byte
+ * order, so the program is independent of the host endianness. Only IPv4
+ * headers without options and unfragmented packets are redirected.
+ *
+ * @param map_fd (int) - XSKMAP file descriptor, indexed by RX queue
+ * @param port (int) - UDP destination port to redirect
+ *
+ * @return int - Program file descriptor, or -1 with errno set
+ */
+static int load_redirect_prog(int map_fd, int port)
+{
+    /* Instruction indexes used as jump targets: offsets are target - (pc + 1) */
+    enum { L_IPV4 = 17, L_REDIRECT = 26, L_PASS = 32 };
+    struct bpf_insn prog[] = {
+		/*  0 */ MOV64_REG(BPF_REG_6, BPF_REG_1),                          // r6 = ctx
+		/*  1 */ LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)),
+		/*  2 */ LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)),
+		/*  3 */ MOV64_REG(BPF_REG_4, BPF_REG_2),
+		/*  4 */ ADD64_IMM(BPF_REG_4, 14 + 20 + 8),                        // eth + ipv4 + udp
+		/*  5 */ JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, L_PASS - 6),
+		/*  6 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 12),                 // h_proto
+		/*  7 */ JMP_IMM(BPF_JEQ, BPF_REG_5, htons(ETH_P_IP), L_IPV4 - 8),
+		/*  8 */ JMP_IMM(BPF_JNE, BPF_REG_5, htons(ETH_P_IPV6), L_PASS - 9),
+		/*  9 */ MOV64_REG(BPF_REG_4, BPF_REG_2),
+		/* 10 */ ADD64_IMM(BPF_REG_4, 14 + 40 + 8),                        // eth + ipv6 + udp
+		/* 11 */ JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, L_PASS - 12),
+		/* 12 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, 14 + 6),             // nexthdr
+		/* 13 */ JMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, L_PASS - 14),
+		/* 14 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 14 + 40 + 2),        // udp dest
+		/* 15 */ JMP_IMM(BPF_JNE, BPF_REG_5, htons(port), L_PASS - 16),
+		/* 16 */ JMP_ALWAYS(L_REDIRECT - 17),
+		/* 17 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, 14),                 // version + ihl
+		/* 18 */ JMP_IMM(BPF_JNE, BPF_REG_5, 0x45, L_PASS - 19),
+		/* 19 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, 14 + 9),             // protocol
+		/* 20 */ JMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, L_PASS - 21),
+		/* 21 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 14 + 6),             // frag_off
+		/* 22 */ AND64_IMM(BPF_REG_5, htons(0x3fff)),                      // MF flag + offset
+		/* 23 */ JMP_IMM(BPF_JNE, BPF_REG_5, 0, L_PASS - 24),
+		/* 24 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 14 + 20 + 2),        // udp dest
+		/* 25 */ JMP_IMM(BPF_JNE, BPF_REG_5, htons(port), L_PASS - 26),
+		/* 26 */ LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)),
+		/* 27 */ LD_MAP_FD(BPF_REG_1, map_fd),
+		/* 29 */ MOV64_IMM(BPF_REG_3, XDP_PASS),                           // action if the queue has no socket
+		/* 30 */ CALL(BPF_FUNC_redirect_map),
+		/* 31 */ EXIT(),
+		/* 32 */ MOV64_IMM(BPF_REG_0, XDP_PASS),
+		/* 33 */ EXIT(),
+    };
+    static char verifier_log[4096];
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t) prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uintptr_t) "GPL";
+    attr.log_buf = (uintptr_t) verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+
+    fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && verifier_log[0])
+		log_printf(log_debug, "XDP verifier log:\n%s", verifier_log);
+    return fd;
+}
+
+/**
+ * Maps one of the AF_XDP rings into memory.
+ *
+ * @param fd (int) - AF_XDP socket
+ * @param off (const struct xdp_ring_offset*) - Ring layout from XDP_MMAP_OFFSETS
+ * @param entry_size (size_t) - Size of a ring entry
+ * @param pgoff (off_t) - Mapping offset selecting the ring
+ * @param ring (struct xdp_ring*) - Output ring description
+ *
+ * @return int - 0 on success, -1 on error with errno set
+ */
+static int map_ring(int fd, const struct xdp_ring_offset *off, size_t entry_size, off_t pgoff, struct xdp_ring *ring)
+{
+    ring->map_len = off->desc + XDP_RING_SIZE * entry_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return -1;
+    }
+
+    ring->producer = (uint32_t *) ((char *) ring->map + off->producer);
+    ring->consumer = (uint32_t *) ((char *) ring->map + off->consumer);
+    ring->descs = (char *) ring->map + off->desc;
+    ring->mask = XDP_RING_SIZE - 1;
+
+    return 0;
+}
+
+/**
+ * Returns chunks to the fill ring so that the kernel can reuse them.
+ *
+ * @param xdp (struct xdp_ingest*) - Ingest state
+ * @param addrs (const uint64_t*) - UMEM chunk addresses
+ * @param n (int) - Number of chunks
+ *
+ * @return void
+ */
+static void fill_ring_put(struct xdp_ingest *xdp, const uint64_t *addrs, int n)
+{
+    uint32_t prod = *xdp->fill.producer;  // only we write the producer index
+    uint64_t *descs = xdp->fill.descs;
+    int i;
+
+    /* the ring can hold every chunk, so there is always room */
+    for (i = 0; i < n; i++)
+		descs[(prod + i) & xdp->fill.mask] = addrs[i];
+
+    __atomic_store_n(xdp->fill.producer, prod + n, __ATOMIC_RELEASE);
+}
+
+/**
+ * Releases every resource held by a partially or fully initialized ingest.
+ */
+static void xdp_ingest_free(struct xdp_ingest *xdp)
+{
+    if (xdp->rx.map)
+		munmap(xdp->rx.map, xdp->rx.map_len);
+    if (xdp->comp.map)
+		munmap(xdp->comp.map, xdp->comp.map_len);
+    if (xdp->fill.map)
+		munmap(xdp->fill.map, xdp->fill.map_len);
+    if (xdp->link_fd >= 0)
+		close(xdp->link_fd);
+    if (xdp->prog_fd >= 0)
+		close(xdp->prog_fd);
+    if (xdp->map_fd >= 0)
+		close(xdp->map_fd);
+    if (xdp->xsk_fd >= 0)
+		close(xdp->xsk_fd);
+    if (xdp->umem)
+		munmap(xdp->umem, xdp->umem_len);
+    free(xdp);
+}
+
+/* the MTU of an interface, or -1 if it cannot be read */
+static int interface_mtu(const char *ifname)
+{
+    struct ifreq ifr;
+    int fd, res;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    res = ioctl(fd, SIOCGIFMTU, &ifr);
+    close(fd);
+    return res < 0 ? -1 : ifr.ifr_mtu;
+}
+
+/**
+ * Sets up AF_XDP ingest for a UDP port on one queue of a network interface.
+ * Failures are not fatal: they are logged and NULL is returned, so that the
+ * caller can keep using the UDP socket alone. So is an interface whose MTU
+ * does not fit in a UMEM frame.
+ *
+ * @param ifname (const char*) - Interface receiving the tunneled traffic
+ * @param queue (int) - RX queue to bind to
+ * @param port (int) - UDP port of the listener, in host byte order
+ * @param native (int) - 1 to attach in driver mode, 0 for generic (SKB) mode
+ *
+ * @return struct xdp_ingest* - Ingest state, or NULL if AF_XDP is unavailable
+ */
+struct xdp_ingest *xdp_ingest_open(const char *ifname, int queue, int port, int native)
+{
+    struct xdp_ingest *xdp;
+    struct xdp_umem_reg umem_reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    union bpf_attr attr;
+    socklen_t optlen;
+    unsigned int ifindex;
+    int ring_size = XDP_RING_SIZE;
+    int mtu;
+    uint64_t addr;
+    int key = queue;
+
+    if (!(ifindex = if_nametoindex(ifname))) {
+		log_printf_err(log_warning, "AF_XDP: unknown interface %s", ifname);
+		return NULL;
+    }
+    if ((mtu = interface_mtu(ifname)) < 0) {
+		log_printf_err(log_warning, "AF_XDP: ioctl(%s, SIOCGIFMTU)", ifname);
+		return NULL;
+    }
+    if (mtu + XDP_LINK_HEADROOM > XDP_FRAME_SIZE) {
+		log_printf(log_warning, "AF_XDP: the MTU %d of %s does not fit in the %d-byte UMEM frames",
+			mtu, ifname, XDP_FRAME_SIZE);
+		return NULL;
+    }
+
+    xdp = NOFAIL(calloc(1, sizeof(*xdp)));
+    xdp->xsk_fd = xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+
+    /* the UMEM must be page aligned, which mmap() guarantees */
+    xdp->umem_len = (size_t) XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    xdp->umem = mmap(NULL, xdp->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (xdp->umem == MAP_FAILED) {
+		xdp->umem = NULL;
+		log_printf_err(log_warning, "AF_XDP: mmap(umem)");
+		goto fail;
+    }
+
+    if ((xdp->xsk_fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+		log_printf_err(log_warning, "AF_XDP: socket(AF_XDP)");
+		goto fail;
+    }
+
+    memset(&umem_reg, 0, sizeof(umem_reg));
+    umem_reg.addr = (uintptr_t) xdp->umem;
+    umem_reg.len = xdp->umem_len;
+    umem_reg.chunk_size = XDP_FRAME_SIZE;
+    umem_reg.headroom = 0;
+    if (setsockopt(xdp->xsk_fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) < 0 ||
+		setsockopt(xdp->xsk_fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0 ||
+		setsockopt(xdp->xsk_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0 ||
+		setsockopt(xdp->xsk_fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0) {
+		log_printf_err(log_warning, "AF_XDP: setsockopt(SOL_XDP)");
+		goto fail;
+    }
+
+    optlen = sizeof(off);
+    if (getsockopt(xdp->xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		log_printf_err(log_warning, "AF_XDP: getsockopt(XDP_MMAP_OFFSETS)");
+		goto fail;
+    }
+
+    if (map_ring(xdp->xsk_fd, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, &xdp->fill) < 0 ||
+		map_ring(xdp->xsk_fd, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, &xdp->comp) < 0 ||
+		map_ring(xdp->xsk_fd, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, &xdp->rx) < 0) {
+		log_printf_err(log_warning, "AF_XDP: mmap(rings)");
+		goto fail;
+    }
+
+    /* hand every chunk to the kernel */
+    for (addr = 0; addr < XDP_NUM_FRAMES; addr++)
+		((uint64_t *) xdp->fill.descs)[addr] = addr * XDP_FRAME_SIZE;
+    __atomic_store_n(xdp->fill.producer, XDP_NUM_FRAMES, __ATOMIC_RELEASE);
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = native ? 0 : XDP_COPY;
+    if (bind(xdp->xsk_fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+		log_printf_err(log_warning, "AF_XDP: bind(%s, queue %d)", ifname, queue);
+		goto fail;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = queue + 1;
+    if ((xdp->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+		log_printf_err(log_warning, "AF_XDP: bpf(BPF_MAP_CREATE)");
+		goto fail;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->map_fd;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) &xdp->xsk_fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		log_printf_err(log_warning, "AF_XDP: bpf(BPF_MAP_UPDATE_ELEM)");
+		goto fail;
+    }
+
+    if ((xdp->prog_fd = load_redirect_prog(xdp->map_fd, port)) < 0) {
+		log_printf_err(log_warning, "AF_XDP: bpf(BPF_PROG_LOAD)");
+		goto fail;
+    }
+
+    /*
+     * Attach through a bpf_link instead of netlink: the kernel detaches the
+     * program as soon as the link fd is closed, also when we are killed.
+     */
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    if ((xdp->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+		log_printf_err(log_warning, "AF_XDP: cannot attach the XDP program to %s", ifname);
+		goto fail;
+    }
+
+    log_printf(log_info, "AF_XDP ingest enabled on %s queue %d (%s mode) for UDP port %d",
+	    ifname, queue, native ? "native" : "generic", port);
+
+    return xdp;
+
+fail:
+    xdp_ingest_free(xdp);
+    return NULL;
+}
+
+/**
+ * Returns the AF_XDP socket, which becomes readable when the RX ring has packets.
+ */
+int xdp_ingest_fd(const struct xdp_ingest *xdp)
+{
+    return xdp->xsk_fd;
+}
+
+/**
+ * Parses the Ethernet/IP/UDP headers of a frame redirected by the program.
+ *
+ * @param frame (char*) - Start of the Ethernet frame in the UMEM
+ * @param len (uint32_t) - Frame length
+ * @param pkt (struct xdp_packet*) - Output packet description
+ *
+ * @return int - 0 on success, -1 if the frame is not a valid UDP datagram
+ */
+static int parse_frame(char *frame, uint32_t len, struct xdp_packet *pkt)
+{
+    uint16_t proto, udp_len;
+    uint32_t l3 = 14, l4;
+
+    if (len < l3)
+		return -1;
+    memcpy(&proto, frame + 12, sizeof(proto));
+
+    if (proto == htons(ETH_P_IP)) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) &pkt->src;
+
+		if (len < l3 + 20)
+			return -1;
+		l4 = l3 + (frame[l3] & 0x0f) * 4;
+		if (len < l4 + 8)
+			return -1;
+		memset(sin, 0, sizeof(*sin));
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, frame + l3 + 12, 4);
+		memcpy(&sin->sin_port, frame + l4, 2);
+		pkt->srclen = sizeof(*sin);
+    } else if (proto == htons(ETH_P_IPV6)) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &pkt->src;
+
+		l4 = l3 + 40;
+		if (len < l4 + 8)
+			return -1;
+		memset(sin6, 0, sizeof(*sin6));
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, frame + l3 + 8, 16);
+		memcpy(&sin6->sin6_port, frame + l4, 2);
+		pkt->srclen = sizeof(*sin6);
+    } else {
+		return -1;
+    }
+
+    /* trust the UDP length over the frame length, which may include padding */
+    memcpy(&udp_len, frame + l4 + 4, sizeof(udp_len));
+    udp_len = ntohs(udp_len);
+    if (udp_len < 8 || l4 + udp_len > len)
+		return -1;
+
+    pkt->payload = frame + l4 + 8;
+    pkt->length = udp_len - 8;
+
+    return 0;
+}
+
+/**
+ * Takes up to max datagrams from the RX ring.
+ * The payloads stay valid until the next xdp_ingest_release() call, which
+ * must happen before xdp_ingest_recv() is called again.
+ *
+ * @param xdp (struct xdp_ingest*) - Ingest state
+ * @param pkts (struct xdp_packet*) - Output array
+ * @param max (int) - Size of pkts, at most XDP_BATCH_SIZE
+ *
+ * @return int - Number of datagrams stored in pkts
+ */
+int xdp_ingest_recv(struct xdp_ingest *xdp, struct xdp_packet *pkts, int max)
+{
+    uint32_t cons = *xdp->rx.consumer;  // only we write the consumer index
+    uint32_t prod = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+    struct xdp_desc *descs = xdp->rx.descs;
+    uint32_t i, avail = prod - cons;
+    int n = 0;
+
+    if (max > XDP_BATCH_SIZE)
+		max = XDP_BATCH_SIZE;
+    if (avail > (uint32_t) max)
+		avail = max;
+
+    for (i = 0; i < avail; i++) {
+		const struct xdp_desc *desc = &descs[(cons + i) & xdp->rx.mask];
+
+		/* the chunk is ours until it is put back in the fill ring */
+		xdp->pending[xdp->pending_len++] = desc->addr & ~((uint64_t) XDP_FRAME_SIZE - 1);
+		if (parse_frame(xdp->umem + desc->addr, desc->len, &pkts[n]) == 0)
+			n++;
+    }
+
+    __atomic_store_n(xdp->rx.consumer, cons + avail, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/**
+ * Gives the chunks of the last xdp_ingest_recv() batch back to the kernel.
+ */
+void xdp_ingest_release(struct xdp_ingest *xdp)
+{
+    fill_ring_put(xdp, xdp->pending, xdp->pending_len);
+    xdp->pending_len = 0;
+}
+
+#else
+
+struct xdp_ingest *xdp_ingest_open(const char *ifname, int queue, int port, int native)
+{
+    log_printf(log_warning, "AF_XDP is not supported on this platform, using the UDP socket");
+    return NULL;
+}
+
+int xdp_ingest_fd(const struct xdp_ingest *xdp)
+{
+    return -1;
+}
+
+int xdp_ingest_recv(struct xdp_ingest *xdp, struct xdp_packet *pkts, int max)
+{
+    return 0;
+}
+
+void xdp_ingest_release(struct xdp_ingest *xdp)
+{
+}
+
+#endif
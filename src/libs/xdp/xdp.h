@@ -0,0 +1,48 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __XDP_H__
+    #define __XDP_H__
+
+    #include <sys/socket.h>
+
+    /* maximum number of packets returned by a single xdp_ingest_recv() call */
+    #define XDP_BATCH_SIZE 64
+
+    /**
+     * A UDP datagram received through AF_XDP. The payload points into the
+     * UMEM chunk holding the frame and is always preceded by at least two
+     * writable bytes (the UDP checksum field), which lets the caller build
+     * the tunnel length prefix in place.
+     */
+    struct xdp_packet {
+        char *payload;                 // UDP payload inside the UMEM chunk
+        int length;                    // UDP payload length
+        struct sockaddr_storage src;   // Source address and port of the datagram
+        socklen_t srclen;              // Significant bytes in src
+    };
+
+    struct xdp_ingest;
+
+    struct xdp_ingest *xdp_ingest_open(const char *ifname, int queue, int port, int native);
+
+    int xdp_ingest_fd(const struct xdp_ingest *xdp);
+
+    int xdp_ingest_recv(struct xdp_ingest *xdp, struct xdp_packet *pkts, int max);
+
+    void xdp_ingest_release(struct xdp_ingest *xdp);
+
+#endif
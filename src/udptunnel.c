@@ -22,6 +22,31 @@
  * - Socket activation support (systemd/inetd)
  * - Configurable timeouts for idle connections
  * - Fork-based server model for multiple concurrent connections
+ * - Batched UDP egress with sendmmsg(), and AF_UNIX datagram destinations
+ *   (unixgram:/path) to skip the UDP/IP stack for co-located applications
+ * - AF_VSOCK stream side (vsock:CID:PORT) for tunnels between VMs and their host
+ * - Optional AF_XDP ingest for the client listener (--xdp), with automatic
+ *   fallback to the UDP socket
+ * - Shared memory transport (--shm) for applications on the client host
+ * - Zero-copy TCP stream for large payloads (bulk-threshold setting), with
+ *   MSG_ZEROCOPY sends and TCP_ZEROCOPY_RECEIVE
+ * - Relay core also available as an embeddable library (libudptunnel)
+ * - Pluggable I/O backend, with a simulated network (--simulate) for
+ *   deterministic benchmarks
+ * - Binary upgrade on SIGUSR2 which keeps the listeners and the tunnels open
+ * - Live migration of the server tunnels to another host (--migrate-to,
+ *   --migrate-listen) with TCP_REPAIR
+ * - Source address pool (--source-pool) binding the server UDP sockets to
+ *   explicit local addresses and ports, beyond the ephemeral port range
+ * - Transparent proxy mode (--tproxy) carrying the original destination of
+ *   the datagrams redirected to the client, for any-destination UDP
+ * - Sessions (--session, --session-dir) resuming a tunnel on any server node
+ *   after the client reconnected, with the same UDP binding and the packets
+ *   received meanwhile
+ * - Kernel filter of the UDP listener (--filter), compiled to classic BPF,
+ *   dropping the unwanted datagrams before they reach the relay
+ * - Control socket (--control) to change the settings and the listeners of
+ *   a running process and to query its state
  * - Comprehensive logging with multiple verbosity levels
  * 
  * Copyright (C) 2018 Marco d'Itri
@@ -83,11 +108,14 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <time.h>
 #include <sys/select.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #ifdef HAVE_SYSTEMD_SD_DAEMON_H
 #include <systemd/sd-daemon.h>
@@ -96,6 +124,26 @@
 #include "libs/utils/utils.h"
 #include "libs/log/log.h"
 #include "libs/network/network.h"
+#include "libs/xdp/xdp.h"
+#include "libs/kcm/kcm.h"
+#include "libs/bulk/bulk.h"
+#include "libs/migrate/migrate.h"
+#include "libs/shm/shm.h"
+#include "libs/relay/relay.h"
+#include "libs/io/io.h"
+#include "libs/io/simnet.h"
+#include "libs/upgrade/upgrade.h"
+#include "libs/config/config.h"
+#include "libs/control/control.h"
+#include "libs/overload/overload.h"
+#include "libs/srcpool/srcpool.h"
+#include "libs/tproxy/tproxy.h"
+#include "libs/filter/filter.h"
+#include "libs/session/session.h"
+#include "libs/sketch/sketch.h"
+#include "libs/acl/acl.h"
+#include "libs/ratelimit/ratelimit.h"
+#include "libs/dnscache/dnscache.h"
 
 #ifdef HAVE_GETOPT_LONG
 #include <getopt.h>
@@ -108,9 +156,11 @@
  * - UDPBUFFERSIZE: reserves 2 bytes for the length prefix in the TCP stream format,
  *   allowing maximum UDP payload of 65534 bytes per encapsulated packet
  */
-#define TCPBUFFERSIZE 65536					// TCP stream buffer size (64KB)
+#define TCPBUFFERSIZE UDPTUNNEL_BUFFER_SIZE	// TCP stream buffer size (64KB)
 #define UDPBUFFERSIZE (TCPBUFFERSIZE - 2)	// Maximum UDP payload size (minus 2-byte length prefix)
 
+#define SHM_RING_SIZE (1024 * 1024) // Bytes of each shared memory ring
+
 /**
  * TCP packet wrapper for sending UDP data over TCP connection.
  * Uses network byte order (big-endian) length prefix followed by UDP payload.
@@ -120,17 +170,28 @@ struct out_packet {
     char buf[UDPBUFFERSIZE];       // UDP packet data (max 65534 bytes)
 };
 
-/**
- * Command-line configuration options.
- * Stores parsed arguments and operational mode settings.
- */
-struct opts {
-    const char *udpaddr, *tcpaddr; // Source and destination address strings
-
-    int is_server;                 // 1 = server mode (TCP->UDP), 0 = client mode (UDP->TCP)
-    int use_inetd;                 // 1 = running under inetd/systemd, 0 = standalone
-    char *handshake;               // Authentication handshake string (32 bytes)
-    int timeout;                   // Idle connection timeout in seconds
+/* Values for the options which have no short equivalent */
+enum {
+    OPT_XDP = 256,
+    OPT_XDP_NATIVE,
+    OPT_SHM,
+    OPT_SIMULATE,
+    OPT_CONTROL,
+    OPT_HEALTH_CHECK,
+    OPT_SET,
+    OPT_IDLE_DISCONNECT,
+    OPT_ACL,
+    OPT_KCM,
+    OPT_MIGRATE_TO,
+    OPT_MIGRATE_LISTEN,
+    OPT_SOURCE_POOL,
+    OPT_SOURCE_PORTS,
+    OPT_TPROXY,
+    OPT_FILTER,
+    OPT_SESSION,
+    OPT_SESSION_DIR,
+    OPT_SESSION_NODE,
+    OPT_SECRET,
 };
 
 /**
@@ -142,21 +203,96 @@ struct relay {
     struct sockaddr_storage remote_udpaddr; // UDP peer address for replies
 
     int udp_sock, tcp_sock;        // Socket file descriptors
-
-    int expect_handshake;          // 1 if handshake validation required (server mode)
-    char handshake[32];            // Expected handshake string for authentication
+    struct xdp_ingest *xdp;        // AF_XDP ingest for the UDP listener, NULL if not used
+    struct shm_tunnel *shm;        // Shared memory transport, NULL if not used
+    struct kcm_mux *kcm;           // AF_KCM socket splitting the TCP stream, NULL if not used
+    int kcm_failed;                // 1 once AF_KCM could not be attached, not tried again
+    struct bulk *bulk;             // Zero-copy sends and receives of the TCP connection, NULL until bulk-threshold is set
+    struct tproxy *tproxy;         // Flows of the transparent proxy mode, NULL if not used
+    struct session *session;       // Session which the client may resume on another connection (server), or NULL
+    unsigned char session_id[SESSION_ID_SIZE]; // Session sent after each handshake, with --session (client)
+    int reply_via_shm;             // 1 if the last packet came from the shared memory rings
+    int udp_connected;             // 1 if udp_sock is connected to the destination (server)
+    int pktinfo;                   // 1 if the listener reports the destination of each datagram (client)
+    union {
+		char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+		struct cmsghdr align;
+    } reply_control;               // IP_PKTINFO or IPV6_PKTINFO pinning the source of the replies
+    size_t reply_controllen;       // 0 to let the kernel choose the source address
+
+    struct udptunnel *core;        // Relay core: handshake, TCP stream parser and packet framing
+    struct config *config;         // Runtime settings
+    struct control *control;       // Control socket served between packets, NULL if not used
+    struct sketch *talkers;        // Traffic per UDP peer, NULL if not counted
+    time_t talkers_logged;         // Last log of the top talkers, for the top-talkers setting
+    struct acl *acl;               // Filter of the UDP sources, or of the TPROXY destinations (server), NULL if all are accepted
+    struct ratelimit *ratelimit;   // Token buckets of the UDP sources, NULL until source-rate is set
+    time_t wg_keepalive_relayed;   // Last WireGuard keepalive sent through the tunnel
+    unsigned long wg_keepalives_dropped;
+    struct dnscache *dns;          // Responses to the DNS queries, NULL until dns-cache is set
+    int dns_entries;               // dns-cache setting the cache was created with
     int udp_timeout, tcp_timeout;  // Timeout values for each protocol direction
-    char buf[TCPBUFFERSIZE];       // TCP stream buffer for parsing packets
-    char *buf_ptr, *packet_start;  // Buffer pointers for stream parsing
-    int packet_length;             // Expected length of current packet being read
-    enum {
-		uninitialized = 0,         // Initial state - determine next operation
-		reading_handshake,         // Expecting handshake data from TCP peer
-		reading_length,            // Reading 2-byte length prefix
-		reading_packet,            // Reading UDP payload data
-    } state;                       // TCP stream parsing state machine
+    time_t tcp_activity;           // Last data sent or received on the TCP connection
+    time_t next_connect;           // Earliest connection attempt of the lazy client after a failure
+    int connect_backoff;           // Seconds without connection attempts after the last failure
+    struct mmsghdr udp_batch[UDP_BATCH_SIZE]; // Pending UDP datagrams for sendmmsg()
+    struct iovec udp_batch_iov[UDP_BATCH_SIZE]; // Payload vectors pointing into the core buffer
+    int udp_batch_len;             // Number of queued datagrams in udp_batch
+};
+
+/**
+ * What the control commands act on: the configuration, and either the
+ * listeners of the server parent or the tunnel of the client.
+ */
+struct instance {
+    struct config config;          // Current configuration
+    struct relay *relay;           // Tunnel of the client, NULL in the server
+    int *listening_sockets;        // Listeners of the server, terminated with -1
+    int *migrate_sockets;          // Listeners of the tunnels migrated from other servers, or NULL
+    struct admission admission;    // Checks of the new connections of the server, and their counters
+    struct overload *overload;     // Tunnels of the server and load shedding, NULL in the other modes
+    struct srcpool *pool;          // Source addresses of the UDP sockets of the server, or NULL
+    struct session_dir *sessions;  // Directory of the sessions of the clients (server), or NULL
+    time_t started;                // Start time, for the status
 };
 
+/*
+ * A WireGuard keepalive is a transport data message (type 4, three reserved
+ * zero bytes, receiver index and counter) with an empty payload, so only the
+ * 16-byte authentication tag follows the 16-byte header.
+ */
+#define WG_KEEPALIVE_SIZE 32
+#define WG_TRANSPORT_DATA 4
+
+/*
+ * The lazy client gives up a connection attempt after CONNECT_TIMEOUT seconds,
+ * then drops the packets for 1, 2, 4... up to CONNECT_BACKOFF_MAX seconds.
+ */
+#define CONNECT_TIMEOUT 5
+#define CONNECT_BACKOFF_MAX 30
+
+/* peers in each log of the top talkers, which the control socket lists in full */
+#define TALKERS_LOGGED 5
+
+/* set by SIGUSR2: re-execute the binary, keeping the sockets open */
+static volatile sig_atomic_t upgrade_requested;
+
+/* set by SIGHUP: load the ACL file again */
+static volatile sig_atomic_t reload_requested;
+
+/* set by SIGUSR1: hand over the tunnel to the server given with --migrate-to */
+static volatile sig_atomic_t migrate_requested;
+
+/*
+ * The migration listeners are watched by the server parent with the control
+ * sockets, the other servers have MIGRATE_TIMEOUT seconds to send a tunnel,
+ * and a migrated tunnel keeps its frozen connection for MIGRATE_LINGER
+ * seconds, until its address is routed to the new server.
+ */
+#define MIGRATE_MAX_LISTENERS 4
+#define MIGRATE_TIMEOUT 5
+#define MIGRATE_LINGER 30
+
 /**
  * Display program usage information and exit.
  *
@@ -174,29 +310,112 @@ static void usage(int status)
     fprintf(fp, "-T N  --timeout N      close the source connection after N seconds\n");
     fprintf(fp, "                       where no data was received\n");
     fprintf(fp, "-S    --syslog         log to syslog instead of standard error\n");
+    fprintf(fp, "      --xdp IFACE[:Q]  receive the UDP packets with AF_XDP from queue Q\n");
+    fprintf(fp, "                       (default 0) of IFACE, in client mode\n");
+    fprintf(fp, "      --xdp-native     attach the XDP program in driver mode\n");
+    fprintf(fp, "      --kcm            let the kernel split the frames of the TCP stream\n");
+    fprintf(fp, "                       with AF_KCM, when available\n");
+    fprintf(fp, "      --tproxy         relay the UDP traffic redirected by TPROXY to SOURCE:PORT\n");
+    fprintf(fp, "                       to its original destination; the server then takes\n");
+    fprintf(fp, "                       no DESTINATION:PORT\n");
+    fprintf(fp, "      --shm PATH       let local applications exchange packets through\n");
+    fprintf(fp, "                       shared memory rings attached at PATH, in client mode\n");
+    fprintf(fp, "      --control PATH   accept commands on the unix socket PATH to change the\n");
+    fprintf(fp, "                       configuration of the running process\n");
+    fprintf(fp, "      --acl FILE       accept the UDP packets only from the sources allowed\n");
+    fprintf(fp, "                       by the rules of FILE, reloaded on SIGHUP, in client mode;\n");
+    fprintf(fp, "                       with --tproxy in server mode, the destinations allowed\n");
+    fprintf(fp, "      --filter EXPR    let the kernel drop the UDP packets unless they match\n");
+    fprintf(fp, "                       EXPR, e.g. \"sport=53,len<=512\"; repeated, any of\n");
+    fprintf(fp, "                       the expressions, in client mode\n");
+    fprintf(fp, "      --migrate-to HOST:PORT  hand over the tunnels to the server listening\n");
+    fprintf(fp, "                       at HOST:PORT on SIGUSR1, in server mode\n");
+    fprintf(fp, "      --migrate-listen ADDRESS:PORT  take over the tunnels of other servers\n");
+    fprintf(fp, "                       on ADDRESS:PORT, in server mode\n");
+    fprintf(fp, "      --source-pool ADDRESS[,ADDRESS]...  bind the UDP sockets of the tunnels\n");
+    fprintf(fp, "                       to these local addresses, in server mode\n");
+    fprintf(fp, "      --source-ports LOW-HIGH  ports of the source pool (default: the\n");
+    fprintf(fp, "                       ephemeral port range of the system)\n");
+    fprintf(fp, "      --session        resume the tunnel after reconnecting, even on another\n");
+    fprintf(fp, "                       server node, with --idle-disconnect in client mode\n");
+    fprintf(fp, "      --session-dir DIR  keep the sessions of the clients in DIR, shared by\n");
+    fprintf(fp, "                       the server nodes, in server mode\n");
+    fprintf(fp, "      --session-node HOST:PORT  address where the other nodes reach this\n");
+    fprintf(fp, "                       server (default: the TCP listen address)\n");
+    fprintf(fp, "      --secret FILE    use the first 32 bytes of FILE as the handshake of the\n");
+    fprintf(fp, "                       tunnels instead of the public default one; needed by\n");
+    fprintf(fp, "                       --migrate-listen and by --tproxy in server mode\n");
+    fprintf(fp, "      --health-check   answer the HTTP requests of load balancers with\n");
+    fprintf(fp, "                       \"200 OK\" instead of rejecting them, in server mode\n");
+    fprintf(fp, "      --idle-disconnect N  connect only when there are UDP packets to send,\n");
+    fprintf(fp, "                       and disconnect after N seconds without data, in\n");
+    fprintf(fp, "                       client mode\n");
+    fprintf(fp, "      --set KEY=VALUE  change a runtime setting, as the set control command,\n");
+    fprintf(fp, "                       e.g. --set max-tunnels=1000\n");
+    fprintf(fp, "      --simulate SPEC  run the client relay on a simulated network and report\n");
+    fprintf(fp, "                       its performance; SPEC is a comma-separated list of\n");
+    fprintf(fp, "                       rate=, size=, count=, bw=, latency=, loss=, rto=,\n");
+    fprintf(fp, "                       rcvbuf=, sndbuf= and seed= settings\n");
     fprintf(fp, "-v    --verbose        explain what is being done\n");
     fprintf(fp, "-h    --help           display this help and exit\n");
-    fprintf(fp, "\nSOURCE:PORT must not be specified when using inetd or socket activation.\n\n");
+    fprintf(fp, "\nSOURCE:PORT must not be specified when using inetd or socket activation.\n");
+    fprintf(fp, "No address is specified with --simulate.\n\n");
     fprintf(fp, "If the -s option is used then the program will listen on SOURCE:PORT for TCP\n");
     fprintf(fp, "connections and relay the encapsulated packets with UDP to DESTINATION:PORT.\n");
     fprintf(fp, "Otherwise it will listen on SOURCE:PORT for UDP packets and encapsulate\n");
     fprintf(fp, "them in a TCP connection to DESTINATION:PORT.\n");
+    fprintf(fp, "\nIn server mode DESTINATION:PORT may also be unixgram:/PATH to deliver the\n");
+    fprintf(fp, "packets to a local AF_UNIX datagram socket.\n");
+    fprintf(fp, "The TCP side may use vsock:[CID:]PORT addresses to tunnel over AF_VSOCK.\n");
+    fprintf(fp, "\nOn SIGUSR2 the program re-executes its binary, handing over the listening\n");
+    fprintf(fp, "sockets or the tunnel, so that a new version can be started without\n");
+    fprintf(fp, "dropping any connection.\n");
+    fprintf(fp, "On SIGUSR1 a tunnel of the server moves to the server given with --migrate-to,\n");
+    fprintf(fp, "which takes over the TCP connection of its client with TCP_REPAIR.\n");
 
     exit(status);
 }
 
+/**
+ * Reads the handshake of the tunnels from a file, which must be private to
+ * this user: with it another server can hand over its tunnels to this one.
+ *
+ * @param path (const char*) - File starting with the secret
+ * @param handshake (char*) - Output handshake, UDPTUNNEL_HANDSHAKE_SIZE bytes
+ *
+ * @return const char* - NULL on success, otherwise the reason of the failure
+ */
+static const char *read_secret(const char *path, char *handshake)
+{
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return strerror(errno);
+    if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 077)) {
+		close(fd);
+		return "it must belong to this user and be private to it (chmod 600)";
+    }
+    len = read(fd, handshake, UDPTUNNEL_HANDSHAKE_SIZE);
+    close(fd);
+    if (len != UDPTUNNEL_HANDSHAKE_SIZE)
+		return "it must hold at least 32 bytes";
+    return NULL;
+}
+
 /**
  * Parse command-line arguments and configure program options.
- * Sets up logging verbosity, validates argument count, and populates the opts structure
- * with parsed configuration including addresses, timeouts, and operational modes.
+ * Sets up logging verbosity, validates argument count, and populates the configuration
+ * with parsed settings including addresses, timeouts, and operational modes.
  *
  * @param argc (int) - Number of command-line arguments
  * @param argv (char*[]) - Array of command-line argument strings
- * @param opts (struct opts*) - Output structure to populate with parsed options
+ * @param config (struct config*) - Output configuration, initialized with config_init()
  *
  * @return void - exits program on invalid arguments via usage()
  */
-static void parse_args(int argc, char *argv[], struct opts *opts)
+static void parse_args(int argc, char *argv[], struct config *config)
 {
 #ifdef HAVE_GETOPT_LONG
     const struct option longopts[] = {
@@ -206,6 +425,26 @@ static void parse_args(int argc, char *argv[], struct opts *opts)
 		{"timeout",			required_argument,	NULL, 'T' },
 		{"help",			no_argument,		NULL, 'h' },
 		{"verbose",			no_argument,		NULL, 'v' },
+		{"xdp",				required_argument,	NULL, OPT_XDP },
+		{"xdp-native",		no_argument,		NULL, OPT_XDP_NATIVE },
+		{"kcm",				no_argument,		NULL, OPT_KCM },
+		{"tproxy",			no_argument,		NULL, OPT_TPROXY },
+		{"shm",				required_argument,	NULL, OPT_SHM },
+		{"simulate",		required_argument,	NULL, OPT_SIMULATE },
+		{"control",			required_argument,	NULL, OPT_CONTROL },
+		{"health-check",	no_argument,		NULL, OPT_HEALTH_CHECK },
+		{"set",				required_argument,	NULL, OPT_SET },
+		{"idle-disconnect",	required_argument,	NULL, OPT_IDLE_DISCONNECT },
+		{"acl",				required_argument,	NULL, OPT_ACL },
+		{"filter",			required_argument,	NULL, OPT_FILTER },
+		{"migrate-to",		required_argument,	NULL, OPT_MIGRATE_TO },
+		{"migrate-listen",	required_argument,	NULL, OPT_MIGRATE_LISTEN },
+		{"source-pool",		required_argument,	NULL, OPT_SOURCE_POOL },
+		{"source-ports",	required_argument,	NULL, OPT_SOURCE_PORTS },
+		{"session",			no_argument,		NULL, OPT_SESSION },
+		{"session-dir",		required_argument,	NULL, OPT_SESSION_DIR },
+		{"session-node",	required_argument,	NULL, OPT_SESSION_NODE },
+		{"secret",			required_argument,	NULL, OPT_SECRET },
 		{NULL,				0,			NULL, 0   },
     };
     int longindex;
@@ -215,23 +454,17 @@ static void parse_args(int argc, char *argv[], struct opts *opts)
     int verbose = 0;
     int use_syslog = 0;
 
-    /*
-     * Initialize default 32-byte handshake authentication token:
-     * - Bytes 0-15: "udptunnel by md." + 3 null terminators (human-readable signature)
-     * - Bytes 16-31: Binary entropy sequence \x01\x03\x06\x10\x15\x21\x28\x36\x45\x55\x66\x78\x91
-     *   providing additional randomness and making the handshake harder to forge accidentally.
-     *   The specific byte values create a distinctive fingerprint for protocol validation.
-     */
-    opts->handshake = NOFAIL(malloc(32));
-    memcpy(opts->handshake, "udptunnel by md.\0\0\0\x01\x03\x06\x10\x15\x21\x28\x36\x45\x55\x66\x78\x91", 32);
+    /* initialize the default 32-byte handshake authentication token */
+    config->handshake = NOFAIL(malloc(UDPTUNNEL_HANDSHAKE_SIZE));
+    memcpy(config->handshake, udptunnel_default_handshake, UDPTUNNEL_HANDSHAKE_SIZE);
 
     while ((c = GETOPT_LONGISH(argc, argv, "ihsvST:", longopts, &longindex)) > 0) {
 		switch (c) {
 			case 'i':
-				opts->use_inetd = 1;
+				config->use_inetd = 1;
 				break;
 			case 's':
-				opts->is_server = 1;
+				config->is_server = 1;
 				break;
 			case 'S':
 				use_syslog = 1;
@@ -243,11 +476,116 @@ static void parse_args(int argc, char *argv[], struct opts *opts)
 				 * INT_MAX will be truncated. For timeout values, this truncation
 				 * is acceptable since timeouts > 2^31 seconds are impractical.
 				 */
-				opts->timeout = atol(optarg);
+				config->timeout = atol(optarg);
 				break;
 			case 'v':
 				verbose++;
 				break;
+			case OPT_XDP: {
+				char *queue;
+
+				config->xdp_ifname = NOFAIL(strdup(optarg));
+				if ((queue = strchr(config->xdp_ifname, ':'))) { // Optional :QUEUE suffix
+					*queue++ = '\0';
+					config->xdp_queue = atoi(queue);
+				}
+				break;
+			}
+			case OPT_XDP_NATIVE:
+				config->xdp_native = 1;
+				break;
+			case OPT_KCM:
+				config->kcm = 1;
+				break;
+			case OPT_TPROXY:
+				config->tproxy = 1;
+				break;
+			case OPT_SHM:
+				config->shm_path = NOFAIL(strdup(optarg));
+				break;
+			case OPT_CONTROL:
+				config->control_path = NOFAIL(strdup(optarg));
+				break;
+			case OPT_ACL:
+				config->acl_path = NOFAIL(strdup(optarg));
+				break;
+			case OPT_FILTER: {
+				const char *error;
+
+				if (!config->filter)
+					config->filter = filter_new();
+				if ((error = filter_add(config->filter, optarg))) {
+					fprintf(stderr, "Invalid filter '%s': %s!\n\n", optarg, error);
+					usage(2);
+				}
+				break;
+			}
+			case OPT_MIGRATE_TO:
+				config->migrate_to = NOFAIL(strdup(optarg));
+				break;
+			case OPT_MIGRATE_LISTEN:
+				config->migrate_listen = NOFAIL(strdup(optarg));
+				break;
+			case OPT_SOURCE_POOL:
+				config->source_pool = NOFAIL(strdup(optarg));
+				break;
+			case OPT_SOURCE_PORTS:
+				config->source_ports = NOFAIL(strdup(optarg));
+				break;
+			case OPT_SESSION:
+				config->session = 1;
+				break;
+			case OPT_SESSION_DIR:
+				config->session_dir = NOFAIL(strdup(optarg));
+				break;
+			case OPT_SESSION_NODE:
+				config->session_node = NOFAIL(strdup(optarg));
+				break;
+			case OPT_SECRET: {
+				const char *error = read_secret(optarg, config->handshake);
+
+				if (error) {
+					fprintf(stderr, "Invalid --secret %s: %s!\n\n", optarg, error);
+					usage(2);
+				}
+				break;
+			}
+			case OPT_HEALTH_CHECK:
+				config->health_check = 1;
+				break;
+			case OPT_SET: {
+				char *key = NOFAIL(strdup(optarg)); // argv is reused as it is by upgrades
+				char *value = strchr(key, '=');
+				const char *error;
+
+				if (!value) {
+					fprintf(stderr, "--set expects KEY=VALUE, got: %s\n\n", optarg);
+					usage(2);
+				}
+				*value++ = '\0';
+				if ((error = config_set(config, key, value))) {
+					fprintf(stderr, "Invalid setting %s: %s\n\n", key, error);
+					usage(2);
+				}
+				free(key);
+				break;
+			}
+			case OPT_IDLE_DISCONNECT: {
+				const char *error = config_set(config, "idle-disconnect", optarg);
+
+				if (error) {
+					fprintf(stderr, "Invalid --idle-disconnect: %s\n\n", error);
+					usage(2);
+				}
+				break;
+			}
+			case OPT_SIMULATE:
+				if (simnet_parse(optarg, &config->simnet) < 0) {
+					fprintf(stderr, "Invalid simulation specification: %s\n\n", optarg);
+					usage(2);
+				}
+				config->simulate = 1;
+				break;
 			case 'h':
 				usage(0);
 				break;
@@ -264,9 +602,74 @@ static void parse_args(int argc, char *argv[], struct opts *opts)
      * sd_listen_fds(0) returns number of systemd-provided sockets (0 if no activation, >0 if socket activation),
      * use_inetd flag indicates traditional inetd mode; either condition means 1 arg expected
      */
-    expected_args = (sd_listen_fds(0) || opts->use_inetd) ? 1 : 2;
+    expected_args = (sd_listen_fds(0) || config->use_inetd) ? 1 : 2;
+    if (config->simulate) { // The simulated network provides both sockets
+		if (config->is_server || config->use_inetd || config->xdp_ifname || config->shm_path ||
+			config->idle_disconnect || config->kcm) {
+			fprintf(stderr, "--simulate only supports the plain client mode!\n\n");
+			usage(2);
+		}
+		expected_args = 0;
+    }
+    if (config->xdp_ifname && config->is_server) { // Only the client has a UDP listener
+		fprintf(stderr, "--xdp only supports the client mode!\n\n");
+		usage(2);
+    }
+    if (config->acl_path && (config->simulate || (config->is_server && !config->tproxy))) { // UDP sources, or destinations
+		fprintf(stderr, "--acl only supports the client mode, or the server mode with --tproxy!\n\n");
+		usage(2);
+    }
+    if (config->filter && (config->is_server || config->simulate)) { // Only the client has a UDP listener
+		fprintf(stderr, "--filter only supports the client mode!\n\n");
+		usage(2);
+    }
+    if ((config->migrate_to || config->migrate_listen) && (!config->is_server || config->use_inetd)) {
+		fprintf(stderr, "--migrate-to and --migrate-listen only support the standalone server mode!\n\n");
+		usage(2);
+    }
+    if (config->migrate_listen && memcmp(config->handshake, udptunnel_default_handshake, UDPTUNNEL_HANDSHAKE_SIZE) == 0) {
+		fprintf(stderr, "--migrate-listen needs --secret: anyone knows the default handshake!\n\n");
+		usage(2);
+    }
+    if ((config->source_pool || config->source_ports) && !config->is_server) {
+		fprintf(stderr, "--source-pool and --source-ports only support the server mode!\n\n");
+		usage(2);
+    }
+    if (config->tproxy && (config->simulate || config->xdp_ifname || config->shm_path || config->source_pool)) {
+		fprintf(stderr, "--tproxy cannot be used with --simulate, --xdp, --shm or --source-pool!\n\n");
+		usage(2);
+    }
+    if (config->tproxy && config->is_server) // The destinations come with the packets
+		expected_args--;
+    if (config->tproxy && config->is_server &&
+		memcmp(config->handshake, udptunnel_default_handshake, UDPTUNNEL_HANDSHAKE_SIZE) == 0) {
+		fprintf(stderr, "--tproxy needs --secret in server mode: anyone knows the default handshake!\n\n");
+		usage(2);
+    }
+    if (config->source_ports && !config->source_pool) {
+		fprintf(stderr, "--source-ports needs --source-pool!\n\n");
+		usage(2);
+    }
+    if (config->session && (config->is_server || !config->idle_disconnect)) { // Only the lazy client reconnects
+		fprintf(stderr, "--session needs the client mode and --idle-disconnect!\n\n");
+		usage(2);
+    }
+    if ((config->session_dir || config->session_node) && (!config->is_server || config->use_inetd || config->tproxy ||
+		config->migrate_to || config->migrate_listen)) {
+		fprintf(stderr, "--session-dir and --session-node only support the standalone server mode, "
+			"without --tproxy or migrations!\n\n");
+		usage(2);
+    }
+    if (config->session_node && !config->session_dir) {
+		fprintf(stderr, "--session-node needs --session-dir!\n\n");
+		usage(2);
+    }
+    if (config->control_path && config->is_server && config->use_inetd) { // No long-lived process to control
+		fprintf(stderr, "--control cannot be used with inetd in server mode!\n\n");
+		usage(2);
+    }
 
-    if (argc - optind == 0)
+    if (argc - optind == 0 && expected_args)
 		usage(2);
     if (argc - optind != expected_args) {
 		fprintf(stderr, "Expected %d argument(s)!\n\n", expected_args);
@@ -274,14 +677,20 @@ static void parse_args(int argc, char *argv[], struct opts *opts)
     }
 
     /* Parse source and destination addresses based on mode */
-    if (opts->is_server) {
-		if (expected_args == 2)
-			opts->tcpaddr = NOFAIL(strdup(argv[optind++])); // Server mode: TCP listen address
-		opts->udpaddr = NOFAIL(strdup(argv[optind++]));     // UDP destination to relay to
-    } else {
+    if (config->is_server) {
+		if (expected_args == 2 - config->tproxy)
+			config->tcpaddr = NOFAIL(strdup(argv[optind++])); // Server mode: TCP listen address
+		if (!config->tproxy)
+			config->udpaddr = NOFAIL(strdup(argv[optind++])); // UDP destination to relay to
+    } else if (expected_args) {
 		if (expected_args == 2)
-			opts->udpaddr = NOFAIL(strdup(argv[optind++])); // Client mode: UDP listen address
-		opts->tcpaddr = NOFAIL(strdup(argv[optind++]));     // TCP destination to connect to
+			config->udpaddr = NOFAIL(strdup(argv[optind++])); // Client mode: UDP listen address
+		config->tcpaddr = NOFAIL(strdup(argv[optind++]));     // TCP destination to connect to
+    }
+
+    if (config->session_dir && !config->session_node && !config->tcpaddr) { // Socket activation
+		fprintf(stderr, "--session-dir needs --session-node with socket activation!\n\n");
+		usage(2);
     }
 
     if (!verbose)
@@ -337,6 +746,7 @@ int *tcp_listener_sa(const int num)
     for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + num; fd++) {
 		if (sd_is_socket(fd, AF_UNSPEC, SOCK_STREAM, 1) <= 0)
 			log_printf_exit(2, log_err, "TCP socket activation fd %d is not valid.", fd);
+		tcp_defer_accept(fd);
 		fds[fd_num++] = fd;
     }
 
@@ -346,332 +756,2233 @@ int *tcp_listener_sa(const int num)
 }
 
 /**
- * Receive UDP packet and encapsulate it in TCP stream.
- * Reads a UDP packet, stores the sender's address for replies, and sends the packet
- * over TCP with a length prefix. Used in client mode to tunnel UDP through TCP.
+ * Tells whether the client opens its TCP connection only when there are
+ * packets to send, and closes it when idle.
  *
- * @param relay (struct relay*) - Connection state and socket information
+ * @param relay (const struct relay*) - Connection state
  *
- * @return void - exits program on socket errors
+ * @return int - 1 in lazy mode, 0 otherwise
  */
-static void udp_to_tcp(struct relay *relay)
+static int is_lazy(const struct relay *relay)
 {
-    struct out_packet p;
-    int buflen;
-    struct sockaddr_storage remote_udpaddr;
-    socklen_t addrlen = sizeof(remote_udpaddr);
-
-    /*
-     * Receive UDP packet and capture sender's address for bidirectional tunnel operation.
-     * The sender address is essential because UDP is connectionless - we need to know
-     * where to send replies when data comes back through the TCP tunnel from the server.
-     * This enables proper bidirectional communication in client mode.
-     */
-    buflen = recvfrom(relay->udp_sock, p.buf, UDPBUFFERSIZE, 0, (struct sockaddr *) &remote_udpaddr, &addrlen);
-    if (buflen < 0)
-		err_sys("recvfrom(udp)");
-    if (buflen == 0)
-		return;	/* ignore empty packets */
+    return !relay->config->is_server && relay->config->idle_disconnect > 0;
+}
 
-    /*
-     * Store the source address of the received UDP packet, to be able to use
-     * it in send_udp_packet as the destination address of the next UDP reply.
-     * addrlen from recvfrom() ensures only valid address bytes are copied.
-     */
-    memcpy(&(relay->remote_udpaddr), &remote_udpaddr, addrlen);
+/**
+ * Close the TCP connection of a lazy client. The process keeps listening
+ * for UDP packets, and the next one opens a new connection.
+ *
+ * @param relay (struct relay*) - Connection state
+ * @param why (const char*) - Reason, for the logs
+ *
+ * @return void
+ */
+static void tunnel_disconnect(struct relay *relay, const char *why)
+{
+    kcm_close(relay->kcm);
+    relay->kcm = NULL;
+    bulk_close(relay->bulk);
+    relay->bulk = NULL;
+    close(relay->tcp_sock);
+    relay->tcp_sock = -1;
+    log_printf(log_notice, "Closed the TCP connection: %s", why);
+    if (relay->session) { // The client may come back, through any node
+		session_park(relay->session, io->time(NULL) + relay->config->session_linger);
+		log_printf(log_info, "Waiting %ds for the client to resume the session", relay->config->session_linger);
+    }
+}
 
-#ifdef DEBUG
-    log_printf(log_debug, "Received a %d bytes UDP packet from %s", buflen,
-	    print_addr_port((struct sockaddr *) &remote_udpaddr, addrlen));
-#endif
+/**
+ * Handle an error while writing to the TCP connection: the lazy client drops
+ * the packet and will reconnect, the tunnel of a session waits for its
+ * client, the others exit.
+ *
+ * @param relay (struct relay*) - Connection state
+ * @param what (const char*) - Failed operation, for the logs
+ *
+ * @return void - exits program if not in lazy mode or in a session
+ */
+static void tcp_send_failed(struct relay *relay, const char *what)
+{
+    if (!is_lazy(relay) && !relay->session)
+		err_sys("%s", what);
 
-    p.length = htons(buflen);
-    if (send(relay->tcp_sock, &p, buflen + sizeof(p.length), 0) < 0) // Send struct: 2-byte length header + UDP payload data (total: buflen + 2 bytes)
-		err_sys("send(tcp)");
+    log_printf_err(log_info, "%s", what);
+    tunnel_disconnect(relay, "write error");
 }
 
 /**
- * Send UDP packet to the stored remote address.
- * Transmits the current packet data to the UDP peer address that was stored
- * from the most recent received UDP packet. Handles ECONNREFUSED errors gracefully.
+ * Handle the end of the TCP stream or an error while reading it: the lazy
+ * client will reconnect on the next packet, the tunnel of a session waits
+ * for its client, the others exit.
  *
- * @param relay (struct relay*) - Connection state with packet data and remote address
+ * @param relay (struct relay*) - Connection state
+ * @param res (int) - 0 if the peer closed the connection, -1 on error with errno set
+ * @param what (const char*) - Failed operation, for the logs
  *
- * @return void - logs errors but continues execution
+ * @return void - exits program if not in lazy mode or in a session
  */
-static void send_udp_packet(struct relay *relay)
+static void tcp_recv_failed(struct relay *relay, int res, const char *what)
 {
-    int opt = 0;
-    socklen_t len = sizeof(opt);
-
-    if (relay->remote_udpaddr.ss_family == 0) { // No UDP peer address stored yet
-		log_printf(log_info, "Ignoring a packet for a still unknown UDP destination!");
+    if (is_lazy(relay) || relay->session) {
+		tunnel_disconnect(relay, res ? strerror(errno) : "remote closed the connection");
 		return;
     }
+    if (res < 0)
+		err_sys("%s", what);
 
-    if (sendto(relay->udp_sock, relay->packet_start, relay->packet_length, 0, (struct sockaddr *) &relay->remote_udpaddr, sizeof(relay->remote_udpaddr)) >= 0) // Send UDP packet to stored peer address
-		return;
-
-    /* this is the error path */
-    if (errno != ECONNREFUSED)
-		err_sys("sendto(udp)");
-
-    /*
-     * Handle ECONNREFUSED gracefully: this commonly occurs when the UDP peer
-     * is not yet listening or has temporarily stopped. Since UDP is connectionless,
-     * we continue operation rather than terminating the tunnel. The getsockopt()
-     * call retrieves and clears any pending socket error state.
-     */
-    log_printf(log_info, "sendto(udp) returned ECONNREFUSED: ignored");
-    if (getsockopt(relay->udp_sock, SOL_SOCKET, SO_ERROR, &opt, &len) < 0) // Retrieve and clear pending socket error state
-		err_sys("getsockopt(udp, SOL_SOCKET, SO_ERROR)");
-
-    return;
+    log_printf_exit(0, log_notice, "Remote closed the connection");
 }
 
 /**
- * Parse TCP stream and extract UDP packets for forwarding.
- * Implements a state machine to parse the TCP stream: reads handshake (if expected),
- * then alternates between reading 2-byte length prefixes and UDP packet data.
- * Forwards complete UDP packets via send_udp_packet().
+ * Returns the socket taking the frames for the TCP stream: the AF_KCM
+ * socket once the connection is attached to it, which must not be written
+ * to directly anymore.
  *
- * @param relay (struct relay*) - Connection state including parsing buffers and state machine
+ * @param relay (const struct relay*) - Connection state with a TCP connection
  *
- * @return void - exits program on TCP connection close or socket errors
+ * @return int - File descriptor
  */
-static void tcp_to_udp(struct relay *relay)
+static int tunnel_fd(const struct relay *relay)
 {
-    int read_len;
-
-    /*
-     * Initialize TCP stream parsing state machine on first call.
-     * Server mode: expect handshake authentication first, then switch to packet parsing
-     * Client mode: immediately start parsing length-prefixed packets
-     */
-    if (relay->state == uninitialized) {
-		if (relay->expect_handshake) {
-			relay->state = reading_handshake;
-			relay->packet_length = sizeof(relay->handshake); // Expect 32-byte handshake first
-		} else {
-			relay->state = reading_length;
-			relay->packet_length = sizeof(uint16_t); // Expect 2-byte length prefix
-		}
-		relay->buf_ptr = relay->buf;        // Current write position in buffer
-		relay->packet_start = relay->buf;   // Start of current packet being parsed
-    }
-
-    read_len = read(relay->tcp_sock, relay->buf_ptr, (relay->buf + TCPBUFFERSIZE - relay->buf_ptr)); // Read into remaining buffer space
-    if (read_len < 0)
-		err_sys("read(tcp)");
-
-    if (read_len == 0) // TCP connection closed by peer
-		log_printf_exit(0, log_notice, "Remote closed the connection");
-
-    relay->buf_ptr += read_len; // Advance write pointer
-
-    while (relay->buf_ptr - relay->packet_start >= relay->packet_length) { // Process complete packets
-		if (relay->state == reading_handshake) {
-			/* check the handshake string */
-			if (memcmp(relay->packet_start, &(relay->handshake), sizeof(relay->handshake)) != 0) // Memory comparison of 32-byte handshake
-			log_printf_exit(0, log_info, "Received a bad handshake, exiting");
-			log_printf(log_debug, "Received a good handshake");
-			relay->packet_start += sizeof(relay->handshake); // Skip past handshake in buffer
-			relay->state = reading_length;
-			relay->packet_length = sizeof(uint16_t);
-		} else if (relay->state == reading_length) {
-			/* Extract packet length from network byte order */
-			relay->packet_length = ntohs(*(uint16_t *) relay->packet_start); // Convert from big-endian
-			relay->packet_start += sizeof(uint16_t); // Skip past 2-byte length field in stream
-			relay->state = reading_packet;
-		} else if (relay->state == reading_packet) {
-			/* read an encapsulated packet and send it as UDP */
-	#ifdef DEBUG
-			log_printf(log_debug, "Received a %u bytes TCP packet", relay->packet_length);
-	#endif
-
-			send_udp_packet(relay);
-
-			/*
-			 * Compact buffer: move any remaining unprocessed data to the start of the buffer.
-			 * This prevents buffer overflow and maintains parsing state across multiple reads.
-			 * - Source: data after the current packet (relay->packet_start + relay->packet_length)
-			 * - Destination: beginning of buffer (relay->buf)
-			 * - Length: remaining unprocessed bytes (relay->buf_ptr - processed_data_end)
-			 */
-			memmove(relay->buf, relay->packet_start + relay->packet_length, relay->buf_ptr - (relay->packet_start + relay->packet_length));
-			/* Update buffer pointer to reflect the compacted buffer state */
-			relay->buf_ptr -= relay->packet_length + (relay->packet_start - relay->buf);
-			relay->packet_start = relay->buf;
-			relay->state = reading_length;
-			relay->packet_length = sizeof(uint16_t);
-		}
-    }
+    return relay->kcm ? kcm_fd(relay->kcm) : relay->tcp_sock;
 }
 
 /**
  * Send authentication handshake to TCP peer.
  * Transmits the 32-byte handshake string to establish the tunnel connection.
- * Used in client mode to authenticate with the server.
+ * Used in client mode to authenticate with the server. With --session the
+ * session record follows in the same segment, so the server does not wait
+ * for it until its handshake deadline.
  *
  * @param relay (struct relay*) - Connection state with handshake data and TCP socket
  *
- * @return void - exits program on send errors
+ * @return void - exits program on send errors, except in lazy mode
  */
 static void send_handshake(struct relay *relay)
 {
-    if (send(relay->tcp_sock, relay->handshake, sizeof(relay->handshake), 0) < 0)
-	err_sys("sendto(tcp, handshake)");
+    char handshake[UDPTUNNEL_HANDSHAKE_SIZE + SESSION_RECORD_SIZE];
+    int len = udptunnel_handshake(relay->core, handshake, UDPTUNNEL_HANDSHAKE_SIZE);
+
+    if (relay->config->session) {
+		session_record(relay->session_id, handshake + len);
+		len += SESSION_RECORD_SIZE;
+    }
+
+    if (io->send(relay->tcp_sock, handshake, len, 0) < 0)
+		tcp_send_failed(relay, "sendto(tcp, handshake)");
 }
 
 /**
- * SIGCHLD signal handler to reap terminated child processes.
- * Prevents zombie processes in server mode by calling waitpid() for all available children.
- * Uses WNOHANG to avoid blocking if no children have exited.
+ * Enable the TCP keepalive probes which stand in for the WireGuard keepalives
+ * of the peers, when they are suppressed.
  *
- * @param sig (int) - Signal number (unused, always SIGCHLD)
+ * @param relay (struct relay*) - Connection state with a TCP connection
  *
  * @return void
  */
-static void wait_for_child(int sig)
+static void tunnel_keepalive(struct relay *relay)
 {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    if (relay->config->wireguard_keepalive && relay->tcp_sock >= 0 && io == &io_posix)
+		tcp_keepalive(relay->tcp_sock, relay->config->wireguard_keepalive);
 }
 
 /**
- * Main event loop for bidirectional packet relaying.
- * Uses select() to monitor both UDP and TCP sockets for incoming data,
- * handles timeout management, and dispatches to appropriate relay functions.
- * Runs indefinitely until a timeout occurs or an error forces program exit.
+ * Hand the parsing of the TCP stream over to the kernel with AF_KCM, if
+ * --kcm was given. The stream must be at a frame boundary: the server waits
+ * for the handshake to be checked and for a read which ends with a complete
+ * frame. If AF_KCM is not available, the relay core keeps parsing the stream.
  *
- * @param relay (struct relay*) - Connection state with sockets and timeout configuration
+ * @param relay (struct relay*) - Connection state
  *
- * @return void - never returns normally, exits via timeout or error
+ * @return void
  */
-static void main_loop(struct relay *relay)
+static void tunnel_kcm(struct relay *relay)
 {
-    time_t last_udp_input, last_tcp_input;
-
-    last_udp_input = relay->udp_timeout ? time(NULL) : 0; // Initialize UDP timeout tracking
-    last_tcp_input = relay->tcp_timeout ? time(NULL) : 0; // Initialize TCP timeout tracking
-
-    while (1) {
-		int ready_fds;
-		int max = 0;
-		fd_set readfds;
-		struct timeval tv, *ptv;
-
-		FD_ZERO(&readfds); // Clear file descriptor set
-		FD_SET(relay->tcp_sock, &readfds); // Monitor TCP socket for data
-		SET_MAX(relay->tcp_sock); // Track highest fd number for select()
-		FD_SET(relay->udp_sock, &readfds); // Monitor UDP socket for data
-		SET_MAX(relay->udp_sock); // Update highest fd number
-
-		/*
-		 * Configure select() timeout strategy:
-		 * - If timeouts are enabled: use 10-second intervals to periodically check for idle connections
-		 * - If no timeouts: block indefinitely waiting for socket activity
-		 * This balances responsiveness (checking timeouts) with efficiency (not busy-waiting)
-		 */
-		if (last_udp_input || last_tcp_input) {
-			tv.tv_usec = 0;
-			tv.tv_sec = 10; // Check for timeouts every 10 seconds
-			ptv = &tv;
-		} else {
-			ptv = NULL; // Block indefinitely if no timeouts configured
-		}
+    if (!relay->config->kcm || relay->kcm || relay->kcm_failed || relay->tcp_sock < 0 || io != &io_posix ||
+		!udptunnel_tcp_drained(relay->core))
+		return;
 
-		ready_fds = select(max, &readfds, NULL, NULL, ptv); // Wait for socket activity or timeout
-		if (ready_fds < 0) {
-			if (errno == EINTR || errno == EAGAIN) // Interrupted by signal or temporary error
-				continue;
-			err_sys("select");
-		}
+    if (!(relay->kcm = kcm_attach(relay->tcp_sock))) {
+		log_printf_err(log_notice, "Cannot use AF_KCM, parsing the TCP stream in user space");
+		relay->kcm_failed = 1;
+		return;
+    }
+    log_printf(log_debug, "Attached the TCP connection to AF_KCM");
+}
 
-		/* check timeouts when no file descriptors are ready (ready_fds == 0) */
-		if (last_udp_input && !ready_fds) {	/* select() timed out, check UDP timeout */
-			if (time(NULL) - last_udp_input > relay->udp_timeout) // Check if UDP idle time exceeded configured limit
-			log_printf_exit(0, log_notice, "Exiting after a %ds timeout for UDP input", relay->udp_timeout);
-		}
-		if (last_tcp_input && !ready_fds) {	/* select() timed out, check TCP timeout */
-			if (time(NULL) - last_tcp_input > relay->tcp_timeout) // Check if TCP idle time exceeded configured limit
-			log_printf_exit(0, log_notice, "Exiting after a %ds timeout for TCP input", relay->tcp_timeout);
-		}
+/**
+ * Returns the zero-copy state of the TCP connection, set up again when the
+ * bulk-threshold setting is enabled and dropped when it is disabled. It is
+ * not used along with AF_KCM, which owns the connection, nor on the
+ * simulated network.
+ *
+ * @param relay (struct relay*) - Connection state
+ *
+ * @return struct bulk* - Zero-copy state, or NULL to copy the stream
+ */
+static struct bulk *tunnel_bulk(struct relay *relay)
+{
+    if (!relay->config->bulk_threshold || relay->config->kcm || relay->tproxy || relay->tcp_sock < 0 ||
+		io != &io_posix) {
+		bulk_close(relay->bulk);
+		relay->bulk = NULL;
+    } else if (!relay->bulk) {
+		relay->bulk = bulk_open(relay->tcp_sock);
+		log_printf(log_debug, "Sending and receiving the payloads of %d bytes or more without copies",
+			relay->config->bulk_threshold);
+    }
+    return relay->bulk;
+}
 
-		if (FD_ISSET(relay->tcp_sock, &readfds)) { // TCP socket has data ready
-			tcp_to_udp(relay);
-			if (last_tcp_input)
-			last_tcp_input = time(NULL); // Update activity timestamp
-		}
-		if (FD_ISSET(relay->udp_sock, &readfds)) { // UDP socket has data ready
-			udp_to_tcp(relay);
-			if (last_udp_input)
-			last_udp_input = time(NULL); // Update activity timestamp
-		}
+/**
+ * Make sure that the lazy client has a TCP connection before sending packets.
+ * The connection is opened on demand with a fresh relay core, since the
+ * stream of the previous connection may have ended in the middle of a packet.
+ * After a failure the packets are dropped for a while, doubling each time,
+ * instead of trying to connect for every packet.
+ *
+ * @param relay (struct relay*) - Connection state
+ *
+ * @return int - 0 if the TCP connection can be used, -1 if the packets must be dropped
+ */
+static int tunnel_connect(struct relay *relay)
+{
+    struct udptunnel_config core_config;
+    time_t now;
+    int res;
+
+    if (relay->tcp_sock >= 0)
+		return 0;
+
+    now = io->time(NULL);
+    if (now < relay->next_connect)
+		return -1;
+
+    if ((relay->tcp_sock = tcp_connect(relay->config->tcpaddr, CONNECT_TIMEOUT)) < 0) {
+		relay->connect_backoff = relay->connect_backoff ? relay->connect_backoff * 2 : 1;
+		if (relay->connect_backoff > CONNECT_BACKOFF_MAX)
+			relay->connect_backoff = CONNECT_BACKOFF_MAX;
+		relay->next_connect = now + relay->connect_backoff;
+		log_printf(log_notice, "Dropping the packets for %ds before connecting again", relay->connect_backoff);
+		return -1;
     }
+    relay->connect_backoff = 0;
+    relay->next_connect = 0;
+
+    udptunnel_free(relay->core);
+    memset(&core_config, 0, sizeof(core_config));
+    core_config.handshake = relay->config->handshake;
+    if ((res = udptunnel_new(&relay->core, &core_config, NULL)) < 0)
+		log_printf_exit(1, log_err, "udptunnel_new: %s", udptunnel_strerror(res));
+
+    send_handshake(relay);
+    tunnel_keepalive(relay);
+    tunnel_kcm(relay);
+    relay->tcp_activity = now;
+    return relay->tcp_sock >= 0 ? 0 : -1;
 }
 
 /**
- * Program entry point and initialization.
- * Parses command-line arguments, sets up signal handlers, establishes network connections
- * based on operational mode (server/client), and starts the main relay loop.
+ * Tells whether a packet of the client exceeds the rate allowed to its
+ * source. The buckets are only allocated once a rate is set.
  *
- * @param argc (int) - Number of command-line arguments
- * @param argv (char*[]) - Array of command-line argument strings
+ * @param relay (struct relay*) - Connection state
+ * @param addr (const struct sockaddr*) - Source of the packet
  *
- * @return int - Program exit status (0 on success, never reached due to main_loop)
+ * @return int - 1 if the packet must be dropped, 0 otherwise
  */
-int main(int argc, char *argv[])
+static int rate_limited(struct relay *relay, const struct sockaddr *addr)
 {
-    struct opts opts;
-    struct relay relay;
+    if (!relay->config->source_rate || relay->config->is_server)
+		return 0;
 
-    memset(&relay, 0, sizeof(relay)); // Initialize all fields to zero
-    relay.tcp_sock = -1; // Mark TCP socket as invalid initially
+    if (!relay->ratelimit)
+		relay->ratelimit = ratelimit_new();
+    return !ratelimit_check(relay->ratelimit, addr, relay->config->source_rate, relay->config->source_burst);
+}
 
-    memset(&opts, 0, sizeof(opts));
-    parse_args(argc, argv, &opts);
-    if (opts.handshake) // Copy custom handshake if provided
-		memcpy(relay.handshake, opts.handshake, sizeof(relay.handshake));
+/**
+ * Tells whether a WireGuard keepalive must not cross the tunnel, because
+ * another one was relayed less than wireguard-keepalive seconds ago.
+ * The peers only send keepalives to keep the NAT state of the UDP path, which
+ * is local at both ends of the tunnel: the probes of the TCP connection,
+ * enabled by tunnel_keepalive(), keep the path in between, and neither the
+ * process nor the peer at the other end are woken up.
+ *
+ * @param relay (struct relay*) - Connection state
+ * @param packet (const unsigned char*) - UDP payload
+ * @param len (size_t) - Length of packet
+ *
+ * @return int - 1 if the packet must be dropped, 0 otherwise
+ */
+static int wireguard_keepalive_suppressed(struct relay *relay, const unsigned char *packet, size_t len)
+{
+    time_t now;
 
-    sd_notify(0, "READY=1"); // Signal systemd that service is ready
+    if (!relay->config->wireguard_keepalive || len != WG_KEEPALIVE_SIZE ||
+		packet[0] != WG_TRANSPORT_DATA || packet[1] || packet[2] || packet[3])
+		return 0;
 
-    if (opts.is_server) {
-		struct sigaction sa;
+    now = io->time(NULL);
+    if (now - relay->wg_keepalive_relayed < relay->config->wireguard_keepalive) {
+		relay->wg_keepalives_dropped++;
+		return 1;
+    }
+    relay->wg_keepalive_relayed = now;
+    return 0;
+}
 
-		sa.sa_handler = wait_for_child; // Set signal handler function
-		sigemptyset(&sa.sa_mask); // Don't block any signals during handler execution
-		sa.sa_flags = SA_RESTART; // Restart interrupted system calls automatically
-		if (sigaction(SIGCHLD, &sa, NULL) == -1) // Install SIGCHLD handler for child reaping
-			err_sys("sigaction");
+/**
+ * Logs the UDP peers which exchanged the most bytes with the tunnel, every
+ * top-talkers seconds. The sketch is created when the setting is first set,
+ * in both modes and without a control socket.
+ *
+ * @param relay (struct relay*) - Connection state
+ *
+ * @return int - Seconds until the next log, -1 if they are not logged
+ */
+static int log_talkers(struct relay *relay)
+{
+    struct sketch_entry entries[TALKERS_LOGGED];
+    char line[TALKERS_LOGGED * 96];
+    time_t now = io->time(NULL);
+    size_t len = 0;
+    int i, n;
+
+    if (!relay->config->top_talkers)
+		return -1;
+    if (!relay->talkers)
+		relay->talkers = sketch_new();
+    if (!relay->talkers_logged) // The first log covers a full interval
+		relay->talkers_logged = now;
+    if (now - relay->talkers_logged < relay->config->top_talkers)
+		return relay->talkers_logged + relay->config->top_talkers - now;
+    relay->talkers_logged = now;
+
+    n = sketch_top(relay->talkers, 0, entries, TALKERS_LOGGED);
+    line[0] = '\0';
+    for (i = 0; i < n && len < sizeof(line); i++)
+		len += snprintf(line + len, sizeof(line) - len, "%s%s %llu bytes %llu packets", i ? ", " : "",
+			print_addr_port((struct sockaddr *) &entries[i].addr, entries[i].addrlen),
+			(unsigned long long) entries[i].bytes, (unsigned long long) entries[i].packets);
+    log_printf(log_notice, "Top talkers of %llu UDP peers: %s",
+		(unsigned long long) sketch_distinct(relay->talkers), n ? line : "none");
+    return relay->config->top_talkers;
+}
 
-		if (opts.timeout)
-			relay.tcp_timeout = opts.timeout; // Server timeout applies to TCP connections
-		relay.expect_handshake = 1; // Server expects handshake from clients
+/**
+ * Returns the DNS cache of the client, created again when the dns-cache
+ * setting changed.
+ *
+ * @param relay (struct relay*) - Connection state
+ *
+ * @return struct dnscache* - Cache, NULL if there is none
+ */
+static struct dnscache *dns_cache(struct relay *relay)
+{
+    if (relay->dns_entries != relay->config->dns_cache && !relay->config->is_server) {
+		dnscache_free(relay->dns);
+		relay->dns = relay->config->dns_cache ? dnscache_new(relay->config->dns_cache) : NULL;
+		relay->dns_entries = relay->config->dns_cache;
+    }
+    return relay->dns;
+}
 
-		if (opts.use_inetd) {
-			relay.tcp_sock = 0; // inetd provides connection on stdin/stdout
-			log_set_options(log_get_filter_level() | log_syslog); // Use syslog when running under inetd
-		} else {
+/**
+ * Answers a DNS query of the client from the cache, without crossing the
+ * tunnel.
+ *
+ * @param relay (struct relay*) - Connection state
+ * @param packet (const char*) - UDP payload
+ * @param len (size_t) - Length of packet
+ * @param addr (struct sockaddr*) - Source of the query
+ * @param addrlen (socklen_t) - Length of addr
+ *
+ * @return int - 1 if the query was answered, 0 if it must be relayed
+ */
+static int dns_answered(struct relay *relay, const char *packet, size_t len, struct sockaddr *addr,
+	socklen_t addrlen)
+{
+    struct dnscache *cache = dns_cache(relay);
+    char reply[DNSCACHE_MAX_RESPONSE];
+    struct msghdr msg;
+    struct iovec iov;
+
+    if (!cache || !(iov.iov_len = dnscache_lookup(cache, packet, len, reply, sizeof(reply))))
+		return 0;
+
+    iov.iov_base = reply;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (io->sendmsg(relay->udp_sock, &msg, 0) < 0)
+		log_printf(log_debug, "Could not send a cached DNS response: %s", strerror(errno));
+    return 1;
+}
+
+/**
+ * Pin the source address of the replies to the destination address of the
+ * datagram just received, which the peer expects the replies to come from.
+ * On a multi-homed client listening on the wildcard address, the kernel
+ * would otherwise pick the address of the outgoing route.
+ *
+ * @param relay (struct relay*) - Connection state
+ * @param msg (const struct msghdr*) - Datagram received with its control messages
+ *
+ * @return void
+ */
+static void pin_reply_source(struct relay *relay, const struct msghdr *msg)
+{
+    struct cmsghdr *cmsg, *reply = &relay->reply_control.align;
+
+    relay->reply_controllen = 0;
+    for (cmsg = CMSG_FIRSTHDR((struct msghdr *) msg); cmsg; cmsg = CMSG_NXTHDR((struct msghdr *) msg, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+			struct in_pktinfo info;
+
+			/* ipi_spec_dst is the local address to reply from, also for broadcasts */
+			memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+			info.ipi_ifindex = 0;
+			info.ipi_addr.s_addr = 0;
+			reply->cmsg_level = IPPROTO_IP;
+			reply->cmsg_type = IP_PKTINFO;
+			reply->cmsg_len = CMSG_LEN(sizeof(info));
+			memcpy(CMSG_DATA(reply), &info, sizeof(info));
+			relay->reply_controllen = CMSG_SPACE(sizeof(info));
+		} else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+			struct in6_pktinfo info;
+
+			memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+			if (IN6_IS_ADDR_MULTICAST(&info.ipi6_addr))
+				continue;
+			if (!IN6_IS_ADDR_LINKLOCAL(&info.ipi6_addr)) // Only link-local addresses need the interface
+				info.ipi6_ifindex = 0;
+			reply->cmsg_level = IPPROTO_IPV6;
+			reply->cmsg_type = IPV6_PKTINFO;
+			reply->cmsg_len = CMSG_LEN(sizeof(info));
+			memcpy(CMSG_DATA(reply), &info, sizeof(info));
+			relay->reply_controllen = CMSG_SPACE(sizeof(info));
+		}
+    }
+}
+
+/**
+ * Receive UDP packet and encapsulate it in TCP stream.
+ * Reads a UDP packet, stores the sender's address for replies, and sends the packet
+ * over TCP with a length prefix. Used in client mode to tunnel UDP through TCP.
+ *
+ * @param relay (struct relay*) - Connection state and socket information
+ *
+ * @return void - exits program on socket errors
+ */
+static void udp_to_tcp(struct relay *relay)
+{
+    struct out_packet p;
+    struct bulk *bulk = tunnel_bulk(relay);
+    char *bulk_buf = bulk ? bulk_buffer(bulk) : NULL; // Page-aligned buffer for a zero-copy send
+    char *buf = bulk_buf ? bulk_buf : p.buf;
+    int buflen, res;
+    struct sockaddr_storage remote_udpaddr;
+    socklen_t addrlen;
+    struct iovec iov = { buf, UDPBUFFERSIZE };
+    struct msghdr msg;
+    union {
+		char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+		struct cmsghdr align;
+    } control;
+
+    /*
+     * Receive UDP packet and capture sender's address for bidirectional tunnel operation.
+     * The sender address is essential because UDP is connectionless - we need to know
+     * where to send replies when data comes back through the TCP tunnel from the server.
+     * This enables proper bidirectional communication in client mode.
+     * The client also gets the destination address of the packet, which will
+     * be the source address of the replies.
+     */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &remote_udpaddr;
+    msg.msg_namelen = sizeof(remote_udpaddr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (relay->pktinfo) {
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+    }
+    buflen = io->recvmsg(relay->udp_sock, &msg, 0);
+    if (buflen < 0 && errno == ECONNREFUSED && relay->udp_connected)
+		return;	/* the connected socket reports the ICMP errors of the previous packets */
+    if (buflen < 0)
+		err_sys("recvmsg(udp)");
+    addrlen = msg.msg_namelen;
+    if (buflen == 0)
+		return;	/* ignore empty packets */
+    if (relay->acl && !acl_check(relay->acl, (struct sockaddr *) &remote_udpaddr))
+		return;	/* not a source to reply to either */
+    if (rate_limited(relay, (struct sockaddr *) &remote_udpaddr))
+		return;
+    if (wireguard_keepalive_suppressed(relay, (unsigned char *) buf, buflen))
+		return;
+    if (dns_answered(relay, buf, buflen, (struct sockaddr *) &remote_udpaddr, addrlen))
+		return;
+
+    /*
+     * Store the source address of the received UDP packet, to be able to use
+     * it in send_udp_packet as the destination address of the next UDP reply.
+     * addrlen from recvmsg() ensures only valid address bytes are copied.
+     * Unnamed AF_UNIX senders only report the address family: keep the
+     * configured destination in that case since it cannot be replied to.
+     */
+    if (addrlen > sizeof(sa_family_t)) {
+		memset(&(relay->remote_udpaddr), 0, sizeof(relay->remote_udpaddr));
+		memcpy(&(relay->remote_udpaddr), &remote_udpaddr, addrlen);
+		if (relay->pktinfo)
+			pin_reply_source(relay, &msg);
+    }
+    relay->reply_via_shm = 0;
+    if (relay->talkers)
+		sketch_update(relay->talkers, (struct sockaddr *) &remote_udpaddr, addrlen, buflen);
+
+#ifdef DEBUG
+    log_printf(log_debug, "Received a %d bytes UDP packet from %s", buflen,
+	    print_addr_port((struct sockaddr *) &remote_udpaddr, addrlen));
+#endif
+
+    if (relay->session && relay->tcp_sock < 0) { // Sent once the client resumes the session
+		session_keep(relay->session, buf, buflen);
+		return;
+    }
+    if (tunnel_connect(relay) < 0)
+		return;
+
+    if (bulk_buf) { // Prefixed in place, and left to the kernel if large enough
+		res = bulk_send(bulk, bulk_buf, buflen, buflen >= relay->config->bulk_threshold);
+    } else {
+		udptunnel_frame_header(buflen, &p.length);
+		res = io->send(tunnel_fd(relay), &p, buflen + sizeof(p.length), 0); // Send struct: 2-byte length header + UDP payload data (total: buflen + 2 bytes)
+    }
+    if (res < 0)
+		tcp_send_failed(relay, "send(tcp)");
+    else
+		relay->tcp_activity = io->time(NULL);
+}
+
+/**
+ * Encapsulate the UDP packets received with AF_XDP in the TCP stream.
+ * The length prefix is written over the UDP checksum field that precedes
+ * each payload in the UMEM chunk, so the frames are sent straight from the
+ * UMEM with a single sendmsg() per batch and no copy in user space.
+ *
+ * @param relay (struct relay*) - Connection state with the AF_XDP ingest
+ *
+ * @return void - exits program on socket errors
+ */
+static void xdp_to_tcp(struct relay *relay)
+{
+    struct xdp_packet pkts[XDP_BATCH_SIZE];
+    struct iovec iov[XDP_BATCH_SIZE];
+    struct msghdr msg;
+    int i, n, iovcnt = 0;
+    int last = -1;
+
+    n = xdp_ingest_recv(relay->xdp, pkts, XDP_BATCH_SIZE);
+
+    for (i = 0; i < n; i++) {
+		if (pkts[i].length == 0)
+			continue;	/* ignore empty packets */
+		if (relay->acl && !acl_check(relay->acl, (struct sockaddr *) &pkts[i].src))
+			continue;
+		if (rate_limited(relay, (struct sockaddr *) &pkts[i].src))
+			continue;
+		if (wireguard_keepalive_suppressed(relay, (unsigned char *) pkts[i].payload, pkts[i].length))
+			continue;
+		last = i;
+
+		udptunnel_frame_header(pkts[i].length, pkts[i].payload - UDPTUNNEL_HEADER_SIZE);
+		iov[iovcnt].iov_base = pkts[i].payload - UDPTUNNEL_HEADER_SIZE;
+		iov[iovcnt].iov_len = pkts[i].length + UDPTUNNEL_HEADER_SIZE;
+		iovcnt++;
+		if (relay->talkers)
+			sketch_update(relay->talkers, (struct sockaddr *) &pkts[i].src, pkts[i].srclen, pkts[i].length);
+
+#ifdef DEBUG
+		log_printf(log_debug, "Received a %d bytes UDP packet from %s", pkts[i].length,
+			print_addr_port((struct sockaddr *) &pkts[i].src, pkts[i].srclen));
+#endif
+    }
+
+    /* replies go to the sender of the most recent packet, as in udp_to_tcp() */
+    if (last >= 0) {
+		memset(&(relay->remote_udpaddr), 0, sizeof(relay->remote_udpaddr));
+		memcpy(&(relay->remote_udpaddr), &pkts[last].src, pkts[last].srclen);
+		relay->reply_controllen = 0; // The destination of the frame is not reported
+		relay->reply_via_shm = 0;
+    }
+
+    if (iovcnt && tunnel_connect(relay) == 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		if (io->sendmsg(tunnel_fd(relay), &msg, 0) < 0)
+			tcp_send_failed(relay, "sendmsg(tcp)");
+		else
+			relay->tcp_activity = io->time(NULL);
+    }
+
+    xdp_ingest_release(relay->xdp);
+}
+
+/**
+ * Encapsulate the packets queued by a local application in the shared
+ * memory ring. Each packet is sent straight from the ring with its own
+ * length prefix, so a batch costs a single sendmsg() and no copy in user space.
+ *
+ * @param relay (struct relay*) - Connection state with the shared memory transport
+ *
+ * @return void - exits program on socket errors
+ */
+static void shm_to_tcp(struct relay *relay)
+{
+    struct shm_packet pkts[SHM_BATCH_SIZE];
+    uint16_t lengths[SHM_BATCH_SIZE];
+    struct iovec iov[SHM_BATCH_SIZE * 2];
+    struct msghdr msg;
+    int i, n, iovcnt = 0;
+
+    n = shm_tunnel_recv(relay->shm, pkts, SHM_BATCH_SIZE);
+
+    for (i = 0; i < n; i++) {
+		if (pkts[i].length == 0)
+			continue;	/* ignore empty packets */
+
+		if (udptunnel_frame_header(pkts[i].length, &lengths[i]) < 0)
+			continue;	/* too large for the TCP stream */
+		iov[iovcnt].iov_base = &lengths[i];
+		iov[iovcnt].iov_len = sizeof(lengths[i]);
+		iov[iovcnt + 1].iov_base = pkts[i].payload;
+		iov[iovcnt + 1].iov_len = pkts[i].length;
+		iovcnt += 2;
+
+#ifdef DEBUG
+		log_printf(log_debug, "Received a %u bytes packet from shared memory", pkts[i].length);
+#endif
+    }
+
+    /* replies go back to the application, as they go to the last UDP sender */
+    if (n > 0)
+		relay->reply_via_shm = 1;
+
+    if (iovcnt && tunnel_connect(relay) == 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		if (io->sendmsg(tunnel_fd(relay), &msg, 0) < 0)
+			tcp_send_failed(relay, "sendmsg(tcp)");
+		else
+			relay->tcp_activity = io->time(NULL);
+    }
+
+    shm_tunnel_release(relay->shm);
+}
+
+/**
+ * Encapsulate the datagrams of the transparent proxy mode: those redirected
+ * to the listener of the client, and those received by the sockets of the
+ * flows. Each frame starts with the original destination and the source of
+ * the datagram, written by tproxy_recv() right before the payload.
+ *
+ * @param relay (struct relay*) - Connection state with the flow table
+ *
+ * @return void - exits program on socket errors
+ */
+static void tproxy_to_tcp(struct relay *relay)
+{
+    static char buf[UDPTUNNEL_HEADER_SIZE + TPROXY_HEADER_MAX + UDPTUNNEL_MAX_PAYLOAD];
+    struct sockaddr_storage src;
+    char *frame;
+    int i, len;
+
+    for (i = 0; i < relay->config->udp_batch; i++) { // The other sockets get their turn
+		len = tproxy_recv(relay->tproxy, buf + UDPTUNNEL_HEADER_SIZE, sizeof(buf) - UDPTUNNEL_HEADER_SIZE,
+			&frame, &src);
+		if (len < 0) { // The errors of the flow sockets are counted as drops by tproxy_recv()
+			if (errno != EAGAIN && errno != EINTR && errno != ENOBUFS && errno != ENOMEM)
+				err_sys("tproxy_recv");
+			return;
+		}
+		if (udptunnel_frame_header(len, frame - UDPTUNNEL_HEADER_SIZE) < 0)
+			continue;	/* too large with the address header */
+		if (relay->acl && !relay->config->is_server && !acl_check(relay->acl, (struct sockaddr *) &src))
+			continue;	/* the server checked the destination when it opened the flow */
+		if (!relay->config->is_server && rate_limited(relay, (struct sockaddr *) &src))
+			continue;
+		if (relay->talkers)
+			sketch_update(relay->talkers, (struct sockaddr *) &src, addr_len((struct sockaddr *) &src), len);
+
+		if (tunnel_connect(relay) < 0)
+			continue;
+		if (io->send(tunnel_fd(relay), frame - UDPTUNNEL_HEADER_SIZE, len + UDPTUNNEL_HEADER_SIZE, 0) < 0) {
+			tcp_send_failed(relay, "send(tcp)");
+			return;
+		}
+		relay->tcp_activity = io->time(NULL);
+    }
+}
+
+/**
+ * Send all the queued UDP packets to the stored remote address.
+ * Transmits the batch built by send_udp_packet() with as few sendmmsg() calls
+ * as possible. Handles ECONNREFUSED and ENOENT errors gracefully by dropping
+ * the refused datagram and continuing with the rest of the batch.
+ *
+ * @param relay (struct relay*) - Connection state with the queued datagrams
+ *
+ * @return void - logs errors but continues execution
+ */
+static void flush_udp_packets(struct relay *relay)
+{
+    int opt = 0;
+    socklen_t len = sizeof(opt);
+    int sent = 0;
+
+    while (sent < relay->udp_batch_len) {
+		int n = io->sendmmsg(relay->udp_sock, relay->udp_batch + sent, relay->udp_batch_len - sent, 0);
+
+		if (n > 0) { // sendmmsg() may stop early: retry with the remaining datagrams
+			sent += n;
+			continue;
+		}
+
+		/* this is the error path */
+		if (n == 0) { // Nothing sent and no errno to report: retrying could spin
+			log_printf(log_warning, "sendmmsg(udp) sent nothing, dropped %d datagrams",
+				relay->udp_batch_len - sent);
+			break;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != ECONNREFUSED && errno != ENOENT)
+			err_sys("sendmmsg(udp)");
+
+		/*
+		 * Handle ECONNREFUSED gracefully: this commonly occurs when the UDP peer
+		 * is not yet listening or has temporarily stopped. Since UDP is connectionless,
+		 * we continue operation rather than terminating the tunnel. The getsockopt()
+		 * call retrieves and clears any pending socket error state.
+		 * A unixgram: destination whose socket file does not exist (yet, or any
+		 * more while the application restarts) reports ENOENT instead.
+		 */
+		log_printf(log_info, "sendmmsg(udp) returned %s: ignored", errno == ENOENT ? "ENOENT" : "ECONNREFUSED");
+		if (getsockopt(relay->udp_sock, SOL_SOCKET, SO_ERROR, &opt, &len) < 0) // Retrieve and clear pending socket error state
+			err_sys("getsockopt(udp, SOL_SOCKET, SO_ERROR)");
+		sent++; // Drop the refused datagram
+    }
+
+    relay->udp_batch_len = 0;
+}
+
+/**
+ * Queue a packet for transmission to the stored remote address.
+ * The packet is not copied: the queued iovec points into the buffer of the
+ * relay core, so tcp_to_udp() must flush the batch before reading again.
+ *
+ * @param relay (struct relay*) - Connection state with the remote address
+ * @param packet (const char*) - UDP payload
+ * @param length (size_t) - Payload length
+ *
+ * @return void
+ */
+static void send_udp_packet(struct relay *relay, const char *packet, size_t length)
+{
+    struct iovec *iov;
+    struct msghdr *msg;
+
+    if (relay->tproxy) { // The frame starts with the addresses of its flow
+		if (tproxy_send(relay->tproxy, packet, length, relay->acl) < 0)
+			log_printf(log_debug, "Dropped a packet of the transparent proxy mode");
+		return;
+    }
+    if (relay->reply_via_shm) { // The ring is a copy target: nothing to batch
+		if (shm_tunnel_send(relay->shm, packet, length) < 0)
+			log_printf(log_debug, "Dropped a packet for the shared memory client");
+		return;
+    }
+
+    if (relay->remote_udpaddr.ss_family == 0) { // No UDP peer address stored yet
+		log_printf(log_info, "Ignoring a packet for a still unknown UDP destination!");
+		return;
+    }
+
+    iov = &relay->udp_batch_iov[relay->udp_batch_len];
+    iov->iov_base = (char *) packet;
+    iov->iov_len = length;
+
+    msg = &relay->udp_batch[relay->udp_batch_len].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    if (!relay->udp_connected) { // Otherwise the kernel has the route to the destination already
+		msg->msg_name = &relay->remote_udpaddr;
+		msg->msg_namelen = addr_len((struct sockaddr *) &relay->remote_udpaddr);
+    }
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    if (relay->reply_controllen) { // Same source for all the packets, which go to the same peer
+		msg->msg_control = &relay->reply_control;
+		msg->msg_controllen = relay->reply_controllen;
+    }
+    if (relay->talkers)
+		sketch_update(relay->talkers, (struct sockaddr *) &relay->remote_udpaddr,
+			addr_len((struct sockaddr *) &relay->remote_udpaddr), length);
+    if (relay->dns)
+		dnscache_store(relay->dns, packet, length);
+
+    if (++relay->udp_batch_len >= relay->config->udp_batch)
+		flush_udp_packets(relay);
+}
+
+/**
+ * Parse TCP stream and extract UDP packets for forwarding.
+ * Reads from the TCP socket straight into the buffer of the relay core, which
+ * validates the handshake (if expected) and splits the length-prefixed packets.
+ * Complete UDP packets are queued by send_udp_packet() and flushed together
+ * once the data from the current read has been parsed.
+ * With bulk-threshold set, the socket pages mapped by bulk_recv() are decoded
+ * in place instead, and only the incomplete packet at their end is copied
+ * into the relay core.
+ *
+ * @param relay (struct relay*) - Connection state including the relay core
+ *
+ * @return void - exits program on TCP connection close, bad handshake or socket errors
+ */
+static void tcp_to_udp(struct relay *relay)
+{
+    int established = udptunnel_established(relay->core);
+    struct bulk *bulk = tunnel_bulk(relay);
+    struct bulk_data data = { NULL, 0 };
+    void *space;
+    size_t space_len;
+    const char *packet;
+    size_t length;
+    int read_len, res;
+
+    if (udptunnel_tcp_buffer(relay->core, &space, &space_len) < 0) // Free space of the stream buffer
+		log_printf_exit(0, log_info, "Received a bad handshake, exiting");
+
+    if (bulk) {
+		res = bulk_recv(bulk, space, space_len, relay->config->bulk_threshold, &data);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;	/* woken up by the completions of the zero-copy sends */
+		read_len = res > 0 ? (int) data.len : res;
+    } else {
+		read_len = io->read(relay->tcp_sock, space, space_len);
+    }
+    if (read_len <= 0) { // TCP connection closed by peer, or error
+		tcp_recv_failed(relay, read_len, "read(tcp)");
+		return;
+    }
+    relay->tcp_activity = io->time(NULL);
+
+    if (data.mapped) {
+		const char *stream = data.mapped;
+		size_t stream_len = data.len;
+
+		while ((res = udptunnel_udp_scan(relay->core, &stream, &stream_len, &packet, &length)) > 0) {
+#ifdef DEBUG
+			log_printf(log_debug, "Received a %zu bytes TCP packet", length);
+#endif
+			send_udp_packet(relay, packet, length);
+		}
+		/* the incomplete packet at the end may overwrite one still queued */
+		flush_udp_packets(relay);
+		if (res == 0 && stream_len)
+			udptunnel_tcp_in(relay->core, stream, stream_len);
+		bulk_release(bulk);
+    } else {
+		udptunnel_tcp_commit(relay->core, read_len);
+
+		while ((res = udptunnel_udp_next(relay->core, &packet, &length)) > 0) { // Process complete packets
+#ifdef DEBUG
+			log_printf(log_debug, "Received a %zu bytes TCP packet", length);
+#endif
+			send_udp_packet(relay, packet, length);
+		}
+    }
+    if (res < 0)
+		log_printf_exit(0, log_info, "Received a bad handshake, exiting");
+    if (!established && udptunnel_established(relay->core))
+		log_printf(log_debug, "Received a good handshake");
+
+    /* the queued packets point into the buffer: send them before reading again */
+    flush_udp_packets(relay);
+
+    tunnel_kcm(relay);
+}
+
+/**
+ * Forward the frames split by AF_KCM as UDP packets.
+ * Each frame arrives as a whole message, so there is no reassembly: a batch
+ * of frames is received with one recvmmsg() and sent with one sendmmsg().
+ * The end of the stream is only reported on the attached TCP socket, which
+ * is peeked at once the frames have been drained.
+ *
+ * @param relay (struct relay*) - Connection state with the AF_KCM socket
+ *
+ * @return void - exits program on TCP connection close or socket errors
+ */
+static void kcm_to_udp(struct relay *relay)
+{
+    struct kcm_frame frames[KCM_BATCH_SIZE];
+    char c;
+    int i, n, res;
+
+    if ((n = kcm_recv(relay->kcm, frames, KCM_BATCH_SIZE)) < 0) {
+		tcp_recv_failed(relay, -1, "recvmmsg(kcm)");
+		return;
+    }
+
+    for (i = 0; i < n; i++) {
+#ifdef DEBUG
+		log_printf(log_debug, "Received a %zu bytes TCP packet", frames[i].length);
+#endif
+		send_udp_packet(relay, frames[i].payload, frames[i].length);
+    }
+    /* the frames are overwritten by the next kcm_recv() */
+    flush_udp_packets(relay);
+    if (n > 0)
+		relay->tcp_activity = io->time(NULL);
+    if (n == KCM_BATCH_SIZE) // More frames may be waiting
+		return;
+
+    res = recv(relay->tcp_sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		tcp_recv_failed(relay, res, "recv(tcp)");
+}
+
+/**
+ * Reaps the tunnel processes which have exited, so that they do not stay
+ * zombies, and forgets them in the overload tracker and the source pool.
+ * Called by the server parent on every tick of the tracker timer.
+ *
+ * @param instance (struct instance*) - Tracker of the tunnels and source pool
+ *
+ * @return void
+ */
+static void reap_tunnels(struct instance *instance)
+{
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		overload_remove(instance->overload, pid);
+		if (instance->pool)
+			srcpool_release(instance->pool, pid);
+    }
+}
+
+/**
+ * Admission hook of accept_connections(): sheds the new connections while
+ * the server is overloaded, or while no source address is left in the pool.
+ *
+ * @param addr (const struct sockaddr*) - Address of the client
+ * @param ctx (void*) - The instance
+ *
+ * @return const char* - NULL to accept the connection, otherwise why it is shed
+ */
+static const char *admit_tunnel(const struct sockaddr *addr, void *ctx)
+{
+    struct instance *instance = ctx;
+    const char *reason = overload_admit(instance->overload, addr);
+
+    if (!reason && instance->pool && !srcpool_ready(instance->pool))
+		reason = "source pool exhausted";
+    return reason;
+}
+
+/**
+ * Admission hook of accept_connections(): records each tunnel process,
+ * which inherited the socket reserved in the source pool.
+ *
+ * @param pid (pid_t) - Process of the tunnel
+ * @param addr (const struct sockaddr*) - Address of the client
+ * @param ctx (void*) - The instance
+ *
+ * @return void
+ */
+static void tunnel_forked(pid_t pid, const struct sockaddr *addr, void *ctx)
+{
+    struct instance *instance = ctx;
+
+    overload_add(instance->overload, pid, addr);
+    if (instance->pool)
+		srcpool_forked(instance->pool, pid);
+}
+
+/**
+ * Admission hook of accept_connections(): hands a connection which resumes
+ * a session over to the tunnel of the session, when it runs on this node.
+ * The sessions of the other nodes and the unknown ones get a new tunnel
+ * process, which forwards them or starts them with join_session().
+ *
+ * @param fd (int) - Connection, the handshake and the session record consumed
+ * @param record (const char*) - Session record
+ * @param ctx (void*) - The instance
+ *
+ * @return int - 1 if the tunnel of the session took the connection, 0 to fork
+ */
+static int resume_tunnel(int fd, const char *record, void *ctx)
+{
+    struct instance *instance = ctx;
+    struct session_entry entry;
+    unsigned char id[SESSION_ID_SIZE];
+
+    if (session_lookup(instance->sessions, record, id, &entry) < 0) {
+		session_count(instance->sessions, SESSION_STARTED);
+		return 0;
+    }
+    if (strcmp(entry.node, session_dir_node(instance->sessions)) != 0) {
+		session_count(instance->sessions, SESSION_FORWARDED);
+		return 0;
+    }
+    if (session_handoff(entry.replay, fd) < 0) { // The new tunnel adopts the session
+		log_printf(log_info, "The tunnel of the session %s is gone: %s", session_id_str(id), strerror(errno));
+		session_count(instance->sessions, SESSION_STARTED);
+		return 0;
+    }
+    log_printf(log_notice, "Resumed the session %s in the tunnel %ld", session_id_str(id), entry.pid);
+    session_count(instance->sessions, SESSION_RESUMED);
+    return 1;
+}
+
+/**
+ * Find the tunnel of the session of a new tunnel process. If it runs on
+ * another node, the connection is forwarded to that node, which hands it over
+ * to the tunnel, and the process exits once the client disconnects. If it is
+ * gone, this tunnel adopts the session, with the same UDP binding if it can.
+ *
+ * @param instance (struct instance*) - Server configuration and directory
+ * @param relay (struct relay*) - Connection state with the TCP connection of the client
+ * @param id (unsigned char*) - Output session ID
+ *
+ * @return int - UDP socket bound like the previous tunnel of the session, or -1
+ */
+static int join_session(struct instance *instance, struct relay *relay, unsigned char *id)
+{
+    struct session_entry entry;
+    char hello[UDPTUNNEL_HANDSHAKE_SIZE + SESSION_RECORD_SIZE];
+    int owner;
+
+    if (session_lookup(instance->sessions, instance->admission.received, id, &entry) < 0) {
+		log_printf(log_info, "Starting the session %s", session_id_str(id));
+		return -1;
+    }
+
+    if (strcmp(entry.node, session_dir_node(instance->sessions)) != 0) {
+		/* the owner node takes it as it would from the client */
+		if ((owner = tcp_connect(entry.node, CONNECT_TIMEOUT)) >= 0) {
+			memcpy(hello, instance->config.handshake, UDPTUNNEL_HANDSHAKE_SIZE);
+			memcpy(hello + UDPTUNNEL_HANDSHAKE_SIZE, instance->admission.received, SESSION_RECORD_SIZE);
+			if (send(owner, hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello)) {
+				log_printf(log_notice, "Forwarding the session %s to %s", session_id_str(id), entry.node);
+				session_proxy(relay->tcp_sock, owner);
+				log_printf_exit(0, log_info, "The client of the session left");
+			}
+			close(owner);
+		}
+
+		/* the owner node may be down while its tunnel still runs on this host */
+		if (session_handoff(entry.replay, relay->tcp_sock) == 0)
+			log_printf_exit(0, log_notice, "Handed the session %s over to the tunnel %ld",
+				session_id_str(id), entry.pid);
+		log_printf(log_notice, "Adopting the session %s of the unreachable node %s", session_id_str(id), entry.node);
+    } else {
+		log_printf(log_notice, "Adopting the session %s", session_id_str(id));
+    }
+    return strcmp(entry.binding, "-") ? session_bind(entry.binding) : -1;
+}
+
+/**
+ * Take the new connection of the client of the session: the packets kept
+ * while it was away are sent first, then the tunnel goes on. A connection
+ * still open is replaced, since the client only reconnects after giving it up.
+ *
+ * @param relay (struct relay*) - Connection state with a session
+ *
+ * @return void
+ */
+static void resume_session(struct relay *relay)
+{
+    struct udptunnel_config core_config;
+    int fd = session_accept(relay->session);
+    int res;
+
+    if (fd < 0)
+		return;
+    if (relay->tcp_sock >= 0)
+		tunnel_disconnect(relay, "the client resumed the session on a new connection");
+    session_park(relay->session, 0);
+    relay->tcp_sock = fd;
+    relay->tcp_activity = io->time(NULL);
+
+    /* the previous stream may have ended in the middle of a packet */
+    udptunnel_free(relay->core);
+    memset(&core_config, 0, sizeof(core_config));
+    core_config.handshake = relay->config->handshake;
+    core_config.expect_handshake = 1;
+    if ((res = udptunnel_new(&relay->core, &core_config, NULL)) < 0)
+		log_printf_exit(1, log_err, "udptunnel_new: %s", udptunnel_strerror(res));
+    udptunnel_tcp_in(relay->core, relay->config->handshake, UDPTUNNEL_HANDSHAKE_SIZE); // Checked by the acceptor
+    log_printf(log_notice, "The client resumed the session");
+
+    if (session_replay(relay->session, fd) < 0) {
+		tcp_send_failed(relay, "send(tcp, replay)");
+		return;
+    }
+    tunnel_keepalive(relay);
+    tunnel_kcm(relay);
+}
+
+/**
+ * SIGUSR2 signal handler requesting a binary upgrade.
+ * The upgrade itself is done by the event loops, outside of the handler.
+ *
+ * @param sig (int) - Signal number (unused, always SIGUSR2)
+ *
+ * @return void
+ */
+static void request_upgrade(int sig)
+{
+    upgrade_requested = 1;
+}
+
+/**
+ * SIGUSR1 signal handler requesting the migration of a tunnel.
+ * The tunnel processes hand themselves over from their event loops.
+ *
+ * @param sig (int) - Signal number (unused, always SIGUSR1)
+ *
+ * @return void
+ */
+static void request_migration(int sig)
+{
+    migrate_requested = 1;
+}
+
+/**
+ * SIGHUP signal handler requesting to load the ACL file again.
+ *
+ * @param sig (int) - Signal number (unused, always SIGHUP)
+ *
+ * @return void
+ */
+static void request_reload(int sig)
+{
+    reload_requested = 1;
+}
+
+/**
+ * Replace the ACL of the client with the current content of its file.
+ * The old rules stay in use if the file is not valid.
+ *
+ * @param relay (struct relay*) - Connection state with the ACL
+ *
+ * @return int - 0 on success, -1 if the file could not be loaded
+ */
+static int reload_acl(struct relay *relay)
+{
+    struct acl *acl = acl_load(relay->config->acl_path);
+
+    if (!acl) {
+		log_printf(log_warning, "Keeping the previous ACL");
+		return -1;
+    }
+    acl_free(relay->acl);
+    relay->acl = acl;
+    log_printf(log_notice, "Reloaded the ACL %s", relay->config->acl_path);
+    return 0;
+}
+
+/**
+ * Apply the runtime settings carried over by an upgrade or a migration, since
+ * they may differ from the command line after changes made with the control
+ * socket.
+ *
+ * @param config (struct config*) - Configuration to update
+ * @param text (const char*) - Settings listed by config_format()
+ *
+ * @return void
+ */
+static void restore_config(struct config *config, const char *text)
+{
+    const char *error = config_parse(config, text);
+
+    if (error)
+		log_printf(log_warning, "Some settings handed over were not kept: %s", error);
+}
+
+/* remote address, NUL-terminated settings, then the relay core */
+#define RELAY_STATE_SIZE (sizeof(struct sockaddr_storage) + 4096 + UDPTUNNEL_EXPORT_SIZE)
+
+/**
+ * Serialize what a new process needs to take over the tunnel: the last UDP
+ * peer address, the runtime settings and the state of the relay core,
+ * including the stream data not parsed yet.
+ * The UDP batch is always flushed by the event loop, so no packet is in flight.
+ *
+ * @param relay (struct relay*) - Connection state to hand over
+ * @param state (char*) - Output buffer of RELAY_STATE_SIZE bytes
+ *
+ * @return int - Length of the state, or -1 after logging the error
+ */
+static int export_relay(struct relay *relay, char *state)
+{
+    size_t used = sizeof(relay->remote_udpaddr);
+    int len;
+
+    memcpy(state, &relay->remote_udpaddr, sizeof(relay->remote_udpaddr));
+    used += config_format(relay->config, state + used, 4096);
+    if (used >= sizeof(relay->remote_udpaddr) + 4096) {
+		log_printf(log_err, "Cannot hand over the tunnel: settings too long");
+		return -1;
+    }
+    used++;
+    len = udptunnel_export(relay->core, state + used, UDPTUNNEL_EXPORT_SIZE);
+    if (len < 0) {
+		log_printf(log_err, "udptunnel_export: %s", udptunnel_strerror(len));
+		return -1;
+    }
+    return used + len;
+}
+
+/**
+ * Load the state serialized by export_relay() in another process.
+ *
+ * @param relay (struct relay*) - Connection state to restore
+ * @param state (const char*) - Serialized state
+ * @param length (size_t) - Length of state
+ *
+ * @return void - exits program if the state is not valid
+ */
+static void import_relay(struct relay *relay, const char *state, size_t length)
+{
+    const char *settings = state + sizeof(relay->remote_udpaddr);
+    size_t used;
+    int res;
+
+    if (length <= sizeof(relay->remote_udpaddr) || !memchr(settings, '\0', length - sizeof(relay->remote_udpaddr)))
+		log_printf_exit(1, log_err, "Invalid tunnel state received");
+
+    memcpy(&relay->remote_udpaddr, state, sizeof(relay->remote_udpaddr));
+    restore_config(relay->config, settings);
+
+    used = sizeof(relay->remote_udpaddr) + strlen(settings) + 1;
+    res = udptunnel_import(relay->core, state + used, length - used);
+    if (res < 0)
+		log_printf_exit(1, log_err, "udptunnel_import: %s", udptunnel_strerror(res));
+}
+
+/**
+ * Hand over the tunnel to a new instance of the binary.
+ * The UDP and TCP sockets are passed along with the state of the relay.
+ *
+ * @param relay (struct relay*) - Connection state to hand over
+ *
+ * @return void - returns only if the upgrade failed
+ */
+static void upgrade_relay(struct relay *relay)
+{
+    static char state[RELAY_STATE_SIZE];
+    int fds[2];
+    int len;
+
+    if (relay->xdp || relay->kcm || relay->shm || relay->tproxy || relay->session || io != &io_posix) {
+		log_printf(log_warning, "Cannot upgrade a tunnel using AF_XDP, AF_KCM, shared memory, TPROXY, a session or the simulator");
+		return;
+    }
+    if ((len = export_relay(relay, state)) < 0)
+		return;
+
+    /* a lazy client may be between two connections */
+    fds[0] = relay->udp_sock;
+    fds[1] = relay->tcp_sock;
+    upgrade_exec(UPGRADE_RELAY, fds, relay->tcp_sock >= 0 ? 2 : 1, state, len);
+}
+
+/**
+ * Take over a tunnel handed over by upgrade_relay() in the previous binary.
+ *
+ * @param relay (struct relay*) - Connection state to restore
+ * @param upgrade (const struct upgrade_state*) - What the previous binary passed
+ *
+ * @return void - exits program if the state is not valid
+ */
+static void restore_relay(struct relay *relay, const struct upgrade_state *upgrade)
+{
+    if (upgrade->nfds < 1 || upgrade->nfds > 2)
+		log_printf_exit(1, log_err, "Invalid tunnel state received");
+
+    relay->udp_sock = upgrade->fds[0];
+    relay->tcp_sock = upgrade->nfds == 2 ? upgrade->fds[1] : -1;
+    relay->tcp_activity = io->time(NULL);
+    import_relay(relay, upgrade->data, upgrade->length);
+}
+
+/* both directions of a connection to another server give up after MIGRATE_TIMEOUT */
+static void migrate_timeouts(int conn)
+{
+    struct timeval tv = { MIGRATE_TIMEOUT, 0 };
+
+    if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+		setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		err_sys("setsockopt(SO_RCVTIMEO)");
+}
+
+/**
+ * Keep a migrated connection frozen for MIGRATE_LINGER seconds, so that the
+ * segments of the client are dropped instead of being answered with a reset
+ * until the address is routed to the new server. The socket has nothing to
+ * drain: the filter of migrate_freeze() drops every segment before TCP sees
+ * it, and a socket in repair mode cannot be read. The signals of upgrades or
+ * migrations, which would end sleep() early, only interrupt select(), which
+ * waits again until the deadline.
+ *
+ * @return void
+ */
+static void migrate_linger(void)
+{
+    long long deadline = migrate_clock() + MIGRATE_LINGER * 1000LL;
+    long long left;
+    struct timeval tv;
+
+    while ((left = deadline - migrate_clock()) > 0) {
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = (left % 1000) * 1000;
+		select(0, NULL, NULL, NULL, &tv);
+    }
+}
+
+/**
+ * Hand over the tunnel to the server given with --migrate-to, which takes
+ * over the TCP connection of the client.
+ * The connection is frozen from its dump until the other server confirms
+ * that it restored it, and stays frozen afterwards, so that this host does
+ * not reset the retransmissions of the client until its address is routed
+ * to the other server.
+ *
+ * @param relay (struct relay*) - Connection state to hand over
+ *
+ * @return void - returns only if the migration failed, the tunnel going on here
+ */
+static void migrate_relay(struct relay *relay)
+{
+    static char state[RELAY_STATE_SIZE];
+    struct migrate_message msg;
+    char ack;
+    int conn, len;
+
+    if (!relay->config->migrate_to || relay->tcp_sock < 0 || relay->kcm || relay->tproxy || io != &io_posix) {
+		log_printf(log_warning, "Cannot migrate this tunnel: no --migrate-to, or AF_KCM or TPROXY is used");
+		return;
+    }
+    if ((len = export_relay(relay, state)) < 0)
+		return;
+    if ((conn = tcp_connect(relay->config->migrate_to, CONNECT_TIMEOUT)) < 0)
+		return;
+    migrate_timeouts(conn);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.frozen = migrate_clock();
+    if (migrate_freeze(relay->tcp_sock) < 0) {
+		log_printf(log_err, "Cannot freeze the TCP connection: %s", strerror(errno));
+		close(conn);
+		return;
+    }
+    if (!(msg.tcp = migrate_dump(relay->tcp_sock, &msg.tcp_len))) {
+		log_printf(log_err, "Cannot dump the TCP connection: %s", strerror(errno));
+		goto thaw;
+    }
+    msg.relay = state;
+    msg.relay_len = len;
+    if (migrate_send(conn, relay->config->handshake, &msg) < 0 || recv(conn, &ack, 1, 0) != 1) {
+		log_printf(log_err, "The migration to %s failed, resuming the tunnel", relay->config->migrate_to);
+		free(msg.tcp);
+		goto thaw;
+    }
+
+    log_printf(log_notice, "Migrated the tunnel to %s, %lld ms after freezing it",
+		relay->config->migrate_to, migrate_clock() - msg.frozen);
+    close(relay->udp_sock);
+    fflush(NULL); // Not after the linger
+    migrate_linger();
+    exit(0); // Closing a socket in repair mode sends nothing
+
+thaw:
+    migrate_thaw(relay->tcp_sock);
+    close(conn);
+}
+
+/**
+ * Take over the tunnels migrated by the server processes of other hosts.
+ * The parent forks the process of the tunnel as soon as it accepts the
+ * connection of the other server, so that a slow or stalled sender never
+ * holds up the listeners. The tunnel receives the state sent by
+ * migrate_relay(), restores the TCP connection of the client on the address
+ * of one of the listeners, and confirms the migration once it imported the
+ * state of the relay.
+ *
+ * @param instance (struct instance*) - Server configuration and listeners
+ * @param watch (const int[]) - Other descriptors of the parent, closed in the tunnel
+ * @param relay (struct relay*) - Connection state to restore in the tunnel
+ *
+ * @return int - TCP socket of the client in the tunnel process, -1 in the parent
+ */
+static int accept_migration(struct instance *instance, const int watch[], struct relay *relay)
+{
+    struct sockaddr_storage from, client, *listeners;
+    struct migrate_message msg;
+    socklen_t fromlen, len;
+    char peer[256];
+    int i, n, conn, fd;
+    pid_t pid;
+
+    for (i = 0; instance->migrate_sockets && instance->migrate_sockets[i] != -1; i++) {
+		fromlen = sizeof(from);
+		if ((conn = accept(instance->migrate_sockets[i], (struct sockaddr *) &from, &fromlen)) < 0)
+			continue; // Non-blocking listener: nothing to accept
+		snprintf(peer, sizeof(peer), "%s", print_addr_port((struct sockaddr *) &from, fromlen));
+		if (instance->pool && !srcpool_ready(instance->pool)) { // The other server keeps the tunnel
+			log_printf(log_warning, "Rejected a migration from %s: source pool exhausted", peer);
+			close(conn);
+			continue;
+		}
+
+		/* the tunnel closes the listeners: it gets their addresses */
+		for (n = 0; instance->listening_sockets[n] != -1; n++)
+			;
+		listeners = NOFAIL(calloc(n + 1, sizeof(*listeners)));
+		for (n = 0; instance->listening_sockets[n] != -1; n++) {
+			len = sizeof(listeners[n]);
+			if (getsockname(instance->listening_sockets[n], (struct sockaddr *) &listeners[n], &len) < 0)
+				err_sys("getsockname");
+		}
+
+		if ((pid = tunnel_fork(instance->listening_sockets, watch)) > 0) {
+			free(listeners);
+			close(conn);
+			instance->admission.accepted++;
+			tunnel_forked(pid, (struct sockaddr *) &from, instance); // The client is not known yet
+			continue;
+		}
+
+		migrate_timeouts(conn);
+		if (migrate_receive(conn, instance->config.handshake, &msg) < 0)
+			log_printf_exit(1, log_warning, "Rejected a migration from %s: %s", peer, strerror(errno));
+		if ((fd = migrate_restore(msg.tcp, msg.tcp_len, listeners, n, &client)) < 0)
+			log_printf_exit(1, log_err, "Cannot restore the tunnel migrated from %s: %s", peer, strerror(errno));
+		free(listeners);
+
+		import_relay(relay, msg.relay, msg.relay_len);
+		if (write(conn, "", 1) != 1) // The other server resumes the tunnel without it
+			log_printf_exit(1, log_err, "Cannot confirm the migration to %s", peer);
+		log_printf(log_notice, "Took over the tunnel of %s from %s, frozen for %lld ms",
+			print_addr_port((struct sockaddr *) &client, addr_len((struct sockaddr *) &client)), peer,
+			migrate_clock() - msg.frozen);
+		close(conn);
+		migrate_free(&msg);
+		return fd;
+    }
+    return -1;
+}
+
+/**
+ * Hand over the listening sockets of the server to a new instance of the
+ * binary, with the runtime settings and the table of the tunnels, which
+ * stay children of the process. The tunnels already forked keep running
+ * the old binary.
+ *
+ * @param instance (struct instance*) - Server configuration and listeners
+ *
+ * @return void - returns only if the upgrade failed
+ */
+static void upgrade_listeners(struct instance *instance)
+{
+    char *state = NOFAIL(malloc(UPGRADE_MAX_STATE));
+    size_t len;
+    int nfds;
+
+    len = config_format(&instance->config, state, 4096);
+    if (len >= 4096) {
+		log_printf(log_err, "Cannot upgrade: settings too long");
+		free(state);
+		return;
+    }
+    len++; // The NUL separates the tunnels of the overload tracker
+    len += overload_export(instance->overload, state + len, UPGRADE_MAX_STATE - len);
+
+    for (nfds = 0; instance->listening_sockets[nfds] != -1; nfds++);
+    upgrade_exec(UPGRADE_LISTENERS, instance->listening_sockets, nfds, state, len);
+    free(state);
+}
+
+/**
+ * Create the listening sockets for an address while the server is running.
+ * tcp_listener() exits on errors, so it runs in a short-lived child process
+ * which passes the sockets back over a socket pair.
+ *
+ * @param address (const char*) - Address to listen on, as on the command line
+ *
+ * @return int* - Listening sockets terminated with -1, or NULL on error (logged by the child)
+ */
+static int *spawn_tcp_listener(const char *address)
+{
+    union {                        // Ensure proper alignment for cmsg
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+		struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int count = 0;
+    int *fds = NULL;
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		log_printf_err(log_err, "socketpair");
+		return NULL;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+
+    fflush(NULL); // The child may exit() with the buffered log lines
+    if ((pid = fork()) < 0) {
+		log_printf_err(log_err, "fork");
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
+    }
+
+    if (pid == 0) {
+		fds = tcp_listener(address); // Exits on errors
+
+		for (count = 0; fds[count] != -1 && count < UPGRADE_MAX_FDS; count++);
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+		if (sendmsg(sv[1], &msg, 0) < 0)
+			_exit(1);
+		_exit(0);
+    }
+
+    close(sv[1]);
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sv[0], &msg, 0) == sizeof(count) && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+		cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int) * count)) {
+		fds = NOFAIL(malloc((count + 1) * sizeof(int)));
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+		fds[count] = -1;
+    }
+    close(sv[0]);
+    waitpid(pid, NULL, 0);
+
+    return fds;
+}
+
+/**
+ * Control command: show the state of the process and its settings.
+ */
+static int cmd_status(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+    char settings[4096];
+    int i;
+
+    control_printf(reply, "mode %s\n", instance->config.is_server ? "server" : "client");
+    control_printf(reply, "pid %d\n", (int) getpid());
+    control_printf(reply, "uptime %ld\n", (long) (time(NULL) - instance->started));
+
+    for (i = 0; instance->listening_sockets && instance->listening_sockets[i] != -1; i++) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+
+		if (getsockname(instance->listening_sockets[i], (struct sockaddr *) &addr, &addrlen) == 0)
+			control_printf(reply, "listen %s\n", print_addr_port((struct sockaddr *) &addr, addrlen));
+    }
+    if (instance->config.is_server)
+		control_printf(reply, "accepted %lu\nrejected %lu\nprobes %lu\nshed %lu\n",
+			instance->admission.accepted, instance->admission.rejected, instance->admission.probes,
+			instance->admission.shed);
+
+    if (instance->relay) {
+		struct relay *relay = instance->relay;
+
+		control_printf(reply, "connected %d\n", relay->tcp_sock >= 0);
+		control_printf(reply, "established %d\n", udptunnel_established(relay->core));
+		if (instance->config.kcm)
+			control_printf(reply, "kcm %d\n", relay->kcm != NULL);
+		if (relay->bulk) {
+			bulk_format(relay->bulk, settings, sizeof(settings));
+			control_printf(reply, "%s", settings);
+		}
+		if (relay->tproxy) {
+			tproxy_format(relay->tproxy, settings, sizeof(settings));
+			control_printf(reply, "%s", settings);
+		}
+		if (instance->config.session)
+			control_printf(reply, "session %s\n", session_id_str(relay->session_id));
+		if (instance->config.filter && relay->udp_sock >= 0) {
+			filter_format(instance->config.filter, relay->udp_sock, settings, sizeof(settings));
+			control_printf(reply, "%s", settings);
+		}
+		if (relay->talkers)
+			control_printf(reply, "udp-peers %llu\n", (unsigned long long) sketch_distinct(relay->talkers));
+		if (instance->config.wireguard_keepalive)
+			control_printf(reply, "wg-keepalives-dropped %lu\n", relay->wg_keepalives_dropped);
+		if (relay->ratelimit) {
+			ratelimit_format(relay->ratelimit, settings, sizeof(settings));
+			control_printf(reply, "%s", settings);
+		}
+		if (relay->dns) {
+			dnscache_format(relay->dns, settings, sizeof(settings));
+			control_printf(reply, "%s", settings);
+		}
+		if (relay->remote_udpaddr.ss_family)
+			control_printf(reply, "udp-peer %s\n", print_addr_port((struct sockaddr *) &relay->remote_udpaddr,
+				addr_len((struct sockaddr *) &relay->remote_udpaddr)));
+    }
+
+    if (instance->overload) {
+		overload_format(instance->overload, settings, sizeof(settings));
+		control_printf(reply, "%s", settings);
+    }
+    if (instance->pool && !instance->relay) {
+		srcpool_format(instance->pool, settings, sizeof(settings));
+		control_printf(reply, "%s", settings);
+    }
+    if (instance->sessions) {
+		session_dir_format(instance->sessions, settings, sizeof(settings));
+		control_printf(reply, "%s", settings);
+    }
+
+    config_format(&instance->config, settings, sizeof(settings));
+    control_printf(reply, "%s", settings);
+    return 0;
+}
+
+/**
+ * Control command: show one or all the runtime settings.
+ */
+static int cmd_get(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+    char settings[4096];
+    char *line, *saveptr;
+
+    config_format(&instance->config, settings, sizeof(settings));
+    for (line = strtok_r(settings, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+		size_t keylen = strcspn(line, " ");
+
+		if (argc == 0 || (strlen(argv[0]) == keylen && strncmp(line, argv[0], keylen) == 0)) {
+			control_printf(reply, "%s\n", line);
+			if (argc)
+				return 0;
+		}
+    }
+
+    if (argc) {
+		control_printf(reply, "unknown setting");
+		return -1;
+    }
+    return 0;
+}
+
+/**
+ * Control command: change a runtime setting. The tunnel of the client uses
+ * it at once, the server uses it for the tunnels created from now on.
+ */
+static int cmd_set(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+    const char *error = config_set(&instance->config, argv[0], argv[1]);
+
+    if (error) {
+		control_printf(reply, "%s", error);
+		return -1;
+    }
+
+    if (instance->relay && !instance->config.is_server)
+		instance->relay->udp_timeout = instance->config.timeout;
+    log_printf(log_notice, "Setting %s changed to %s", argv[0], argv[1]);
+    return 0;
+}
+
+/**
+ * Control command: add the listening sockets for an address (server only).
+ */
+static int cmd_listen(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+    int *fds;
+    int i, n;
+
+    if (!instance->listening_sockets) {
+		control_printf(reply, "only the server has listeners");
+		return -1;
+    }
+    if (!(fds = spawn_tcp_listener(argv[0]))) {
+		control_printf(reply, "cannot listen on %s, see the log", argv[0]);
+		return -1;
+    }
+
+    for (n = 0; instance->listening_sockets[n] != -1; n++);
+    for (i = 0; fds[i] != -1; i++);
+    instance->listening_sockets = NOFAIL(realloc(instance->listening_sockets, (n + i + 1) * sizeof(int)));
+    memcpy(instance->listening_sockets + n, fds, (i + 1) * sizeof(int));
+    free(fds);
+
+    log_printf(log_notice, "Listening for TCP connections on %s", argv[0]);
+    return 0;
+}
+
+/**
+ * Control command: close the listening sockets bound to an address, as shown
+ * by the status command (server only). The tunnels are not affected.
+ */
+static int cmd_unlisten(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+    int i, j, closed = 0;
+
+    if (!instance->listening_sockets) {
+		control_printf(reply, "only the server has listeners");
+		return -1;
+    }
+
+    for (i = j = 0; instance->listening_sockets[i] != -1; i++) {
+		int fd = instance->listening_sockets[i];
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof(addr);
+
+		if (getsockname(fd, (struct sockaddr *) &addr, &addrlen) == 0 &&
+			strcmp(print_addr_port((struct sockaddr *) &addr, addrlen), argv[0]) == 0) {
+			close(fd);
+			closed++;
+		} else {
+			instance->listening_sockets[j++] = fd;
+		}
+    }
+    instance->listening_sockets[j] = -1;
+
+    if (!closed) {
+		control_printf(reply, "no listener on %s", argv[0]);
+		return -1;
+    }
+    log_printf(log_notice, "Stopped listening for TCP connections on %s", argv[0]);
+    return 0;
+}
+
+/**
+ * Control command: list the UDP peers which exchanged the most bytes or
+ * packets with the client, or clear the counters.
+ */
+static int cmd_top(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+    struct sketch_entry entries[SKETCH_TOP_SIZE];
+    int by_packets = 0;
+    int i, n;
+
+    if (!instance->relay || !instance->relay->talkers) {
+		control_printf(reply, "only the client counts its UDP peers");
+		return -1;
+    }
+    if (argc && strcmp(argv[0], "reset") == 0) {
+		sketch_reset(instance->relay->talkers);
+		return 0;
+    }
+    if (argc && strcmp(argv[0], "packets") == 0) {
+		by_packets = 1;
+    } else if (argc && strcmp(argv[0], "bytes") != 0) {
+		control_printf(reply, "expected bytes, packets or reset");
+		return -1;
+    }
+
+    /* the counts are estimates, never below the real values */
+    n = sketch_top(instance->relay->talkers, by_packets, entries, SKETCH_TOP_SIZE);
+    for (i = 0; i < n; i++)
+		control_printf(reply, "%s bytes %llu packets %llu\n",
+			print_addr_port((struct sockaddr *) &entries[i].addr, entries[i].addrlen),
+			(unsigned long long) entries[i].bytes, (unsigned long long) entries[i].packets);
+    return 0;
+}
+
+/**
+ * Control command: list the ACL rules with their hits, or load the file again.
+ */
+static int cmd_acl(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+    static char rules[CONTROL_REPLY_SIZE];
+
+    if (!instance->relay || !instance->relay->acl) {
+		control_printf(reply, "no ACL, see --acl");
+		return -1;
+    }
+    if (argc && strcmp(argv[0], "reload") != 0) {
+		control_printf(reply, "expected reload");
+		return -1;
+    }
+    if (argc && reload_acl(instance->relay) < 0) {
+		control_printf(reply, "cannot load %s, see the log", instance->config.acl_path);
+		return -1;
+    }
+
+    if (acl_format(instance->relay->acl, rules, sizeof(rules)) >= sizeof(rules))
+		control_printf(reply, "# truncated\n");
+    control_printf(reply, "%s", rules);
+    return 0;
+}
+
+/**
+ * Control command: hand over all the tunnels of the server to the server
+ * given with --migrate-to.
+ */
+static int cmd_migrate(struct control_reply *reply, int argc, char *argv[], void *ctx)
+{
+    struct instance *instance = ctx;
+
+    if (!instance->overload || !instance->config.migrate_to) {
+		control_printf(reply, "no server to migrate to, see --migrate-to");
+		return -1;
+    }
+    control_printf(reply, "migrating %d tunnels to %s\n", overload_signal(instance->overload, SIGUSR1),
+		instance->config.migrate_to);
+    return 0;
+}
+
+static const struct control_command control_commands[] = {
+    { "status",		"",					0, 0, cmd_status },
+    { "get",		"[KEY]",			0, 1, cmd_get },
+    { "set",		"KEY VALUE",		2, 2, cmd_set },
+    { "listen",		"ADDRESS:PORT",		1, 1, cmd_listen },
+    { "unlisten",	"ADDRESS:PORT",		1, 1, cmd_unlisten },
+    { "top",		"[bytes|packets|reset]", 0, 1, cmd_top },
+    { "acl",		"[reload]",			0, 1, cmd_acl },
+    { "migrate",	"",					0, 0, cmd_migrate },
+    { NULL,			NULL,				0, 0, NULL },
+};
+
+/**
+ * Main event loop for bidirectional packet relaying.
+ * Uses select() to monitor both UDP and TCP sockets for incoming data,
+ * handles timeout management, and dispatches to appropriate relay functions.
+ * Runs indefinitely until a timeout occurs or an error forces program exit.
+ *
+ * @param relay (struct relay*) - Connection state with sockets and timeout configuration
+ *
+ * @return void - never returns normally, exits via timeout or error
+ */
+static void main_loop(struct relay *relay)
+{
+    time_t last_udp_input, last_tcp_input;
+
+    last_udp_input = relay->udp_timeout ? io->time(NULL) : 0; // Initialize UDP timeout tracking
+    last_tcp_input = relay->tcp_timeout ? io->time(NULL) : 0; // Initialize TCP timeout tracking
+
+    while (1) {
+		int ready_fds;
+		int max = 0;
+		int shm_pending = 0;
+		int control_fds_list[CONTROL_MAX_FDS];
+		int control_nfds = 0;
+		int i;
+		fd_set readfds;
+		struct timeval tv, *ptv;
+		int talkers_left;
+
+		if (upgrade_requested) { // Does not return if the new binary was started
+			upgrade_requested = 0;
+			upgrade_relay(relay);
+		}
+		if (migrate_requested) { // Does not return if the other server took over the tunnel
+			migrate_requested = 0;
+			migrate_relay(relay);
+		}
+		if (reload_requested) {
+			reload_requested = 0;
+			if (relay->acl)
+				reload_acl(relay);
+		}
+
+		/* the UDP timeout may have been changed with the control socket */
+		if (!relay->udp_timeout)
+			last_udp_input = 0;
+		else if (!last_udp_input)
+			last_udp_input = io->time(NULL);
+
+		/* the lazy client closes the connection when no data went through it for a while */
+		if (is_lazy(relay) && relay->tcp_sock >= 0 &&
+			io->time(NULL) - relay->tcp_activity >= relay->config->idle_disconnect)
+			tunnel_disconnect(relay, "idle");
+
+		/* the tunnel of a session waits for its client for a while */
+		if (relay->session && session_parked(relay->session) && io->time(NULL) >= session_parked(relay->session))
+			log_printf_exit(0, log_notice, "The client did not resume the session, exiting");
+
+		talkers_left = log_talkers(relay);
+
+		FD_ZERO(&readfds); // Clear file descriptor set
+		if (relay->tcp_sock >= 0) { // The lazy client may be disconnected
+			FD_SET(relay->tcp_sock, &readfds); // Monitor TCP socket for data
+			SET_MAX(relay->tcp_sock); // Track highest fd number for select()
+		}
+		if (relay->kcm) { // The frames split by the kernel
+			FD_SET(kcm_fd(relay->kcm), &readfds);
+			SET_MAX(kcm_fd(relay->kcm));
+		}
+		if (relay->udp_sock >= 0) { // Not in the server of the transparent proxy mode
+			FD_SET(relay->udp_sock, &readfds); // Monitor UDP socket for data
+			SET_MAX(relay->udp_sock); // Update highest fd number
+		}
+		if (relay->tproxy) { // The listener of the client and the sockets of the flows
+			FD_SET(tproxy_fd(relay->tproxy), &readfds);
+			SET_MAX(tproxy_fd(relay->tproxy));
+		}
+		if (relay->session) { // The connections of the client resuming the session
+			FD_SET(session_fd(relay->session), &readfds);
+			SET_MAX(session_fd(relay->session));
+		}
+		if (relay->xdp) { // The AF_XDP socket carries the redirected UDP packets
+			FD_SET(xdp_ingest_fd(relay->xdp), &readfds);
+			SET_MAX(xdp_ingest_fd(relay->xdp));
+		}
+		if (relay->shm) { // Attach requests, client hangups and the doorbell of the rings
+			FD_SET(shm_tunnel_listen_fd(relay->shm), &readfds);
+			SET_MAX(shm_tunnel_listen_fd(relay->shm));
+			if (shm_tunnel_conn_fd(relay->shm) >= 0) {
+				FD_SET(shm_tunnel_conn_fd(relay->shm), &readfds);
+				SET_MAX(shm_tunnel_conn_fd(relay->shm));
+				FD_SET(shm_tunnel_doorbell_fd(relay->shm), &readfds);
+				SET_MAX(shm_tunnel_doorbell_fd(relay->shm));
+			}
+		}
+		if (relay->control) { // The listener and the connected control clients
+			control_nfds = control_fds(relay->control, control_fds_list, CONTROL_MAX_FDS);
+			for (i = 0; i < control_nfds; i++) {
+				FD_SET(control_fds_list[i], &readfds);
+				SET_MAX(control_fds_list[i]);
+			}
+		}
+
+		/*
+		 * Configure select() timeout strategy:
+		 * - If timeouts are enabled: use 10-second intervals to periodically check for idle connections
+		 * - If no timeouts: block indefinitely waiting for socket activity
+		 * This balances responsiveness (checking timeouts) with efficiency (not busy-waiting)
+		 */
+		if (last_udp_input || last_tcp_input) {
+			tv.tv_usec = 0;
+			tv.tv_sec = 10; // Check for timeouts every 10 seconds
+			ptv = &tv;
+		} else {
+			ptv = NULL; // Block indefinitely if no timeouts configured
+		}
+		if (is_lazy(relay) && relay->tcp_sock >= 0) { // Wake up when the connection becomes idle
+			time_t idle_left = relay->tcp_activity + relay->config->idle_disconnect - io->time(NULL);
+
+			if (!ptv || idle_left < tv.tv_sec) {
+				tv.tv_usec = 0;
+				tv.tv_sec = idle_left > 0 ? idle_left : 0;
+				ptv = &tv;
+			}
+		}
+		if (relay->session && session_parked(relay->session)) { // Wake up when the session expires
+			time_t linger_left = session_parked(relay->session) - io->time(NULL);
+
+			if (!ptv || linger_left < tv.tv_sec) {
+				tv.tv_usec = 0;
+				tv.tv_sec = linger_left > 0 ? linger_left : 0;
+				ptv = &tv;
+			}
+		}
+		if (talkers_left >= 0 && (!ptv || talkers_left < tv.tv_sec)) { // Wake up for the next log of the top talkers
+			tv.tv_usec = 0;
+			tv.tv_sec = talkers_left;
+			ptv = &tv;
+		}
+
+		/*
+		 * The application only rings the doorbell after we asked for it, and
+		 * it may have queued a packet just before: poll instead of sleeping then.
+		 */
+		if (relay->shm && (shm_pending = shm_tunnel_prepare_sleep(relay->shm))) {
+			tv.tv_usec = 0;
+			tv.tv_sec = 0;
+			ptv = &tv;
+		}
+
+		ready_fds = io->select(max, &readfds, NULL, NULL, ptv); // Wait for socket activity or timeout
+		if (ready_fds < 0) {
+			if (errno == EINTR || errno == EAGAIN) // Interrupted by signal or temporary error
+				continue;
+			err_sys("select");
+		}
+
+		/* check timeouts when no file descriptors are ready (ready_fds == 0) */
+		if (last_udp_input && !ready_fds) {	/* select() timed out, check UDP timeout */
+			if (io->time(NULL) - last_udp_input > relay->udp_timeout) // Check if UDP idle time exceeded configured limit
+			log_printf_exit(0, log_notice, "Exiting after a %ds timeout for UDP input", relay->udp_timeout);
+		}
+		if (last_tcp_input && !ready_fds) {	/* select() timed out, check TCP timeout */
+			if (io->time(NULL) - last_tcp_input > relay->tcp_timeout) // Check if TCP idle time exceeded configured limit
+			log_printf_exit(0, log_notice, "Exiting after a %ds timeout for TCP input", relay->tcp_timeout);
+		}
+
+		if (relay->kcm && (FD_ISSET(kcm_fd(relay->kcm), &readfds) || FD_ISSET(relay->tcp_sock, &readfds))) {
+			kcm_to_udp(relay); // Frames ready, or an error or the end of the attached stream
+			if (last_tcp_input)
+			last_tcp_input = io->time(NULL); // Update activity timestamp
+		} else if (relay->tcp_sock >= 0 && FD_ISSET(relay->tcp_sock, &readfds)) { // TCP socket has data ready
+			tcp_to_udp(relay);
+			if (last_tcp_input)
+			last_tcp_input = io->time(NULL); // Update activity timestamp
+		}
+		if (relay->session && FD_ISSET(session_fd(relay->session), &readfds)) // A new connection of the client
+			resume_session(relay);
+		if (relay->tproxy && FD_ISSET(tproxy_fd(relay->tproxy), &readfds)) { // Datagrams of any flow
+			tproxy_to_tcp(relay);
+			if (last_udp_input)
+			last_udp_input = io->time(NULL); // Update activity timestamp
+		} else if (!relay->tproxy && relay->udp_sock >= 0 && FD_ISSET(relay->udp_sock, &readfds)) { // UDP socket has data ready
+			udp_to_tcp(relay);
+			if (last_udp_input)
+			last_udp_input = io->time(NULL); // Update activity timestamp
+		}
+		if (relay->xdp && FD_ISSET(xdp_ingest_fd(relay->xdp), &readfds)) { // AF_XDP RX ring has packets
+			xdp_to_tcp(relay);
+			if (last_udp_input)
+			last_udp_input = io->time(NULL); // Update activity timestamp
+		}
+		if (relay->shm) {
+			int conn_fd = shm_tunnel_conn_fd(relay->shm);
+
+			if (conn_fd >= 0 && (FD_ISSET(conn_fd, &readfds) || FD_ISSET(shm_tunnel_doorbell_fd(relay->shm), &readfds) || shm_pending)) {
+				shm_to_tcp(relay); // Drain the ring first: a detaching client may have left packets
+				if (last_udp_input)
+				last_udp_input = io->time(NULL); // Update activity timestamp
+			}
+			if (conn_fd >= 0 && FD_ISSET(conn_fd, &readfds)) // Client hangup
+				shm_tunnel_conn_event(relay->shm);
+			if (FD_ISSET(shm_tunnel_listen_fd(relay->shm), &readfds)) // New client
+				shm_tunnel_accept(relay->shm);
+		}
+		for (i = 0; i < control_nfds; i++) {
+			if (FD_ISSET(control_fds_list[i], &readfds)) { // Serves all the pending commands
+				control_poll(relay->control);
+				break;
+			}
+		}
+    }
+}
+
+/**
+ * Program entry point and initialization.
+ * Parses command-line arguments, sets up signal handlers, establishes network connections
+ * based on operational mode (server/client), and starts the main relay loop.
+ *
+ * @param argc (int) - Number of command-line arguments
+ * @param argv (char*[]) - Array of command-line argument strings
+ *
+ * @return int - Program exit status (0 on success, never reached due to main_loop)
+ */
+int main(int argc, char *argv[])
+{
+    static struct instance instance; // Referenced by the control commands
+    struct config *config = &instance.config;
+    struct relay relay;
+    struct udptunnel_config core_config;
+    struct upgrade_state upgrade;
+    struct sigaction sa;
+    unsigned char session_id[SESSION_ID_SIZE];
+    int bound = -1; // UDP socket of the server already bound to its source
+    int res;
+
+    memset(&relay, 0, sizeof(relay)); // Initialize all fields to zero
+    relay.tcp_sock = -1; // Mark TCP socket as invalid initially
+    relay.config = config;
+
+    config_init(config);
+    parse_args(argc, argv, config);
+    instance.started = time(NULL);
+
+    /* the server expects the handshake from clients */
+    memset(&core_config, 0, sizeof(core_config));
+    core_config.handshake = config->handshake;
+    core_config.expect_handshake = config->is_server;
+    if ((res = udptunnel_new(&relay.core, &core_config, NULL)) < 0)
+		log_printf_exit(1, log_err, "udptunnel_new: %s", udptunnel_strerror(res));
+
+    /* sockets and state passed by the previous binary, if this is an upgrade */
+    upgrade_init(argv);
+    upgrade_receive(&upgrade);
+
+    sd_notify(0, "READY=1"); // Signal systemd that service is ready
+
+    sa.sa_handler = request_upgrade;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART; // select() is interrupted anyway, the other calls must not fail
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) // Install SIGUSR2 handler for binary upgrades
+		err_sys("sigaction");
+    /* SIGHUP and SIGUSR1 keep their default action unless their feature is used */
+    sa.sa_handler = request_reload;
+    if (config->acl_path && sigaction(SIGHUP, &sa, NULL) == -1) // Install SIGHUP handler to reload the ACL
+		err_sys("sigaction");
+    if (config->migrate_to)
+		signal(SIGUSR1, SIG_IGN); // Only the tunnels migrate, see below
+
+    /* also a new one after an upgrade, which does not pass it */
+    if (config->session) {
+		session_new_id(relay.session_id);
+		log_printf(log_info, "Starting the session %s", session_id_str(relay.session_id));
+    }
+
+    if (upgrade.kind == UPGRADE_RELAY) { // A tunnel of the previous binary: resume it
+		restore_relay(&relay, &upgrade);
+		if (config->is_server) // Same timeout semantics as below
+			relay.tcp_timeout = config->timeout;
+		else
+			relay.udp_timeout = config->timeout;
+    } else if (config->is_server) {
+		if (config->use_inetd) {
+			relay.tcp_sock = 0; // inetd provides connection on stdin/stdout
+			log_set_options(log_get_filter_level() | log_syslog); // Use syslog when running under inetd
+		} else {
 			int socket_activation_fds = sd_listen_fds(0);
-			int *listening_sockets;
+			struct control *control = NULL;
+
+			/* the tunnels are reaped by the overload tracker on its timer ticks */
+			instance.overload = overload_new(&config->limits);
+			instance.admission.admit = admit_tunnel;
+			instance.admission.forked = tunnel_forked;
+			instance.admission.ctx = &instance;
+			if (config->source_pool)
+				instance.pool = srcpool_new(config->source_pool, config->source_ports);
+
+			if (upgrade.kind == UPGRADE_LISTENERS) { // Inherited from the previous binary
+				size_t settings_len = strnlen(upgrade.data, upgrade.length);
+
+				instance.listening_sockets = NOFAIL(malloc(sizeof(upgrade.fds)));
+				memcpy(instance.listening_sockets, upgrade.fds, sizeof(upgrade.fds));
+				if (settings_len < upgrade.length) { // The settings, then the tunnels of the previous binary
+					restore_config(config, upgrade.data);
+					if (overload_import(instance.overload, upgrade.data + settings_len + 1,
+						upgrade.length - settings_len - 1) < 0)
+						log_printf(log_warning, "Upgrade: the tunnel table of the previous binary has "
+							"another layout, its tunnels are not tracked");
+				}
+			} else if (socket_activation_fds) { // systemd socket activation
+				instance.listening_sockets = tcp_listener_sa(socket_activation_fds);
+			} else { // Create listening socket manually
+				instance.listening_sockets = tcp_listener(config->tcpaddr);
+			}
+			upgrade_complete(&upgrade);
+
+			if (config->migrate_listen) { // Created again by an upgrade, hence close-on-exec
+				int i;
+
+				instance.migrate_sockets = tcp_listener(config->migrate_listen);
+				for (i = 0; instance.migrate_sockets[i] != -1; i++) {
+					if (i == MIGRATE_MAX_LISTENERS)
+						log_printf_exit(1, log_err, "%s has too many addresses", config->migrate_listen);
+					if (fcntl(instance.migrate_sockets[i], F_SETFL, O_NONBLOCK) < 0 ||
+						fcntl(instance.migrate_sockets[i], F_SETFD, FD_CLOEXEC) < 0)
+						err_sys("fcntl");
+				}
+			}
+			if (config->session_dir) { // The clients send their session after the handshake
+				instance.sessions = session_dir_open(config->session_dir,
+					config->session_node ? config->session_node : config->tcpaddr);
+				instance.admission.session_len = SESSION_RECORD_SIZE;
+				instance.admission.resume = resume_tunnel;
+			}
+			if (config->control_path)
+				control = control_listen(config->control_path, control_commands, &instance);
 
-			if (socket_activation_fds) // systemd socket activation
-				listening_sockets = tcp_listener_sa(socket_activation_fds);
-			else // Create listening socket manually
-				listening_sockets = tcp_listener(opts.tcpaddr);
 			/*
 			 * Accept TCP connection and fork child process to handle it (forking occurs within accept_connections()).
 			 * Parent continues listening for new connections, child handles tunnel relay.
 			 * This implements the fork-based server model mentioned in the header.
+			 * accept_connections() returns in the parent to serve an upgrade
+			 * request or the control socket, which may change the listeners.
 			 */
-			relay.tcp_sock = accept_connections(listening_sockets);
+			while (1) {
+				int watch[CONTROL_MAX_FDS + MIGRATE_MAX_LISTENERS + 2];
+				int nwatch = control ? control_fds(control, watch, CONTROL_MAX_FDS) : 0;
+				int i;
+
+				watch[nwatch++] = overload_fd(instance.overload);
+				for (i = 0; instance.migrate_sockets && instance.migrate_sockets[i] != -1; i++)
+					watch[nwatch++] = instance.migrate_sockets[i];
+				watch[nwatch] = -1;
+				instance.admission.handshake = config->handshake;
+				instance.admission.handshake_len = UDPTUNNEL_HANDSHAKE_SIZE;
+				instance.admission.timeout = config->handshake_timeout;
+				instance.admission.health_check = config->health_check;
+				relay.tcp_sock = accept_connections(instance.listening_sockets, watch, &upgrade_requested,
+					&instance.admission);
+				if (relay.tcp_sock >= 0) {
+					/* the acceptor has consumed the handshake after checking it */
+					udptunnel_tcp_in(relay.core, config->handshake, UDPTUNNEL_HANDSHAKE_SIZE);
+					if (!instance.admission.has_session && instance.admission.received_len) // Read along with the handshake
+						udptunnel_tcp_in(relay.core, instance.admission.received, instance.admission.received_len);
+					break;
+				}
+				if ((relay.tcp_sock = accept_migration(&instance, watch, &relay)) >= 0)
+					break; // The state of the relay core came with the tunnel
+				if (upgrade_requested) {
+					upgrade_requested = 0;
+					upgrade_listeners(&instance);
+				}
+				if (control)
+					control_poll(control);
+				overload_tick(instance.overload);
+				reap_tunnels(&instance);
+			}
 		}
-		relay.udp_sock = udp_client(opts.udpaddr, &relay.remote_udpaddr); // Connect to UDP destination
+		if (config->timeout)
+			relay.tcp_timeout = config->timeout; // Server timeout applies to TCP connections
+		if (instance.admission.has_session) // Forwarded to another node, or started here
+			bound = join_session(&instance, &relay, session_id);
+		if (config->tproxy) { // A socket for each destination, opened by the flow table
+			relay.udp_sock = -1;
+			relay.tproxy = tproxy_new(-1, &config->tproxy_timeout);
+		} else if (config->source_pool) { // Bound to a slot of the pool, reserved by the parent
+			if (bound >= 0) // The pool decides
+				close(bound);
+			if (!instance.pool) // With inetd, this process is the only user of the pool
+				instance.pool = srcpool_new(config->source_pool, config->source_ports);
+			if ((bound = srcpool_take(instance.pool)) < 0)
+				log_printf_exit(1, log_err, "No source address and port left in the pool");
+			relay.udp_sock = udp_client_bound(config->udpaddr, &relay.remote_udpaddr, bound);
+		} else { // Connect to UDP destination, from the binding of an adopted session if possible
+			relay.udp_sock = udp_client_bound(config->udpaddr, &relay.remote_udpaddr, bound);
+		}
+		if (instance.admission.has_session)
+			relay.session = session_open(instance.sessions, session_id, relay.udp_sock);
     } else {
-		if (opts.timeout)
-			relay.udp_timeout = opts.timeout; // Client timeout applies to UDP connections
+		if (config->timeout)
+			relay.udp_timeout = config->timeout; // Client timeout applies to UDP connections
 
-		if (opts.use_inetd) {
+		if (config->simulate) {
+			simnet_setup(&config->simnet, config->handshake, &relay.udp_sock, &relay.tcp_sock);
+		} else if (config->use_inetd) {
 			relay.udp_sock = 0;
 			log_set_options(log_get_filter_level() | log_syslog);
 		} else {
@@ -680,13 +2991,72 @@ int main(int argc, char *argv[])
 			if (socket_activation_fds)
 				relay.udp_sock = udp_listener_sa(socket_activation_fds);
 			else
-				relay.udp_sock = udp_listener(opts.udpaddr);
+				relay.udp_sock = udp_listener(config->udpaddr);
+		}
+		if (config->tproxy) // The listener receives the datagrams of any destination
+			relay.tproxy = tproxy_new(relay.udp_sock, &config->tproxy_timeout);
+		if (config->xdp_ifname) {
+			struct sockaddr_storage local_addr;
+			socklen_t addrlen = sizeof(local_addr);
+
+			/*
+			 * The XDP program redirects the packets for the port of the UDP socket,
+			 * which stays open: it still receives whatever the program passes on
+			 * (other queues, IP options, fragments) and it is used for the replies.
+			 */
+			if (getsockname(relay.udp_sock, (struct sockaddr *) &local_addr, &addrlen) < 0)
+				err_sys("getsockname(udp)");
+			if (local_addr.ss_family == AF_INET || local_addr.ss_family == AF_INET6) // sin_port and sin6_port share the same offset
+				relay.xdp = xdp_ingest_open(config->xdp_ifname, config->xdp_queue,
+					ntohs(((struct sockaddr_in *) &local_addr)->sin_port), config->xdp_native);
+			if (!relay.xdp)
+				log_printf(log_warning, "AF_XDP ingest is not available, using the UDP socket only");
+		}
+
+		if (config->shm_path)
+			relay.shm = shm_tunnel_listen(config->shm_path, SHM_RING_SIZE);
+
+		/* write errors are reported, and make the lazy client reconnect */
+		signal(SIGPIPE, SIG_IGN);
+
+		if (!config->idle_disconnect) { // Otherwise connect when the first packet arrives
+			if (!config->simulate) // The simulated connection is already established
+				relay.tcp_sock = tcp_client(config->tcpaddr); // Connect to TCP server
+
+			send_handshake(&relay); // Send authentication handshake to server
 		}
-		relay.tcp_sock = tcp_client(opts.tcpaddr); // Connect to TCP server
+    }
+    upgrade_complete(&upgrade); // Does nothing if not upgrading
+
+    /* also after an upgrade: the rules may have changed since the previous binary loaded them */
+    if (config->acl_path && !(relay.acl = acl_load(config->acl_path)))
+		exit(2);
 
-		send_handshake(&relay); // Send authentication handshake to server
+    /* also after an upgrade, replacing the filter of the previous binary */
+    if (!config->is_server && config->filter && filter_attach(config->filter, relay.udp_sock) < 0)
+		exit(2);
+
+    /* the client is controlled while it relays, the server only in its parent */
+    if (!config->is_server && config->control_path) {
+		instance.relay = &relay;
+		relay.control = control_listen(config->control_path, control_commands, &instance);
+		relay.talkers = sketch_new(); // Shown by the control socket, and logged with the top-talkers setting
+    }
+
+    /* also after an upgrade, which passes the sockets as they are */
+    if (io == &io_posix && relay.udp_sock >= 0) {
+		relay.udp_connected = udp_connected(relay.udp_sock);
+		if (!config->is_server && !relay.tproxy) // The flows reply from the original destinations
+			relay.pktinfo = udp_pktinfo(relay.udp_sock);
     }
 
+    /* not in the server parent, whose children would inherit a pending request */
+    sa.sa_handler = request_migration;
+    if (config->migrate_to && sigaction(SIGUSR1, &sa, NULL) == -1) // Install SIGUSR1 handler for tunnel migrations
+		err_sys("sigaction");
+
+    tunnel_keepalive(&relay);
+    tunnel_kcm(&relay);
     main_loop(&relay);
     exit(0);
 }